@@ -5,15 +5,21 @@
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
 ../Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/tuner_e4k.c \
-../Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/usbh_rtlsdr.c 
+../Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/usbh_rtlsdr.c \
+../Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/usbh_rtlsdr_ctl.c \
+../Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/usbh_rtlsdr_seq.c 
 
 OBJS += \
 ./Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/tuner_e4k.o \
-./Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/usbh_rtlsdr.o 
+./Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/usbh_rtlsdr.o \
+./Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/usbh_rtlsdr_ctl.o \
+./Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/usbh_rtlsdr_seq.o 
 
 C_DEPS += \
 ./Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/tuner_e4k.d \
-./Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/usbh_rtlsdr.d 
+./Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/usbh_rtlsdr.d \
+./Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/usbh_rtlsdr_ctl.d \
+./Middlewares/ST/STM32_USB_Host_Library/Class/RTLSDR/Src/usbh_rtlsdr_seq.d 
 
 
 # Each subdirectory must supply rules for building sources it contributes
@@ -5,18 +5,45 @@
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
 ../src/main.c \
+../src/sdr_audio.c \
+../src/sdr_decim.c \
+../src/sdr_demod.c \
+../src/sdr_fft.c \
+../src/sdr_iq.c \
+../src/sdr_nco.c \
+../src/sdr_scan.c \
+../src/sdr_waterfall.c \
+../src/sdr_wbfm.c \
 ../src/stm32f7xx_it.c \
 ../src/syscalls.c \
 ../src/system_stm32f7xx.c 
 
 OBJS += \
 ./src/main.o \
+./src/sdr_audio.o \
+./src/sdr_decim.o \
+./src/sdr_demod.o \
+./src/sdr_fft.o \
+./src/sdr_iq.o \
+./src/sdr_nco.o \
+./src/sdr_scan.o \
+./src/sdr_waterfall.o \
+./src/sdr_wbfm.o \
 ./src/stm32f7xx_it.o \
 ./src/syscalls.o \
 ./src/system_stm32f7xx.o 
 
 C_DEPS += \
 ./src/main.d \
+./src/sdr_audio.d \
+./src/sdr_decim.d \
+./src/sdr_demod.d \
+./src/sdr_fft.d \
+./src/sdr_iq.d \
+./src/sdr_nco.d \
+./src/sdr_scan.d \
+./src/sdr_waterfall.d \
+./src/sdr_wbfm.d \
 ./src/stm32f7xx_it.d \
 ./src/syscalls.d \
 ./src/system_stm32f7xx.d 
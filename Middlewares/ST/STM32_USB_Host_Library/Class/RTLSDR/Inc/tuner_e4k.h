@@ -237,7 +237,6 @@ struct e4k_pll_params {
 
 enum e4k_init_state {
 	E4K_REQ_RUN=0,
-	E4K_REQ_INC,
 	E4K_REQ_COMPLETE
 };
 
@@ -248,9 +247,13 @@ enum e4k_mask_state {
 
 typedef struct {
 	enum e4k_init_state initState;
-	uint8_t initNumber;
+	RTLSDR_SeqTypeDef initSeq;
 
 	enum e4k_mask_state maskState;
+	uint8_t maskVal;
+
+	/* Shadow registers, masked writes do not read them back */
+	RTLSDR_I2CShadowTypeDef shadow;
 
 	uint8_t gainState;
 	
@@ -283,6 +286,9 @@ typedef struct {
 USBH_StatusTypeDef E4K_Init(USBH_HandleTypeDef *phost);
 USBH_StatusTypeDef E4K_InitProcess(USBH_HandleTypeDef *phost);
 USBH_StatusTypeDef E4K_SetBW(USBH_HandleTypeDef *phost);
+USBH_StatusTypeDef E4K_tune_freq(USBH_HandleTypeDef *phost, uint32_t freq);
+USBH_StatusTypeDef E4K_set_freq(USBH_HandleTypeDef *phost, uint32_t freq, uint8_t flags);
+void E4K_Abort(USBH_HandleTypeDef *phost);
 /*USBH_StatusTypeDef e4k_standby(struct e4k_state *e4k, int enable);
 USBH_StatusTypeDef e4k_if_gain_set(struct e4k_state *e4k, uint8_t stage, int8_t value);
 USBH_StatusTypeDef e4k_mixer_gain_set(struct e4k_state *e4k, int8_t value);
@@ -67,6 +67,8 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "usbh_core.h"
+#include "usbh_rtlsdr_seq.h"
+#include "usbh_rtlsdr_ctl.h"
 #include "stm32746g_discovery.h"
 #include "stm32746g_discovery_lcd.h"
 #include "stm32746g_discovery_sdram.h"
@@ -97,6 +99,73 @@
 /*USB Control Protocol Codes*/
 #define VENDOR_SPECIFIC                                         0xFF
 
+/* Sample buffers, same geometry as librtlsdr async reads */
+#define DEFAULT_BUF_NUMBER	15
+#define DEFAULT_BUF_LENGTH	(16 * 32 * 512)
+
+/* The sample ring lives in SDRAM, right after the two LCD layer framebuffers.
+ * 15 slots of 256 kB take 3.75 MB of the 8 MB device. */
+#define RTLSDR_RING_SLOT_NUMBER    DEFAULT_BUF_NUMBER
+#define RTLSDR_RING_SLOT_LENGTH    DEFAULT_BUF_LENGTH
+#define RTLSDR_RING_START_ADDRESS  ((uint32_t)(LCD_FB_START_ADDRESS + \
+                                   2 * (RK043FN48H_WIDTH * RK043FN48H_HEIGHT * 4)))
+
+/* Control transfer buffers, see Note on buffer sizes */
+#define RTLSDR_CTL_BUF_SIZE        64
+#define RTLSDR_CTL_BUF_ALIGN       32
+#define RTLSDR_CTL_BUF_ALIGNED     __attribute__((aligned(RTLSDR_CTL_BUF_ALIGN)))
+
+/* Every bulk URB starts on a D-cache line */
+#define RTLSDR_RING_ALIGN          32
+
+/* Bulk transfer length limits, in packets of SdrEpSize. 
+ * USBH_BulkReceiveData takes a 16 bit length, so 127 * 512 is the top. */
+#define RTLSDR_XFER_MIN_PACKETS    1
+#define RTLSDR_XFER_MAX_PACKETS    127
+
+/* Transfer size calibration: each candidate size is measured for
+ * this many TIM5 ticks (100 kHz) */
+#define RTLSDR_CALIB_WINDOW        50000
+
+/* Stream statistics: bins of the inter-URB gap histogram, bin n counts
+ * gaps of 2^(n-1) up to 2^n - 1 TIM5 ticks, the last bin takes the rest */
+#define RTLSDR_STATS_HIST_BINS     16
+
+/* TIM5 ticks between two statistics lines on the console, 0 disables them */
+#define RTLSDR_STATS_PERIOD        500000
+
+/* Bytes the dongle may hold back before samples are considered lost: 
+ * when the stream lags the sample rate by more than this, the RTL2832 
+ * FIFO has overflowed */
+#define RTLSDR_FIFO_SLACK          (32 * 1024)
+
+/* Set to 1 to complete and resubmit the bulk URBs from the HCD interrupt,
+ * set to 0 to poll the URB state from USBH_RTLSDR_Process */
+#define RTLSDR_STREAM_IRQ          1
+
+/* EXPERIMENTAL, not checked on hardware.
+ * 1: the dummy read-back that follows a demod write is deferred to the end
+ * of a batch (RTLSDR_demod_sync) or to the next I2C access, about half
+ * the control transfers of a demod write batch.
+ * 0: read back after every demod write, like librtlsdr does.
+ * Keep 0 until the sync points are checked against a USB capture of the
+ * init sequence and a retune. test/fir_check builds both */
+#ifndef RTLSDR_DEMOD_SYNC_DEFERRED
+#define RTLSDR_DEMOD_SYNC_DEFERRED 0
+#endif
+
+/* Packed FIR coefficients in the demod registers (page 1, 0x1c..0x2f),
+ * uploaded with a single control transfer */
+#define RTLSDR_FIR_BYTES           20
+#define RTLSDR_FIR_ADDR            0x1c
+
+/* Largest crystal correction, the resampler takes 14 bits of 2^-24 */
+#define RTLSDR_PPM_MAX             488
+
+/* Flags of RTLSDR_set_center_freq */
+#define RTLSDR_FREQ_NO_LOCK_CHECK  0x01   /* Do not read back the PLL lock */
+#define RTLSDR_FREQ_FULL           0x02   /* Write all the PLL registers */
+
 /**
   * @}
   */ 
@@ -110,7 +179,6 @@
 typedef enum
 {
   RTLSDR_REQ_STARTWAIT= 0,
-  RTLSDR_REQ_INC,
   RTLSDR_REQ_COMPLETE,
 }
 RTLSDR_ReqStateTypeDef;
@@ -128,7 +196,6 @@ typedef enum
 {
   RTLSDR_FIR_CALC= 0,
   RTLSDR_FIR_WRITE_WAIT,
-  RTLSDR_FIR_INC,
   RTLSDR_FIR_COMPLETE,
 }
 RTLSDR_FirStateTypeDef;
@@ -157,10 +224,19 @@ typedef enum
 {
   RTLSDR_XFER_START= 0,
   RTLSDR_XFER_WAIT,
-  RTLSDR_XFER_COMPLETE
+  RTLSDR_XFER_STREAM,
 }
 RTLSDR_xferStateTypeDef;
 
+/* Bulk transfer size calibration FSM */
+typedef enum
+{
+  RTLSDR_CALIB_IDLE= 0,
+  RTLSDR_CALIB_START,
+  RTLSDR_CALIB_MEASURE,
+}
+RTLSDR_CalibStateTypeDef;
+
 /* Structure for RTLSDR Sample Stream EP */
 typedef struct
 {
@@ -169,9 +245,58 @@ typedef struct
   uint16_t             SdrEpSize;
   uint32_t             buffSize;
   uint8_t*             buff;
+  uint32_t             xferLength;   /* Length of the URB in flight */
 }
 RTLSDR_CommItfTypedef ;
 
+/* Statistics of the sample stream, updated on every bulk URB.
+ * Times are TIM5 ticks (10 us). */
+typedef struct
+{
+  uint32_t             bytes;      /* Bytes received */
+  uint32_t             urbs;       /* URBs completed */
+  uint32_t             errors;     /* URBs failed with error or stall */
+  uint32_t             retries;    /* Transactions retried by the driver (URB_NOTREADY) */
+  uint32_t             gapMin;     /* Time between two URB completions */
+  uint32_t             gapMax;
+  uint32_t             gapSum;
+  uint32_t             gapCount;
+  uint32_t             hist[RTLSDR_STATS_HIST_BINS];
+  uint32_t             lastTick;
+}
+RTLSDR_StatsTypeDef;
+
+/* One slot of the sample ring */
+typedef struct
+{
+  uint32_t             length;     /* Valid bytes in the slot */
+  uint32_t             seq;        /* Sequence number, skips when a slot was dropped */
+  uint32_t             timestamp;  /* HAL tick (ms) when the slot was closed */
+  uint32_t             lost;       /* Estimated bytes lost inside or before the slot */
+  uint8_t              discontinuity; /* Samples are not contiguous with the previous slot */
+}
+RTLSDR_SlotTypeDef;
+
+/* Ring of sample buffers filled by the bulk pipe.
+ * Slots from tail up to (not including) head are full and belong to the
+ * consumer, the head slot is being filled by the URB in flight. */
+typedef struct
+{
+  uint8_t*             base;
+  volatile uint8_t     head;
+  volatile uint8_t     tail;
+  volatile uint32_t    fill;       /* Bytes already received into the head slot */
+  uint32_t             overruns;   /* Head slot restarted because the ring was full */
+  uint32_t             seq;        /* Sequence number of the head slot */
+  uint8_t              discontinuity; /* Pending flag for the head slot */
+  uint32_t             lost;       /* Pending lost bytes for the head slot */
+  int32_t              backlog;    /* Estimated bytes waiting in the dongle FIFO */
+  uint32_t             shortXfers; /* URBs shorter than requested */
+  uint32_t             totalLost;  /* Estimated bytes lost since the stream started */
+  RTLSDR_SlotTypeDef   slot[RTLSDR_RING_SLOT_NUMBER];
+}
+RTLSDR_RingTypeDef;
+
 /* RTLSDR Tuner Interface */
 /* All the tuner modules should implement these functions */
 typedef struct 
@@ -180,6 +305,8 @@ typedef struct
   USBH_StatusTypeDef  (*Init)         (struct _USBH_HandleTypeDef *phost);
   USBH_StatusTypeDef  (*InitProcess)  (struct _USBH_HandleTypeDef *phost);
   USBH_StatusTypeDef  (*SetBW)        (struct _USBH_HandleTypeDef *phost);
+  USBH_StatusTypeDef  (*SetFreq)      (struct _USBH_HandleTypeDef *phost, uint32_t freq, uint8_t flags);
+  void                (*Abort)        (struct _USBH_HandleTypeDef *phost); /* Reset the sub-FSMs after a failure */
   /*USBH_StatusTypeDef  (*DeInit)       (struct _USBH_HandleTypeDef *phost);
   USBH_StatusTypeDef  (*Requests)     (struct _USBH_HandleTypeDef *phost);  
   USBH_StatusTypeDef  (*BgndProcess)  (struct _USBH_HandleTypeDef *phost);
@@ -188,57 +315,99 @@ typedef struct
   void*               tunerData;
 } RTLSDR_TunerTypeDef;
 
+/* Resampler settings of a sample rate */
+typedef struct
+{
+  uint32_t                          rate;           /* Requested, Hz */
+  uint32_t                          rsamp_ratio;
+  uint32_t                          real_rate;      /* Hz, integer part */
+  uint16_t                          real_rate_frac; /* Hz, fraction in Q16 */
+} RTLSDR_RateTypeDef;
+
+/* Copy of the registers of an I2C device behind the repeater, kept up to
+ * date by RTLSDR_i2c_write_reg / RTLSDR_i2c_read_reg. Owned by the tuner
+ * driver, see RTLSDR_i2c_shadow_attach */
+#define RTLSDR_I2C_SHADOW_SIZE     256
+
+typedef struct
+{
+  uint8_t                           addr;           /* I2C address */
+  uint8_t                           val[RTLSDR_I2C_SHADOW_SIZE];
+  uint8_t                           valid[RTLSDR_I2C_SHADOW_SIZE / 8];
+  uint32_t                          hits;
+  uint32_t                          misses;
+} RTLSDR_I2CShadowTypeDef;
+
 
 /* Structure for RTLSDR process */
 typedef struct _RTLSDR_Process
 {
+  void                              *alloc;         /* From USBH_malloc, see Note */
   
   RTLSDR_CommItfTypedef             CommItf;
+  RTLSDR_RingTypeDef                ring;
   RTLSDR_ReqStateTypeDef            reqState;
-  uint8_t                           reqNumber;
+  RTLSDR_SeqTypeDef                 initSeq;
+  RTLSDR_CtlQueueTypeDef            ctlQueue;       /* See usbh_rtlsdr_ctl.h */
+#if (RTLSDR_SEQ_PROFILE == 1)
+  uint32_t                          bootCycles;     /* DWT->CYCCNT at attach */
+  uint32_t                          firstSampleCycles;
+  uint8_t                           firstSampleState;
+#endif
   
   /* Demod */
   RTLSDR_DemodStateTypeDef          demodState;
+  uint8_t                           demodPending;   /* Write not read back yet */
   uint16_t                          demodRead;
   uint16_t                          demodReadIndex;
   uint16_t                          demodReadAddr;
-  uint8_t                           demodReadData[4];
+  uint8_t                           demodReadData[RTLSDR_CTL_BUF_SIZE] RTLSDR_CTL_BUF_ALIGNED;
   
   uint16_t                          demodWriteIndex;
   uint16_t                          demodWriteAddr;
-  uint8_t                           demodWriteData[4];
+  uint8_t                           demodWriteData[RTLSDR_CTL_BUF_SIZE] RTLSDR_CTL_BUF_ALIGNED;
   
   /* FIR */
   RTLSDR_FirStateTypeDef            firState;
-  uint8_t                           firNumber;
-  uint8_t 							fir[20];
+  const int                         *firCoeffs;     /* NULL: RTLSDR_FIR */
+  uint8_t                           fir[RTLSDR_FIR_BYTES];
   
   /* RTL2830 raw read and write*/
   uint16_t            				regWriteIndex;
-  uint8_t							regWriteData[4];
+  uint8_t							regWriteData[RTLSDR_CTL_BUF_SIZE] RTLSDR_CTL_BUF_ALIGNED;
   uint16_t           				arrReadIndex;
   uint16_t            				arrWriteIndex;
   
   /* RTL2830 I2C read and write */
   uint16_t            				i2cWriteAddress;
-  uint8_t							i2cWriteData[4];
+  uint8_t							i2cWriteData[RTLSDR_CTL_BUF_SIZE] RTLSDR_CTL_BUF_ALIGNED;
   
   uint16_t            				i2cReadAddress;
-  uint8_t							i2cReadReg;
+  uint8_t							i2cReadReg[RTLSDR_CTL_BUF_SIZE] RTLSDR_CTL_BUF_ALIGNED;
   uint8_t							i2cReadVal;
-  uint8_t							i2cReadData[4]; /* See Note */
+  uint8_t							i2cReadData[RTLSDR_CTL_BUF_SIZE] RTLSDR_CTL_BUF_ALIGNED; /* See Note */
   
-  uint32_t							bw;
+  uint32_t							bw;              /* Applied to the tuner, 0: not yet */
+  uint32_t                          bwSetting;       /* 0: follow the sample rate */
   uint8_t 							setSampleRateState;
+  uint32_t                          streamRate;      /* Bytes per TIM5 tick, Q16 */
   uint32_t 							rsamp_ratio;
   uint32_t 							real_rsamp_ratio;
-  double 							real_rate;
+  uint32_t 							real_rate;       /* Hz, integer part */
+  uint16_t                          real_rate_frac;  /* Hz, fraction in Q16 */
+  
+  /* Frequency correction */
+  int32_t                           ppm;
+  uint32_t                          xtal;            /* Hz, corrected by ppm */
+  uint8_t                           freqCorrState;
   
   uint16_t 							xferWaitNo;
   
   RTLSDR_ProbeStateTypeDef          probeState;
   RTLSDR_I2CStateTypeDef            i2cState;
+  RTLSDR_I2CShadowTypeDef*          i2cShadow;
   RTLSDR_TunerTypeDef*              tuner;
+  uint32_t                          centerFreq;     /* Hz, last tuned */
   
   
   
@@ -249,6 +418,20 @@ typedef struct _RTLSDR_Process
   uint32_t uwPrescalerValue;
   
   RTLSDR_xferStateTypeDef			xferState;
+  USBH_URBStateTypeDef              xferUrbState;   /* Last polled, XFER_WAIT */
+  RTLSDR_StatsTypeDef               stats;
+  uint32_t                          statsTick;
+  uint32_t                          statsTicks;
+  uint32_t                          statsBytes;
+  
+  /* Bulk transfer size calibration */
+  RTLSDR_CalibStateTypeDef          calibState;
+  uint8_t                           calibIndex;
+  uint32_t                          calibTick;
+  uint32_t                          calibTicks;
+  uint32_t                          calibBytes;
+  uint32_t                          calibBestSize;
+  uint32_t                          calibBestRate;
   
 }
 RTLSDR_HandleTypeDef;
@@ -258,7 +441,15 @@ RTLSDR_HandleTypeDef;
  * 4 bytes (blocks of 32 bits). If not, USB will write outside the 
  * buffer and cause a buffer overflow. This has been physically tested,
  * if the buffers are less than 4 bytes, the next variable inside the
- * struct gets altered. Probably the cause is in stm32f7xx_ll_usb.c **/
+ * struct gets altered. Probably the cause is in stm32f7xx_ll_usb.c 
+ * 
+ * The cause is indeed there: USB_ReadPacket copies whole words out of
+ * the FIFO, and in DMA mode USB_HC_StartXfer rounds IN transfers up to
+ * a whole number of packets. So the control buffers hold a full EP0 
+ * packet and are aligned to the D-cache lines. USBH_malloc only gives 8
+ * bytes, so the handle is placed on the next RTLSDR_CTL_BUF_ALIGN boundary
+ * of a slightly larger block (alloc, given back to USBH_free). The bulk buffers are multiples of SdrEpSize
+ * inside the SDRAM ring. **/
 
 /**
 * @}
@@ -274,9 +465,6 @@ typedef struct RTLSDR_DONGLE {
 	const char *name;
 } RTLSDR_DONGLE_T;
 
-#define DEFAULT_BUF_NUMBER	15
-#define DEFAULT_BUF_LENGTH	(16 * 32 * 512)
-
 #define DEF_RTL_XTAL_FREQ	28800000
 #define MIN_RTL_XTAL_FREQ	(DEF_RTL_XTAL_FREQ - 1000)
 #define MAX_RTL_XTAL_FREQ	(DEF_RTL_XTAL_FREQ + 1000)
@@ -377,6 +565,9 @@ extern USBH_ClassTypeDef  RTLSDR_Class;
 */ 
 USBH_StatusTypeDef USBH_RTLSDR_IOProcess (USBH_HandleTypeDef *phost);
 USBH_StatusTypeDef USBH_RTLSDR_Init (USBH_HandleTypeDef *phost);
+void USBH_RTLSDR_URBChangeCallback (USBH_HandleTypeDef *phost, 
+                                    uint8_t pipe, 
+                                    USBH_URBStateTypeDef urbState);
 
 USBH_StatusTypeDef RTLSDR_read_reg (USBH_HandleTypeDef *phost, 
                                uint8_t block, 
@@ -408,12 +599,30 @@ USBH_StatusTypeDef RTLSDR_i2c_write(USBH_HandleTypeDef *phost, uint8_t i2c_addr,
 
 USBH_StatusTypeDef RTLSDR_i2c_read(USBH_HandleTypeDef *phost, uint8_t i2c_addr, uint8_t *buffer, uint8_t);
 
+USBH_StatusTypeDef RTLSDR_set_sample_rate(USBH_HandleTypeDef *phost, uint32_t samp_rate);
+
+void RTLSDR_set_bandwidth(USBH_HandleTypeDef *phost, uint32_t bw);
+
+USBH_StatusTypeDef RTLSDR_set_freq_correction(USBH_HandleTypeDef *phost, int32_t ppm);
+
+USBH_StatusTypeDef RTLSDR_set_center_freq(USBH_HandleTypeDef *phost, uint32_t freq, uint8_t flags);
+
+void RTLSDR_i2c_shadow_attach(USBH_HandleTypeDef *phost, RTLSDR_I2CShadowTypeDef *shadow, uint8_t i2c_addr);
+
+void RTLSDR_i2c_shadow_reset(USBH_HandleTypeDef *phost);
+
+uint8_t RTLSDR_i2c_shadow_get(USBH_HandleTypeDef *phost, uint8_t i2c_addr, uint8_t reg, uint8_t *val);
+
 USBH_StatusTypeDef RTLSDR_open(USBH_HandleTypeDef *phost) ;
 
 USBH_StatusTypeDef RTLSDR_demod_read_reg(USBH_HandleTypeDef *phost, uint8_t page, uint16_t addr, uint8_t len);
 
 USBH_StatusTypeDef RTLSDR_demod_write_reg(USBH_HandleTypeDef *phost, uint8_t page, uint16_t addr, uint16_t val, uint8_t len);
 
+USBH_StatusTypeDef RTLSDR_demod_write_array(USBH_HandleTypeDef *phost, uint8_t page, uint16_t addr, const uint8_t *array, uint8_t len);
+
+USBH_StatusTypeDef RTLSDR_demod_sync(USBH_HandleTypeDef *phost);
+
 USBH_StatusTypeDef RTLSDR_set_i2c_repeater(USBH_HandleTypeDef *phost, int on);
 
 USBH_StatusTypeDef RTLSDR_write_array(USBH_HandleTypeDef *phost, 
@@ -430,8 +639,30 @@ USBH_StatusTypeDef RTLSDR_write_reg(USBH_HandleTypeDef *phost,
 
 USBH_StatusTypeDef RTLSDR_set_fir(USBH_HandleTypeDef *phost);
 
+USBH_StatusTypeDef RTLSDR_load_fir(USBH_HandleTypeDef *phost, const int *coeffs);
+
 USBH_StatusTypeDef RTLSDR_probe_tuners(USBH_HandleTypeDef *phost);
 
+uint8_t* RTLSDR_get_slot(USBH_HandleTypeDef *phost, uint32_t *length);
+
+void RTLSDR_release_slot(USBH_HandleTypeDef *phost);
+
+const RTLSDR_SlotTypeDef* RTLSDR_get_slot_info(USBH_HandleTypeDef *phost);
+
+uint32_t RTLSDR_get_stream_seq(USBH_HandleTypeDef *phost);
+
+USBH_StatusTypeDef RTLSDR_set_xfer_size(USBH_HandleTypeDef *phost, uint32_t length);
+
+uint32_t RTLSDR_get_xfer_size(USBH_HandleTypeDef *phost);
+
+USBH_StatusTypeDef RTLSDR_calibrate_xfer_size(USBH_HandleTypeDef *phost);
+
+USBH_StatusTypeDef RTLSDR_get_stats(USBH_HandleTypeDef *phost, RTLSDR_StatsTypeDef *stats);
+
+void RTLSDR_reset_stats(USBH_HandleTypeDef *phost);
+
+void RTLSDR_print_stats(USBH_HandleTypeDef *phost);
+
 /**
 * @}
 */ 
@@ -0,0 +1,162 @@
+/**
+  ******************************************************************************
+  * @file    usbh_rtlsdr_ctl.h
+  * @author
+  * @version
+  * @date
+  * @brief   Asynchronous control request queue for the RTLSDR USB Host class
+  *
+  *
+  ******************************************************************************
+  * @attention
+  *
+  * Register accesses once the class is active (retune, gain changes, ...)
+  * are queued as request descriptors instead of being polled to completion
+  * by the caller. USBH_RTLSDR_Process runs the queue one request at a time
+  * over the control pipe, while the bulk pipe keeps streaming, and calls
+  * the completion callback of each request when it is done.
+  *
+  * Requests can be submitted from the main loop or from interrupts.
+  * Callbacks run in the context of USBH_Process.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive  ----------------------------------------------*/
+#ifndef __USBH_RTLSDR_CTL_H
+#define __USBH_RTLSDR_CTL_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbh_core.h"
+#include "usbh_rtlsdr_seq.h"
+
+/** @addtogroup USBH_LIB
+* @{
+*/
+
+/** @addtogroup USBH_CLASS
+* @{
+*/
+
+/** @addtogroup USBH_RTLSDR_CLASS
+* @{
+*/
+
+/** @defgroup USBH_RTLSDR_CTL
+* @brief This file is the Header file for usbh_rtlsdr_ctl.c
+* @{
+*/
+
+/* Request descriptors in the queue, must be a power of 2 */
+#define RTLSDR_CTL_QUEUE_SIZE      16
+
+/**
+  * @}
+  */
+
+/** @defgroup USBH_RTLSDR_CTL_Exported_Types
+* @{
+*/
+
+struct _RTLSDR_CtlReq;
+
+/* Completion callback, status is USBH_OK or the error of the request */
+typedef void (*RTLSDR_CtlCallbackTypeDef)(USBH_HandleTypeDef *phost,
+                                          struct _RTLSDR_CtlReq *req,
+                                          USBH_StatusTypeDef status);
+
+/* Request descriptor */
+typedef struct _RTLSDR_CtlReq
+{
+  RTLSDR_SeqStepTypeDef      step;      /* What to do, see RTLSDR_SEQ_* */
+  uint8_t                    result;    /* Value read by an I2C read */
+  RTLSDR_CtlCallbackTypeDef  callback;  /* Can be NULL */
+  void                      *context;   /* For the callback */
+}
+RTLSDR_CtlReqTypeDef;
+
+/* Ring of requests, head is run by USBH_RTLSDR_Process */
+typedef struct
+{
+  RTLSDR_CtlReqTypeDef       req[RTLSDR_CTL_QUEUE_SIZE];
+  volatile uint32_t          head;
+  volatile uint32_t          tail;
+  uint8_t                    running;   /* Head request started */
+  uint32_t                   rejected;  /* Submitted with the queue full */
+  RTLSDR_SeqTypeDef          seq;       /* Runs the step of the head request */
+}
+RTLSDR_CtlQueueTypeDef;
+
+/**
+* @}
+*/
+
+/** @defgroup USBH_RTLSDR_CTL_Exported_FunctionsPrototype
+* @{
+*/
+
+void RTLSDR_ctl_init(RTLSDR_CtlQueueTypeDef *queue);
+
+USBH_StatusTypeDef RTLSDR_ctl_process(USBH_HandleTypeDef *phost, RTLSDR_CtlQueueTypeDef *queue);
+
+USBH_StatusTypeDef RTLSDR_ctl_submit(USBH_HandleTypeDef *phost,
+                                     const RTLSDR_SeqStepTypeDef *step,
+                                     RTLSDR_CtlCallbackTypeDef callback,
+                                     void *context);
+
+uint32_t RTLSDR_ctl_pending(USBH_HandleTypeDef *phost);
+
+USBH_StatusTypeDef RTLSDR_ctl_write_reg(USBH_HandleTypeDef *phost,
+                                        uint8_t block, uint16_t addr, uint16_t val, uint8_t len,
+                                        RTLSDR_CtlCallbackTypeDef callback, void *context);
+
+USBH_StatusTypeDef RTLSDR_ctl_demod_write_reg(USBH_HandleTypeDef *phost,
+                                              uint8_t page, uint16_t addr, uint16_t val, uint8_t len,
+                                              RTLSDR_CtlCallbackTypeDef callback, void *context);
+
+USBH_StatusTypeDef RTLSDR_ctl_i2c_write_reg(USBH_HandleTypeDef *phost,
+                                            uint8_t i2c_addr, uint8_t reg, uint8_t val,
+                                            RTLSDR_CtlCallbackTypeDef callback, void *context);
+
+USBH_StatusTypeDef RTLSDR_ctl_i2c_read_reg(USBH_HandleTypeDef *phost,
+                                           uint8_t i2c_addr, uint8_t reg,
+                                           RTLSDR_CtlCallbackTypeDef callback, void *context);
+
+USBH_StatusTypeDef RTLSDR_ctl_set_freq(USBH_HandleTypeDef *phost, uint32_t freq, uint8_t flags,
+                                       RTLSDR_CtlCallbackTypeDef callback, void *context);
+
+USBH_StatusTypeDef RTLSDR_ctl_set_sample_rate(USBH_HandleTypeDef *phost, uint32_t rate,
+                                              RTLSDR_CtlCallbackTypeDef callback, void *context);
+
+USBH_StatusTypeDef RTLSDR_ctl_set_freq_correction(USBH_HandleTypeDef *phost, int32_t ppm,
+                                                  RTLSDR_CtlCallbackTypeDef callback, void *context);
+
+/**
+* @}
+*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __USBH_RTLSDR_CTL_H */
+
+/**
+* @}
+*/
+
+/**
+* @}
+*/
+
+/**
+* @}
+*/
+
+/**
+* @}
+*/
@@ -0,0 +1,186 @@
+/**
+  ******************************************************************************
+  * @file    usbh_rtlsdr_seq.h
+  * @author
+  * @version
+  * @date
+  * @brief   Register sequence engine for the RTLSDR USB Host class
+  *
+  *
+  ******************************************************************************
+  * @attention
+  *
+  * Register sequences (RTL2832 init, tuner init, ...) are const tables of
+  * steps in flash. RTLSDR_seq_run executes them one step at a time from the
+  * class state machines, the same way the hand written switch(reqNumber)
+  * FSMs did.
+  *
+  * Adjacent writes to consecutive registers of the same demod page or
+  * USB/SYS block are sent as a single multi-byte control transfer.
+  * I2C writes are never merged.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive  ----------------------------------------------*/
+#ifndef __USBH_RTLSDR_SEQ_H
+#define __USBH_RTLSDR_SEQ_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbh_core.h"
+
+/** @addtogroup USBH_LIB
+* @{
+*/
+
+/** @addtogroup USBH_CLASS
+* @{
+*/
+
+/** @addtogroup USBH_RTLSDR_CLASS
+* @{
+*/
+
+/** @defgroup USBH_RTLSDR_SEQ
+* @brief This file is the Header file for usbh_rtlsdr_seq.c
+* @{
+*/
+
+/* Longest merged write, it must fit the control buffers of the handle */
+#define RTLSDR_SEQ_BATCH_MAX       64
+
+/* Set to 0 to send every step as its own control transfer */
+#define RTLSDR_SEQ_BATCH           1
+
+/* Set to 1 to record the DWT cycles spent in every step, they are dumped
+ * with RTLSDR_seq_print_profile when the class becomes active */
+#define RTLSDR_SEQ_PROFILE         0
+
+/* Steps profiled per sequence, the rest are only counted in the total */
+#define RTLSDR_SEQ_PROFILE_MAX     48
+
+/**
+  * @}
+  */
+
+/** @defgroup USBH_RTLSDR_SEQ_Exported_Types
+* @{
+*/
+
+/* Operations of a sequence step */
+typedef enum
+{
+  RTLSDR_SEQ_OP_WRITE= 0,     /* RTLSDR_write_reg(block, addr, val, len) */
+  RTLSDR_SEQ_OP_DEMOD,        /* RTLSDR_demod_write_reg(page, addr, val, len) */
+  RTLSDR_SEQ_OP_I2C_WRITE,    /* RTLSDR_i2c_write_reg(i2c addr, reg, val) */
+  RTLSDR_SEQ_OP_I2C_READ,     /* RTLSDR_i2c_read_reg(i2c addr, reg) */
+  RTLSDR_SEQ_OP_I2C_MASK,     /* Read-modify-write of the mask bits of an I2C reg */
+  RTLSDR_SEQ_OP_CALL,         /* Run a sub-FSM until it returns USBH_OK */
+}
+RTLSDR_SeqOpTypeDef;
+
+struct _RTLSDR_SeqStep;
+
+/* Sub-FSM called by a step, it gets the step for its arguments */
+typedef USBH_StatusTypeDef (*RTLSDR_SeqCallTypeDef)(USBH_HandleTypeDef *phost,
+                                                    const struct _RTLSDR_SeqStep *step);
+
+/* One step of a register sequence */
+typedef struct _RTLSDR_SeqStep
+{
+  uint8_t                op;       /* RTLSDR_SeqOpTypeDef */
+  uint8_t                block;    /* Block, demod page or I2C address */
+  uint16_t               addr;     /* Register address */
+  uint32_t               val;      /* Value, or argument of the call */
+  uint8_t                len;      /* Register length in bytes */
+  uint8_t                mask;     /* Bits written by RTLSDR_SEQ_OP_I2C_MASK */
+  RTLSDR_SeqCallTypeDef  call;
+}
+RTLSDR_SeqStepTypeDef;
+
+/* Execution state of a sequence, owned by the FSM that runs it */
+typedef struct
+{
+  const RTLSDR_SeqStepTypeDef* table;
+  uint8_t                length;
+  uint8_t                index;    /* Step being run */
+  uint8_t                state;    /* Phase inside the step */
+  uint8_t                batchSteps; /* Steps merged into the current transfer */
+  uint8_t                batchLen;
+  uint8_t                batch[RTLSDR_SEQ_BATCH_MAX];
+#if (RTLSDR_SEQ_PROFILE == 1)
+  uint8_t                running;
+  uint32_t               seqStart;  /* DWT->CYCCNT at the first step */
+  uint32_t               stepStart; /* DWT->CYCCNT at the current step */
+  uint32_t               total;     /* Cycles of the last complete run */
+  uint32_t               stepCycles[RTLSDR_SEQ_PROFILE_MAX];
+#endif
+}
+RTLSDR_SeqTypeDef;
+
+/* Table entry helpers */
+#define RTLSDR_SEQ_WRITE(block, addr, val, len) \
+  { RTLSDR_SEQ_OP_WRITE, (block), (addr), (val), (len), 0, NULL }
+
+#define RTLSDR_SEQ_DEMOD(page, addr, val, len) \
+  { RTLSDR_SEQ_OP_DEMOD, (page), (addr), (val), (len), 0, NULL }
+
+#define RTLSDR_SEQ_I2C_WRITE(i2c_addr, reg, val) \
+  { RTLSDR_SEQ_OP_I2C_WRITE, (i2c_addr), (reg), (val), 1, 0, NULL }
+
+#define RTLSDR_SEQ_I2C_READ(i2c_addr, reg) \
+  { RTLSDR_SEQ_OP_I2C_READ, (i2c_addr), (reg), 0, 1, 0, NULL }
+
+#define RTLSDR_SEQ_I2C_MASK(i2c_addr, reg, mask, val) \
+  { RTLSDR_SEQ_OP_I2C_MASK, (i2c_addr), (reg), (val), 1, (mask), NULL }
+
+#define RTLSDR_SEQ_CALL(fn, addr, val) \
+  { RTLSDR_SEQ_OP_CALL, 0, (addr), (val), 0, 0, (fn) }
+
+#define RTLSDR_SEQ_LENGTH(table)   (sizeof(table) / sizeof((table)[0]))
+
+/**
+* @}
+*/
+
+/** @defgroup USBH_RTLSDR_SEQ_Exported_FunctionsPrototype
+* @{
+*/
+
+void RTLSDR_seq_init(RTLSDR_SeqTypeDef *seq,
+                     const RTLSDR_SeqStepTypeDef *table,
+                     uint8_t length);
+
+USBH_StatusTypeDef RTLSDR_seq_run(USBH_HandleTypeDef *phost, RTLSDR_SeqTypeDef *seq);
+
+void RTLSDR_seq_print_profile(RTLSDR_SeqTypeDef *seq, const char *name);
+
+/**
+* @}
+*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __USBH_RTLSDR_SEQ_H */
+
+/**
+* @}
+*/
+
+/**
+* @}
+*/
+
+/**
+* @}
+*/
+
+/**
+* @}
+*/
@@ -69,6 +69,8 @@ RTLSDR_TunerTypeDef  Tuner_E4K =
   E4K_Init,
   E4K_InitProcess,
   E4K_SetBW,
+  E4K_set_freq,
+  E4K_Abort,
   NULL,
 };
 
@@ -298,19 +300,64 @@ struct pll_settings {
 	uint8_t mult;
 };
 
+/* Upper edges of the PLL bands, shared by pll_vars and pll_band_lut */
+#define E4K_PLL_EDGE0	KHZ(72400)
+#define E4K_PLL_EDGE1	KHZ(81200)
+#define E4K_PLL_EDGE2	KHZ(108300)
+#define E4K_PLL_EDGE3	KHZ(162500)
+#define E4K_PLL_EDGE4	KHZ(216600)
+#define E4K_PLL_EDGE5	KHZ(325000)
+#define E4K_PLL_EDGE6	KHZ(350000)
+#define E4K_PLL_EDGE7	KHZ(432000)
+#define E4K_PLL_EDGE8	KHZ(667000)
+#define E4K_PLL_EDGE9	KHZ(1200000)
+
 static const struct pll_settings pll_vars[] = {
-	{KHZ(72400),	(1 << 3) | 7,	48},
-	{KHZ(81200),	(1 << 3) | 6,	40},
-	{KHZ(108300),	(1 << 3) | 5,	32},
-	{KHZ(162500),	(1 << 3) | 4,	24},
-	{KHZ(216600),	(1 << 3) | 3,	16},
-	{KHZ(325000),	(1 << 3) | 2,	12},
-	{KHZ(350000),	(1 << 3) | 1,	8},
-	{KHZ(432000),	(0 << 3) | 3,	8},
-	{KHZ(667000),	(0 << 3) | 2,	6},
-	{KHZ(1200000),	(0 << 3) | 1,	4}
+	{E4K_PLL_EDGE0,	(1 << 3) | 7,	48},
+	{E4K_PLL_EDGE1,	(1 << 3) | 6,	40},
+	{E4K_PLL_EDGE2,	(1 << 3) | 5,	32},
+	{E4K_PLL_EDGE3,	(1 << 3) | 4,	24},
+	{E4K_PLL_EDGE4,	(1 << 3) | 3,	16},
+	{E4K_PLL_EDGE5,	(1 << 3) | 2,	12},
+	{E4K_PLL_EDGE6,	(1 << 3) | 1,	8},
+	{E4K_PLL_EDGE7,	(0 << 3) | 3,	8},
+	{E4K_PLL_EDGE8,	(0 << 3) | 2,	6},
+	{E4K_PLL_EDGE9,	(0 << 3) | 1,	4}
+};
+
+/* Band of flo for the fast path: pll_band_lut[flo >> E4K_PLL_LUT_SHIFT] is
+ * the first entry of pll_vars above the start of the bucket. The buckets
+ * (4 MHz) are narrower than any band, so at most one edge falls inside a
+ * bucket and one compare finishes the lookup. ARRAY_SIZE(pll_vars) means
+ * above the last edge (R = 2) */
+#define E4K_PLL_LUT_SHIFT	22
+#define E4K_PLL_LUT_SIZE	576	/* Covers 2.4 GHz */
+
+#define E4K_PLL_IDX(f) \
+	((f) < E4K_PLL_EDGE0 ? 0 : (f) < E4K_PLL_EDGE1 ? 1 : \
+	 (f) < E4K_PLL_EDGE2 ? 2 : (f) < E4K_PLL_EDGE3 ? 3 : \
+	 (f) < E4K_PLL_EDGE4 ? 4 : (f) < E4K_PLL_EDGE5 ? 5 : \
+	 (f) < E4K_PLL_EDGE6 ? 6 : (f) < E4K_PLL_EDGE7 ? 7 : \
+	 (f) < E4K_PLL_EDGE8 ? 8 : (f) < E4K_PLL_EDGE9 ? 9 : 10)
+
+#define E4K_PLL_LUT1(n)		E4K_PLL_IDX((uint32_t)(n) << E4K_PLL_LUT_SHIFT)
+#define E4K_PLL_LUT4(n)		E4K_PLL_LUT1(n), E4K_PLL_LUT1((n) + 1), \
+				E4K_PLL_LUT1((n) + 2), E4K_PLL_LUT1((n) + 3)
+#define E4K_PLL_LUT16(n)	E4K_PLL_LUT4(n), E4K_PLL_LUT4((n) + 4), \
+				E4K_PLL_LUT4((n) + 8), E4K_PLL_LUT4((n) + 12)
+#define E4K_PLL_LUT64(n)	E4K_PLL_LUT16(n), E4K_PLL_LUT16((n) + 16), \
+				E4K_PLL_LUT16((n) + 32), E4K_PLL_LUT16((n) + 48)
+
+static const uint8_t pll_band_lut[E4K_PLL_LUT_SIZE] = {
+	E4K_PLL_LUT64(0),   E4K_PLL_LUT64(64),  E4K_PLL_LUT64(128),
+	E4K_PLL_LUT64(192), E4K_PLL_LUT64(256), E4K_PLL_LUT64(320),
+	E4K_PLL_LUT64(384), E4K_PLL_LUT64(448), E4K_PLL_LUT64(512)
 };
 
+/* The fast path splits the 64 bit products of the PLL math in 32 bit steps.
+ * They hold for any fosc below 2^25 Hz, so the whole is_fosc_valid range */
+typedef char e4k_fast_fosc_check[(MHZ(30) < (1UL << 25)) ? 1 : -1];
+
 static int is_fvco_valid(uint32_t fvco_z)
 {
 	/* check if the resulting fosc is valid */
@@ -333,6 +380,7 @@ static int is_fosc_valid(uint32_t fosc)
 	return 1;
 }
 
+#ifdef E4K_PLL_CHECK
 /* \brief compute Fvco based on Fosc, Z and X
  * \returns positive value (Fvco in Hz), 0 in case of error */
 static uint64_t compute_fvco(uint32_t f_osc, uint8_t z, uint16_t x)
@@ -359,6 +407,7 @@ static uint32_t compute_flo(uint32_t f_osc, uint8_t z, uint16_t x, uint8_t r)
 	uint64_t fvco = compute_fvco(f_osc, z, x);
 	return fvco / r;
 }
+#endif /* E4K_PLL_CHECK */
 
 static int find_if_bw(enum e4k_if_filter filter, uint32_t bw)
 {
@@ -400,21 +449,28 @@ USBH_StatusTypeDef E4K_reg_set_mask(USBH_HandleTypeDef *phost, uint8_t reg,
     
   switch (E4K_Handle->maskState) {
 	  case E4K_MASK_READ:
-		uStatus = E4K_reg_read(phost, reg);
-		if (uStatus == USBH_OK) {
-			rStatus = USBH_BUSY;
+		/* Cache hit: no read, go on with the write right away */
+		if (RTLSDR_i2c_shadow_get(phost, E4K_I2C_ADDR, reg, &(E4K_Handle->maskVal))) {
 			E4K_Handle->maskState = E4K_MASK_WRITE;
 		} else {
-			rStatus = uStatus;
+			uStatus = E4K_reg_read(phost, reg);
+			if (uStatus == USBH_OK) {
+				E4K_Handle->maskVal = RTLSDR_Handle->i2cReadVal;
+				rStatus = USBH_BUSY;
+				E4K_Handle->maskState = E4K_MASK_WRITE;
+			} else {
+				rStatus = uStatus;
+			}
+			break;
 		}
-	  break;
+	  /* no break */
 	  
 	  case E4K_MASK_WRITE:
 		
-		if ((RTLSDR_Handle->i2cReadVal & mask) == val) {
+		if ((E4K_Handle->maskVal & mask) == val) {
 			uStatus = USBH_OK;
 		} else {
-			uStatus = E4K_reg_write(phost, reg, (RTLSDR_Handle->i2cReadVal & ~mask) | (val & mask));
+			uStatus = E4K_reg_write(phost, reg, (E4K_Handle->maskVal & ~mask) | (val & mask));
 		}
 		
 		if (uStatus == USBH_OK) {
@@ -686,7 +742,67 @@ USBH_StatusTypeDef E4K_SetBW(USBH_HandleTypeDef *phost)
 
 /* Tune routines */
 
-uint32_t E4K_compute_pll_params(struct e4k_pll_params *oscp, uint32_t fosc, uint32_t intended_flo)
+/* E4K_compute_pll_params with 32 bit math only, for any valid fosc: the
+ * nominal crystal as well as one corrected by RTLSDR_set_freq_correction.
+ * The divisions are by a variable fosc, single UDIV instructions */
+static uint32_t E4K_compute_pll_params_fast(struct e4k_pll_params *oscp, uint32_t fosc, uint32_t intended_flo)
+{
+	uint32_t i, r, z, x, rem, fx, flo;
+	uint32_t lut = intended_flo >> E4K_PLL_LUT_SHIFT;
+
+	if (lut < E4K_PLL_LUT_SIZE) {
+		i = pll_band_lut[lut];
+		if ((i < ARRAY_SIZE(pll_vars)) && (intended_flo >= pll_vars[i].freq)) i++;
+	} else {
+		i = ARRAY_SIZE(pll_vars);
+	}
+
+	if (i < ARRAY_SIZE(pll_vars)) {
+		oscp->r_idx = pll_vars[i].reg_synth7;
+		oscp->threephase = (pll_vars[i].reg_synth7 & 0x08) ? 1 : 0;
+		r = pll_vars[i].mult;
+	} else {
+		oscp->r_idx = 0;
+		oscp->threephase = 0;
+		r = 2;
+	}
+
+	/* flo * R = Z * fosc + rem, with flo = a * fosc + b:
+	 * Z = a * R + (b * R) / fosc, rem = (b * R) % fosc */
+	z = (intended_flo / fosc) * r;
+	rem = (intended_flo % fosc) * r;
+	z += rem / fosc;
+	rem = rem % fosc;
+
+	/* X = rem * 2^16 / fosc by long division, 7 + 7 + 2 bits at a time:
+	 * rem < fosc < 2^25, so each shifted remainder fits in 32 bits */
+	rem <<= 7;
+	x = rem / fosc;
+	rem = (rem % fosc) << 7;
+	x = (x << 7) | (rem / fosc);
+	rem = (rem % fosc) << 2;
+	x = (x << 2) | (rem / fosc);
+
+	/* Fvco = fosc * Z + fosc * X / Y, flo = Fvco / R
+	 * with Z = zq * R + zr: flo = fosc * zq + (fosc * zr + fosc * X / Y) / R
+	 * and fosc * X / Y taken in two halves of fosc */
+	fx = (fosc >> 16) * x + (((fosc & 0xffff) * x) >> 16);
+	flo = fosc * (z / r) + (fosc * (z % r) + fx) / r;
+
+	oscp->fosc = fosc;
+	oscp->flo = flo;
+	oscp->intended_flo = intended_flo;
+	oscp->r = r;
+	oscp->x = x;
+	oscp->z = z;
+
+	return flo;
+}
+
+#ifdef E4K_PLL_CHECK
+/* The 64 bit computation of librtlsdr, the reference of the fast path in
+ * test/e4k_pll_check.c */
+static uint32_t E4K_compute_pll_params_64(struct e4k_pll_params *oscp, uint32_t fosc, uint32_t intended_flo)
 {
 	uint32_t i;
 	uint8_t r = 2;
@@ -735,6 +851,17 @@ uint32_t E4K_compute_pll_params(struct e4k_pll_params *oscp, uint32_t fosc, uint
 
 	return flo;
 }
+#endif /* E4K_PLL_CHECK */
+
+uint32_t E4K_compute_pll_params(struct e4k_pll_params *oscp, uint32_t fosc, uint32_t intended_flo)
+{
+	oscp->r_idx = 0;
+
+	if (!is_fosc_valid(fosc))
+		return 0;
+
+	return E4K_compute_pll_params_fast(oscp, fosc, intended_flo);
+}
 
 /* \brief Automatically select apropriate RF filter based on e4k state */
 int E4K_rf_filter_set(USBH_HandleTypeDef *phost)
@@ -810,7 +937,34 @@ USBH_StatusTypeDef E4K_band_set(USBH_HandleTypeDef *phost, enum e4k_band band)
 	return rStatus;
 }
 
-USBH_StatusTypeDef E4K_tune_params(USBH_HandleTypeDef *phost, struct e4k_pll_params *p)
+/* Write reg unless the shadow says it already holds val */
+static USBH_StatusTypeDef E4K_reg_write_diff(USBH_HandleTypeDef *phost, uint8_t reg, uint8_t val, uint8_t force)
+{
+	uint8_t cur;
+
+	if (!force && RTLSDR_i2c_shadow_get(phost, E4K_I2C_ADDR, reg, &cur) && (cur == val)) {
+		return USBH_OK;
+	}
+
+	return E4K_reg_write(phost, reg, val);
+}
+
+static enum e4k_band E4K_band_for(uint32_t flo)
+{
+	if (flo < MHZ(140))
+		return E4K_BAND_VHF2;
+	else if (flo < MHZ(350))
+		return E4K_BAND_VHF3;
+	else if (flo < MHZ(1135))
+		return E4K_BAND_UHF;
+	else
+		return E4K_BAND_L;
+}
+
+/* Program the PLL. Unless RTLSDR_FREQ_FULL is set, only the registers
+ * that differ from the shadow are written and the band is only switched
+ * when it changes */
+USBH_StatusTypeDef E4K_tune_params(USBH_HandleTypeDef *phost, struct e4k_pll_params *p, uint8_t flags)
 {
 	USBH_StatusTypeDef uStatus = USBH_FAIL;
   USBH_StatusTypeDef rStatus = USBH_BUSY;
@@ -821,12 +975,15 @@ USBH_StatusTypeDef E4K_tune_params(USBH_HandleTypeDef *phost, struct e4k_pll_par
   E4K_HandleTypeDef * E4K_Handle = 
     (E4K_HandleTypeDef*) RTLSDR_Handle->tuner->tunerData;
   
+  uint8_t force = (flags & RTLSDR_FREQ_FULL) ? 1 : 0;
+  enum e4k_band band;
+  
   switch (E4K_Handle->tuneParamsState) {
 		case 0:
 			/* program R + 3phase/2phase */
-			uStatus = E4K_reg_write(phost, E4K_REG_SYNTH7, p->r_idx);
+			uStatus = E4K_reg_write_diff(phost, E4K_REG_SYNTH7, p->r_idx, force);
 			if (uStatus==USBH_OK) {
-				E4K_Handle->tuneFreqState++;
+				E4K_Handle->tuneParamsState++;
 				rStatus=USBH_BUSY;
 			} else {
 				rStatus=uStatus;
@@ -835,9 +992,9 @@ USBH_StatusTypeDef E4K_tune_params(USBH_HandleTypeDef *phost, struct e4k_pll_par
 		
 		case 1:
 			/* program Z */
-			uStatus = E4K_reg_write(phost,  E4K_REG_SYNTH3, p->z);
+			uStatus = E4K_reg_write_diff(phost, E4K_REG_SYNTH3, p->z, force);
 			if (uStatus==USBH_OK) {
-				E4K_Handle->tuneFreqState++;
+				E4K_Handle->tuneParamsState++;
 				rStatus=USBH_BUSY;
 			} else {
 				rStatus=uStatus;
@@ -846,9 +1003,9 @@ USBH_StatusTypeDef E4K_tune_params(USBH_HandleTypeDef *phost, struct e4k_pll_par
 		
 		case 2:
 			/* program X (1) */
-			uStatus = E4K_reg_write(phost, E4K_REG_SYNTH4, p->x & 0xff);
+			uStatus = E4K_reg_write_diff(phost, E4K_REG_SYNTH4, p->x & 0xff, force);
 			if (uStatus==USBH_OK) {
-				E4K_Handle->tuneFreqState++;
+				E4K_Handle->tuneParamsState++;
 				rStatus=USBH_BUSY;
 			} else {
 				rStatus=uStatus;
@@ -857,9 +1014,9 @@ USBH_StatusTypeDef E4K_tune_params(USBH_HandleTypeDef *phost, struct e4k_pll_par
 		
 		case 3:
 			/* program X (2) */
-			uStatus = E4K_reg_write(phost, E4K_REG_SYNTH5, p->x >> 8);
+			uStatus = E4K_reg_write_diff(phost, E4K_REG_SYNTH5, p->x >> 8, force);
 			if (uStatus==USBH_OK) {
-				E4K_Handle->tuneFreqState++;
+				E4K_Handle->tuneParamsState++;
 				rStatus=USBH_BUSY;
 				/* we're in auto calibration mode, so there's no need to trigger it */
 				memcpy(&(E4K_Handle->vco), p, sizeof(E4K_Handle->vco));
@@ -869,18 +1026,17 @@ USBH_StatusTypeDef E4K_tune_params(USBH_HandleTypeDef *phost, struct e4k_pll_par
 		break;
 		
 		case 4:
-			/* set the band */
-			if (E4K_Handle->vco.flo < MHZ(140))
-				uStatus=E4K_band_set(phost, E4K_BAND_VHF2);
-			else if (E4K_Handle->vco.flo < MHZ(350))
-				uStatus=E4K_band_set(phost, E4K_BAND_VHF3);
-			else if (E4K_Handle->vco.flo < MHZ(1135))
-				uStatus=E4K_band_set(phost, E4K_BAND_UHF);
-			else
-				uStatus=E4K_band_set(phost, E4K_BAND_L);
+			/* set the band, the SYNTH1 workaround costs 3 transfers */
+			band = E4K_band_for(E4K_Handle->vco.flo);
+			
+			if (!force && (band == E4K_Handle->band)) {
+				uStatus=USBH_OK;
+			} else {
+				uStatus=E4K_band_set(phost, band);
+			}
 				
 			if (uStatus==USBH_OK) {
-				E4K_Handle->tuneFreqState++;
+				E4K_Handle->tuneParamsState++;
 				rStatus=USBH_BUSY;
 			} else {
 				rStatus=uStatus;
@@ -888,10 +1044,10 @@ USBH_StatusTypeDef E4K_tune_params(USBH_HandleTypeDef *phost, struct e4k_pll_par
 		break;
 		
 		case 5:
-			/* select and set proper RF filter */
+			/* select and set proper RF filter, skipped if unchanged */
 			uStatus = E4K_rf_filter_set(phost);
 			if (uStatus==USBH_OK) {
-				E4K_Handle->tuneFreqState=0;
+				E4K_Handle->tuneParamsState=0;
 				rStatus=USBH_OK;
 			} else {
 				rStatus=uStatus;
@@ -902,7 +1058,8 @@ USBH_StatusTypeDef E4K_tune_params(USBH_HandleTypeDef *phost, struct e4k_pll_par
 	return rStatus;
 }
 
-USBH_StatusTypeDef E4K_tune_freq(USBH_HandleTypeDef *phost, uint32_t freq)
+/* Tune to freq (Hz), see RTLSDR_set_center_freq for the flags */
+USBH_StatusTypeDef E4K_set_freq(USBH_HandleTypeDef *phost, uint32_t freq, uint8_t flags)
 {
 	USBH_StatusTypeDef uStatus = USBH_FAIL;
   USBH_StatusTypeDef rStatus = USBH_BUSY;
@@ -916,8 +1073,9 @@ USBH_StatusTypeDef E4K_tune_freq(USBH_HandleTypeDef *phost, uint32_t freq)
   switch (E4K_Handle->tuneFreqState) {
 		case 0:
 			/* determine PLL parameters */								 
+		  /* The crystal follows RTLSDR_set_freq_correction */
 		  E4K_compute_pll_params(&(E4K_Handle->tuneParams),
-				E4K_Handle->vco.fosc, freq);
+				RTLSDR_Handle->xtal, freq);
 	
 			E4K_Handle->tuneFreqState = 1;
 			rStatus=USBH_BUSY;
@@ -926,11 +1084,16 @@ USBH_StatusTypeDef E4K_tune_freq(USBH_HandleTypeDef *phost, uint32_t freq)
 		
 		case 1:
 			/* actually tune to those parameters */
-			uStatus = E4K_tune_params(phost, &(E4K_Handle->tuneParams));
+			uStatus = E4K_tune_params(phost, &(E4K_Handle->tuneParams), flags);
 			
 			if (uStatus==USBH_OK) {
-				E4K_Handle->tuneFreqState = 2;
-				rStatus=USBH_BUSY;
+				if (flags & RTLSDR_FREQ_NO_LOCK_CHECK) {
+					E4K_Handle->tuneFreqState = 0;
+					rStatus=USBH_OK;
+				} else {
+					E4K_Handle->tuneFreqState = 2;
+					rStatus=USBH_BUSY;
+				}
 			} else {
 				rStatus=uStatus;
 			}
@@ -956,6 +1119,106 @@ USBH_StatusTypeDef E4K_tune_freq(USBH_HandleTypeDef *phost, uint32_t freq)
 	return rStatus;
 }
 
+/* Full retune, every PLL register is written and the lock is checked */
+USBH_StatusTypeDef E4K_tune_freq(USBH_HandleTypeDef *phost, uint32_t freq)
+{
+	return E4K_set_freq(phost, freq, RTLSDR_FREQ_FULL);
+}
+
+/* Sub-FSMs called from E4K_INIT_SEQ, the step holds their arguments */
+
+static USBH_StatusTypeDef E4K_seq_manual_gain(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step) {
+  return E4K_enable_manual_gain(phost, step->val);
+}
+
+static USBH_StatusTypeDef E4K_seq_if_gain(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step) {
+  return E4K_if_gain_set(phost, step->addr, (int8_t)step->val);
+}
+
+static USBH_StatusTypeDef E4K_seq_if_filter_bw(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step) {
+  return E4K_if_filter_bw_set(phost, (enum e4k_if_filter)step->addr, step->val);
+}
+
+static USBH_StatusTypeDef E4K_seq_chan_enable(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step) {
+  return E4K_if_filter_chan_enable(phost, step->val);
+}
+
+static USBH_StatusTypeDef E4K_seq_tune_freq(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step) {
+  return E4K_tune_freq(phost, step->val);
+}
+
+static USBH_StatusTypeDef E4K_seq_shadow_reset(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step) {
+  RTLSDR_i2c_shadow_reset(phost);
+  return USBH_OK;
+}
+
+/* E4000 initialization, run by E4K_InitProcess */
+static const RTLSDR_SeqStepTypeDef E4K_INIT_SEQ[] = {
+  /* make a dummy i2c read or write command, will not be ACKed! */
+  RTLSDR_SEQ_I2C_READ(E4K_I2C_ADDR, 0),
+
+  /* Make sure we reset everything and clear POR indicator */
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, E4K_REG_MASTER1,
+    E4K_MASTER1_RESET |
+    E4K_MASTER1_NORM_STBY |
+    E4K_MASTER1_POR_DET),
+
+  /* The reset brings back the default values, drop the shadow registers */
+  RTLSDR_SEQ_CALL(E4K_seq_shadow_reset, 0, 0),
+
+  /* Configure clock input */
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, E4K_REG_CLK_INP, 0x00),
+
+  /* Disable clock output */
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, E4K_REG_REF_CLK, 0x00),
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, E4K_REG_CLKOUT_PWDN, 0x96),
+
+  /* Write some magic values into registers */
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, 0x7e, 0x01),
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, 0x7f, 0xfe),
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, 0x82, 0x00),
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, 0x86, 0x50), // polarity A 
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, 0x87, 0x20),
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, 0x88, 0x01),
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, 0x9f, 0x7f),
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, 0xa0, 0x07),
+
+  /* Set LNA mode to manual */
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, E4K_REG_AGC4, 0x10), /* High threshold */
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, E4K_REG_AGC5, 0x04), /* Low threshold */
+  RTLSDR_SEQ_I2C_WRITE(E4K_I2C_ADDR, E4K_REG_AGC6, 0x1a), /* LNA calib + loop rate */
+
+  RTLSDR_SEQ_I2C_MASK(E4K_I2C_ADDR, E4K_REG_AGC1, E4K_AGC1_MOD_MASK, E4K_AGC_MOD_SERIAL),
+
+  /* Set Mixer Gain Control to manual */
+  RTLSDR_SEQ_I2C_MASK(E4K_I2C_ADDR, E4K_REG_AGC7, E4K_AGC7_MIX_GAIN_AUTO, 0),
+
+  /* Use auto-gain as default */
+  RTLSDR_SEQ_CALL(E4K_seq_manual_gain, 0, 0),
+
+  /* Select moderate gain levels */
+  RTLSDR_SEQ_CALL(E4K_seq_if_gain, 1, 6),
+  RTLSDR_SEQ_CALL(E4K_seq_if_gain, 2, 0),
+  RTLSDR_SEQ_CALL(E4K_seq_if_gain, 3, 0),
+  RTLSDR_SEQ_CALL(E4K_seq_if_gain, 4, 0),
+  RTLSDR_SEQ_CALL(E4K_seq_if_gain, 5, 9),
+  RTLSDR_SEQ_CALL(E4K_seq_if_gain, 6, 9),
+
+  /* Set the most narrow filter we can possibly use */
+  RTLSDR_SEQ_CALL(E4K_seq_if_filter_bw, E4K_IF_FILTER_MIX, KHZ(1900)),
+  RTLSDR_SEQ_CALL(E4K_seq_if_filter_bw, E4K_IF_FILTER_RC, KHZ(1000)),
+  RTLSDR_SEQ_CALL(E4K_seq_if_filter_bw, E4K_IF_FILTER_CHAN, KHZ(2150)),
+  RTLSDR_SEQ_CALL(E4K_seq_chan_enable, 0, 1),
+
+  /* Disable time variant DC correction and LUT */
+  RTLSDR_SEQ_I2C_MASK(E4K_I2C_ADDR, E4K_REG_DC5, 0x03, 0),
+  RTLSDR_SEQ_I2C_MASK(E4K_I2C_ADDR, E4K_REG_DCTIME1, 0x03, 0),
+  RTLSDR_SEQ_I2C_MASK(E4K_I2C_ADDR, E4K_REG_DCTIME2, 0x03, 0),
+
+  /* Tune some frequency */
+  RTLSDR_SEQ_CALL(E4K_seq_tune_freq, 0, KHZ(99700)),
+};
+
 /* Functions to export */
 
 USBH_StatusTypeDef E4K_Init(USBH_HandleTypeDef *phost) {
@@ -964,26 +1227,51 @@ USBH_StatusTypeDef E4K_Init(USBH_HandleTypeDef *phost) {
     (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
   
   RTLSDR_Handle->tuner->tunerData = 
-      (E4K_HandleTypeDef *)USBH_malloc (sizeof(RTLSDR_HandleTypeDef));
+      (E4K_HandleTypeDef *)USBH_malloc (sizeof(E4K_HandleTypeDef));
       
   E4K_HandleTypeDef * E4K_Handle = 
     (E4K_HandleTypeDef*) RTLSDR_Handle->tuner->tunerData;
     
   E4K_Handle->initState = E4K_REQ_RUN;
-  E4K_Handle->initNumber = 0;
+  RTLSDR_seq_init(&(E4K_Handle->initSeq), E4K_INIT_SEQ, RTLSDR_SEQ_LENGTH(E4K_INIT_SEQ));
+  RTLSDR_i2c_shadow_attach(phost, &(E4K_Handle->shadow), E4K_I2C_ADDR);
   E4K_Handle->maskState = E4K_MASK_READ;
   E4K_Handle->gainState = 0;
   E4K_Handle->ifGainState = 0;
   E4K_Handle->iffiltState=0;
   E4K_Handle->bandSetState=0;
+  E4K_Handle->band=E4K_BAND_VHF2;
   E4K_Handle->tuneFreqState=0;
   E4K_Handle->tuneParamsState=0;
-  E4K_Handle->vco.fosc = DEF_RTL_XTAL_FREQ;
+  E4K_Handle->vco.fosc = RTLSDR_Handle->xtal;
   E4K_Handle->setBWState=0;
   
   return USBH_OK;
 }
 
+/* A request that failed halfway leaves its sub-FSM in the middle, the next
+ * one would resume there (with the PLL parameters of the old frequency).
+ * Called by RTLSDR_ctl_abort. */
+void E4K_Abort(USBH_HandleTypeDef *phost) {
+  
+  RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+  
+  E4K_HandleTypeDef * E4K_Handle = 
+    (E4K_HandleTypeDef*) RTLSDR_Handle->tuner->tunerData;
+  
+  if (E4K_Handle == NULL) return;
+  
+  E4K_Handle->maskState = E4K_MASK_READ;
+  E4K_Handle->gainState = 0;
+  E4K_Handle->ifGainState = 0;
+  E4K_Handle->iffiltState=0;
+  E4K_Handle->bandSetState=0;
+  E4K_Handle->tuneFreqState=0;
+  E4K_Handle->tuneParamsState=0;
+  E4K_Handle->setBWState=0;
+}
+
 USBH_StatusTypeDef E4K_InitProcess(USBH_HandleTypeDef *phost) {
   USBH_StatusTypeDef uStatus = USBH_FAIL;
   USBH_StatusTypeDef retStatus = USBH_BUSY;
@@ -998,122 +1286,21 @@ USBH_StatusTypeDef E4K_InitProcess(USBH_HandleTypeDef *phost) {
   
     /* Start or run the sub FSM for each init step */
     case E4K_REQ_RUN:
-      switch (E4K_Handle->initNumber) {
-      
-        /* make a dummy i2c read or write command, will not be ACKed! */
-	      case 0: uStatus = E4K_reg_read(phost, 0); break;
-
-	      /* Make sure we reset everything and clear POR indicator */
-	      case 1: uStatus = E4K_reg_write(phost, E4K_REG_MASTER1,
-		      E4K_MASTER1_RESET |
-		      E4K_MASTER1_NORM_STBY |
-		      E4K_MASTER1_POR_DET
-	      ); break;
-
-	      /* Configure clock input */
-	      case 2: uStatus = E4K_reg_write(phost, E4K_REG_CLK_INP, 0x00); break;
-
-	      /* Disable clock output */
-	      case 3: uStatus = E4K_reg_write(phost, E4K_REG_REF_CLK, 0x00); break;
-	      case 4: uStatus = E4K_reg_write(phost, E4K_REG_CLKOUT_PWDN, 0x96); break;
-
-	      /* Write some magic values into registers */
-	      case 5: uStatus = E4K_reg_write(phost, 0x7e, 0x01); break;
-	      case 6: uStatus = E4K_reg_write(phost, 0x7f, 0xfe); break;
-	      case 7: uStatus = E4K_reg_write(phost, 0x82, 0x00); break;
-	      case 8: uStatus = E4K_reg_write(phost, 0x86, 0x50); break; // polarity A 
-	      case 9: uStatus = E4K_reg_write(phost, 0x87, 0x20); break;
-	      case 10: uStatus = E4K_reg_write(phost, 0x88, 0x01); break;
-	      case 11: uStatus = E4K_reg_write(phost, 0x9f, 0x7f); break;
-	      case 12: uStatus = E4K_reg_write(phost, 0xa0, 0x07); break;
-      #if 0
-	      /* Set common mode voltage a bit higher for more margin 850 mv */
-	      e4k_commonmode_set(phost, 4);
-
-	      /* Initialize DC offset lookup tables */
-	      e4k_dc_offset_gen_table(phost);
-
-	      /* Enable time variant DC correction */
-	      E4K_reg_write(phost, E4K_REG_DCTIME1, 0x01);
-	      E4K_reg_write(phost, E4K_REG_DCTIME2, 0x01);
-      #endif
-
-	      /* Set LNA mode to manual */
-	      case 13: uStatus = E4K_reg_write(phost, E4K_REG_AGC4, 0x10); break; /* High threshold */
-	      case 14: uStatus = E4K_reg_write(phost, E4K_REG_AGC5, 0x04); break;	/* Low threshold */
-	      case 15: uStatus = E4K_reg_write(phost, E4K_REG_AGC6, 0x1a); break;	/* LNA calib + loop rate */
-
-	      case 16: uStatus = E4K_reg_set_mask(phost, E4K_REG_AGC1, E4K_AGC1_MOD_MASK,
-		      E4K_AGC_MOD_SERIAL); break;
-
-	      /* Set Mixer Gain Control to manual */
-	      case 17: uStatus = E4K_reg_set_mask(phost, E4K_REG_AGC7, E4K_AGC7_MIX_GAIN_AUTO, 0); break;
-
-      #if 0
-	      /* Enable LNA Gain enhancement */
-	      E4K_reg_set_mask(phost, E4K_REG_AGC11, 0x7,
-			       E4K_AGC11_LNA_GAIN_ENH | (2 << 1));
-
-	      /* Enable automatic IF gain mode switching */
-	      E4K_reg_set_mask(phost, E4K_REG_AGC8, 0x1, E4K_AGC8_SENS_LIN_AUTO);
-      #endif
-
-	      /* Use auto-gain as default */
-	      case 18: uStatus = E4K_enable_manual_gain(phost, 0); break;
-
-	      /* Select moderate gain levels */
-	      case 19: uStatus = E4K_if_gain_set(phost, 1, 6); break;
-	      case 20: uStatus = E4K_if_gain_set(phost, 2, 0); break;
-	      case 21: uStatus = E4K_if_gain_set(phost, 3, 0); break;
-	      case 22: uStatus = E4K_if_gain_set(phost, 4, 0); break;
-	      case 23: uStatus = E4K_if_gain_set(phost, 5, 9); break;
-	      case 24: uStatus = E4K_if_gain_set(phost, 6, 9); break;
-
-	      /* Set the most narrow filter we can possibly use */
-	      case 25: uStatus = E4K_if_filter_bw_set(phost, E4K_IF_FILTER_MIX, KHZ(1900)); break;
-	      case 26: uStatus = E4K_if_filter_bw_set(phost, E4K_IF_FILTER_RC, KHZ(1000)); break;
-	      case 27: uStatus = E4K_if_filter_bw_set(phost, E4K_IF_FILTER_CHAN, KHZ(2150)); break;
-	      case 28: uStatus = E4K_if_filter_chan_enable(phost, 1); break;
-
-	      /* Disable time variant DC correction and LUT */
-	      case 29: uStatus = E4K_reg_set_mask(phost, E4K_REG_DC5, 0x03, 0); break;
-	      case 30: uStatus = E4K_reg_set_mask(phost, E4K_REG_DCTIME1, 0x03, 0); break;
-	      case 31: uStatus = E4K_reg_set_mask(phost, E4K_REG_DCTIME2, 0x03, 0); break;
-				
-	      /* Tune some frequency */
-	      case 32: uStatus = E4K_tune_freq(phost, KHZ(99700)); break;
-        default:
-    
-        break;
-      }
+      uStatus = RTLSDR_seq_run(phost, &(E4K_Handle->initSeq));
       
       if (uStatus == USBH_OK) {
-        //USBH_DbgLog("E4K OK %d", E4K_Handle->initNumber);
-        E4K_Handle->initState = E4K_REQ_INC;
+        E4K_Handle->initState = E4K_REQ_COMPLETE;
       } else if (uStatus != USBH_BUSY) { // TODO: Maybe handle USBH_UNRECOVERABLE_ERRORS here
-        USBH_DbgLog("E4K Init Fail initNumber=%d, error=%d", E4K_Handle->initNumber, uStatus);
-        //E4K_Handle->initNumber = 0;
+        USBH_DbgLog("E4K Init Fail step=%d, error=%d", E4K_Handle->initSeq.index, uStatus);
       }
       
       retStatus = USBH_BUSY;
     break;
-  
-    /* Increment the initNumber pointing to the next initialization operation */
-    case E4K_REQ_INC:
-    
-      if (E4K_Handle->initNumber == 32) {
-        E4K_Handle->initState = E4K_REQ_COMPLETE;
-        E4K_Handle->initNumber = 0;
-      } else {
-        E4K_Handle->initNumber++;
-        E4K_Handle->initState = E4K_REQ_RUN;
-      }
-      retStatus = USBH_BUSY;
-    break;
     
     /* Configuration complete, give back control to ClassRequest process */
     case E4K_REQ_COMPLETE:
 	  USBH_DbgLog("E4K Init Complete");
+      RTLSDR_seq_print_profile(&(E4K_Handle->initSeq), "E4K init");
       E4K_Handle->initState = E4K_REQ_RUN;
       retStatus = USBH_OK;
     break;
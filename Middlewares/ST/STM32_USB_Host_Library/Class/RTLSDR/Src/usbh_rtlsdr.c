@@ -103,8 +103,27 @@
 * @{
 */ 
 
-/* two raised to the power of n */
-#define TWO_POW(n)		((double)(1ULL<<(n)))
+/* Resampler ratio of the RTL2832 for a sample rate: xtal * 2^22 / rate,
+ * the 2 low bits are not implemented */
+#define RTLSDR_RSAMP_RATIO(xtal, rate) \
+  ((uint32_t)((((uint64_t)(xtal)) << 22) / (rate)) & 0x0ffffffc)
+
+/* Bit 27 of the ratio is sign extended by the resampler */
+#define RTLSDR_REAL_RSAMP_RATIO(ratio) \
+  ((ratio) | (((ratio) & 0x08000000) << 1))
+
+/* Actual rate for a ratio, integer Hz and the fraction in Q16 */
+#define RTLSDR_REAL_RATE(xtal, ratio) \
+  ((uint32_t)((((uint64_t)(xtal)) << 22) / (ratio)))
+#define RTLSDR_REAL_RATE_FRAC(xtal, ratio) \
+  ((uint16_t)((((((uint64_t)(xtal)) << 22) % (ratio)) << 16) / (ratio)))
+
+#define RTLSDR_RATE_ENTRY(rate) \
+  { (rate), RTLSDR_RSAMP_RATIO(DEF_RTL_XTAL_FREQ, rate), \
+    RTLSDR_REAL_RATE(DEF_RTL_XTAL_FREQ, \
+      RTLSDR_REAL_RSAMP_RATIO(RTLSDR_RSAMP_RATIO(DEF_RTL_XTAL_FREQ, rate))), \
+    RTLSDR_REAL_RATE_FRAC(DEF_RTL_XTAL_FREQ, \
+      RTLSDR_REAL_RSAMP_RATIO(RTLSDR_RSAMP_RATIO(DEF_RTL_XTAL_FREQ, rate))) }
 
 /**
 * @}
@@ -114,6 +133,13 @@
 /** @defgroup USBH_RTLSDR_CORE_Private_Variables
 * @{
 */
+
+/* Candidate bulk transfer lengths for the calibration, in packets */
+static const uint8_t RTLSDR_CALIB_PACKETS[] = {
+	1, 2, 4, 8, 16, 32, 48, 64, 80, 96, 112, 127
+};
+
+#define RTLSDR_CALIB_NUMBER (sizeof(RTLSDR_CALIB_PACKETS) / sizeof(RTLSDR_CALIB_PACKETS[0]))
 /**
 * @}
 */ 
@@ -133,6 +159,42 @@ static USBH_StatusTypeDef USBH_RTLSDR_SOFProcess(USBH_HandleTypeDef *phost);
 
 static USBH_StatusTypeDef USBH_RTLSDR_ClassRequest (USBH_HandleTypeDef *phost);
 
+static void RTLSDR_ring_init(RTLSDR_RingTypeDef *ring, uint8_t *base);
+
+static void RTLSDR_ring_commit(RTLSDR_RingTypeDef *ring, uint32_t count, uint32_t next);
+
+static USBH_StatusTypeDef RTLSDR_ring_arm(USBH_HandleTypeDef *phost, uint32_t length);
+
+static uint32_t RTLSDR_tim_elapsed(RTLSDR_HandleTypeDef *RTLSDR_Handle, uint32_t *tick);
+
+static void RTLSDR_calibrate(USBH_HandleTypeDef *phost);
+
+static uint32_t RTLSDR_stats_urb(RTLSDR_HandleTypeDef *RTLSDR_Handle, uint32_t length);
+
+static void RTLSDR_stream_check(RTLSDR_HandleTypeDef *RTLSDR_Handle, 
+                                uint32_t length, 
+                                uint32_t requested, 
+                                uint32_t gap);
+
+static void RTLSDR_stats_report(USBH_HandleTypeDef *phost);
+
+static void RTLSDR_i2c_shadow_set(RTLSDR_HandleTypeDef *RTLSDR_Handle, uint8_t i2c_addr, uint8_t reg, uint8_t val);
+
+#if (RTLSDR_SEQ_PROFILE == 1)
+static void RTLSDR_profile_report(USBH_HandleTypeDef *phost);
+#endif
+
+static USBH_StatusTypeDef RTLSDR_seq_set_fir(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step);
+
+static USBH_StatusTypeDef RTLSDR_seq_probe_tuners(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step);
+
+static USBH_StatusTypeDef RTLSDR_seq_tuner_init(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step);
+
+static USBH_StatusTypeDef RTLSDR_seq_tuner_init_process(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step);
+
+static USBH_StatusTypeDef RTLSDR_seq_set_sample_rate(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step);
+
+
 
 USBH_ClassTypeDef  RTLSDR_Class = 
 {
@@ -145,6 +207,93 @@ USBH_ClassTypeDef  RTLSDR_Class =
   USBH_RTLSDR_SOFProcess,
   NULL,
 };
+
+/* RTL2832 initialization, run by USBH_RTLSDR_ClassRequest */
+static const RTLSDR_SeqStepTypeDef RTLSDR_INIT_SEQ[] = {
+	/* Dummy write */
+	RTLSDR_SEQ_WRITE(USBB, USB_SYSCTL, 0x09, 1),
+
+	/* initialize USB */
+	RTLSDR_SEQ_WRITE(USBB, USB_SYSCTL, 0x09, 1),
+	RTLSDR_SEQ_WRITE(USBB, USB_EPA_MAXPKT, 0x0002, 2),
+	RTLSDR_SEQ_WRITE(USBB, USB_EPA_CTL, 0x1002, 2),
+
+	/* poweron demod */
+	RTLSDR_SEQ_WRITE(SYSB, DEMOD_CTL_1, 0x22, 1),
+
+	// Note: This one causes increase of power consumption
+	// The STM32F7 board must be connected to an external power supply
+	RTLSDR_SEQ_WRITE(SYSB, DEMOD_CTL, 0xe8, 1),
+
+	/* reset demod (bit 3, soft_rst) */
+	RTLSDR_SEQ_DEMOD(1, 0x01, 0x14, 1),
+	RTLSDR_SEQ_DEMOD(1, 0x01, 0x10, 1),
+
+	/* disable spectrum inversion and adjacent channel rejection */
+	RTLSDR_SEQ_DEMOD(1, 0x15, 0x00, 1),
+	RTLSDR_SEQ_DEMOD(1, 0x16, 0x0000, 2),
+
+	/* clear both DDC shift and IF frequency registers  */
+	RTLSDR_SEQ_DEMOD(1, 0x16 + 0, 0x00, 1),
+	RTLSDR_SEQ_DEMOD(1, 0x16 + 1, 0x00, 1),
+	RTLSDR_SEQ_DEMOD(1, 0x16 + 2, 0x00, 1),
+	RTLSDR_SEQ_DEMOD(1, 0x16 + 3, 0x00, 1),
+	RTLSDR_SEQ_DEMOD(1, 0x16 + 4, 0x00, 1),
+	RTLSDR_SEQ_DEMOD(1, 0x16 + 5, 0x00, 1),
+
+	/* Set FIR coefficients (This is a SUB-FSM) */
+	RTLSDR_SEQ_CALL(RTLSDR_seq_set_fir, 0, 0),
+
+	/* enable SDR mode, disable DAGC (bit 5) */
+	RTLSDR_SEQ_DEMOD(0, 0x19, 0x05, 1),
+
+	/* init FSM state-holding register */
+	RTLSDR_SEQ_DEMOD(1, 0x93, 0xf0, 1),
+	RTLSDR_SEQ_DEMOD(1, 0x94, 0x0f, 1),
+
+	/* disable AGC (en_dagc, bit 0) (this seems to have no effect) */
+	RTLSDR_SEQ_DEMOD(1, 0x11, 0x00, 1),
+
+	/* disable RF and IF AGC loop */
+	RTLSDR_SEQ_DEMOD(1, 0x04, 0x00, 1),
+
+	/* disable PID filter (enable_PID = 0) */
+	RTLSDR_SEQ_DEMOD(0, 0x61, 0x60, 1),
+
+	/* opt_adc_iq = 0, default ADC_I/ADC_Q datapath */
+	RTLSDR_SEQ_DEMOD(0, 0x06, 0x80, 1),
+
+	/* Enable Zero-IF mode (en_bbin bit), DC cancellation (en_dc_est),
+	* IQ estimation/compensation (en_iq_comp, en_iq_est) */
+	RTLSDR_SEQ_DEMOD(1, 0xb1, 0x1b, 1),
+
+	/* disable 4.096 MHz clock output on pin TP_CK0 */
+	RTLSDR_SEQ_DEMOD(0, 0x0d, 0x83, 1),
+
+	/* set i2c repeater, see RTLSDR_set_i2c_repeater */
+	RTLSDR_SEQ_DEMOD(1, 0x01, 0x18, 1),
+
+	/* probe tuners (This is a SUB-FSM) */
+	RTLSDR_SEQ_CALL(RTLSDR_seq_probe_tuners, 0, 0),
+
+	/* initialize tuner variables */
+	RTLSDR_SEQ_CALL(RTLSDR_seq_tuner_init, 0, 0),
+
+	/* Tuner initialization process */
+	RTLSDR_SEQ_CALL(RTLSDR_seq_tuner_init_process, 0, 0),
+
+	/* Set sample rate */
+	RTLSDR_SEQ_CALL(RTLSDR_seq_set_sample_rate, 0, 240000),
+
+	/* Set test mode, see RTLSDR_set_test_mode */
+	RTLSDR_SEQ_DEMOD(0, 0x19, 0x03, 1),
+
+	/* Reset RTL2832 buffer,mandatory (1) */
+	RTLSDR_SEQ_WRITE(USBB, USB_EPA_CTL, 0x1002, 2),
+
+	/* Reset RTL2832 buffer,mandatory (2) */
+	RTLSDR_SEQ_WRITE(USBB, USB_EPA_CTL, 0x0000, 2),
+};
 /**
 * @}
 */ 
@@ -165,6 +314,7 @@ static USBH_StatusTypeDef USBH_RTLSDR_InterfaceInit (USBH_HandleTypeDef *phost)
   USBH_StatusTypeDef status = USBH_OK ;
   uint8_t interface;
   RTLSDR_HandleTypeDef *RTLSDR_Handle;
+  void *mem;
   
   interface = USBH_FindInterface(phost, 
                                  USB_RTLSDR_CLASS, 
@@ -179,22 +329,43 @@ static USBH_StatusTypeDef USBH_RTLSDR_InterfaceInit (USBH_HandleTypeDef *phost)
 		USBH_DbgLog ("Found interface for class: %s", phost->pActiveClass->Name);
 		USBH_SelectInterface (phost, interface);
 		
+		/* Aligned for the control buffers, see Note on buffer sizes */
+		mem = USBH_malloc (sizeof(RTLSDR_HandleTypeDef) + RTLSDR_CTL_BUF_ALIGN - 1);
 		phost->pActiveClass->pData = 
-		  (RTLSDR_HandleTypeDef *)USBH_malloc (sizeof(RTLSDR_HandleTypeDef));
+		  (RTLSDR_HandleTypeDef *)(((uint32_t)mem + RTLSDR_CTL_BUF_ALIGN - 1) & 
+		                           ~(uint32_t)(RTLSDR_CTL_BUF_ALIGN - 1));
 		
 		RTLSDR_Handle =  (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+		RTLSDR_Handle->alloc = mem;
 		  
 		/* Initialize the FSM for writing the initialization registers */
 		RTLSDR_Handle->demodState = RTLSDR_DEM_WRITE_WAIT;
+		RTLSDR_Handle->demodPending = 0;
 		RTLSDR_Handle->reqState  = RTLSDR_REQ_STARTWAIT;
-		RTLSDR_Handle->reqNumber = 0;
+		RTLSDR_seq_init(&(RTLSDR_Handle->initSeq), RTLSDR_INIT_SEQ, RTLSDR_SEQ_LENGTH(RTLSDR_INIT_SEQ));
+		RTLSDR_ctl_init(&(RTLSDR_Handle->ctlQueue));
+#if (RTLSDR_SEQ_PROFILE == 1)
+		RTLSDR_Handle->bootCycles = DWT->CYCCNT;
+		RTLSDR_Handle->firstSampleState = 0;
+#endif
 		RTLSDR_Handle->firState = RTLSDR_FIR_CALC;
-		RTLSDR_Handle->firNumber = 0;
+		RTLSDR_Handle->firCoeffs = NULL;
 		RTLSDR_Handle->probeState = RTLSDR_PROBE_E4000;
 		RTLSDR_Handle->i2cState = RTLSDR_I2C_WRITE_WAIT;
+		RTLSDR_Handle->i2cShadow = NULL;
 		RTLSDR_Handle->tuner = 0;
+		RTLSDR_Handle->centerFreq = 0;
 		RTLSDR_Handle->xferState = RTLSDR_XFER_START;
+		RTLSDR_Handle->statsTicks = 0;
+		RTLSDR_Handle->statsBytes = 0;
+		RTLSDR_Handle->calibState = RTLSDR_CALIB_IDLE;
 		RTLSDR_Handle->setSampleRateState=0;
+		RTLSDR_Handle->streamRate = 0;
+		RTLSDR_Handle->bw = 0;
+		RTLSDR_Handle->bwSetting = 0;
+		RTLSDR_Handle->ppm = 0;
+		RTLSDR_Handle->xtal = DEF_RTL_XTAL_FREQ;
+		RTLSDR_Handle->freqCorrState = 0;
 		  
 		/*Collect the SDR sample stream endpoint address and length*/
 		if(phost->device.CfgDesc.Itf_Desc[interface].Ep_Desc[0].bEndpointAddress & 
@@ -224,10 +395,13 @@ static USBH_StatusTypeDef USBH_RTLSDR_InterfaceInit (USBH_HandleTypeDef *phost)
 						USB_EP_TYPE_BULK,
 						RTLSDR_Handle->CommItf.SdrEpSize); 
 						
-		RTLSDR_Handle->CommItf.buff = (uint8_t*)((uint32_t)(LCD_FB_START_ADDRESS + (RK043FN48H_WIDTH * RK043FN48H_HEIGHT * 4)));
+		/* Sample ring in SDRAM, CommItf.buff follows the URB in flight */
+		RTLSDR_ring_init(&(RTLSDR_Handle->ring), (uint8_t*)RTLSDR_RING_START_ADDRESS);
+		RTLSDR_Handle->CommItf.buff = RTLSDR_Handle->ring.base;
 		
-    /* This should be user configurable. It gives expected throughput values from 32..127 *512 */
-    RTLSDR_Handle->CommItf.buffSize = 1*512;
+    /* Change it with RTLSDR_set_xfer_size, or let RTLSDR_calibrate_xfer_size pick it.
+     * It gives expected throughput values from 32..127 *512 */
+    RTLSDR_Handle->CommItf.buffSize = 1 * RTLSDR_Handle->CommItf.SdrEpSize;
     
 		USBH_LL_SetToggle (phost, RTLSDR_Handle->CommItf.SdrPipe, 0);
 		
@@ -255,6 +429,9 @@ static USBH_StatusTypeDef USBH_RTLSDR_InterfaceInit (USBH_HandleTypeDef *phost)
     if (HAL_TIM_Base_Start(&(RTLSDR_Handle->TimHandle)) != HAL_OK) {
       USBH_DbgLog("Unable to start Timer 3");
     }
+    
+    RTLSDR_reset_stats(phost);
+    RTLSDR_tim_elapsed(RTLSDR_Handle, &(RTLSDR_Handle->statsTick));
 	}
 	return status;
 }
@@ -361,8 +538,11 @@ uint8_t RTLSDR_i2c_read_reg(USBH_HandleTypeDef *phost,
 	USBH_StatusTypeDef uStatus = USBH_FAIL;
 	USBH_StatusTypeDef rStatus = USBH_BUSY;
 
+	uStatus = RTLSDR_demod_sync(phost);
+	if (uStatus != USBH_OK) return uStatus;
+
 	RTLSDR_Handle->i2cReadAddress = i2c_addr;
-	RTLSDR_Handle->i2cReadReg = reg;
+	RTLSDR_Handle->i2cReadReg[0] = reg;
 	RTLSDR_Handle->i2cReadVal = 0x00;
 
 	switch (RTLSDR_Handle->i2cState) {
@@ -371,7 +551,7 @@ uint8_t RTLSDR_i2c_read_reg(USBH_HandleTypeDef *phost,
 	  uStatus = RTLSDR_write_array(phost, 
 									IICB, 
 									RTLSDR_Handle->i2cReadAddress, 
-									&(RTLSDR_Handle->i2cReadReg), 
+									RTLSDR_Handle->i2cReadReg, 
 									1);
 	  
 	  if (uStatus == USBH_OK) {
@@ -395,6 +575,7 @@ uint8_t RTLSDR_i2c_read_reg(USBH_HandleTypeDef *phost,
 	  if (uStatus == USBH_OK) {
 		RTLSDR_Handle->i2cReadVal = RTLSDR_Handle->i2cReadData[0];
 		RTLSDR_Handle->i2cState = RTLSDR_I2C_WRITE_WAIT;
+		RTLSDR_i2c_shadow_set(RTLSDR_Handle, i2c_addr, reg, RTLSDR_Handle->i2cReadVal);
 		rStatus = uStatus;
 	  } else if (uStatus == USBH_NOT_SUPPORTED) {
 		rStatus = USBH_BUSY;
@@ -414,12 +595,19 @@ USBH_StatusTypeDef RTLSDR_i2c_write_reg(USBH_HandleTypeDef *phost, uint8_t i2c_a
 	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
     (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
 	
+	USBH_StatusTypeDef uStatus = RTLSDR_demod_sync(phost);
+	if (uStatus != USBH_OK) return uStatus;
+	
 	RTLSDR_Handle->i2cWriteAddress = i2c_addr;
 
 	RTLSDR_Handle->i2cWriteData[0] = reg;
 	RTLSDR_Handle->i2cWriteData[1] = val;
 	
-	return RTLSDR_write_array(phost, IICB, RTLSDR_Handle->i2cWriteAddress, &(RTLSDR_Handle->i2cWriteData[0]), 2);
+	uStatus = RTLSDR_write_array(phost, IICB, RTLSDR_Handle->i2cWriteAddress, &(RTLSDR_Handle->i2cWriteData[0]), 2);
+	
+	if (uStatus == USBH_OK) RTLSDR_i2c_shadow_set(RTLSDR_Handle, i2c_addr, reg, val);
+	
+	return uStatus;
 }
 
 USBH_StatusTypeDef RTLSDR_i2c_write(USBH_HandleTypeDef *phost, uint8_t i2c_addr, uint8_t *buffer, uint8_t len)
@@ -427,9 +615,23 @@ USBH_StatusTypeDef RTLSDR_i2c_write(USBH_HandleTypeDef *phost, uint8_t i2c_addr,
 	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
     (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
 	
+	USBH_StatusTypeDef uStatus = RTLSDR_demod_sync(phost);
+	uint8_t n;
+	
+	if (uStatus != USBH_OK) return uStatus;
+	
 	RTLSDR_Handle->i2cWriteAddress = i2c_addr;
 
-	return RTLSDR_write_array(phost, IICB, RTLSDR_Handle->i2cWriteAddress, buffer, len);
+	uStatus = RTLSDR_write_array(phost, IICB, RTLSDR_Handle->i2cWriteAddress, buffer, len);
+	
+	/* buffer[0] is the first register, the device auto-increments */
+	if (uStatus == USBH_OK) {
+		for (n = 1; n < len; n++) {
+			RTLSDR_i2c_shadow_set(RTLSDR_Handle, i2c_addr, buffer[0] + n - 1, buffer[n]);
+		}
+	}
+	
+	return uStatus;
 }
 
 USBH_StatusTypeDef RTLSDR_i2c_read(USBH_HandleTypeDef *phost, uint8_t i2c_addr, uint8_t *buffer, uint8_t len)
@@ -437,11 +639,70 @@ USBH_StatusTypeDef RTLSDR_i2c_read(USBH_HandleTypeDef *phost, uint8_t i2c_addr,
 	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
     (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
 	
+	USBH_StatusTypeDef uStatus = RTLSDR_demod_sync(phost);
+	if (uStatus != USBH_OK) return uStatus;
+	
 	RTLSDR_Handle->i2cReadAddress = i2c_addr;
 
 	return RTLSDR_read_array(phost, IICB, RTLSDR_Handle->i2cReadAddress, buffer, len);
 }
 
+/* I2C shadow registers */
+
+/* Start caching the registers of the device at i2c_addr, all invalid */
+void RTLSDR_i2c_shadow_attach(USBH_HandleTypeDef *phost, RTLSDR_I2CShadowTypeDef *shadow, uint8_t i2c_addr)
+{
+	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+	
+	shadow->addr = i2c_addr;
+	RTLSDR_Handle->i2cShadow = shadow;
+	RTLSDR_i2c_shadow_reset(phost);
+}
+
+/* Forget the cached values, e.g. after a soft reset of the device */
+void RTLSDR_i2c_shadow_reset(USBH_HandleTypeDef *phost)
+{
+	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+	
+	if (RTLSDR_Handle->i2cShadow == NULL) return;
+	
+	USBH_memset(RTLSDR_Handle->i2cShadow->valid, 0, sizeof(RTLSDR_Handle->i2cShadow->valid));
+	RTLSDR_Handle->i2cShadow->hits = 0;
+	RTLSDR_Handle->i2cShadow->misses = 0;
+}
+
+/* Returns 1 and the value in val if the register is cached */
+uint8_t RTLSDR_i2c_shadow_get(USBH_HandleTypeDef *phost, uint8_t i2c_addr, uint8_t reg, uint8_t *val)
+{
+	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+	
+	RTLSDR_I2CShadowTypeDef *shadow = RTLSDR_Handle->i2cShadow;
+	
+	if ((shadow == NULL) || (shadow->addr != i2c_addr)) return 0;
+	
+	if (!(shadow->valid[reg >> 3] & (1 << (reg & 7)))) {
+		shadow->misses++;
+		return 0;
+	}
+	
+	shadow->hits++;
+	*val = shadow->val[reg];
+	return 1;
+}
+
+static void RTLSDR_i2c_shadow_set(RTLSDR_HandleTypeDef *RTLSDR_Handle, uint8_t i2c_addr, uint8_t reg, uint8_t val)
+{
+	RTLSDR_I2CShadowTypeDef *shadow = RTLSDR_Handle->i2cShadow;
+	
+	if ((shadow == NULL) || (shadow->addr != i2c_addr)) return;
+	
+	shadow->val[reg] = val;
+	shadow->valid[reg >> 3] |= (1 << (reg & 7));
+}
+
 /* Demod routines */
 USBH_StatusTypeDef RTLSDR_demod_read_reg(USBH_HandleTypeDef *phost, uint8_t page, uint16_t addr, uint8_t len)
 {
@@ -468,6 +729,22 @@ USBH_StatusTypeDef RTLSDR_demod_read_reg(USBH_HandleTypeDef *phost, uint8_t page
 } 
 
 USBH_StatusTypeDef RTLSDR_demod_write_reg(USBH_HandleTypeDef *phost, uint8_t page, uint16_t addr, uint16_t val, uint8_t len)
+{
+	uint8_t data[2];
+
+	if (len == 1)
+		data[0] = val & 0xff;
+	else
+		data[0] = val >> 8;
+
+	data[1] = val & 0xff;
+
+	return RTLSDR_demod_write_array(phost, page, addr, data, len);
+}
+
+/* Write len consecutive demod registers in a single control transfer.
+ * With RTLSDR_DEMOD_SYNC_DEFERRED the read-back is left to RTLSDR_demod_sync */
+USBH_StatusTypeDef RTLSDR_demod_write_array(USBH_HandleTypeDef *phost, uint8_t page, uint16_t addr, const uint8_t *array, uint8_t len)
 {
   RTLSDR_HandleTypeDef *RTLSDR_Handle =  
     (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
@@ -475,6 +752,8 @@ USBH_StatusTypeDef RTLSDR_demod_write_reg(USBH_HandleTypeDef *phost, uint8_t pag
   USBH_StatusTypeDef uStatus = USBH_FAIL;
   USBH_StatusTypeDef rStatus = USBH_BUSY;
   
+  if (len > RTLSDR_CTL_BUF_SIZE) return USBH_FAIL;
+  
   switch (RTLSDR_Handle->demodState) {
     case RTLSDR_DEM_WRITE_WAIT:
 		
@@ -482,12 +761,7 @@ USBH_StatusTypeDef RTLSDR_demod_write_reg(USBH_HandleTypeDef *phost, uint8_t pag
 			RTLSDR_Handle->demodWriteIndex = 0x10 | page;
 			RTLSDR_Handle->demodWriteAddr = (addr << 8) | 0x20;
 
-			if (len == 1)
-				RTLSDR_Handle->demodWriteData[0] = val & 0xff;
-			else
-				RTLSDR_Handle->demodWriteData[0] = val >> 8;
-
-			RTLSDR_Handle->demodWriteData[1] = val & 0xff;
+			USBH_memcpy(RTLSDR_Handle->demodWriteData, array, len);
 		  
 			phost->Control.setup.b.bmRequestType = CTRL_OUT;
 			phost->Control.setup.b.bRequest = 0;
@@ -499,8 +773,13 @@ USBH_StatusTypeDef RTLSDR_demod_write_reg(USBH_HandleTypeDef *phost, uint8_t pag
 		uStatus = USBH_CtlReq(phost, &(RTLSDR_Handle->demodWriteData[0]), len);
 		
 		if (uStatus == USBH_OK) {
+#if (RTLSDR_DEMOD_SYNC_DEFERRED == 1)
+			RTLSDR_Handle->demodPending = 1;
+			rStatus = USBH_OK;
+#else
 			RTLSDR_Handle->demodState = RTLSDR_DEM_READ_WAIT;
 			rStatus = USBH_BUSY; 
+#endif
 		} else {
 			rStatus = uStatus;
 		}
@@ -508,7 +787,6 @@ USBH_StatusTypeDef RTLSDR_demod_write_reg(USBH_HandleTypeDef *phost, uint8_t pag
     break;
     
     case RTLSDR_DEM_READ_WAIT:
-      // You really need to do this read after writing? (Why?)
 		uStatus = RTLSDR_demod_read_reg(phost, 0x0a, 0x01, 1);
 
 		if (uStatus == USBH_OK) {
@@ -524,13 +802,48 @@ USBH_StatusTypeDef RTLSDR_demod_write_reg(USBH_HandleTypeDef *phost, uint8_t pag
 	return rStatus;
 }
 
+/* Issue the read-back of the last demod write, if it is still pending.
+ * Returns USBH_OK right away when there is nothing to do */
+USBH_StatusTypeDef RTLSDR_demod_sync(USBH_HandleTypeDef *phost)
+{
+	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+	(RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+
+	USBH_StatusTypeDef uStatus;
+
+	if (!RTLSDR_Handle->demodPending) return USBH_OK;
+
+	uStatus = RTLSDR_demod_read_reg(phost, 0x0a, 0x01, 1);
+
+	if (uStatus == USBH_OK) RTLSDR_Handle->demodPending = 0;
+
+	return uStatus;
+}
+
 /* I2C Repeater control */
 USBH_StatusTypeDef RTLSDR_set_i2c_repeater(USBH_HandleTypeDef *phost, int on)
 {
 	return RTLSDR_demod_write_reg(phost, 1, 0x01, on ? 0x18 : 0x10, 1);
 }
 
-/* FIR routine */
+/* Range check of a coefficient set: int8_t[8] then int12_t[8] */
+static USBH_StatusTypeDef RTLSDR_check_fir(const int *coeffs)
+{
+	int i;
+
+	for (i = 0; i < 8; ++i) {
+		if (coeffs[i] < -128 || coeffs[i] > 127) return USBH_FAIL;
+	}
+
+	for (i = 8; i < RTLSDR_FIR_LEN; ++i) {
+		if (coeffs[i] < -2048 || coeffs[i] > 2047) return USBH_FAIL;
+	}
+
+	return USBH_OK;
+}
+
+/* FIR routine: pack the selected coefficient set and upload it to
+ * the demod in one control transfer */
 USBH_StatusTypeDef RTLSDR_set_fir(USBH_HandleTypeDef *phost)
 {
 
@@ -540,68 +853,68 @@ USBH_StatusTypeDef RTLSDR_set_fir(USBH_HandleTypeDef *phost)
 	USBH_StatusTypeDef uStatus = USBH_FAIL;
 	USBH_StatusTypeDef rStatus = USBH_BUSY;
 
+	const int *coeffs = RTLSDR_Handle->firCoeffs ? RTLSDR_Handle->firCoeffs : RTLSDR_FIR;
 	
 	int i;
 	int val;
 	int val0;
 	int val1;
 	
-	//USBH_DbgLog("firState=%d, firNumber=%d", RTLSDR_Handle->firState, RTLSDR_Handle->firNumber);
-	//USBH_DbgLog("firState=%d, firNumber=%d", RTLSDR_Handle->firState, 0);
 	switch (RTLSDR_Handle->firState) {
 	  case RTLSDR_FIR_CALC:
 	    /* format: int8_t[8] */
 	    for (i = 0; i < 8; ++i) {
-		    val = RTLSDR_FIR[i];
+		    val = coeffs[i];
 		    if (val < -128 || val > 127) {
 			    USBH_DbgLog("Invalid FIR coefficient!");
+			    return USBH_FAIL;
 		    }
 		    RTLSDR_Handle->fir[i] = val;
 	    }
 	    
 	    /* format: int12_t[8] */
 	    for (i = 0; i < 8; i += 2) {
-		    val0 = RTLSDR_FIR[8+i];
-		    val1 = RTLSDR_FIR[8+i+1];
+		    val0 = coeffs[8+i];
+		    val1 = coeffs[8+i+1];
 		    if (val0 < -2048 || val0 > 2047 || val1 < -2048 || val1 > 2047) {
 			    USBH_DbgLog("Invalid FIR coefficient!");
+			    return USBH_FAIL;
 		    }
 		    RTLSDR_Handle->fir[8+i*3/2] = val0 >> 4;
 		    RTLSDR_Handle->fir[8+i*3/2+1] = (val0 << 4) | ((val1 >> 8) & 0x0f);
 		    RTLSDR_Handle->fir[8+i*3/2+2] = val1;
 	    }
 	    RTLSDR_Handle->firState = RTLSDR_FIR_WRITE_WAIT;
-	    RTLSDR_Handle->firNumber = 0;
 	  break;
     
+    /* All the 20 registers are consecutive, write them at once */
     case RTLSDR_FIR_WRITE_WAIT:
-      uStatus = RTLSDR_demod_write_reg(phost, 
-										1, 
-                                        0x1c + RTLSDR_Handle->firNumber, 
-                                        RTLSDR_Handle->fir[RTLSDR_Handle->firNumber], 
-                                        1);
-      
-      if (uStatus == USBH_OK) RTLSDR_Handle->firState = RTLSDR_FIR_INC;
+      uStatus = RTLSDR_demod_write_array(phost, 
+                                         1, 
+                                         RTLSDR_FIR_ADDR, 
+                                         RTLSDR_Handle->fir, 
+                                         RTLSDR_FIR_BYTES);
       
-      rStatus = USBH_BUSY;
-    break;
-    
-	  /* Increment the reqNumber pointing to the next FIR reg */
-    case RTLSDR_FIR_INC:
-      if (RTLSDR_Handle->firNumber == 19) {
+      if (uStatus == USBH_OK) {
         RTLSDR_Handle->firState = RTLSDR_FIR_COMPLETE;
-        RTLSDR_Handle->firNumber = 0;
-      } else {
-        RTLSDR_Handle->firNumber++;
-        RTLSDR_Handle->firState = RTLSDR_FIR_WRITE_WAIT;
+      } else if (uStatus != USBH_BUSY) {
+        RTLSDR_Handle->firState = RTLSDR_FIR_CALC;
+        return uStatus;
       }
+      
       rStatus = USBH_BUSY;
     break;
     
-    /* FIR writing complete, exit sub FSM */
+    /* FIR writing complete, read back once and exit sub FSM */
     case RTLSDR_FIR_COMPLETE:
-      RTLSDR_Handle->firState = RTLSDR_FIR_CALC;
-      rStatus = USBH_OK;
+      uStatus = RTLSDR_demod_sync(phost);
+      
+      if (uStatus == USBH_OK) {
+        RTLSDR_Handle->firState = RTLSDR_FIR_CALC;
+        rStatus = USBH_OK;
+      } else {
+        rStatus = uStatus;
+      }
     break;
     
     default:
@@ -612,6 +925,28 @@ USBH_StatusTypeDef RTLSDR_set_fir(USBH_HandleTypeDef *phost)
 	return rStatus;
 }
 
+/* Select a coefficient set (RTLSDR_FIR_LEN values, same format as
+ * RTLSDR_FIR) and upload it. Call until it stops returning USBH_BUSY.
+ * A set out of range gives USBH_FAIL and leaves the current one.
+ * The set is kept for later RTLSDR_set_fir calls, so it must not go out
+ * of scope; NULL goes back to the default DAB/FM filter. */
+USBH_StatusTypeDef RTLSDR_load_fir(USBH_HandleTypeDef *phost, const int *coeffs)
+{
+	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+	(RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+
+	if (RTLSDR_Handle->firState == RTLSDR_FIR_CALC) {
+		/* A bad set is not selected, the previous one stays in use */
+		if ((coeffs != NULL) && (RTLSDR_check_fir(coeffs) != USBH_OK)) {
+			USBH_DbgLog("Invalid FIR coefficient!");
+			return USBH_FAIL;
+		}
+		RTLSDR_Handle->firCoeffs = coeffs;
+	}
+
+	return RTLSDR_set_fir(phost);
+}
+
 /**
   * @brief  USBH_RTLSDR_InterfaceDeInit 
   *         The function DeInit the Pipes used for the RTLSDR class.
@@ -633,7 +968,7 @@ USBH_StatusTypeDef USBH_RTLSDR_InterfaceDeInit (USBH_HandleTypeDef *phost)
   }
   
   if(phost->pActiveClass->pData) {
-    USBH_free (phost->pActiveClass->pData);
+    USBH_free (RTLSDR_Handle->alloc);
     phost->pActiveClass->pData = 0;
   }
   
@@ -659,14 +994,205 @@ static void USBH_Wdt1(int s) {
   usbh_wdt1_s = s;
 }
 
+/* Retune the tuner to freq (Hz), call until it stops returning USBH_BUSY.
+ * By default only the PLL registers that change are written (see the
+ * shadow registers) and the PLL lock is read back at the end.
+ * RTLSDR_FREQ_NO_LOCK_CHECK skips the lock read, for frequency hopping.
+ * RTLSDR_FREQ_FULL writes every register like the init does. */
+USBH_StatusTypeDef RTLSDR_set_center_freq(USBH_HandleTypeDef *phost, uint32_t freq, uint8_t flags)
+{
+	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+	(RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+	
+	USBH_StatusTypeDef uStatus;
+	
+	if ((RTLSDR_Handle->tuner == NULL) || (RTLSDR_Handle->tuner->SetFreq == NULL)) {
+		return USBH_NOT_SUPPORTED;
+	}
+	
+	uStatus = RTLSDR_Handle->tuner->SetFreq(phost, freq, flags);
+	
+	if (uStatus == USBH_OK) RTLSDR_Handle->centerFreq = freq;
+	
+	return uStatus;
+}
+
 USBH_StatusTypeDef RTLSDR_set_test_mode(USBH_HandleTypeDef *phost, uint8_t on) {
 	return RTLSDR_demod_write_reg(phost, 0, 0x19, on ? 0x03 : 0x05, 1);
 }
 
+/* Sample rates with their resampler settings worked out at build time */
+static const RTLSDR_RateTypeDef RTLSDR_RATES[] = {
+	RTLSDR_RATE_ENTRY(240000),
+	RTLSDR_RATE_ENTRY(250000),
+	RTLSDR_RATE_ENTRY(288000),
+	RTLSDR_RATE_ENTRY(960000),
+	RTLSDR_RATE_ENTRY(1024000),
+	RTLSDR_RATE_ENTRY(1200000),
+	RTLSDR_RATE_ENTRY(1440000),
+	RTLSDR_RATE_ENTRY(1536000),
+	RTLSDR_RATE_ENTRY(1800000),
+	RTLSDR_RATE_ENTRY(1920000),
+	RTLSDR_RATE_ENTRY(2048000),
+	RTLSDR_RATE_ENTRY(2304000),
+	RTLSDR_RATE_ENTRY(2400000),
+	RTLSDR_RATE_ENTRY(2560000),
+	RTLSDR_RATE_ENTRY(2880000),
+	RTLSDR_RATE_ENTRY(3200000),
+};
+
+/**
+  * @brief  RTLSDR_rate_compute
+  *         Resampler ratio and actual rate for samp_rate, in integers. The
+  *         usual rates come from RTLSDR_RATES, the others are computed the
+  *         same way at run time.
+  * @param  RTLSDR_Handle: RTLSDR handle
+  * @param  samp_rate: Requested rate, Hz
+  * @retval None
+  */
+static void RTLSDR_rate_compute(RTLSDR_HandleTypeDef *RTLSDR_Handle, uint32_t samp_rate)
+{
+	uint8_t n;
+	
+	for (n = 0; n < sizeof(RTLSDR_RATES) / sizeof(RTLSDR_RATES[0]); n++) {
+		if (RTLSDR_RATES[n].rate == samp_rate) {
+			RTLSDR_Handle->rsamp_ratio = RTLSDR_RATES[n].rsamp_ratio;
+			RTLSDR_Handle->real_rsamp_ratio = RTLSDR_REAL_RSAMP_RATIO(RTLSDR_RATES[n].rsamp_ratio);
+			RTLSDR_Handle->real_rate = RTLSDR_RATES[n].real_rate;
+			RTLSDR_Handle->real_rate_frac = RTLSDR_RATES[n].real_rate_frac;
+			return;
+		}
+	}
+	
+	RTLSDR_Handle->rsamp_ratio = RTLSDR_RSAMP_RATIO(DEF_RTL_XTAL_FREQ, samp_rate);
+	RTLSDR_Handle->real_rsamp_ratio = RTLSDR_REAL_RSAMP_RATIO(RTLSDR_Handle->rsamp_ratio);
+	RTLSDR_Handle->real_rate = 
+		RTLSDR_REAL_RATE(DEF_RTL_XTAL_FREQ, RTLSDR_Handle->real_rsamp_ratio);
+	RTLSDR_Handle->real_rate_frac = 
+		RTLSDR_REAL_RATE_FRAC(DEF_RTL_XTAL_FREQ, RTLSDR_Handle->real_rsamp_ratio);
+}
+
+/* Sample frequency correction of the resampler for ppm, 14 bit signed */
+static int32_t RTLSDR_ppm_offs(int32_t ppm)
+{
+	return (int32_t)(((int64_t)ppm * -(1 << 24)) / 1000000);
+}
+
+/* Crystal frequency once corrected by ppm, Hz */
+static uint32_t RTLSDR_ppm_xtal(uint32_t xtal, int32_t ppm)
+{
+	return (uint32_t)(((uint64_t)xtal * (uint32_t)(1000000 + ppm)) / 1000000);
+}
+
+/**
+  * @brief  RTLSDR_set_freq_correction
+  *         Correct the error of the crystal, in ppm. Call it until it stops
+  *         returning USBH_BUSY. The RTL2832 resampler is corrected with its
+  *         sample frequency correction registers, the ratio stays on the
+  *         nominal crystal as in librtlsdr. The tuner PLL gets the 
+  *         corrected crystal and is retuned to the current frequency.
+  *         Nothing else of the init is run again.
+  * @param  phost: Host handle
+  * @param  ppm: Crystal error, up to +/-RTLSDR_PPM_MAX
+  * @retval USBH_OK when done, USBH_BUSY, or USBH_FAIL for an out of
+  *         range ppm
+  */
+USBH_StatusTypeDef RTLSDR_set_freq_correction(USBH_HandleTypeDef *phost, int32_t ppm)
+{
+	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+	
+	USBH_StatusTypeDef rStatus = USBH_FAIL;  
+	USBH_StatusTypeDef uStatus = USBH_FAIL;
+	
+	switch (RTLSDR_Handle->freqCorrState) {
+		case 0:
+			if ((ppm > RTLSDR_PPM_MAX) || (ppm < -RTLSDR_PPM_MAX)) {
+				USBH_DbgLog("Invalid frequency correction: %ld ppm", ppm);
+				rStatus = USBH_FAIL;
+				break;
+			}
+			
+			RTLSDR_Handle->ppm = ppm;
+			RTLSDR_Handle->xtal = RTLSDR_ppm_xtal(DEF_RTL_XTAL_FREQ, ppm);
+			
+			rStatus = USBH_BUSY;
+			RTLSDR_Handle->freqCorrState++;
+		break;
+		
+		case 1:
+			uStatus = RTLSDR_demod_write_reg(phost, 1, 0x3f, 
+				RTLSDR_ppm_offs(RTLSDR_Handle->ppm) & 0xff, 1);
+			if (uStatus==USBH_OK) {
+				rStatus=USBH_BUSY;
+				RTLSDR_Handle->freqCorrState++;
+			} else {
+				rStatus=uStatus;
+			}
+		break;
+		
+		case 2:
+			uStatus = RTLSDR_demod_write_reg(phost, 1, 0x3e, 
+				(RTLSDR_ppm_offs(RTLSDR_Handle->ppm) >> 8) & 0x3f, 1);
+			if (uStatus==USBH_OK) {
+				rStatus=USBH_BUSY;
+				RTLSDR_Handle->freqCorrState++;
+			} else {
+				rStatus=uStatus;
+			}
+		break;
+		
+		case 3:
+			uStatus = RTLSDR_demod_sync(phost);
+			if (uStatus==USBH_OK) {
+				rStatus=USBH_BUSY;
+				RTLSDR_Handle->freqCorrState++;
+			} else {
+				rStatus=uStatus;
+			}
+		break;
+		
+		case 4:
+			/* The PLL registers depend on the crystal, retune */
+			if (RTLSDR_Handle->centerFreq == 0) {
+				uStatus = USBH_OK;
+			} else {
+				uStatus = RTLSDR_set_center_freq(phost, RTLSDR_Handle->centerFreq, 0);
+			}
+			
+			if (uStatus==USBH_OK) {
+				rStatus=USBH_OK;
+				RTLSDR_Handle->freqCorrState=0;
+			} else {
+				rStatus=uStatus;
+			}
+		break;
+	}
+	
+	return rStatus;
+}
+
+/* Tuner bandwidth used by the next RTLSDR_set_sample_rate, Hz.
+ * 0 follows the sample rate. */
+void RTLSDR_set_bandwidth(USBH_HandleTypeDef *phost, uint32_t bw)
+{
+	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+	
+	RTLSDR_Handle->bwSetting = bw;
+}
+
+/* Program the resampler for samp_rate (Hz), call until it stops returning
+ * USBH_BUSY. The I2C repeater and the tuner filters are only touched when
+ * the bandwidth changes.
+ * Unlike librtlsdr the repeater is not closed after the tuner filters:
+ * the init sequence opens it for good, and the tuner drivers and the
+ * queued I2C requests rely on that, none of them opens it. */
 USBH_StatusTypeDef RTLSDR_set_sample_rate (USBH_HandleTypeDef *phost, uint32_t samp_rate)
 {   
   USBH_StatusTypeDef rStatus = USBH_FAIL;  
   USBH_StatusTypeDef uStatus = USBH_FAIL;
+  uint32_t bw;
   
 	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
     (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
@@ -678,24 +1204,28 @@ USBH_StatusTypeDef RTLSDR_set_sample_rate (USBH_HandleTypeDef *phost, uint32_t s
 				 ((samp_rate > 300000) && (samp_rate <= 900000))) {
 				USBH_DbgLog("Invalid sample rate: %lu Hz", samp_rate);
 				rStatus = USBH_FAIL;
+				break;
 			}
 			
-			RTLSDR_Handle->rsamp_ratio = (DEF_RTL_XTAL_FREQ * TWO_POW(22)) / samp_rate;
-			RTLSDR_Handle->rsamp_ratio &= 0x0ffffffc;
-			RTLSDR_Handle->real_rsamp_ratio = RTLSDR_Handle->rsamp_ratio | 
-				((RTLSDR_Handle->rsamp_ratio & 0x08000000) << 1);
-			
-			RTLSDR_Handle->real_rate = (DEF_RTL_XTAL_FREQ * TWO_POW(22)) / 
-				RTLSDR_Handle->real_rsamp_ratio;
+			RTLSDR_rate_compute(RTLSDR_Handle, samp_rate);
 				
-			if ( ((double)samp_rate) != RTLSDR_Handle->real_rate ) {
-				USBH_DbgLog("Exact sample rate is: %f Hz", RTLSDR_Handle->real_rate);
+			if ((samp_rate != RTLSDR_Handle->real_rate) || RTLSDR_Handle->real_rate_frac) {
+				USBH_DbgLog("Exact sample rate is: %lu.%03lu Hz", RTLSDR_Handle->real_rate,
+				            ((uint32_t)RTLSDR_Handle->real_rate_frac * 1000) >> 16);
 				USBH_DbgLog("Rsamp_ratio: %lu Hz", RTLSDR_Handle->rsamp_ratio);
 				USBH_DbgLog("Real_rsamp_ratio: %lu Hz", RTLSDR_Handle->real_rsamp_ratio);
 			}
 			
+			/* The tuner filters only change with the bandwidth */
+			bw = RTLSDR_Handle->bwSetting ? RTLSDR_Handle->bwSetting : RTLSDR_Handle->real_rate;
+			
 			rStatus = USBH_BUSY;
-			RTLSDR_Handle->setSampleRateState++;
+			if (bw == RTLSDR_Handle->bw) {
+				RTLSDR_Handle->setSampleRateState = 4;
+			} else {
+				RTLSDR_Handle->bw = 0;
+				RTLSDR_Handle->setSampleRateState++;
+			}
 		break;
 		
 		case 1:
@@ -703,27 +1233,23 @@ USBH_StatusTypeDef RTLSDR_set_sample_rate (USBH_HandleTypeDef *phost, uint32_t s
 			if (uStatus==USBH_OK) {
 				rStatus=USBH_BUSY;
 				RTLSDR_Handle->setSampleRateState++;
-				RTLSDR_Handle->bw=(uint32_t)RTLSDR_Handle->real_rate; /* TODO: dev->bw > 0 ? dev->bw : dev->rate */
 			} else {
 				rStatus=uStatus;
 			}
 		break;
 		
 		case 2:
+			/* Read by SetBW, and remembered once it is applied */
+			RTLSDR_Handle->bw = RTLSDR_Handle->bwSetting ? 
+				RTLSDR_Handle->bwSetting : RTLSDR_Handle->real_rate;
 			uStatus = RTLSDR_Handle->tuner->SetBW(phost);
 			if (uStatus==USBH_OK) {
+				/* The repeater stays open, see above */
 				rStatus=USBH_BUSY;
-				RTLSDR_Handle->setSampleRateState++;
-			} else {
+				RTLSDR_Handle->setSampleRateState = 4;
+			} else if (uStatus!=USBH_BUSY) {
+				RTLSDR_Handle->bw = 0;
 				rStatus=uStatus;
-			}
-		break;
-		
-		case 3:
-			uStatus = RTLSDR_set_i2c_repeater(phost, 1);
-			if (uStatus==USBH_OK) {
-				rStatus=USBH_BUSY;
-				RTLSDR_Handle->setSampleRateState++;
 			} else {
 				rStatus=uStatus;
 			}
@@ -749,10 +1275,10 @@ USBH_StatusTypeDef RTLSDR_set_sample_rate (USBH_HandleTypeDef *phost, uint32_t s
 			}
 		break;
 		
-		/* TODO: Ignored frequency correction (ppm=0) */
-		/* This should be implemented in rtlsdr_set_sample_freq_correction*/
+		/* Sample frequency correction, see RTLSDR_set_freq_correction */
 		case 6:
-			uStatus = RTLSDR_demod_write_reg(phost, 1, 0x3f, 0, 1);
+			uStatus = RTLSDR_demod_write_reg(phost, 1, 0x3f, 
+				RTLSDR_ppm_offs(RTLSDR_Handle->ppm) & 0xff, 1);
 			if (uStatus==USBH_OK) {
 				rStatus=USBH_BUSY;
 				RTLSDR_Handle->setSampleRateState++;
@@ -762,7 +1288,8 @@ USBH_StatusTypeDef RTLSDR_set_sample_rate (USBH_HandleTypeDef *phost, uint32_t s
 		break;
 		
 		case 7:
-			uStatus = RTLSDR_demod_write_reg(phost, 1, 0x3f, 0, 1);
+			uStatus = RTLSDR_demod_write_reg(phost, 1, 0x3e, 
+				(RTLSDR_ppm_offs(RTLSDR_Handle->ppm) >> 8) & 0x3f, 1);
 			if (uStatus==USBH_OK) {
 				rStatus=USBH_BUSY;
 				RTLSDR_Handle->setSampleRateState++;
@@ -785,6 +1312,20 @@ USBH_StatusTypeDef RTLSDR_set_sample_rate (USBH_HandleTypeDef *phost, uint32_t s
 		case 9:
 			uStatus = RTLSDR_demod_write_reg(phost,  1, 0x01, 0x10, 1);
 			if (uStatus==USBH_OK) {
+				rStatus=USBH_BUSY;
+				RTLSDR_Handle->setSampleRateState++;
+			} else {
+				rStatus=uStatus;
+			}
+		break;
+		
+		/* Single read-back for the whole batch of demod writes */
+		case 10:
+			uStatus = RTLSDR_demod_sync(phost);
+			if (uStatus==USBH_OK) {
+				/* 2 bytes per IQ sample, for the sample loss detection */
+				RTLSDR_Handle->streamRate = (uint32_t)(((((uint64_t)RTLSDR_Handle->real_rate) << 16) + 
+				                            RTLSDR_Handle->real_rate_frac) * 2 / 100000);
 				rStatus=USBH_OK;
 				RTLSDR_Handle->setSampleRateState=0;
 			} else {
@@ -792,9 +1333,8 @@ USBH_StatusTypeDef RTLSDR_set_sample_rate (USBH_HandleTypeDef *phost, uint32_t s
 			}
 		break;
 		
-			/* TODO recalculate offset frequency if offset tuning is enabled */
-	/*if (dev->offs_freq)
-		rtlsdr_set_offset_tuning(dev, 1);*/
+		/* No offset tuning here: the channel is moved off DC by the DSP
+		 * front end, see SDR_decim_set_shift */
 	}
   return rStatus;
 }
@@ -821,122 +1361,25 @@ static USBH_StatusTypeDef USBH_RTLSDR_ClassRequest (USBH_HandleTypeDef *phost)
     /* Start or run the sub FSM for writing registers */
     case RTLSDR_REQ_STARTWAIT:
       
-      switch (RTLSDR_Handle->reqNumber) {
-			/* Dummy write */
-			case 0: uStatus = RTLSDR_write_reg(phost, USBB, USB_SYSCTL, 0x09, 1); break;
-
-			/* initialize USB */
-			case 1: uStatus = RTLSDR_write_reg(phost, USBB, USB_SYSCTL, 0x09, 1); break;
-			case 2: uStatus = RTLSDR_write_reg(phost, USBB, USB_EPA_MAXPKT, 0x0002, 2); break;
-			case 3: uStatus = RTLSDR_write_reg(phost, USBB, USB_EPA_CTL, 0x1002, 2); break;
-
-			/* poweron demod */
-			case 4: uStatus = RTLSDR_write_reg(phost, SYSB, DEMOD_CTL_1, 0x22, 1); break;
-
-			// Note: This one causes increase of power consumption
-			// The STM32F7 board must be connected to an external power supply
-			case 5: uStatus = RTLSDR_write_reg(phost, SYSB, DEMOD_CTL, 0xe8, 1); break;
-
-			/* reset demod (bit 3, soft_rst) */
-			case 6: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x01, 0x14, 1); break;
-			case 7: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x01, 0x10, 1); break;
-
-			/* disable spectrum inversion and adjacent channel rejection */
-			case 8: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x15, 0x00, 1); break;
-			case 9: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x16, 0x0000, 2); break;
-
-			/* clear both DDC shift and IF frequency registers  */
-			case 10: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x16 + 0, 0x00, 1); break;
-			case 11: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x16 + 1, 0x00, 1); break;
-			case 12: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x16 + 2, 0x00, 1); break;
-			case 13: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x16 + 3, 0x00, 1); break;
-			case 14: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x16 + 4, 0x00, 1); break;
-			case 15: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x16 + 5, 0x00, 1); break;
-
-			/* Set FIR coefficients (This is a SUB-FSM) */
-			case 16: uStatus = RTLSDR_set_fir(phost); break;
-
-			/* enable SDR mode, disable DAGC (bit 5) */
-			case 17: uStatus = RTLSDR_demod_write_reg(phost, 0, 0x19, 0x05, 1); break;
-
-			/* init FSM state-holding register */
-			case 18: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x93, 0xf0, 1); break;
-			case 19: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x94, 0x0f, 1); break;
-
-			/* disable AGC (en_dagc, bit 0) (this seems to have no effect) */
-			case 20: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x11, 0x00, 1); break;
-
-			/* disable RF and IF AGC loop */
-			case 21: uStatus = RTLSDR_demod_write_reg(phost, 1, 0x04, 0x00, 1); break;
-
-			/* disable PID filter (enable_PID = 0) */
-			case 22: uStatus = RTLSDR_demod_write_reg(phost, 0, 0x61, 0x60, 1); break;
-
-			/* opt_adc_iq = 0, default ADC_I/ADC_Q datapath */
-			case 23: uStatus = RTLSDR_demod_write_reg(phost, 0, 0x06, 0x80, 1); break;
-
-			/* Enable Zero-IF mode (en_bbin bit), DC cancellation (en_dc_est),
-			* IQ estimation/compensation (en_iq_comp, en_iq_est) */
-			case 24: uStatus = RTLSDR_demod_write_reg(phost, 1, 0xb1, 0x1b, 1); break;
-
-			/* disable 4.096 MHz clock output on pin TP_CK0 */
-			case 25: uStatus = RTLSDR_demod_write_reg(phost, 0, 0x0d, 0x83, 1); break;
-
-			/* set i2c repeater */
-			case 26: uStatus = RTLSDR_set_i2c_repeater(phost, 1); break;
-
-			/* probe tuners (This is a SUB-FSM) */
-			case 27: uStatus = RTLSDR_probe_tuners(phost); break;
-
-			/* initialize tuner variables */
-			case 28: uStatus = RTLSDR_Handle->tuner->Init(phost); break;
-
-			/* Tuner initialization process */
-			case 29: uStatus = RTLSDR_Handle->tuner->InitProcess(phost); break;
-			
-			/* Set sample rate */
-			case 30: uStatus = RTLSDR_set_sample_rate(phost, 240000); break;
-			
-			/* Set test mode */
-			case 31: uStatus = RTLSDR_set_test_mode(phost, 1); break;
-			
-			/* Reset RTL2832 buffer,mandatory (1) */
-			case 32: uStatus = RTLSDR_write_reg(phost, USBB, USB_EPA_CTL, 0x1002, 2); break;
-			
-			/* Reset RTL2832 buffer,mandatory (2) */
-			case 33: uStatus = RTLSDR_write_reg(phost, USBB, USB_EPA_CTL, 0x0000, 2); break;
-				
-		}
+      uStatus = RTLSDR_seq_run(phost, &(RTLSDR_Handle->initSeq));
       
 	if (uStatus == USBH_OK) {
-		RTLSDR_Handle->reqState = RTLSDR_REQ_INC;
+		RTLSDR_Handle->reqState = RTLSDR_REQ_COMPLETE;
 		rStatus = USBH_BUSY;
 	} else if (uStatus != USBH_BUSY) { 
 		// TODO: Maybe handle USBH_UNRECOVERABLE_ERRORS here
-		USBH_DbgLog("Write Fail reqNumber=%d, error=%d", RTLSDR_Handle->reqNumber, uStatus);
+		USBH_DbgLog("Write Fail step=%d, error=%d", RTLSDR_Handle->initSeq.index, uStatus);
 		rStatus = uStatus;
+	} else {
+		rStatus = USBH_BUSY;
 	}
       
     break;
-      
-    /* Increment the reqNumber pointing to the next config reg */
-    case RTLSDR_REQ_INC:
-    
-      //USBH_DbgLog("Completed reqNumber: %d", RTLSDR_Handle->reqNumber);
-    
-      if (RTLSDR_Handle->reqNumber == 33) {
-        RTLSDR_Handle->reqState = RTLSDR_REQ_COMPLETE;
-        RTLSDR_Handle->reqNumber = 0;
-      } else {
-        RTLSDR_Handle->reqNumber++;
-        RTLSDR_Handle->reqState = RTLSDR_REQ_STARTWAIT;
-      }
-      rStatus = USBH_BUSY;
-    break;
     
     /* Configuration complete, proceed to class active */
     case RTLSDR_REQ_COMPLETE:
       USBH_DbgLog("RTLSDR Init Complete");
+      RTLSDR_seq_print_profile(&(RTLSDR_Handle->initSeq), "RTL2832 init");
       RTLSDR_Handle->reqState = RTLSDR_REQ_STARTWAIT;
       rStatus = USBH_OK;
     break;
@@ -954,6 +1397,38 @@ static USBH_StatusTypeDef USBH_RTLSDR_ClassRequest (USBH_HandleTypeDef *phost)
   return rStatus; 
 }
 
+/* Sub-FSMs of RTLSDR_INIT_SEQ */
+static USBH_StatusTypeDef RTLSDR_seq_set_fir(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step)
+{
+	return RTLSDR_set_fir(phost);
+}
+
+static USBH_StatusTypeDef RTLSDR_seq_probe_tuners(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step)
+{
+	return RTLSDR_probe_tuners(phost);
+}
+
+static USBH_StatusTypeDef RTLSDR_seq_tuner_init(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step)
+{
+	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+	(RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+
+	return RTLSDR_Handle->tuner->Init(phost);
+}
+
+static USBH_StatusTypeDef RTLSDR_seq_tuner_init_process(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step)
+{
+	RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+	(RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+
+	return RTLSDR_Handle->tuner->InitProcess(phost);
+}
+
+static USBH_StatusTypeDef RTLSDR_seq_set_sample_rate(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step)
+{
+	return RTLSDR_set_sample_rate(phost, step->val);
+}
+
 /**
   * @brief  RTLSDR_probe_tuners
   *         This is a sub-FSM to check what tuner we have.
@@ -1049,6 +1524,566 @@ USBH_StatusTypeDef RTLSDR_probe_tuners(USBH_HandleTypeDef *phost) {
 }
 
 
+/**
+  * @brief  RTLSDR_ring_init
+  *         Reset the sample ring to empty, slots start at base.
+  * @param  ring: Sample ring
+  * @param  base: Start of the ring storage
+  * @retval None
+  */
+static void RTLSDR_ring_init(RTLSDR_RingTypeDef *ring, uint8_t *base)
+{
+  uint8_t i;
+  
+  ring->base = base;
+  ring->head = 0;
+  ring->tail = 0;
+  ring->fill = 0;
+  ring->overruns = 0;
+  ring->seq = 0;
+  ring->discontinuity = 0;
+  ring->lost = 0;
+  ring->backlog = 0;
+  ring->shortXfers = 0;
+  ring->totalLost = 0;
+  
+  for (i = 0; i < RTLSDR_RING_SLOT_NUMBER; i++) {
+    ring->slot[i].length = 0;
+    ring->slot[i].seq = 0;
+    ring->slot[i].timestamp = 0;
+    ring->slot[i].lost = 0;
+    ring->slot[i].discontinuity = 0;
+  }
+}
+
+/**
+  * @brief  RTLSDR_ring_commit
+  *         Account count received bytes in the head slot. The slot is closed
+  *         when the next transfer of length next would not fit in it.
+  *         If the consumer still holds the following slot, the head slot
+  *         is restarted and its samples are lost.
+  * @param  ring: Sample ring
+  * @param  count: Bytes received by the last URB
+  * @param  next: Length of the next URB
+  * @retval None
+  */
+static void RTLSDR_ring_commit(RTLSDR_RingTypeDef *ring, uint32_t count, uint32_t next)
+{
+  uint8_t nextHead;
+  
+  ring->fill += count;
+  
+  /* A short packet closes the slot, so the next URB stays line aligned */
+  if (((count & (RTLSDR_RING_ALIGN - 1)) == 0) &&
+      (ring->fill + next <= RTLSDR_RING_SLOT_LENGTH)) return;
+  
+  nextHead = (ring->head + 1) % RTLSDR_RING_SLOT_NUMBER;
+  
+  if (nextHead == ring->tail) {
+    /* Ring full, overwrite the head slot. Its sequence number is consumed 
+     * so the consumer sees the gap */
+    ring->overruns++;
+    ring->lost += ring->fill;
+    ring->totalLost += ring->fill;
+    ring->discontinuity = 1;
+  } else {
+    ring->slot[ring->head].length = ring->fill;
+    ring->slot[ring->head].seq = ring->seq;
+    ring->slot[ring->head].timestamp = HAL_GetTick();
+    ring->slot[ring->head].lost = ring->lost;
+    ring->slot[ring->head].discontinuity = ring->discontinuity;
+    /* Publish the slot before the consumer can see the new head */
+    __DMB();
+    ring->head = nextHead;
+    ring->lost = 0;
+    ring->discontinuity = 0;
+  }
+  
+  ring->seq++;
+  ring->fill = 0;
+}
+
+/**
+  * @brief  RTLSDR_ring_arm
+  *         Submit the bulk URB for the next free bytes of the head slot.
+  * @param  phost: Host handle
+  * @param  length: URB length, the one given as next to RTLSDR_ring_commit
+  * @retval USBH Status
+  */
+static USBH_StatusTypeDef RTLSDR_ring_arm(USBH_HandleTypeDef *phost, uint32_t length)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  
+  RTLSDR_RingTypeDef *ring = &(RTLSDR_Handle->ring);
+  
+  RTLSDR_Handle->CommItf.buff = ring->base + 
+    (ring->head * RTLSDR_RING_SLOT_LENGTH) + ring->fill;
+  RTLSDR_Handle->CommItf.xferLength = length;
+  
+  return USBH_BulkReceiveData(phost, 
+                              RTLSDR_Handle->CommItf.buff, 
+                              length,
+                              RTLSDR_Handle->CommItf.SdrPipe);
+}
+
+/**
+  * @brief  RTLSDR_tim_elapsed
+  *         TIM5 ticks (10 us) since the previous call with the same tick, 
+  *         it must be called at least once per timer period (1 s).
+  * @param  RTLSDR_Handle: RTLSDR handle
+  * @param  tick: Counter value of the previous call, updated
+  * @retval Elapsed ticks
+  */
+static uint32_t RTLSDR_tim_elapsed(RTLSDR_HandleTypeDef *RTLSDR_Handle, uint32_t *tick)
+{
+  uint32_t period = RTLSDR_Handle->TimHandle.Init.Period + 1;
+  uint32_t now = RTLSDR_Handle->TimHandle.Instance->CNT;
+  uint32_t elapsed = (now + period - *tick) % period;
+  
+  *tick = now;
+  return elapsed;
+}
+
+/**
+  * @brief  RTLSDR_set_xfer_size
+  *         Set the length of the bulk transfers, it is rounded down to a 
+  *         whole number of packets and takes effect from the next URB.
+  * @param  phost: Host handle
+  * @param  length: Transfer length in bytes
+  * @retval USBH Status
+  */
+USBH_StatusTypeDef RTLSDR_set_xfer_size(USBH_HandleTypeDef *phost, uint32_t length)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle;
+  uint32_t packets;
+  
+  if ((phost->pActiveClass == NULL) || (phost->pActiveClass->pData == NULL)) {
+    return USBH_FAIL;
+  }
+  
+  RTLSDR_Handle = (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  
+  packets = length / RTLSDR_Handle->CommItf.SdrEpSize;
+  
+  if (packets < RTLSDR_XFER_MIN_PACKETS) packets = RTLSDR_XFER_MIN_PACKETS;
+  if (packets > RTLSDR_XFER_MAX_PACKETS) packets = RTLSDR_XFER_MAX_PACKETS;
+  
+  RTLSDR_Handle->CommItf.buffSize = packets * RTLSDR_Handle->CommItf.SdrEpSize;
+  
+  return USBH_OK;
+}
+
+/**
+  * @brief  RTLSDR_get_xfer_size
+  * @param  phost: Host handle
+  * @retval Current bulk transfer length in bytes, 0 if no device
+  */
+uint32_t RTLSDR_get_xfer_size(USBH_HandleTypeDef *phost)
+{
+  if ((phost->pActiveClass == NULL) || (phost->pActiveClass->pData == NULL)) {
+    return 0;
+  }
+  
+  return ((RTLSDR_HandleTypeDef*) phost->pActiveClass->pData)->CommItf.buffSize;
+}
+
+/**
+  * @brief  RTLSDR_stats_urb
+  *         Account a completed bulk URB in the stream statistics. Called
+  *         from the HCD interrupt in stream mode, so it must stay short.
+  * @param  RTLSDR_Handle: RTLSDR handle
+  * @param  length: Bytes received
+  * @retval TIM5 ticks since the previous URB
+  */
+static uint32_t RTLSDR_stats_urb(RTLSDR_HandleTypeDef *RTLSDR_Handle, uint32_t length)
+{
+  RTLSDR_StatsTypeDef *stats = &(RTLSDR_Handle->stats);
+  uint32_t gap = RTLSDR_tim_elapsed(RTLSDR_Handle, &(stats->lastTick));
+  uint32_t bin = 32 - __CLZ(gap);
+  
+  if (bin >= RTLSDR_STATS_HIST_BINS) bin = RTLSDR_STATS_HIST_BINS - 1;
+  
+  stats->bytes += length;
+  stats->urbs++;
+  
+#if (RTLSDR_SEQ_PROFILE == 1)
+  if (RTLSDR_Handle->firstSampleState == 0) {
+    RTLSDR_Handle->firstSampleCycles = DWT->CYCCNT - RTLSDR_Handle->bootCycles;
+    RTLSDR_Handle->firstSampleState = 1;
+  }
+#endif
+  
+  if (gap < stats->gapMin) stats->gapMin = gap;
+  if (gap > stats->gapMax) stats->gapMax = gap;
+  stats->gapSum += gap;
+  stats->gapCount++;
+  stats->hist[bin]++;
+  
+  return gap;
+}
+
+/**
+  * @brief  RTLSDR_stream_check
+  *         Detect lost samples before committing a URB to the ring. The 
+  *         bytes produced by the dongle since the previous URB are estimated
+  *         from the sample rate, what was not received piles up in its FIFO.
+  *         Once that backlog passes RTLSDR_FIFO_SLACK the FIFO has overflowed,
+  *         the head slot is flagged as discontinuous and the excess counted 
+  *         as lost. Short URBs are counted, they mean the FIFO ran empty.
+  * @param  RTLSDR_Handle: RTLSDR handle
+  * @param  length: Bytes received
+  * @param  requested: Length of the URB
+  * @param  gap: TIM5 ticks since the previous URB
+  * @retval None
+  */
+static void RTLSDR_stream_check(RTLSDR_HandleTypeDef *RTLSDR_Handle, 
+                                uint32_t length, 
+                                uint32_t requested, 
+                                uint32_t gap)
+{
+  RTLSDR_RingTypeDef *ring = &(RTLSDR_Handle->ring);
+  int32_t backlog;
+  
+  if (length < requested) ring->shortXfers++;
+  
+  /* Sample rate not set yet */
+  if (RTLSDR_Handle->streamRate == 0) return;
+  
+  backlog = ring->backlog + 
+            (int32_t)(((uint64_t)gap * RTLSDR_Handle->streamRate) >> 16) - 
+            (int32_t)length;
+  
+  /* Timer jitter, the dongle can not send more than it produced */
+  if (backlog < 0) backlog = 0;
+  
+  if (backlog > RTLSDR_FIFO_SLACK) {
+    ring->lost += backlog - RTLSDR_FIFO_SLACK;
+    ring->totalLost += backlog - RTLSDR_FIFO_SLACK;
+    ring->discontinuity = 1;
+    backlog = RTLSDR_FIFO_SLACK;
+  }
+  
+  ring->backlog = backlog;
+}
+
+/**
+  * @brief  RTLSDR_stats_report
+  *         Print a line with the stream statistics every RTLSDR_STATS_PERIOD,
+  *         run from USBH_RTLSDR_Process.
+  * @param  phost: Host handle
+  * @retval None
+  */
+static void RTLSDR_stats_report(USBH_HandleTypeDef *phost)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  RTLSDR_StatsTypeDef stats;
+  uint32_t rate;
+  
+  if (RTLSDR_STATS_PERIOD == 0) return;
+  
+  RTLSDR_Handle->statsTicks += RTLSDR_tim_elapsed(RTLSDR_Handle, &(RTLSDR_Handle->statsTick));
+  
+  if (RTLSDR_Handle->statsTicks < RTLSDR_STATS_PERIOD) return;
+  
+  RTLSDR_get_stats(phost, &stats);
+  
+  /* Ticks are 10 us, so bytes / ticks * 100 gives kB/s */
+  rate = (uint32_t)(((uint64_t)(stats.bytes - RTLSDR_Handle->statsBytes) * 100) / 
+                    RTLSDR_Handle->statsTicks);
+  
+  USBH_UsrLog("%d kB/s, %d URBs, %d err, %d retry, gap %d/%d/%d", 
+              rate, stats.urbs, stats.errors, stats.retries, 
+              (stats.gapCount > 0) ? stats.gapMin : 0, 
+              (stats.gapCount > 0) ? (stats.gapSum / stats.gapCount) : 0, 
+              stats.gapMax);
+  
+  RTLSDR_Handle->statsBytes = stats.bytes;
+  RTLSDR_Handle->statsTicks = 0;
+}
+
+#if (RTLSDR_SEQ_PROFILE == 1)
+/**
+  * @brief  RTLSDR_profile_report
+  *         Print the cold start time, from the attach to the first samples,
+  *         once they have been received (recorded by RTLSDR_stats_urb).
+  * @param  phost: Host handle
+  * @retval None
+  */
+static void RTLSDR_profile_report(USBH_HandleTypeDef *phost)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  
+  if (RTLSDR_Handle->firstSampleState != 1) return;
+  
+  USBH_UsrLog("First samples %d us after attach", 
+              RTLSDR_Handle->firstSampleCycles / (SystemCoreClock / 1000000));
+  
+  RTLSDR_Handle->firstSampleState = 2;
+}
+#endif
+
+/**
+  * @brief  RTLSDR_get_stats
+  *         Consistent copy of the stream statistics.
+  * @param  phost: Host handle
+  * @param  stats: Where to copy them
+  * @retval USBH Status
+  */
+USBH_StatusTypeDef RTLSDR_get_stats(USBH_HandleTypeDef *phost, RTLSDR_StatsTypeDef *stats)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle;
+  uint32_t primask;
+  
+  if ((phost->pActiveClass == NULL) || (phost->pActiveClass->pData == NULL)) {
+    return USBH_FAIL;
+  }
+  
+  RTLSDR_Handle = (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  
+  /* The HCD interrupt updates them in stream mode */
+  primask = __get_PRIMASK();
+  __disable_irq();
+  *stats = RTLSDR_Handle->stats;
+  __set_PRIMASK(primask);
+  
+  return USBH_OK;
+}
+
+/**
+  * @brief  RTLSDR_reset_stats
+  * @param  phost: Host handle
+  * @retval None
+  */
+void RTLSDR_reset_stats(USBH_HandleTypeDef *phost)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle;
+  uint32_t primask;
+  
+  if ((phost->pActiveClass == NULL) || (phost->pActiveClass->pData == NULL)) {
+    return;
+  }
+  
+  RTLSDR_Handle = (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  
+  primask = __get_PRIMASK();
+  __disable_irq();
+  USBH_memset(&(RTLSDR_Handle->stats), 0, sizeof(RTLSDR_StatsTypeDef));
+  RTLSDR_Handle->stats.gapMin = 0xFFFFFFFF;
+  RTLSDR_tim_elapsed(RTLSDR_Handle, &(RTLSDR_Handle->stats.lastTick));
+  RTLSDR_Handle->statsBytes = 0;
+  __set_PRIMASK(primask);
+}
+
+/**
+  * @brief  RTLSDR_print_stats
+  *         Dump the stream statistics and the gap histogram to the console.
+  * @param  phost: Host handle
+  * @retval None
+  */
+void RTLSDR_print_stats(USBH_HandleTypeDef *phost)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle;
+  RTLSDR_StatsTypeDef stats;
+  uint8_t n;
+  
+  if (RTLSDR_get_stats(phost, &stats) != USBH_OK) return;
+  
+  RTLSDR_Handle = (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  
+  USBH_UsrLog("%d B in %d URBs, %d err, %d retry, %d overruns", 
+              stats.bytes, stats.urbs, stats.errors, stats.retries, 
+              RTLSDR_Handle->ring.overruns);
+  
+  USBH_UsrLog("%d short URBs, %d B lost", 
+              RTLSDR_Handle->ring.shortXfers, RTLSDR_Handle->ring.totalLost);
+  
+  USBH_UsrLog("Gap min %d avg %d max %d (x10 us)", 
+              (stats.gapCount > 0) ? stats.gapMin : 0, 
+              (stats.gapCount > 0) ? (stats.gapSum / stats.gapCount) : 0, 
+              stats.gapMax);
+  
+  for (n = 0; n < RTLSDR_STATS_HIST_BINS; n++) {
+    if (stats.hist[n] == 0) continue;
+    
+    if (n < RTLSDR_STATS_HIST_BINS - 1) {
+      USBH_UsrLog("Gap < %d: %d", 1 << n, stats.hist[n]);
+    } else {
+      USBH_UsrLog("Gap >= %d: %d", 1 << (n - 1), stats.hist[n]);
+    }
+  }
+}
+
+/**
+  * @brief  RTLSDR_calibrate_xfer_size
+  *         Start sweeping the bulk transfer length while streaming. Every 
+  *         candidate is measured during RTLSDR_CALIB_WINDOW and the fastest
+  *         one is kept when the sweep ends.
+  * @param  phost: Host handle
+  * @retval USBH Status
+  */
+USBH_StatusTypeDef RTLSDR_calibrate_xfer_size(USBH_HandleTypeDef *phost)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle;
+  
+  if ((phost->pActiveClass == NULL) || (phost->pActiveClass->pData == NULL)) {
+    return USBH_FAIL;
+  }
+  
+  RTLSDR_Handle = (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  
+  RTLSDR_Handle->calibIndex = 0;
+  RTLSDR_Handle->calibBestSize = RTLSDR_Handle->CommItf.buffSize;
+  RTLSDR_Handle->calibBestRate = 0;
+  RTLSDR_Handle->calibState = RTLSDR_CALIB_START;
+  
+  return USBH_OK;
+}
+
+/**
+  * @brief  RTLSDR_calibrate
+  *         Transfer size calibration FSM, run from USBH_RTLSDR_Process.
+  * @param  phost: Host handle
+  * @retval None
+  */
+static void RTLSDR_calibrate(USBH_HandleTypeDef *phost)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  uint32_t rate;
+  
+  switch (RTLSDR_Handle->calibState) {
+    case RTLSDR_CALIB_IDLE:
+    break;
+    
+    case RTLSDR_CALIB_START:
+      RTLSDR_set_xfer_size(phost, RTLSDR_CALIB_PACKETS[RTLSDR_Handle->calibIndex] * 
+                                  RTLSDR_Handle->CommItf.SdrEpSize);
+      
+      RTLSDR_tim_elapsed(RTLSDR_Handle, &(RTLSDR_Handle->calibTick));
+      RTLSDR_Handle->calibTicks = 0;
+      RTLSDR_Handle->calibBytes = RTLSDR_Handle->stats.bytes;
+      RTLSDR_Handle->calibState = RTLSDR_CALIB_MEASURE;
+    break;
+    
+    case RTLSDR_CALIB_MEASURE:
+      RTLSDR_Handle->calibTicks += RTLSDR_tim_elapsed(RTLSDR_Handle, &(RTLSDR_Handle->calibTick));
+      
+      if (RTLSDR_Handle->calibTicks < RTLSDR_CALIB_WINDOW) break;
+      
+      /* Ticks are 10 us, so bytes / ticks * 100 gives kB/s */
+      rate = (uint32_t)(((uint64_t)(RTLSDR_Handle->stats.bytes - RTLSDR_Handle->calibBytes) * 100) / 
+                        RTLSDR_Handle->calibTicks);
+      
+      USBH_DbgLog("Xfer size %d B: %d kB/s", RTLSDR_Handle->CommItf.buffSize, rate);
+      
+      if (rate > RTLSDR_Handle->calibBestRate) {
+        RTLSDR_Handle->calibBestRate = rate;
+        RTLSDR_Handle->calibBestSize = RTLSDR_Handle->CommItf.buffSize;
+      }
+      
+      RTLSDR_Handle->calibIndex++;
+      
+      if (RTLSDR_Handle->calibIndex < RTLSDR_CALIB_NUMBER) {
+        RTLSDR_Handle->calibState = RTLSDR_CALIB_START;
+      } else {
+        RTLSDR_set_xfer_size(phost, RTLSDR_Handle->calibBestSize);
+        USBH_UsrLog("Xfer size calibrated: %d B, %d kB/s", 
+                    RTLSDR_Handle->calibBestSize, RTLSDR_Handle->calibBestRate);
+        RTLSDR_Handle->calibState = RTLSDR_CALIB_IDLE;
+      }
+    break;
+  }
+}
+
+/**
+  * @brief  RTLSDR_get_slot
+  *         Oldest full slot of the sample ring, it stays owned by the caller
+  *         until RTLSDR_release_slot is called.
+  * @param  phost: Host handle
+  * @param  length: Returns the number of valid bytes in the slot
+  * @retval Pointer to the samples, NULL if no slot is ready
+  */
+uint8_t* RTLSDR_get_slot(USBH_HandleTypeDef *phost, uint32_t *length)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle;
+  RTLSDR_RingTypeDef *ring;
+  
+  if ((phost->gState != HOST_CLASS) || (phost->pActiveClass == NULL) ||
+      (phost->pActiveClass->pData == NULL)) {
+    return NULL;
+  }
+  
+  RTLSDR_Handle = (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  ring = &(RTLSDR_Handle->ring);
+  
+  if (ring->tail == ring->head) return NULL;
+  
+  *length = ring->slot[ring->tail].length;
+  
+  return ring->base + (ring->tail * RTLSDR_RING_SLOT_LENGTH);
+}
+
+/**
+  * @brief  RTLSDR_release_slot
+  *         Give the slot returned by RTLSDR_get_slot back to the bulk pipe.
+  * @param  phost: Host handle
+  * @retval None
+  */
+void RTLSDR_release_slot(USBH_HandleTypeDef *phost)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  
+  RTLSDR_RingTypeDef *ring = &(RTLSDR_Handle->ring);
+  
+  if (ring->tail != ring->head) {
+    ring->tail = (ring->tail + 1) % RTLSDR_RING_SLOT_NUMBER;
+  }
+}
+
+/**
+  * @brief  RTLSDR_get_slot_info
+  *         Sequence number, timestamp and losses of the slot returned by
+  *         RTLSDR_get_slot.
+  * @param  phost: Host handle
+  * @retval Slot descriptor, NULL if no slot is ready
+  */
+const RTLSDR_SlotTypeDef* RTLSDR_get_slot_info(USBH_HandleTypeDef *phost)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle;
+  RTLSDR_RingTypeDef *ring;
+  
+  if ((phost->gState != HOST_CLASS) || (phost->pActiveClass == NULL) ||
+      (phost->pActiveClass->pData == NULL)) {
+    return NULL;
+  }
+  
+  RTLSDR_Handle = (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  ring = &(RTLSDR_Handle->ring);
+  
+  if (ring->tail == ring->head) return NULL;
+  
+  return &(ring->slot[ring->tail]);
+}
+
+/**
+  * @brief  RTLSDR_get_stream_seq
+  *         Sequence number of the slot being filled by the bulk pipe. Slots
+  *         with this number or lower hold samples received up to now.
+  * @param  phost: Host handle
+  * @retval Sequence number
+  */
+uint32_t RTLSDR_get_stream_seq(USBH_HandleTypeDef *phost)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle =  
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  
+  return RTLSDR_Handle->ring.seq;
+}
+
 /**
   * @brief  USBH_RTLSDR_Process 
   *         The function is for managing state machine for RTLSDR data transfers 
@@ -1059,6 +2094,8 @@ static USBH_StatusTypeDef USBH_RTLSDR_Process (USBH_HandleTypeDef *phost)
 {
 	USBH_StatusTypeDef rStatus = USBH_FAIL;  
   USBH_URBStateTypeDef urbStatus = USBH_URB_ERROR;
+  uint32_t xferSize;
+  uint32_t nextSize;
   //USBH_DbgLog("Enter RTLSDR_Process");
   
   RTLSDR_HandleTypeDef *RTLSDR_Handle =  
@@ -1067,39 +2104,129 @@ static USBH_StatusTypeDef USBH_RTLSDR_Process (USBH_HandleTypeDef *phost)
   switch (RTLSDR_Handle->xferState) {
 		case RTLSDR_XFER_START:
             //RTLSDR_Handle->TimHandle.Instance->CNT=0;
-			rStatus = USBH_BulkReceiveData(phost, 
-																			&(RTLSDR_Handle->CommItf.buff[0]), 
-																			RTLSDR_Handle->CommItf.buffSize,
-																			RTLSDR_Handle->CommItf.SdrPipe);
+			/* Gaps are measured from the first submission */
+			RTLSDR_tim_elapsed(RTLSDR_Handle, &(RTLSDR_Handle->stats.lastTick));
+#if (RTLSDR_STREAM_IRQ == 1)
+			/* From now on the HCD interrupt keeps the pipe busy */
+			RTLSDR_Handle->xferState = RTLSDR_XFER_STREAM;
+			rStatus = RTLSDR_ring_arm(phost, RTLSDR_Handle->CommItf.buffSize);
+#else
+			rStatus = RTLSDR_ring_arm(phost, RTLSDR_Handle->CommItf.buffSize);
 			
 			RTLSDR_Handle->xferState = RTLSDR_XFER_WAIT;
+#endif
 			RTLSDR_Handle->xferWaitNo=0;
+			RTLSDR_Handle->xferUrbState = USBH_URB_IDLE;
 		break;
 		
 		case RTLSDR_XFER_WAIT:
 			RTLSDR_Handle->xferWaitNo++;
 			urbStatus = USBH_LL_GetURBState(phost , RTLSDR_Handle->CommItf.SdrPipe);
 			if (urbStatus == USBH_URB_DONE) {
-				//USBH_DbgLog("Xfer complete %02X %02X", RTLSDR_Handle->CommItf.buff[0], RTLSDR_Handle->CommItf.buff[1]);
-				USBH_DbgLog("Xfer complete %d B, %d kB/s", USBH_LL_GetLastXferSize(phost,RTLSDR_Handle->CommItf.SdrPipe), USBH_LL_GetLastXferSize(phost,RTLSDR_Handle->CommItf.SdrPipe) * 100 / RTLSDR_Handle->TimHandle.Instance->CNT);
-				RTLSDR_Handle->TimHandle.Instance->CNT=0;
+				xferSize = USBH_LL_GetLastXferSize(phost, RTLSDR_Handle->CommItf.SdrPipe);
+				nextSize = RTLSDR_Handle->CommItf.buffSize;
+				
+				/* Close the transfer and arm the next one right away */
+				RTLSDR_stream_check(RTLSDR_Handle, xferSize, RTLSDR_Handle->CommItf.xferLength,
+				                    RTLSDR_stats_urb(RTLSDR_Handle, xferSize));
+				RTLSDR_ring_commit(&(RTLSDR_Handle->ring), xferSize, nextSize);
+				RTLSDR_ring_arm(phost, nextSize);
+				RTLSDR_Handle->xferWaitNo=0;
 				rStatus = USBH_OK;
-				RTLSDR_Handle->xferState = RTLSDR_XFER_COMPLETE;
-			} else if (urbStatus == USBH_URB_ERROR) {
+			} else if (urbStatus == USBH_URB_NOTREADY) {
+				/* The state stays NOTREADY over many polls, count it once */
+				if (RTLSDR_Handle->xferUrbState != USBH_URB_NOTREADY) {
+					RTLSDR_Handle->stats.retries++;
+				}
+			} else if ((urbStatus == USBH_URB_ERROR) || (urbStatus == USBH_URB_STALL)) {
 				USBH_DbgLog("Xfer error");
+				RTLSDR_Handle->stats.errors++;
+				RTLSDR_Handle->ring.discontinuity = 1;
+				RTLSDR_Handle->xferState = RTLSDR_XFER_START;
 				rStatus = USBH_FAIL;
 			}			
+			RTLSDR_Handle->xferUrbState = urbStatus;
 		break;
 		
-		case RTLSDR_XFER_COMPLETE:
-			RTLSDR_Handle->xferState = RTLSDR_XFER_START;
+		case RTLSDR_XFER_STREAM:
+			/* Nothing to do, see USBH_RTLSDR_URBChangeCallback */
 			rStatus = USBH_OK;
 		break;
 	}
+	
+	/* Queued register accesses share the loop with the bulk stream */
+	RTLSDR_ctl_process(phost, &(RTLSDR_Handle->ctlQueue));
+	
+	RTLSDR_calibrate(phost);
+	RTLSDR_stats_report(phost);
+#if (RTLSDR_SEQ_PROFILE == 1)
+	RTLSDR_profile_report(phost);
+#endif
   
   return rStatus;
 }
 
+/**
+  * @brief  USBH_RTLSDR_URBChangeCallback 
+  *         Called from the HCD interrupt when a URB changes state. In stream
+  *         mode the completed bulk URB is committed to the ring and the
+  *         next one is submitted here, so the sample rate does not depend
+  *         on how often the main loop runs USBH_Process.
+  * @param  phost: Host handle
+  * @param  pipe: Pipe that changed state
+  * @param  urbState: New URB state
+  * @retval None
+  */
+void USBH_RTLSDR_URBChangeCallback (USBH_HandleTypeDef *phost, 
+                                    uint8_t pipe, 
+                                    USBH_URBStateTypeDef urbState)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle;
+  uint32_t xferSize;
+  uint32_t nextSize;
+  
+  if ((phost->gState != HOST_CLASS) || (phost->pActiveClass == NULL) ||
+      (phost->pActiveClass->pData == NULL)) {
+    return;
+  }
+  
+  RTLSDR_Handle = (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData; 
+  
+  if ((RTLSDR_Handle->xferState != RTLSDR_XFER_STREAM) ||
+      (pipe != RTLSDR_Handle->CommItf.SdrPipe)) {
+    return;
+  }
+  
+  switch (urbState) {
+    case USBH_URB_DONE:
+      xferSize = USBH_LL_GetLastXferSize(phost, pipe);
+      nextSize = RTLSDR_Handle->CommItf.buffSize;
+      
+      RTLSDR_stream_check(RTLSDR_Handle, xferSize, RTLSDR_Handle->CommItf.xferLength,
+                          RTLSDR_stats_urb(RTLSDR_Handle, xferSize));
+      RTLSDR_ring_commit(&(RTLSDR_Handle->ring), xferSize, nextSize);
+      RTLSDR_ring_arm(phost, nextSize);
+    break;
+    
+    case USBH_URB_ERROR:
+    case USBH_URB_STALL:
+      /* Let USBH_RTLSDR_Process restart the stream */
+      RTLSDR_Handle->stats.errors++;
+      RTLSDR_Handle->ring.discontinuity = 1;
+      RTLSDR_Handle->xferState = RTLSDR_XFER_START;
+    break;
+    
+    case USBH_URB_NOTREADY:
+      /* Transaction error, the HCD driver retries it */
+      RTLSDR_Handle->stats.retries++;
+    break;
+    
+    default:
+      /* NAKs are retried by the HCD driver itself */
+    break;
+  }
+}
+
 /**
   * @brief  USBH_RTLSDR_SOFProcess 
   *         The function is for managing SOF callback 
@@ -0,0 +1,325 @@
+/**
+  ******************************************************************************
+  * @file    usbh_rtlsdr_ctl.c
+  * @author
+  * @version
+  * @date
+  * @brief   Asynchronous control request queue for the RTLSDR USB Host class
+  *
+  *
+  ******************************************************************************
+  * @attention
+  *
+  * See usbh_rtlsdr_ctl.h
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbh_rtlsdr_ctl.h"
+#include "usbh_rtlsdr.h"
+
+/** @addtogroup USBH_LIB
+* @{
+*/
+
+/** @addtogroup USBH_CLASS
+* @{
+*/
+
+/** @addtogroup USBH_RTLSDR_CLASS
+* @{
+*/
+
+/** @defgroup USBH_RTLSDR_CTL
+* @brief    This file includes the control request queue.
+* @{
+*/
+
+/** @defgroup USBH_RTLSDR_CTL_Private_FunctionPrototypes
+* @{
+*/
+
+static void RTLSDR_ctl_abort(USBH_HandleTypeDef *phost);
+
+static USBH_StatusTypeDef RTLSDR_ctl_tuner_freq(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step);
+
+static USBH_StatusTypeDef RTLSDR_ctl_sample_rate(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step);
+
+static USBH_StatusTypeDef RTLSDR_ctl_freq_correction(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step);
+
+/**
+* @}
+*/
+
+
+/** @defgroup USBH_RTLSDR_CTL_Private_Functions
+* @{
+*/
+
+/**
+  * @brief  RTLSDR_ctl_abort
+  *         Leave the control pipe and the register sub-FSMs ready for the
+  *         next request after a failed one.
+  * @param  phost: Host handle
+  * @retval None
+  */
+static void RTLSDR_ctl_abort(USBH_HandleTypeDef *phost)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle =
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+
+  phost->RequestState = CMD_SEND;
+  phost->Control.state = CTRL_IDLE;
+
+  RTLSDR_Handle->demodState = RTLSDR_DEM_WRITE_WAIT;
+  RTLSDR_Handle->i2cState = RTLSDR_I2C_WRITE_WAIT;
+
+  /* A new rate starts over from the table lookup */
+  RTLSDR_Handle->setSampleRateState = 0;
+  RTLSDR_Handle->freqCorrState = 0;
+
+  /* Retune, band, gain and masked writes of the tuner */
+  if ((RTLSDR_Handle->tuner != NULL) && (RTLSDR_Handle->tuner->Abort != NULL)) {
+    RTLSDR_Handle->tuner->Abort(phost);
+  }
+}
+
+/* Sub-FSM of RTLSDR_ctl_set_freq */
+static USBH_StatusTypeDef RTLSDR_ctl_tuner_freq(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step)
+{
+  return RTLSDR_set_center_freq(phost, step->val, step->addr);
+}
+
+/* Sub-FSM of RTLSDR_ctl_set_sample_rate */
+static USBH_StatusTypeDef RTLSDR_ctl_sample_rate(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step)
+{
+  return RTLSDR_set_sample_rate(phost, step->val);
+}
+
+/* Sub-FSM of RTLSDR_ctl_set_freq_correction */
+static USBH_StatusTypeDef RTLSDR_ctl_freq_correction(USBH_HandleTypeDef *phost, const RTLSDR_SeqStepTypeDef *step)
+{
+  return RTLSDR_set_freq_correction(phost, (int32_t)step->val);
+}
+
+/**
+  * @brief  RTLSDR_ctl_init
+  *         Empty the queue.
+  * @param  queue: Queue
+  * @retval None
+  */
+void RTLSDR_ctl_init(RTLSDR_CtlQueueTypeDef *queue)
+{
+  queue->head = 0;
+  queue->tail = 0;
+  queue->running = 0;
+  queue->rejected = 0;
+}
+
+/**
+  * @brief  RTLSDR_ctl_process
+  *         Run the request at the head of the queue, called from
+  *         USBH_RTLSDR_Process. A failed request is not retried, its
+  *         callback gets the error.
+  * @param  phost: Host handle
+  * @param  queue: Queue
+  * @retval USBH_OK when idle, USBH_BUSY while a request runs, or the
+  *         status of the request that just finished
+  */
+USBH_StatusTypeDef RTLSDR_ctl_process(USBH_HandleTypeDef *phost, RTLSDR_CtlQueueTypeDef *queue)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle =
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+
+  RTLSDR_CtlReqTypeDef *req;
+  USBH_StatusTypeDef uStatus;
+
+  if (queue->head == queue->tail) return USBH_OK;
+
+  req = &(queue->req[queue->head & (RTLSDR_CTL_QUEUE_SIZE - 1)]);
+
+  if (!queue->running) {
+    RTLSDR_seq_init(&(queue->seq), &(req->step), 1);
+    queue->running = 1;
+  }
+
+  uStatus = RTLSDR_seq_run(phost, &(queue->seq));
+
+  if (uStatus == USBH_BUSY) return USBH_BUSY;
+
+  if (uStatus != USBH_OK) {
+    USBH_DbgLog("Ctl request failed, op=%d, error=%d", req->step.op, uStatus);
+    RTLSDR_ctl_abort(phost);
+  } else if (req->step.op == RTLSDR_SEQ_OP_I2C_READ) {
+    req->result = RTLSDR_Handle->i2cReadVal;
+  }
+
+  queue->running = 0;
+
+  if (req->callback != NULL) {
+    req->callback(phost, req, uStatus);
+  }
+
+  /* Release the descriptor only after the callback is done with it */
+  __DMB();
+  queue->head++;
+
+  return uStatus;
+}
+
+/**
+  * @brief  RTLSDR_ctl_submit
+  *         Queue a request. The step is copied, it can live on the stack.
+  * @param  phost: Host handle
+  * @param  step: What to do, built with the RTLSDR_SEQ_* macros
+  * @param  callback: Called when the request is done, can be NULL
+  * @param  context: Passed to the callback in req->context
+  * @retval USBH_OK when queued, USBH_BUSY if the queue is full or
+  *         USBH_FAIL if the class is not active
+  */
+USBH_StatusTypeDef RTLSDR_ctl_submit(USBH_HandleTypeDef *phost,
+                                     const RTLSDR_SeqStepTypeDef *step,
+                                     RTLSDR_CtlCallbackTypeDef callback,
+                                     void *context)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle;
+  RTLSDR_CtlQueueTypeDef *queue;
+  RTLSDR_CtlReqTypeDef *req;
+  uint32_t primask;
+
+  if ((phost->pActiveClass == NULL) || (phost->pActiveClass->pData == NULL)) {
+    return USBH_FAIL;
+  }
+
+  RTLSDR_Handle = (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+  queue = &(RTLSDR_Handle->ctlQueue);
+
+  /* Several producers are allowed, interrupts included */
+  primask = __get_PRIMASK();
+  __disable_irq();
+
+  if (queue->tail - queue->head >= RTLSDR_CTL_QUEUE_SIZE) {
+    queue->rejected++;
+    __set_PRIMASK(primask);
+    return USBH_BUSY;
+  }
+
+  req = &(queue->req[queue->tail & (RTLSDR_CTL_QUEUE_SIZE - 1)]);
+  req->step = *step;
+  req->result = 0;
+  req->callback = callback;
+  req->context = context;
+
+  __DMB();
+  queue->tail++;
+
+  __set_PRIMASK(primask);
+
+  return USBH_OK;
+}
+
+/**
+  * @brief  RTLSDR_ctl_pending
+  * @param  phost: Host handle
+  * @retval Requests queued or running
+  */
+uint32_t RTLSDR_ctl_pending(USBH_HandleTypeDef *phost)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle;
+
+  if ((phost->pActiveClass == NULL) || (phost->pActiveClass->pData == NULL)) {
+    return 0;
+  }
+
+  RTLSDR_Handle = (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+
+  return RTLSDR_Handle->ctlQueue.tail - RTLSDR_Handle->ctlQueue.head;
+}
+
+/* Helpers for the usual requests, same arguments as the blocking versions */
+
+USBH_StatusTypeDef RTLSDR_ctl_write_reg(USBH_HandleTypeDef *phost,
+                                        uint8_t block, uint16_t addr, uint16_t val, uint8_t len,
+                                        RTLSDR_CtlCallbackTypeDef callback, void *context)
+{
+  RTLSDR_SeqStepTypeDef step = RTLSDR_SEQ_WRITE(block, addr, val, len);
+
+  return RTLSDR_ctl_submit(phost, &step, callback, context);
+}
+
+USBH_StatusTypeDef RTLSDR_ctl_demod_write_reg(USBH_HandleTypeDef *phost,
+                                              uint8_t page, uint16_t addr, uint16_t val, uint8_t len,
+                                              RTLSDR_CtlCallbackTypeDef callback, void *context)
+{
+  RTLSDR_SeqStepTypeDef step = RTLSDR_SEQ_DEMOD(page, addr, val, len);
+
+  return RTLSDR_ctl_submit(phost, &step, callback, context);
+}
+
+USBH_StatusTypeDef RTLSDR_ctl_i2c_write_reg(USBH_HandleTypeDef *phost,
+                                            uint8_t i2c_addr, uint8_t reg, uint8_t val,
+                                            RTLSDR_CtlCallbackTypeDef callback, void *context)
+{
+  RTLSDR_SeqStepTypeDef step = RTLSDR_SEQ_I2C_WRITE(i2c_addr, reg, val);
+
+  return RTLSDR_ctl_submit(phost, &step, callback, context);
+}
+
+/* The value read is in req->result when the callback runs */
+USBH_StatusTypeDef RTLSDR_ctl_i2c_read_reg(USBH_HandleTypeDef *phost,
+                                           uint8_t i2c_addr, uint8_t reg,
+                                           RTLSDR_CtlCallbackTypeDef callback, void *context)
+{
+  RTLSDR_SeqStepTypeDef step = RTLSDR_SEQ_I2C_READ(i2c_addr, reg);
+
+  return RTLSDR_ctl_submit(phost, &step, callback, context);
+}
+
+/* Queued RTLSDR_set_center_freq, freq in Hz */
+USBH_StatusTypeDef RTLSDR_ctl_set_freq(USBH_HandleTypeDef *phost, uint32_t freq, uint8_t flags,
+                                       RTLSDR_CtlCallbackTypeDef callback, void *context)
+{
+  RTLSDR_SeqStepTypeDef step = RTLSDR_SEQ_CALL(RTLSDR_ctl_tuner_freq, flags, freq);
+
+  return RTLSDR_ctl_submit(phost, &step, callback, context);
+}
+
+/* Queued RTLSDR_set_sample_rate, rate in Hz */
+USBH_StatusTypeDef RTLSDR_ctl_set_sample_rate(USBH_HandleTypeDef *phost, uint32_t rate,
+                                              RTLSDR_CtlCallbackTypeDef callback, void *context)
+{
+  RTLSDR_SeqStepTypeDef step = RTLSDR_SEQ_CALL(RTLSDR_ctl_sample_rate, 0, rate);
+
+  return RTLSDR_ctl_submit(phost, &step, callback, context);
+}
+
+/* Queued RTLSDR_set_freq_correction */
+USBH_StatusTypeDef RTLSDR_ctl_set_freq_correction(USBH_HandleTypeDef *phost, int32_t ppm,
+                                                  RTLSDR_CtlCallbackTypeDef callback, void *context)
+{
+  RTLSDR_SeqStepTypeDef step = RTLSDR_SEQ_CALL(RTLSDR_ctl_freq_correction, 0, (uint32_t)ppm);
+
+  return RTLSDR_ctl_submit(phost, &step, callback, context);
+}
+
+/**
+* @}
+*/
+
+/**
+* @}
+*/
+
+/**
+* @}
+*/
+
+/**
+* @}
+*/
+
+
+/**
+* @}
+*/
@@ -0,0 +1,335 @@
+/**
+  ******************************************************************************
+  * @file    usbh_rtlsdr_seq.c
+  * @author
+  * @version
+  * @date
+  * @brief   Register sequence engine for the RTLSDR USB Host class
+  *
+  *
+  ******************************************************************************
+  * @attention
+  *
+  * See usbh_rtlsdr_seq.h
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbh_rtlsdr_seq.h"
+#include "usbh_rtlsdr.h"
+
+/** @addtogroup USBH_LIB
+* @{
+*/
+
+/** @addtogroup USBH_CLASS
+* @{
+*/
+
+/** @addtogroup USBH_RTLSDR_CLASS
+* @{
+*/
+
+/** @defgroup USBH_RTLSDR_SEQ
+* @brief    This file includes the register sequence engine.
+* @{
+*/
+
+/** @defgroup USBH_RTLSDR_SEQ_Private_FunctionPrototypes
+* @{
+*/
+
+static void RTLSDR_seq_batch(RTLSDR_SeqTypeDef *seq);
+
+#if (RTLSDR_SEQ_PROFILE == 1)
+static void RTLSDR_seq_profile_start(RTLSDR_SeqTypeDef *seq);
+#endif
+
+/**
+* @}
+*/
+
+
+/** @defgroup USBH_RTLSDR_SEQ_Private_Functions
+* @{
+*/
+
+/**
+  * @brief  RTLSDR_seq_batch
+  *         Collect the data bytes of the current step, and of the following
+  *         ones while they write the next registers of the same block.
+  *         Values are sent MSB first, as RTLSDR_write_reg does.
+  * @param  seq: Sequence
+  * @retval None
+  */
+static void RTLSDR_seq_batch(RTLSDR_SeqTypeDef *seq)
+{
+  const RTLSDR_SeqStepTypeDef *first = &(seq->table[seq->index]);
+  const RTLSDR_SeqStepTypeDef *step = first;
+  uint8_t n;
+
+  seq->batchSteps = 0;
+  seq->batchLen = 0;
+
+  while (1) {
+    for (n = 0; n < step->len; n++) {
+      seq->batch[seq->batchLen++] = (uint8_t)(step->val >> (8 * (step->len - 1 - n)));
+    }
+    seq->batchSteps++;
+
+    if ((RTLSDR_SEQ_BATCH == 0) || (seq->index + seq->batchSteps >= seq->length)) break;
+
+    step = &(seq->table[seq->index + seq->batchSteps]);
+
+    if ((step->op != first->op) ||
+        (step->block != first->block) ||
+        (step->addr != first->addr + seq->batchLen) ||
+        (seq->batchLen + step->len > RTLSDR_SEQ_BATCH_MAX)) break;
+  }
+}
+
+#if (RTLSDR_SEQ_PROFILE == 1)
+/**
+  * @brief  RTLSDR_seq_profile_start
+  *         Clear the step counters when a sequence starts running.
+  * @param  seq: Sequence
+  * @retval None
+  */
+static void RTLSDR_seq_profile_start(RTLSDR_SeqTypeDef *seq)
+{
+  uint8_t n;
+
+  for (n = 0; n < RTLSDR_SEQ_PROFILE_MAX; n++) {
+    seq->stepCycles[n] = 0;
+  }
+
+  seq->seqStart = DWT->CYCCNT;
+  seq->stepStart = seq->seqStart;
+  seq->running = 1;
+}
+#endif
+
+/**
+  * @brief  RTLSDR_seq_init
+  *         Load a table in a sequence, it starts from its first step.
+  * @param  seq: Sequence
+  * @param  table: Steps, usually a const array in flash
+  * @param  length: Number of steps
+  * @retval None
+  */
+void RTLSDR_seq_init(RTLSDR_SeqTypeDef *seq,
+                     const RTLSDR_SeqStepTypeDef *table,
+                     uint8_t length)
+{
+  seq->table = table;
+  seq->length = length;
+  seq->index = 0;
+  seq->state = 0;
+  seq->batchSteps = 0;
+  seq->batchLen = 0;
+
+#if (RTLSDR_SEQ_PROFILE == 1)
+  /* Start the cycle counter, it is off until a debugger enables it */
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->LAR = 0xC5ACCE55;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+  seq->running = 0;
+  seq->total = 0;
+#endif
+}
+
+/**
+  * @brief  RTLSDR_seq_run
+  *         Run the current step of a sequence. Call it until it stops
+  *         returning USBH_BUSY. When a step fails its error is returned
+  *         and the same step is retried on the next call.
+  * @param  phost: Host handle
+  * @param  seq: Sequence
+  * @retval USBH_OK when the last step is done and the pending demod
+  *         read-back is issued (the sequence is rewound), USBH_BUSY while
+  *         running, or the error of the failing step
+  */
+USBH_StatusTypeDef RTLSDR_seq_run(USBH_HandleTypeDef *phost, RTLSDR_SeqTypeDef *seq)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle =
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+
+  const RTLSDR_SeqStepTypeDef *step;
+  USBH_StatusTypeDef uStatus = USBH_FAIL;
+  uint8_t steps = 1;
+  uint8_t val;
+
+#if (RTLSDR_SEQ_PROFILE == 1)
+  if (!seq->running) RTLSDR_seq_profile_start(seq);
+#endif
+
+  /* End of the batch, sync the demod before reporting completion */
+  if (seq->index >= seq->length) {
+    uStatus = RTLSDR_demod_sync(phost);
+    if (uStatus != USBH_OK) return uStatus;
+
+#if (RTLSDR_SEQ_PROFILE == 1)
+    seq->total = DWT->CYCCNT - seq->seqStart;
+    seq->running = 0;
+#endif
+
+    seq->index = 0;
+    return USBH_OK;
+  }
+
+  step = &(seq->table[seq->index]);
+
+  switch (step->op) {
+    case RTLSDR_SEQ_OP_WRITE:
+      if (seq->state == 0) {
+        RTLSDR_seq_batch(seq);
+        seq->state = 1;
+      }
+
+      /* The data goes out from the aligned control buffer of the handle */
+      if (phost->RequestState == CMD_SEND) {
+        USBH_memcpy(RTLSDR_Handle->regWriteData, seq->batch, seq->batchLen);
+      }
+
+      uStatus = RTLSDR_write_array(phost, step->block, step->addr,
+                                   RTLSDR_Handle->regWriteData, seq->batchLen);
+      steps = seq->batchSteps;
+    break;
+
+    case RTLSDR_SEQ_OP_DEMOD:
+      if (seq->state == 0) {
+        RTLSDR_seq_batch(seq);
+        seq->state = 1;
+      }
+
+      uStatus = RTLSDR_demod_write_array(phost, step->block, step->addr,
+                                         seq->batch, seq->batchLen);
+      steps = seq->batchSteps;
+    break;
+
+    case RTLSDR_SEQ_OP_I2C_WRITE:
+      uStatus = RTLSDR_i2c_write_reg(phost, step->block, step->addr, step->val);
+    break;
+
+    case RTLSDR_SEQ_OP_I2C_READ:
+      uStatus = RTLSDR_i2c_read_reg(phost, step->block, step->addr);
+    break;
+
+    case RTLSDR_SEQ_OP_I2C_MASK:
+      if (seq->state == 0) {
+        /* No read needed if the register is in the shadow of the device */
+        if (RTLSDR_i2c_shadow_get(phost, step->block, step->addr, &val)) {
+          RTLSDR_Handle->i2cReadVal = val;
+          uStatus = USBH_OK;
+        } else {
+          uStatus = RTLSDR_i2c_read_reg(phost, step->block, step->addr);
+        }
+
+        if (uStatus == USBH_OK) {
+          seq->batch[0] = RTLSDR_Handle->i2cReadVal;
+          seq->state = 1;
+          uStatus = USBH_BUSY;
+        }
+      } else {
+        val = (seq->batch[0] & ~step->mask) | (step->val & step->mask);
+
+        /* Skip the write if the bits are already set */
+        if (val == seq->batch[0]) {
+          uStatus = USBH_OK;
+        } else {
+          uStatus = RTLSDR_i2c_write_reg(phost, step->block, step->addr, val);
+        }
+      }
+    break;
+
+    case RTLSDR_SEQ_OP_CALL:
+      uStatus = step->call(phost, step);
+    break;
+
+    default:
+    break;
+  }
+
+  if (uStatus != USBH_OK) return uStatus;
+
+#if (RTLSDR_SEQ_PROFILE == 1)
+  /* Merged steps are accounted to the first one of the batch */
+  if (seq->index < RTLSDR_SEQ_PROFILE_MAX) {
+    seq->stepCycles[seq->index] = DWT->CYCCNT - seq->stepStart;
+  }
+  seq->stepStart = DWT->CYCCNT;
+#endif
+
+  seq->index += steps;
+  seq->state = 0;
+
+  return USBH_BUSY;
+}
+
+/**
+  * @brief  RTLSDR_seq_print_profile
+  *         Dump the time spent in the steps of the last run, slowest first.
+  *         Does nothing unless RTLSDR_SEQ_PROFILE is set.
+  * @param  seq: Sequence
+  * @param  name: Printed in the header line
+  * @retval None
+  */
+void RTLSDR_seq_print_profile(RTLSDR_SeqTypeDef *seq, const char *name)
+{
+#if (RTLSDR_SEQ_PROFILE == 1)
+  const RTLSDR_SeqStepTypeDef *step;
+  uint8_t order[RTLSDR_SEQ_PROFILE_MAX];
+  uint8_t count;
+  uint8_t n, m, tmp;
+  uint32_t mhz = SystemCoreClock / 1000000;
+
+  count = (seq->length < RTLSDR_SEQ_PROFILE_MAX) ? seq->length : RTLSDR_SEQ_PROFILE_MAX;
+
+  /* Insertion sort of the step numbers by decreasing time */
+  for (n = 0; n < count; n++) {
+    order[n] = n;
+
+    for (m = n; m > 0; m--) {
+      if (seq->stepCycles[order[m]] <= seq->stepCycles[order[m - 1]]) break;
+      tmp = order[m];
+      order[m] = order[m - 1];
+      order[m - 1] = tmp;
+    }
+  }
+
+  USBH_UsrLog("%s: %d steps in %d us", name, seq->length, seq->total / mhz);
+
+  for (n = 0; n < count; n++) {
+    if (seq->stepCycles[order[n]] == 0) break;
+
+    step = &(seq->table[order[n]]);
+
+    USBH_UsrLog("  step %d (op %d, %02x:%04x): %d us",
+                order[n], step->op, step->block, step->addr,
+                seq->stepCycles[order[n]] / mhz);
+  }
+#endif
+}
+
+/**
+* @}
+*/
+
+/**
+* @}
+*/
+
+/**
+* @}
+*/
+
+/**
+* @}
+*/
+
+
+/**
+* @}
+*/
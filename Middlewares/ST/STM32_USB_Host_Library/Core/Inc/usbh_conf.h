@@ -61,6 +61,8 @@
 #define USBH_MAX_DATA_BUFFER                  0x200
 #define USBH_DEBUG_LEVEL                      3
 #define USBH_USE_OS                           0
+/* Let the OTG HS core move the data with its internal DMA */
+#define USBH_USE_DMA                          1
     
 /** @defgroup USBH_Exported_Macros
   * @{
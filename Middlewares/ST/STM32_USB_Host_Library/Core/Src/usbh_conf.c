@@ -28,9 +28,81 @@
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f7xx_hal.h"
 #include "usbh_core.h"
+#include "usbh_rtlsdr.h"
 
 HCD_HandleTypeDef hhcd;
 
+#if (USBH_USE_DMA == 1)
+/* Cortex-M7 D-cache line size */
+#define USBH_DCACHE_LINE_SIZE   32U
+
+/* The first 64 KB of RAM are DTCM, which is never cached */
+#define USBH_IS_CACHEABLE(addr) (((uint32_t)(addr) < 0x20000000U) || \
+                                 ((uint32_t)(addr) >= 0x20010000U))
+
+/**
+  * @brief  Writes back and drops the D-cache lines holding a transfer buffer,
+  *         so the DMA sees the CPU data and no dirty line is evicted on top
+  *         of the data written by the DMA.
+  * @param  pbuff: Buffer address
+  * @param  length: Buffer length
+  * @retval None
+  */
+static void USBH_LL_CleanBuffer(uint8_t *pbuff, uint32_t length)
+{
+  uint32_t start = (uint32_t)pbuff & ~(USBH_DCACHE_LINE_SIZE - 1);
+  uint32_t end = ((uint32_t)pbuff + length + USBH_DCACHE_LINE_SIZE - 1) & 
+                 ~(USBH_DCACHE_LINE_SIZE - 1);
+  
+  if ((pbuff != NULL) && (length > 0) && USBH_IS_CACHEABLE(pbuff))
+  {
+    SCB_CleanInvalidateDCache_by_Addr((uint32_t *)start, end - start);
+  }
+}
+
+/**
+  * @brief  Drops the D-cache lines holding a buffer written by the DMA, so
+  *         the CPU does not read stale (or speculatively loaded) data. 
+  *         Lines only partially covered by the buffer are cleaned first to
+  *         keep the neighbouring data, buffers should be 32-byte aligned.
+  * @param  pbuff: Buffer address
+  * @param  length: Buffer length
+  * @retval None
+  */
+static void USBH_LL_InvalidateBuffer(uint8_t *pbuff, uint32_t length)
+{
+  uint32_t start = (uint32_t)pbuff;
+  uint32_t end = (uint32_t)pbuff + length;
+  uint32_t startLine = (start + USBH_DCACHE_LINE_SIZE - 1) & ~(USBH_DCACHE_LINE_SIZE - 1);
+  uint32_t endLine = end & ~(USBH_DCACHE_LINE_SIZE - 1);
+  
+  if ((pbuff == NULL) || (length == 0) || !USBH_IS_CACHEABLE(pbuff))
+  {
+    return;
+  }
+  
+  if (startLine >= endLine)
+  {
+    /* Buffer inside one or two lines */
+    USBH_LL_CleanBuffer(pbuff, length);
+    return;
+  }
+  
+  if (start != startLine)
+  {
+    SCB_CleanInvalidateDCache_by_Addr((uint32_t *)(startLine - USBH_DCACHE_LINE_SIZE), 
+                                      USBH_DCACHE_LINE_SIZE);
+  }
+  
+  SCB_InvalidateDCache_by_Addr((uint32_t *)startLine, endLine - startLine);
+  
+  if (end != endLine)
+  {
+    SCB_CleanInvalidateDCache_by_Addr((uint32_t *)endLine, USBH_DCACHE_LINE_SIZE);
+  }
+}
+#endif /* USBH_USE_DMA */
+
 /*******************************************************************************
                        HCD BSP Routines
 *******************************************************************************/
@@ -208,6 +280,17 @@ void HAL_HCD_Disconnect_Callback(HCD_HandleTypeDef *hhcd)
 void HAL_HCD_HC_NotifyURBChange_Callback(HCD_HandleTypeDef *hhcd, uint8_t chnum, HCD_URBStateTypeDef urb_state)
 {
   /* To be used with OS to sync URB state with the global state machine */
+  
+#if (USBH_USE_DMA == 1)
+  /* The DMA wrote behind the D-cache, xfer_len covers whole packets */
+  if ((urb_state == URB_DONE) && (hhcd->hc[chnum].ep_is_in))
+  {
+    USBH_LL_InvalidateBuffer(hhcd->hc[chnum].xfer_buff, hhcd->hc[chnum].xfer_len);
+  }
+#endif
+  
+  /* Stream the RTLSDR samples from interrupt context */
+  USBH_RTLSDR_URBChangeCallback(hhcd->pData, chnum, (USBH_URBStateTypeDef)urb_state);
 }
 
 /*******************************************************************************
@@ -245,7 +328,7 @@ USBH_StatusTypeDef USBH_LL_Init(USBH_HandleTypeDef *phost)
   /* Set the LL driver parameters */
   hhcd.Instance = USB_OTG_HS;
   hhcd.Init.Host_channels = 11; 
-  hhcd.Init.dma_enable = 0; /* vpecanins line */
+  hhcd.Init.dma_enable = USBH_USE_DMA; /* vpecanins line */
   hhcd.Init.low_power_enable = 0;
   hhcd.Init.phy_itface = HCD_PHY_ULPI;
   hhcd.Init.Sof_enable = 0;
@@ -429,6 +512,20 @@ USBH_StatusTypeDef USBH_LL_SubmitURB(USBH_HandleTypeDef *phost,
                                      uint16_t length,
                                      uint8_t do_ping) 
 {
+#if (USBH_USE_DMA == 1)
+  /* IN transfers are rounded up to whole packets by the driver */
+  if (direction == 1)
+  {
+    USBH_LL_CleanBuffer(pbuff, 
+                        ((length + hhcd.hc[pipe].max_packet - 1) / hhcd.hc[pipe].max_packet) * 
+                        hhcd.hc[pipe].max_packet);
+  }
+  else
+  {
+    USBH_LL_CleanBuffer(pbuff, length);
+  }
+#endif
+  
   HAL_HCD_HC_SubmitRequest(phost->pData,
                            pipe, 
                            direction,
@@ -35,6 +35,11 @@
 #include "stm32746g_discovery.h"
 #include "usbh_rtlsdr.h"
 #include "lcd_log.h"
+#include "sdr_fft.h"
+#include "sdr_waterfall.h"
+#include "sdr_audio.h"
+#include "sdr_wbfm.h"
+#include "sdr_demod.h"
 
 /* Exported constants --------------------------------------------------------*/
 /* Exported types ------------------------------------------------------------*/
@@ -0,0 +1,148 @@
+/**
+  ******************************************************************************
+  * @file    sdr_audio.h
+  * @author
+  * @version
+  * @date
+  * @brief   Audio sink on the WM8994 codec, header for sdr_audio.c
+  ******************************************************************************
+  * @attention
+  *
+  * The demodulators write mono q15 samples at SDR_AUDIO_RATE into the
+  * audio ring, the SAI plays them through the BSP audio driver:
+  *
+  *   SDR_audio_write -> audio ring (SDRAM) -> DMA half -> SAI2 -> WM8994
+  *
+  * The SAI DMA runs in circular mode over two halves of SDR_AUDIO_BLOCK
+  * stereo frames. The half and full transfer callbacks copy the next block
+  * of the ring into the half that was just played, then count it in
+  * blocks. That count is the cadence of the DSP: the main loop runs the
+  * demodulator once per block played (see SDR_wbfm_process).
+  *
+  * The ring absorbs the sample ring, which hands the samples over one
+  * slot at a time. Playback starts when prime samples are queued and
+  * stops again, with silence, when a block can not be filled.
+  *
+  * The samples are written with the crystal of the dongle and played with
+  * PLLI2S, which gives 47991 Hz and not 48000 for SDR_AUDIO_RATE. Any
+  * difference fills or drains the ring, so SDR_audio_write resamples:
+  *
+  *   pcm -> windowed sinc, SDR_AUDIO_RS_PHASES fractional delays
+  *          interpolated linearly -> audio ring
+  *
+  * The ratio is the rate given to SDR_audio_set_rate over the rate of the
+  * SAI, read back from its clock, trimmed by a PI loop on the fill level
+  * of the ring. The fill goes up by a slot and down again twice a second,
+  * the loop sees it through two one pole low-pass of 2 s and holds the
+  * level reached once playback has settled. The trim is bounded to
+  * SDR_AUDIO_PPM_MAX and keeps what it learned across underruns. The loop
+  * runs in the DMA callbacks, once per block.
+  *
+  * Only one sink can exist, the BSP callbacks are global.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SDR_AUDIO_H
+#define __SDR_AUDIO_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbh_core.h"
+#include "stm32746g_discovery_audio.h"
+#include "sdr_waterfall.h"
+
+/* Exported constants --------------------------------------------------------*/
+
+#define SDR_AUDIO_RATE             AUDIO_FREQUENCY_48K
+
+/* Stereo frames per DMA half, 10 ms */
+#define SDR_AUDIO_BLOCK            480
+
+/* Mono samples in the audio ring, a power of 2 (1.36 s) */
+#define SDR_AUDIO_RING_SIZE        65536
+
+/* In SDRAM, after the waterfall */
+#define SDR_AUDIO_RING_ADDRESS     ((uint32_t)(SDR_WATERFALL_FB_ADDRESS + SDR_WATERFALL_FB_SIZE))
+
+/* Resampler: flat to 18 kHz, distortion 75 dB down at 15 kHz */
+#define SDR_AUDIO_RS_TAPS          24
+#define SDR_AUDIO_RS_PHASES        32
+#define SDR_AUDIO_RS_CHUNK         256       /* Input samples per step */
+
+/* Bound of the drift correction of the PI loop */
+#define SDR_AUDIO_PPM_MAX          500
+
+/* Exported types ------------------------------------------------------------*/
+
+/* Refreshed about once per second */
+typedef struct
+{
+  uint32_t                 fill;     /* Samples in the ring, average */
+  uint32_t                 fillMin;
+  uint32_t                 fillMax;
+  uint32_t                 target;   /* Level held by the loop, 0 until locked */
+  float                    outRate;  /* Hz, SAI */
+  float                    ppm;      /* Correction of the loop */
+  float                    ratio;    /* Input samples per output sample */
+}
+SDR_AudioStatsTypeDef;
+
+typedef struct
+{
+  uint16_t                 device;   /* OUTPUT_DEVICE_xxx */
+  uint8_t                  volume;   /* 0..100 */
+  uint8_t                  playing;  /* 0 while priming or after an underrun */
+  uint32_t                 prime;    /* Samples queued before playback starts */
+
+  /* Free running indexes of the ring, head is written by SDR_audio_write
+   * and tail by the DMA callbacks */
+  int16_t                 *ring;
+  volatile uint32_t        head;
+  volatile uint32_t        tail;
+
+  volatile uint32_t        blocks;   /* Halves refilled, played or silent */
+  volatile uint32_t        underruns;/* Blocks that could not be filled */
+  volatile uint32_t        errors;   /* SAI errors */
+  uint32_t                 overruns; /* Samples dropped, ring full */
+
+  /* Drift loop, run by the DMA callbacks */
+  float                    inRate;   /* Hz, of the samples written */
+  float                    outRate;  /* Hz, SAI */
+  float                    base;     /* inRate / outRate - 1 */
+  float                    fillLp[2];
+  float                    target;
+  float                    integ;
+  float                    correction;
+  uint32_t                 settle;   /* Blocks played before the lock */
+  volatile int32_t         step;     /* Input samples per output - 1, Q32 */
+
+  /* Statistics */
+  SDR_AudioStatsTypeDef    stats;
+  uint32_t                 statBlocks;
+  uint32_t                 statFillMin;
+  uint32_t                 statFillMax;
+
+  /* Resampler, the history first */
+  uint64_t                 rsPos;    /* Next output, Q32 index in rsBuf */
+  float                    rsBuf[SDR_AUDIO_RS_TAPS - 1 + SDR_AUDIO_RS_CHUNK];
+  float                    rsCoeffs[SDR_AUDIO_RS_PHASES + 1][SDR_AUDIO_RS_TAPS];
+
+  int16_t                  dma[2][2 * SDR_AUDIO_BLOCK] __attribute__((aligned(32)));
+}
+SDR_AudioTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+USBH_StatusTypeDef SDR_audio_init(SDR_AudioTypeDef *audio, uint16_t device, uint8_t volume);
+
+void SDR_audio_set_prime(SDR_AudioTypeDef *audio, uint32_t samples);
+
+void SDR_audio_set_rate(SDR_AudioTypeDef *audio, float rate);
+
+uint32_t SDR_audio_write(SDR_AudioTypeDef *audio, const int16_t *pcm, uint32_t samples);
+
+uint32_t SDR_audio_fill(SDR_AudioTypeDef *audio);
+
+void SDR_audio_stop(SDR_AudioTypeDef *audio);
+
+#endif /* __SDR_AUDIO_H */
@@ -0,0 +1,115 @@
+/**
+  ******************************************************************************
+  * @file    sdr_decim.h
+  * @author
+  * @version
+  * @date
+  * @brief   Multistage decimator, header for sdr_decim.c
+  ******************************************************************************
+  * @attention
+  *
+  * The RTL2832 resampler does not go below about 225 kS/s, the voice and
+  * data channels want 8 to 48 kS/s. The decimator brings the IQ stream
+  * down by an integer factor in two parts:
+  *
+  *   half-band /2 -> ... -> half-band /2 -> FIR /factor (channel filter)
+  *
+  * The half-bands are 15 tap filters with 4 multiplies per output, most of
+  * the factor is taken by them while the rate is high. They are used while
+  * the rest of the factor is even and at least 4, so the FIR always keeps a
+  * factor of 2 or more and the half-bands only have to protect the channel,
+  * not shape it. The FIR is a windowed sinc of SDR_DECIM_TAPS_PER_PHASE
+  * taps per phase, run in polyphase form: only the outputs that are kept
+  * are computed.
+  *
+  * SDR_decim_set_shift moves a channel of the input to DC first, with the
+  * mixer of SDR_nco, so the channel filter can pick any part of the band.
+  * The mixer leaves SDR_NCO_HEADROOM bits of headroom, the channel filter
+  * takes them back: the output level is the same with or without a shift.
+  *
+  * Samples are processed in blocks of SDR_DECIM_BLOCK input samples, a
+  * call can take any number of them (a whole ring slot) and the rest waits
+  * for the next call. Inside a block every stage is a single loop.
+  *
+  * Coefficients and states are q15 and live in the decimator, which should
+  * be declared SDR_DTCM. Output is interleaved q15 I/Q.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SDR_DECIM_H
+#define __SDR_DECIM_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbh_core.h"
+#include "sdr_iq.h"
+#include "sdr_nco.h"
+#include "sdr_dsp.h"
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Input IQ samples per block, a power of 2 */
+#define SDR_DECIM_BLOCK            1024
+
+/* Half-band stages, up to a factor of 2^SDR_DECIM_HB_MAX */
+#define SDR_DECIM_HB_MAX           8
+
+/* Samples kept from block to block by a half-band */
+#define SDR_DECIM_HB_HIST          14
+
+/* Channel filter length, per unit of its decimation factor */
+#define SDR_DECIM_TAPS_PER_PHASE   12
+#define SDR_DECIM_TAPS_MAX         1008
+
+/* Largest output of one SDR_decim_process call */
+#define SDR_DECIM_OUT_MAX(d, samples)  (((samples) + SDR_DECIM_BLOCK) / (d)->decimation + 1)
+
+/* Exported types ------------------------------------------------------------*/
+
+typedef struct
+{
+  uint32_t                 inRate;   /* Hz */
+  uint32_t                 outRate;  /* Hz */
+  uint32_t                 bandwidth;/* Hz, passband of the channel filter */
+  uint32_t                 decimation;
+
+  uint8_t                  halfbands;
+  uint16_t                 factor;   /* FIR decimation */
+  uint16_t                 taps;
+  uint16_t                 phase;    /* FIR input samples to the next output */
+
+  SDR_IqTypeDef            iq;       /* For SDR_decim_process_u8 */
+  SDR_NcoTypeDef           nco;      /* Shift of the input, off at 0 Hz */
+  uint32_t                 fill;     /* Samples waiting in block */
+
+  /* Cycles per input sample, averaged over the calls */
+  float                    cyclesPerSample;
+
+  int16_t                  coeffs[SDR_DECIM_TAPS_MAX] __attribute__((aligned(4)));
+
+  /* Planar I and Q, history first */
+  int16_t                  hbHist[SDR_DECIM_HB_MAX][2][SDR_DECIM_HB_HIST];
+  int16_t                  hb[2][2][SDR_DECIM_HB_HIST + SDR_DECIM_BLOCK];
+  int16_t                  fir[2][SDR_DECIM_TAPS_MAX - 1 + SDR_DECIM_BLOCK];
+
+  /* Interleaved input block */
+  int16_t                  block[2 * SDR_DECIM_BLOCK] __attribute__((aligned(4)));
+}
+SDR_DecimTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+USBH_StatusTypeDef SDR_decim_init(SDR_DecimTypeDef *d, uint32_t inRate,
+                                  uint32_t outRate, uint32_t bandwidth);
+
+void SDR_decim_reset(SDR_DecimTypeDef *d);
+
+USBH_StatusTypeDef SDR_decim_set_shift(SDR_DecimTypeDef *d, int32_t freq);
+
+uint32_t SDR_decim_process(SDR_DecimTypeDef *d, const int16_t *in, uint32_t samples, int16_t *out);
+
+uint32_t SDR_decim_process_u8(SDR_DecimTypeDef *d, const uint8_t *in, uint32_t samples, int16_t *out);
+
+float SDR_decim_benchmark(SDR_DecimTypeDef *d, uint32_t samples);
+
+#endif /* __SDR_DECIM_H */
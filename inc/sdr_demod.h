@@ -0,0 +1,185 @@
+/**
+  ******************************************************************************
+  * @file    sdr_demod.h
+  * @author
+  * @version
+  * @date
+  * @brief   Narrowband demodulators, header for sdr_demod.c
+  ******************************************************************************
+  * @attention
+  *
+  * AM, USB, LSB, CW and NBFM share one front end, only the detector
+  * changes with the mode:
+  *
+  *   slot bytes -> SDR_iq -> SDR_decim to SDR_DEMOD_IF_RATE
+  *              -> shift of the channel to DC -> channel low-pass
+  *              -> detector (mode) -> AGC (mode) -> x2 to SDR_AUDIO_RATE
+  *              -> SDR_audio
+  *
+  * A mode is a const SDR_DemodModeTypeDef, the way RTLSDR_TunerTypeDef
+  * describes a tuner: the channel filter it wants and its functions. The
+  * sidebands use the Weaver method: the middle of the sideband is moved
+  * to DC, the low-pass keeps half the sideband on each side, and the real
+  * part of the result moved back is the audio. CW is the same with the
+  * carrier on DC and the beat frequency oscillator at SDR_DEMOD_CW_BFO.
+  *
+  * SDR_demod_set_offset picks a channel anywhere in the captured band with
+  * the mixer of the decimator, the tuner stays where it is. Off DC the
+  * spike of the tuner is removed in every mode.
+  *
+  * SDR_demod_set_mode switches at run time: the channel filter is designed
+  * again in place and the detector state is cleared, no buffer moves.
+  * All the buffers are sized for SDR_DEMOD_TAPS_MAX.
+  *
+  * SDR_demod_benchmark runs the chain of a mode on test samples and gives
+  * the share of the CPU it takes at the ring rate. The UI compares it with
+  * what the other engines leave (their stats.load) before it switches, a
+  * mode that does not fit would drop samples. stats has the load measured
+  * while it runs, refreshed about once per second.
+  *
+  * SDR_demod_process is called from the main loop like SDR_wbfm_process,
+  * once per block played, and consumes the sample ring the same way.
+  *
+  * The receiver holds a decimator, it should be declared SDR_DTCM. It is
+  * smaller than SDR_WbfmTypeDef, the two can share the DTCM in a union
+  * when only one runs at a time.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SDR_DEMOD_H
+#define __SDR_DEMOD_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbh_core.h"
+#include "usbh_rtlsdr.h"
+#include "sdr_decim.h"
+#include "sdr_audio.h"
+#include "sdr_fft.h"
+#include "sdr_dsp.h"
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Rate of the channel filter and the detectors, half SDR_AUDIO_RATE */
+#define SDR_DEMOD_IF_RATE          24000
+
+/* Smallest decimation to the IF, the RTL2832 does not go below 225 kS/s */
+#define SDR_DEMOD_DECIM_MIN        10
+
+/* Channel filter, the longest gives about 500 Hz of transition */
+#define SDR_DEMOD_TAPS_MAX         256
+
+/* x2 interpolation to SDR_AUDIO_RATE, images 80 dB down */
+#define SDR_DEMOD_INTERP_TAPS      32
+
+#define SDR_DEMOD_CW_BFO           700       /* Hz, pitch of the CW tone */
+#define SDR_DEMOD_NBFM_DEVIATION   5000      /* Hz, full scale */
+
+/* IQ samples per DSP step, even */
+#define SDR_DEMOD_CHUNK            2048
+
+/* Largest output of the decimator for one step */
+#define SDR_DEMOD_IF_MAX           ((SDR_DEMOD_CHUNK + SDR_DECIM_BLOCK) / SDR_DEMOD_DECIM_MIN + 1)
+
+/* Exported types ------------------------------------------------------------*/
+
+struct _SDR_DemodTypeDef;
+
+/* Demodulator interface */
+/* All the modes should implement these functions */
+typedef struct
+{
+  const char          *Name;
+  uint32_t             bandwidth;    /* Hz, channel filter, both sides of DC */
+  int32_t              shift;        /* Hz, middle of the channel */
+  uint16_t             taps;         /* Channel filter, even, up to SDR_DEMOD_TAPS_MAX */
+  uint8_t              dcShift;      /* SDR_iq DC removal, 0 with a carrier on DC */
+  uint8_t              agc;          /* Audio leveled by the AGC */
+  void               (*Init)   (struct _SDR_DemodTypeDef *demod);
+  void               (*Detect) (struct _SDR_DemodTypeDef *demod, uint32_t samples);
+}
+SDR_DemodModeTypeDef;
+
+/* Complex oscillator, a phasor turned by a fixed step */
+typedef struct
+{
+  float                    re;
+  float                    im;
+  float                    stepRe;
+  float                    stepIm;
+}
+SDR_DemodOscTypeDef;
+
+/* Refreshed about once per second */
+typedef struct
+{
+  float                    load;     /* Share of the CPU in SDR_demod_process, 0..1 */
+  float                    cyclesPerSample; /* Per ring sample, whole chain */
+}
+SDR_DemodStatsTypeDef;
+
+typedef struct _SDR_DemodTypeDef
+{
+  const SDR_DemodModeTypeDef *mode;
+  SDR_AudioTypeDef        *audio;
+  SDR_FftTypeDef          *spectrum; /* NULL, or fed with the samples */
+
+  uint32_t                 inRate;   /* Hz, ring */
+  uint32_t                 offset;   /* Bytes used of the current slot */
+  uint32_t                 blocks;   /* Sink blocks already answered */
+
+  /* Detectors */
+  SDR_DemodOscTypeDef      osc;      /* Channel to DC */
+  SDR_DemodOscTypeDef      bfo;      /* Back to audio, SSB and CW */
+  float                    carrier;  /* AM, average envelope */
+  uint32_t                 carrierSamples; /* AM, up to SDR_DEMOD_AM_SETTLE */
+  float                    lastI;    /* NBFM, previous sample */
+  float                    lastQ;
+  float                    peak;     /* AGC */
+
+  /* Statistics */
+  SDR_DemodStatsTypeDef    stats;
+  uint32_t                 statStart;
+  uint32_t                 statBusy;
+  uint32_t                 statSamples;
+
+  float                    coeffs[SDR_DEMOD_TAPS_MAX];
+  float                    interp[2][SDR_DEMOD_INTERP_TAPS / 2];
+
+  /* Planar I and Q, the history of the channel filter first */
+  float                    chan[2][SDR_DEMOD_TAPS_MAX - 1 + SDR_DEMOD_IF_MAX];
+  float                    base[2][SDR_DEMOD_IF_MAX];
+
+  /* Detector output, the history of the interpolator first */
+  float                    af[SDR_DEMOD_INTERP_TAPS / 2 - 1 + SDR_DEMOD_IF_MAX];
+
+  int16_t                  ifBuf[2 * SDR_DEMOD_IF_MAX] __attribute__((aligned(4)));
+  int16_t                  pcm[2 * SDR_DEMOD_IF_MAX];
+
+  SDR_DecimTypeDef         decim;
+}
+SDR_DemodTypeDef;
+
+/* Exported variables --------------------------------------------------------*/
+extern const SDR_DemodModeTypeDef SDR_Demod_AM;
+extern const SDR_DemodModeTypeDef SDR_Demod_USB;
+extern const SDR_DemodModeTypeDef SDR_Demod_LSB;
+extern const SDR_DemodModeTypeDef SDR_Demod_CW;
+extern const SDR_DemodModeTypeDef SDR_Demod_NBFM;
+
+/* Exported functions ------------------------------------------------------- */
+USBH_StatusTypeDef SDR_demod_init(SDR_DemodTypeDef *demod, SDR_AudioTypeDef *audio,
+                                  uint32_t inRate, const SDR_DemodModeTypeDef *mode);
+
+USBH_StatusTypeDef SDR_demod_set_mode(SDR_DemodTypeDef *demod, const SDR_DemodModeTypeDef *mode);
+
+void SDR_demod_reset(SDR_DemodTypeDef *demod);
+
+USBH_StatusTypeDef SDR_demod_set_offset(SDR_DemodTypeDef *demod, int32_t freq);
+
+void SDR_demod_process(USBH_HandleTypeDef *phost, SDR_DemodTypeDef *demod);
+
+float SDR_demod_benchmark(SDR_DemodTypeDef *demod, const SDR_DemodModeTypeDef *mode);
+
+#endif /* __SDR_DEMOD_H */
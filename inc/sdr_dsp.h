@@ -0,0 +1,73 @@
+/**
+  ******************************************************************************
+  * @file    sdr_dsp.h
+  * @author
+  * @version
+  * @date
+  * @brief   Definitions shared by the SDR signal processing modules
+  ******************************************************************************
+  * @attention
+  *
+  * SDR_DTCM places a variable in the .dtcm section (see LinkerScript.ld),
+  * the 64K of data RAM tightly coupled to the core: no wait states and no
+  * D-cache in the way. It is meant for filter coefficients, filter states
+  * and lookup tables. It is not initialized by the startup code.
+  *
+  * The cycle counter of the DWT is used to measure the cost of every
+  * stage, SDR_cycles_init starts it.
+  *
+  * SDR_atan2 is the angle of the FM discriminators.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SDR_DSP_H
+#define __SDR_DSP_H
+
+/* Includes ------------------------------------------------------------------*/
+#include <math.h>
+#include "stm32f7xx.h"
+
+/* Exported constants --------------------------------------------------------*/
+
+#define SDR_DTCM                   __attribute__((section(".dtcm")))
+
+/* Exported functions ------------------------------------------------------- */
+
+/* Start the cycle counter, it is off until a debugger enables it */
+static inline void SDR_cycles_init(void)
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->LAR = 0xC5ACCE55;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static inline uint32_t SDR_cycles(void)
+{
+  return DWT->CYCCNT;
+}
+
+/* atan(z) ~ z * (pi/4 + 0.273 * (1 - z)) on the first octant, the others
+ * by symmetry. Max error 0.0038 rad, -pi..pi */
+static inline float SDR_atan2(float y, float x)
+{
+  float ax = fabsf(x);
+  float ay = fabsf(y);
+  float z, a;
+
+  if (ax >= ay) {
+    if (ax == 0.0f) return 0.0f;
+    z = ay / ax;
+    a = z * (0.78539816f + 0.273f * (1.0f - z));
+  } else {
+    z = ax / ay;
+    a = 1.57079633f - z * (0.78539816f + 0.273f * (1.0f - z));
+  }
+
+  if (x < 0.0f) a = 3.14159265f - a;
+
+  return (y < 0.0f) ? -a : a;
+}
+
+#endif /* __SDR_DSP_H */
@@ -0,0 +1,156 @@
+/**
+  ******************************************************************************
+  * @file    sdr_fft.h
+  * @author
+  * @version
+  * @date
+  * @brief   Spectrum engine, header for sdr_fft.c
+  ******************************************************************************
+  * @attention
+  *
+  * The engine takes the sample ring and turns it into log magnitude
+  * spectra with a complex FFT, in f32 or q15:
+  *
+  *   slot bytes -> SDR_iq conversion -> window -> FFT -> |X|^2
+  *              -> average of N frames -> dB, DC in the middle bin
+  *
+  * Every config.interval IQ samples one frame of config.size samples is
+  * taken, the samples in between are dropped. interval == size uses every
+  * sample, a larger one lowers the frame rate to what the CPU can afford.
+  *
+  * SDR_fft_process must be called from the main loop, next to
+  * USBH_Process. It returns USBH_OK every time db[] (and maxHold[]) holds
+  * a new spectrum, at most one per call. Like the scanner, the engine
+  * consumes the sample ring, nothing else should take slots while it runs.
+  * When a demodulator owns the ring, it passes the samples it takes to
+  * SDR_fft_feed instead.
+  *
+  * stats is refreshed about once per second: spectra and frames per
+  * second, CPU load of the engine and the sample rate it could sustain at
+  * 100% load with the current settings.
+  *
+  * The FFT is a radix 2 decimation in time on twiddles computed by
+  * SDR_fft_init for the size. The q15 one halves every stage, its output is
+  * scaled by 1 / size.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SDR_FFT_H
+#define __SDR_FFT_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbh_core.h"
+#include "usbh_rtlsdr.h"
+#include "sdr_iq.h"
+#include "sdr_dsp.h"
+
+/* Exported constants --------------------------------------------------------*/
+
+/* FFT sizes, powers of 2. The buffers of SDR_FftTypeDef are sized for
+ * SDR_FFT_SIZE_MAX, lower it to save RAM */
+#define SDR_FFT_SIZE_MIN           256
+#ifndef SDR_FFT_SIZE_MAX
+#define SDR_FFT_SIZE_MAX           4096
+#endif
+
+/* Floor of the dB output, keeps silent bins finite */
+#define SDR_FFT_DB_FLOOR           (-150.0f)
+
+/* Exported types ------------------------------------------------------------*/
+
+typedef enum
+{
+  SDR_FFT_F32 = 0,
+  SDR_FFT_Q15,              /* Less dynamic range */
+}
+SDR_FftFormatTypeDef;
+
+typedef enum
+{
+  SDR_FFT_WINDOW_RECT = 0,
+  SDR_FFT_WINDOW_HANN,
+  SDR_FFT_WINDOW_BLACKMAN_HARRIS,
+}
+SDR_FftWindowTypeDef;
+
+typedef struct
+{
+  uint16_t                 size;     /* Bins, SDR_FFT_SIZE_MIN..SDR_FFT_SIZE_MAX */
+  SDR_FftFormatTypeDef     format;
+  SDR_FftWindowTypeDef     window;
+  uint16_t                 average;  /* Frames per spectrum, 0 and 1 do not average */
+  uint32_t                 interval; /* IQ samples from frame to frame, 0: size */
+}
+SDR_FftConfigTypeDef;
+
+/* Refreshed about once per second */
+typedef struct
+{
+  float                    fps;      /* Spectra per second */
+  float                    frameRate;/* FFTs per second */
+  float                    load;     /* Share of the CPU in SDR_fft_process, 0..1 */
+  float                    capacity; /* Samples per second at 100% load */
+}
+SDR_FftStatsTypeDef;
+
+/* Spectrum engine, usually a static variable of the application */
+typedef struct
+{
+  SDR_FftConfigTypeDef     config;
+  SDR_IqTypeDef            iq;
+  float                    scale;    /* Power of a full scale tone to 1 */
+
+  uint32_t                 fill;     /* IQ samples of the frame being built */
+  uint32_t                 skip;     /* IQ samples to drop before the next frame */
+  uint32_t                 offset;   /* Bytes used of the current slot */
+  uint16_t                 averaged; /* Frames in power */
+
+  uint32_t                 frames;   /* FFTs done */
+  uint32_t                 spectra;  /* Spectra output */
+
+  /* Statistics */
+  SDR_FftStatsTypeDef      stats;
+  uint32_t                 statStart;
+  uint32_t                 statBusy;
+  uint32_t                 statFrames;
+  uint32_t                 statSpectra;
+
+  /* Output, DC is bin size / 2 */
+  float                    db[SDR_FFT_SIZE_MAX];
+  float                    maxHold[SDR_FFT_SIZE_MAX];
+
+  float                    power[SDR_FFT_SIZE_MAX];
+
+  union {
+    float                  f32[2 * SDR_FFT_SIZE_MAX];
+    int16_t                q15[2 * SDR_FFT_SIZE_MAX];
+  } work __attribute__((aligned(32)));
+
+  union {
+    float                  f32[SDR_FFT_SIZE_MAX];
+    int16_t                q15[SDR_FFT_SIZE_MAX];
+  } window;
+
+  /* size / 2 complex W^k, re and im interleaved */
+  union {
+    float                  f32[SDR_FFT_SIZE_MAX];
+    int16_t                q15[SDR_FFT_SIZE_MAX];
+  } twiddle;
+}
+SDR_FftTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+USBH_StatusTypeDef SDR_fft_init(SDR_FftTypeDef *fft, const SDR_FftConfigTypeDef *config);
+
+USBH_StatusTypeDef SDR_fft_process(USBH_HandleTypeDef *phost, SDR_FftTypeDef *fft);
+
+USBH_StatusTypeDef SDR_fft_feed(SDR_FftTypeDef *fft, const uint8_t *bytes,
+                                uint32_t length, uint8_t restart);
+
+void SDR_fft_reset_max(SDR_FftTypeDef *fft);
+
+float SDR_fft_bin_freq(SDR_FftTypeDef *fft, uint16_t bin, uint32_t centerFreq, uint32_t rate);
+
+#endif /* __SDR_FFT_H */
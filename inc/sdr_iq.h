@@ -0,0 +1,76 @@
+/**
+  ******************************************************************************
+  * @file    sdr_iq.h
+  * @author
+  * @version
+  * @date
+  * @brief   IQ sample conversion, header for sdr_iq.c
+  ******************************************************************************
+  * @attention
+  *
+  * The dongle sends interleaved I/Q bytes in offset binary (0x80 is zero).
+  * The converters turn them into interleaved complex q15 or f32 and take
+  * out the DC offset of the tuner at the same time:
+  *
+  *   q15 = ((byte - 128) << 8) - dc          (saturated)
+  *   f32 = q15 / 32768                       (not saturated)
+  *
+  * dc is a running estimate for I and Q. Each call converts a block with
+  * the estimate of the blocks before it, then moves the estimate towards
+  * the mean of the block by 1 / 2^shift. The time constant is therefore
+  * counted in calls, blocks of about the same length should be used.
+  *
+  * The output is written from the end of the block to the start, so out
+  * can be the same buffer as in when it has room for the output (2 bytes
+  * per input byte for q15, 4 for f32). The ring slots are filled to the
+  * top by the bulk pipe, a whole slot is converted in blocks into a work
+  * buffer, carrying the DC state from one block to the next.
+  *
+  * On the Cortex-M7 the DSP extension converts 2 IQ samples per 32 bit
+  * word. SDR_iq_to_q15_ref and SDR_iq_to_f32_ref are the plain C versions,
+  * they give the same results and build on any compiler.
+  *
+  * in and out must be 4 byte aligned.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SDR_IQ_H
+#define __SDR_IQ_H
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Fraction bits of the DC estimate below q15 */
+#define SDR_IQ_DC_FRAC             16
+
+/* Default time constant of the DC estimate, 2^shift blocks */
+#define SDR_IQ_DC_SHIFT            4
+
+/* Exported types ------------------------------------------------------------*/
+
+/* Converter state, one per stream */
+typedef struct
+{
+  int32_t                  dcI;      /* q15 << SDR_IQ_DC_FRAC */
+  int32_t                  dcQ;
+  uint8_t                  shift;    /* 0 freezes the estimate */
+  uint8_t                  primed;   /* First block sets the estimate */
+}
+SDR_IqTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+void SDR_iq_init(SDR_IqTypeDef *iq, uint8_t shift);
+
+void SDR_iq_to_q15(SDR_IqTypeDef *iq, const uint8_t *in, int16_t *out, uint32_t samples);
+
+void SDR_iq_to_f32(SDR_IqTypeDef *iq, const uint8_t *in, float *out, uint32_t samples);
+
+void SDR_iq_to_q15_ref(SDR_IqTypeDef *iq, const uint8_t *in, int16_t *out, uint32_t samples);
+
+void SDR_iq_to_f32_ref(SDR_IqTypeDef *iq, const uint8_t *in, float *out, uint32_t samples);
+
+#endif /* __SDR_IQ_H */
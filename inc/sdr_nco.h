@@ -0,0 +1,70 @@
+/**
+  ******************************************************************************
+  * @file    sdr_nco.h
+  * @author
+  * @version
+  * @date
+  * @brief   Numerically controlled oscillator and mixer, header for sdr_nco.c
+  ******************************************************************************
+  * @attention
+  *
+  * The mixer moves a channel of the captured band to DC, so the tuner can
+  * stay where it is (away from the DC spike of the E4000) and picking a
+  * channel is only a change of freq, no I2C and no USB request:
+  *
+  *   y[n] = x[n] * exp(-j * 2 * pi * freq * n / rate)
+  *
+  * The oscillator is a 32 bit phase accumulator. Its top SDR_NCO_LUT_BITS
+  * bits index a table of cos / sin packed like the samples (cos in the
+  * low half), so each sample is one table load and a complex multiply of
+  * two __SMUAD / __SMUSDX. The frequency resolution is rate / 2^32, the
+  * truncation of the phase gives spurs about 6 dB per bit down (60 dB for
+  * 1024 entries, more than the 8 bits of the dongle).
+  *
+  * A full scale sample turned by 45 degrees is 1.41 full scale, so the
+  * mixer output is scaled down by 2^SDR_NCO_HEADROOM instead of being
+  * clipped. Whoever reads it takes the gain back once the channel is
+  * filtered, as SDR_decim does.
+  *
+  * The table is shared by all the oscillators and lives in the DTCM, it
+  * is filled by the first SDR_nco_init.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SDR_NCO_H
+#define __SDR_NCO_H
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+#include "sdr_dsp.h"
+
+/* Exported constants --------------------------------------------------------*/
+
+/* cos / sin table, 4 bytes per entry */
+#define SDR_NCO_LUT_BITS           10
+#define SDR_NCO_LUT_SIZE           (1UL << SDR_NCO_LUT_BITS)
+
+/* Bits of headroom of the mixer output, 6 dB */
+#define SDR_NCO_HEADROOM           1
+
+/* Exported types ------------------------------------------------------------*/
+
+typedef struct
+{
+  int32_t                  freq;     /* Hz, moved to DC */
+  uint32_t                 rate;     /* Hz */
+  uint32_t                 phase;    /* Turns, Q32 */
+  uint32_t                 step;     /* Turns per sample, Q32 */
+}
+SDR_NcoTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+void SDR_nco_init(SDR_NcoTypeDef *nco, uint32_t rate, int32_t freq);
+
+void SDR_nco_set_freq(SDR_NcoTypeDef *nco, int32_t freq);
+
+void SDR_nco_mix_q15(SDR_NcoTypeDef *nco, int16_t *iq, uint32_t samples);
+
+#endif /* __SDR_NCO_H */
@@ -0,0 +1,123 @@
+/**
+  ******************************************************************************
+  * @file    sdr_scan.h
+  * @author
+  * @version
+  * @date
+  * @brief   Band scanner, header for sdr_scan.c
+  ******************************************************************************
+  * @attention
+  *
+  * The scanner steps the tuner over a frequency plan and builds a power map
+  * of the band, one or more values (dB) per step. Each step runs:
+  *
+  *   retune -> drop the settling samples -> capture -> measure
+  *
+  * The retune goes through the control queue (RTLSDR_ctl_set_freq) and only
+  * writes the PLL registers that change. As soon as a capture is complete
+  * the retune of the next step is queued, and the capture is measured while
+  * those control transfers are on the bus.
+  *
+  * SDR_scan_process must be called from the main loop, next to
+  * USBH_Process. The scanner consumes the sample ring, nothing else should
+  * take slots while it runs.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SDR_SCAN_H
+#define __SDR_SCAN_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbh_core.h"
+#include "usbh_rtlsdr.h"
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Largest capture of a step, in IQ samples (2 bytes each) */
+#define SDR_SCAN_CAPTURE_MAX       4096
+
+/* Flags of SDR_ScanPlanTypeDef */
+#define SDR_SCAN_CONTINUOUS        0x01   /* Start over after the last step */
+#define SDR_SCAN_LOCK_CHECK        0x02   /* Read the PLL lock on every retune */
+
+/* Exported types ------------------------------------------------------------*/
+
+/* Scanner FSM */
+typedef enum
+{
+  SDR_SCAN_IDLE= 0,
+  SDR_SCAN_TUNE_REQ,        /* Retune to be queued */
+  SDR_SCAN_TUNE,            /* Retune queued, old samples are dropped */
+  SDR_SCAN_CAPTURE,         /* Dropping the settling samples, then copying */
+}
+SDR_ScanStateTypeDef;
+
+/* Measurement of one step. iq holds samples interleaved offset binary I/Q
+ * bytes as they come from the dongle, out receives bins values */
+typedef void (*SDR_ScanMeasureTypeDef)(const uint8_t *iq, uint32_t samples,
+                                       float *out, uint16_t bins, void *context);
+
+/* Frequency plan */
+typedef struct
+{
+  uint32_t                 start;    /* Hz, center of the first step */
+  uint32_t                 stop;     /* Hz, last center, inclusive */
+  uint32_t                 step;     /* Hz */
+  uint32_t                 settle;   /* IQ samples dropped after every retune */
+  uint32_t                 samples;  /* IQ samples captured per step */
+  uint16_t                 bins;     /* Map values per step, 1 for band power */
+  uint8_t                  flags;    /* SDR_SCAN_* */
+  SDR_ScanMeasureTypeDef   measure;  /* NULL: SDR_scan_band_power */
+  void                    *context;  /* For measure */
+}
+SDR_ScanPlanTypeDef;
+
+/* Scanner, usually a static variable of the application */
+typedef struct
+{
+  SDR_ScanPlanTypeDef      plan;
+  SDR_ScanStateTypeDef     state;
+  float                   *map;      /* steps * bins values */
+  uint32_t                 steps;
+  uint32_t                 index;    /* Step being tuned or captured */
+
+  /* Retune, written by the completion callback of the control queue */
+  uint32_t                 tuneFreq;
+  volatile uint8_t         tuned;
+  volatile uint8_t         tuneStatus;
+  uint32_t                 tuneSeq;  /* Stream slot being filled when tuned */
+
+  uint32_t                 discard;  /* Bytes still to drop */
+  uint32_t                 offset;   /* Bytes used of the current slot */
+  uint32_t                 captured; /* Bytes in capture */
+
+  uint8_t                  measurePending;
+  uint32_t                 measureIndex;
+
+  uint32_t                 sweeps;   /* Complete passes over the plan */
+  uint32_t                 errors;   /* Failed retunes, their steps are skipped */
+
+  uint8_t                  capture[2 * SDR_SCAN_CAPTURE_MAX] __attribute__((aligned(32)));
+}
+SDR_ScanTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+void SDR_scan_init(SDR_ScanTypeDef *scan);
+
+USBH_StatusTypeDef SDR_scan_start(SDR_ScanTypeDef *scan,
+                                  const SDR_ScanPlanTypeDef *plan,
+                                  float *map,
+                                  uint32_t mapLength);
+
+void SDR_scan_stop(SDR_ScanTypeDef *scan);
+
+USBH_StatusTypeDef SDR_scan_process(USBH_HandleTypeDef *phost, SDR_ScanTypeDef *scan);
+
+uint32_t SDR_scan_freq(SDR_ScanTypeDef *scan, uint32_t index);
+
+void SDR_scan_band_power(const uint8_t *iq, uint32_t samples,
+                         float *out, uint16_t bins, void *context);
+
+#endif /* __SDR_SCAN_H */
@@ -0,0 +1,78 @@
+/**
+  ******************************************************************************
+  * @file    sdr_waterfall.h
+  * @author
+  * @version
+  * @date
+  * @brief   Waterfall display on LCD layer 1, header for sdr_waterfall.c
+  ******************************************************************************
+  * @attention
+  *
+  * Every spectrum pushed becomes a new line at the top of LCD layer 1, the
+  * older ones move down. Nothing is drawn pixel by pixel:
+  *
+  * - The bins are mapped to one byte per pixel column (the strongest bin
+  *   of the column) and DMA2D converts that L8 line to ARGB8888 through a
+  *   256 color palette loaded in its CLUT.
+  *
+  * - The image never moves in memory. The framebuffer holds the height of
+  *   the screen twice, each line is written in both halves, and the layer
+  *   start address goes up one line per spectrum. The new address is taken
+  *   by LTDC in the vertical blanking, so there is no tearing.
+  *
+  * The framebuffer is in SDRAM after the sample ring. DMA2D is shared with
+  * the BSP LCD drawing functions, push must be called from the same
+  * context as them (main loop).
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SDR_WATERFALL_H
+#define __SDR_WATERFALL_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32746g_discovery_lcd.h"
+#include "usbh_rtlsdr.h"
+
+/* Exported constants --------------------------------------------------------*/
+
+#define SDR_WATERFALL_LAYER        1
+#define SDR_WATERFALL_WIDTH        RK043FN48H_WIDTH
+#define SDR_WATERFALL_HEIGHT       RK043FN48H_HEIGHT
+
+/* Two screens of ARGB8888, after the sample ring */
+#define SDR_WATERFALL_FB_ADDRESS   ((uint32_t)(RTLSDR_RING_START_ADDRESS + \
+                                   RTLSDR_RING_SLOT_NUMBER * RTLSDR_RING_SLOT_LENGTH))
+#define SDR_WATERFALL_FB_SIZE      (2 * SDR_WATERFALL_WIDTH * SDR_WATERFALL_HEIGHT * 4)
+
+/* Exported types ------------------------------------------------------------*/
+
+typedef struct
+{
+  float                    dbMin;    /* First color of the palette */
+  float                    dbMax;    /* Last color of the palette */
+  float                    dbScale;  /* Palette entries per dB */
+
+  uint16_t                 top;      /* Framebuffer line at the top of the screen */
+  uint32_t                 lines;    /* Spectra pushed */
+
+  /* First bin of every column, for bins spectra */
+  uint16_t                 bins;
+  uint16_t                 column[SDR_WATERFALL_WIDTH + 1];
+
+  DMA2D_HandleTypeDef      hdma2d;
+
+  uint32_t                 palette[256] __attribute__((aligned(32)));
+  uint8_t                  line[SDR_WATERFALL_WIDTH] __attribute__((aligned(32)));
+}
+SDR_WaterfallTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+void SDR_waterfall_init(SDR_WaterfallTypeDef *wf, float dbMin, float dbMax);
+
+void SDR_waterfall_set_range(SDR_WaterfallTypeDef *wf, float dbMin, float dbMax);
+
+void SDR_waterfall_push(SDR_WaterfallTypeDef *wf, const float *db, uint16_t bins);
+
+#endif /* __SDR_WATERFALL_H */
@@ -0,0 +1,140 @@
+/**
+  ******************************************************************************
+  * @file    sdr_wbfm.h
+  * @author
+  * @version
+  * @date
+  * @brief   Wideband FM broadcast receiver, header for sdr_wbfm.c
+  ******************************************************************************
+  * @attention
+  *
+  * The receiver takes the sample ring and plays the mono FM broadcast at
+  * the center frequency on the audio sink:
+  *
+  *   slot bytes -> SDR_iq -> SDR_decim to SDR_WBFM_IF_RATE (channel filter)
+  *              -> quadrature discriminator -> de-emphasis
+  *              -> low-pass and decimation to SDR_AUDIO_RATE -> SDR_audio
+  *
+  * The discriminator takes the phase of x[n] * conj(x[n-1]), the product
+  * is done on the packed I/Q words with __SMUAD / __SMUSDX and the angle
+  * with SDR_atan2 (max error 0.0038 rad, far below the 1.96 rad of a full
+  * 75 kHz deviation at 240 kS/s).
+  *
+  * The ring rate must be a multiple of SDR_WBFM_IF_RATE, the 240 kS/s of
+  * the RTL2832 init sequence is taken as is (the decimator is then only
+  * the channel filter). With the station tuned on DC the converter does
+  * not remove the DC, that would take the carrier away. At a higher ring
+  * rate SDR_wbfm_set_offset receives it off DC, away from the spike of
+  * the tuner, and the DC is removed again.
+  *
+  * SDR_wbfm_process must be called from the main loop. It does nothing
+  * until the sink has played a block, then demodulates up to twice the
+  * samples of the blocks played, so it follows the slots as they come
+  * without holding the main loop for a whole slot. The receiver consumes
+  * the sample ring, spectrum can be set to an engine that gets the same
+  * samples through SDR_fft_feed. The sink is told the exact audio rate
+  * that follows from the real_rate of the dongle.
+  *
+  * stats is refreshed about once per second. latency is the age of the
+  * samples from the moment the dongle sent them to the moment they leave
+  * the codec, which makes the receiver the end to end latency benchmark:
+  * the sample ring slot and the audio prime dominate it.
+  *
+  * The receiver holds a decimator, it should be declared SDR_DTCM.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SDR_WBFM_H
+#define __SDR_WBFM_H
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbh_core.h"
+#include "usbh_rtlsdr.h"
+#include "sdr_decim.h"
+#include "sdr_audio.h"
+#include "sdr_fft.h"
+#include "sdr_dsp.h"
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Rate of the discriminator, a multiple of SDR_AUDIO_RATE */
+#define SDR_WBFM_IF_RATE           240000
+#define SDR_WBFM_DEVIATION         75000     /* Hz, full scale */
+
+/* Audio low-pass: -2 dB at 15 kHz, the 19 kHz pilot 40 dB down */
+#define SDR_WBFM_AUDIO_DECIM       (SDR_WBFM_IF_RATE / SDR_AUDIO_RATE)
+#define SDR_WBFM_AUDIO_CUTOFF      16000
+#define SDR_WBFM_AUDIO_TAPS        (SDR_WBFM_AUDIO_DECIM * 32)
+
+/* De-emphasis time constant, us */
+#define SDR_WBFM_DEEMPHASIS_EU     50
+#define SDR_WBFM_DEEMPHASIS_US     75
+
+/* IQ samples per DSP step, even */
+#define SDR_WBFM_CHUNK             2048
+
+/* Largest output of the decimator for one step */
+#define SDR_WBFM_IF_MAX            (SDR_WBFM_CHUNK + SDR_DECIM_BLOCK + 1)
+
+/* Exported types ------------------------------------------------------------*/
+
+/* Refreshed about once per second */
+typedef struct
+{
+  float                    load;     /* Share of the CPU in SDR_wbfm_process, 0..1 */
+  float                    cyclesPerSample; /* Per ring sample, whole chain */
+  float                    latency;  /* ms, average */
+  float                    latencyMax; /* ms */
+}
+SDR_WbfmStatsTypeDef;
+
+typedef struct
+{
+  SDR_AudioTypeDef        *audio;
+  SDR_FftTypeDef          *spectrum; /* NULL, or fed with the samples */
+
+  uint32_t                 inRate;   /* Hz, ring */
+  uint32_t                 offset;   /* Bytes used of the current slot */
+  uint32_t                 blocks;   /* Sink blocks already answered */
+
+  /* Discriminator and de-emphasis */
+  uint32_t                 last;     /* Previous IF sample, packed I/Q */
+  float                    discScale;/* rad to full scale */
+  float                    deemphAlpha;
+  float                    deemph;
+
+  uint16_t                 audioPhase;
+  float                    audioCoeffs[SDR_WBFM_AUDIO_TAPS];
+
+  /* Statistics */
+  SDR_WbfmStatsTypeDef     stats;
+  uint32_t                 statStart;
+  uint32_t                 statBusy;
+  uint32_t                 statSamples;
+  float                    statLatency;
+  uint32_t                 statLatencies;
+  float                    statLatencyMax;
+
+  /* Discriminator output, the history of the audio low-pass first */
+  float                    fm[SDR_WBFM_AUDIO_TAPS - 1 + SDR_WBFM_IF_MAX];
+
+  int16_t                  ifBuf[2 * SDR_WBFM_IF_MAX] __attribute__((aligned(4)));
+  int16_t                  pcm[SDR_WBFM_IF_MAX / SDR_WBFM_AUDIO_DECIM + 1];
+
+  SDR_DecimTypeDef         decim;
+}
+SDR_WbfmTypeDef;
+
+/* Exported functions ------------------------------------------------------- */
+USBH_StatusTypeDef SDR_wbfm_init(SDR_WbfmTypeDef *wbfm, SDR_AudioTypeDef *audio,
+                                 uint32_t inRate, uint8_t deemphasis);
+
+void SDR_wbfm_reset(SDR_WbfmTypeDef *wbfm);
+
+USBH_StatusTypeDef SDR_wbfm_set_offset(SDR_WbfmTypeDef *wbfm, int32_t freq);
+
+void SDR_wbfm_process(USBH_HandleTypeDef *phost, SDR_WbfmTypeDef *wbfm);
+
+#endif /* __SDR_WBFM_H */
@@ -16,18 +16,84 @@
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
+
+/* Waterfall colors, dB relative to a full scale tone */
+#define WATERFALL_DB_MIN  -90.0f
+#define WATERFALL_DB_MAX  -30.0f
+
+/* Sample rate set by the RTL2832 init sequence */
+#define RECEIVER_RATE     240000
+
+#define AUDIO_VOLUME      70
+
+/* Waterfall lines per second and FFT frames averaged into each line */
+#define SPECTRUM_LINES    25
+#define SPECTRUM_AVERAGE  8
+
+/* Narrowband mode of the receiver (&SDR_Demod_AM, ...), NULL for FM
+ * broadcast */
+#define RECEIVER_MODE     NULL
+
+/* Hz from the center frequency to the narrowband channel. 0 leaves the
+ * channel on the DC spike of the tuner: set it, and the tuner that much
+ * below the channel, to move away from the spike. FM broadcast takes the
+ * whole band on DC and ignores it */
+#define RECEIVER_OFFSET   0
+
+/* Share of the CPU a narrowband mode may take, the rest is for the USB
+ * host, the spectrum and the waterfall */
+#define RECEIVER_LOAD_MAX 0.5f
+
 /* Private macro -------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
 USBH_HandleTypeDef hUSBHost;
 
+SDR_FftTypeDef hSpectrum;
+SDR_WaterfallTypeDef hWaterfall;
+
+SDR_AudioTypeDef hAudio;
+
+/* One receiver runs at a time, they share the DTCM */
+SDR_DTCM union
+{
+  SDR_WbfmTypeDef wbfm;
+  SDR_DemodTypeDef demod;
+} hReceiver;
+
+/* The receiver owns the sample ring when the codec is there */
+static uint8_t receiverOn = 0;
+static const SDR_DemodModeTypeDef *receiverMode = NULL;
+
+static const SDR_DemodModeTypeDef *const DemodModes[] = {
+  &SDR_Demod_AM,
+  &SDR_Demod_USB,
+  &SDR_Demod_LSB,
+  &SDR_Demod_CW,
+  &SDR_Demod_NBFM,
+};
+static uint32_t spectraShown = 0;
+
+/* 1024 bins, the frame interval gives SPECTRUM_LINES at RECEIVER_RATE:
+ * one frame every 1200 samples, 200 FFTs/s at 240 kS/s, a small share
+ * of the CPU */
+static const SDR_FftConfigTypeDef SpectrumConfig = {
+  .size = 1024,
+  .format = SDR_FFT_F32,
+  .window = SDR_FFT_WINDOW_HANN,
+  .average = SPECTRUM_AVERAGE,
+  .interval = RECEIVER_RATE / (SPECTRUM_LINES * SPECTRUM_AVERAGE),
+};
+
 uint8_t currentScreen=0;
 
 /* Private function prototypes -----------------------------------------------*/
 static void SystemClock_Config(void);
 static void Error_Handler(void);
+static void MPU_Config(void);
 static void CPU_CACHE_Enable(void);
 static void USBH_UserProcess(USBH_HandleTypeDef *phost, uint8_t id);
 static void RTLSDR_InitApplication(void);
+static void RTLSDR_InitReceiver(void);
 
 /* Private functions ---------------------------------------------------------*/
 
@@ -39,6 +105,9 @@ static void RTLSDR_InitApplication(void);
   */
 int main(void)
 {
+  /* Configure the MPU attributes of the SDRAM */
+  MPU_Config();
+  
   /* Enable the CPU Cache */
   CPU_CACHE_Enable();
   
@@ -65,6 +134,11 @@ int main(void)
   /* Start Host Process */
   USBH_Start(&hUSBHost);
 
+  /* Spectrum of the samples for the waterfall */
+  SDR_fft_init(&hSpectrum, &SpectrumConfig);
+
+  /* Receiver on the headphones, it feeds the spectrum */
+  RTLSDR_InitReceiver();
   
   RTLSDR_HandleTypeDef *RTLSDR_Handle =
      		(RTLSDR_HandleTypeDef*) hUSBHost.pActiveClass->pData;
@@ -73,6 +147,21 @@ int main(void)
   {
     /* USB Host Background task */
     USBH_Process(&hUSBHost); 
+
+    /* Demodulate once per audio block played */
+    if (receiverOn && (receiverMode != NULL)) {
+      SDR_demod_process(&hUSBHost, &(hReceiver.demod));
+    } else if (receiverOn) {
+      SDR_wbfm_process(&hUSBHost, &(hReceiver.wbfm));
+    } else {
+      SDR_fft_process(&hUSBHost, &hSpectrum);
+    }
+
+    /* New spectrum, new line on the waterfall */
+    if (hSpectrum.spectra != spectraShown) {
+      spectraShown = hSpectrum.spectra;
+      SDR_waterfall_push(&hWaterfall, hSpectrum.db, hSpectrum.config.size);
+    }
 	/*if (RTLSDR_Handle->xferState==RTLSDR_XFER_COMPLETE) {
 		USBH_UsrLog("St %d", *RTLSDR_Handle);
 		RTLSDR_Handle->xferState = RTLSDR_XFER_START;
@@ -108,10 +197,8 @@ static void RTLSDR_InitApplication(void)
   BSP_LCD_SelectLayer(1);
   BSP_LCD_SetTransparency(1, 0x00);
   
-  /* Draw a test circle and background to the layer 1 */
-  BSP_LCD_Clear(LCD_COLOR_TRANSPARENT);
-  BSP_LCD_SetTextColor(LCD_COLOR_WHITE);
-  BSP_LCD_DrawCircle(BSP_LCD_GetXSize()/2, BSP_LCD_GetYSize()/2, 10);
+  /* The waterfall takes the layer 1 */
+  SDR_waterfall_init(&hWaterfall, WATERFALL_DB_MIN, WATERFALL_DB_MAX);
   
   /* Return to layer 0 for putting the console */
   BSP_LCD_SelectLayer(0);
@@ -140,6 +227,53 @@ static void RTLSDR_InitApplication(void)
   
 }
 
+/**
+  * @brief  Receiver Init.
+  *         Measure the narrowband modes, then start RECEIVER_MODE if it
+  *         fits in RECEIVER_LOAD_MAX, FM broadcast otherwise.
+  * @param  None
+  * @retval None
+  */
+static void RTLSDR_InitReceiver(void)
+{
+  const SDR_DemodModeTypeDef *mode = RECEIVER_MODE;
+  uint32_t n, load;
+
+  if (SDR_audio_init(&hAudio, OUTPUT_DEVICE_HEADPHONE, AUDIO_VOLUME) != USBH_OK) {
+    USBH_UsrLog("No audio, spectrum only");
+    return;
+  }
+
+  if (SDR_demod_init(&(hReceiver.demod), &hAudio, RECEIVER_RATE, DemodModes[0]) == USBH_OK) {
+    for (n = 0; n < sizeof(DemodModes) / sizeof(DemodModes[0]); n++) {
+      load = (uint32_t)(SDR_demod_benchmark(&(hReceiver.demod), DemodModes[n]) * 1000.0f);
+      USBH_UsrLog("%s: %lu.%lu%% CPU", DemodModes[n]->Name, load / 10, load % 10);
+
+      if ((DemodModes[n] == mode) && ((float)load > RECEIVER_LOAD_MAX * 1000.0f)) {
+        USBH_UsrLog("%s does not fit, FM broadcast", mode->Name);
+        mode = NULL;
+      }
+    }
+  } else {
+    mode = NULL;
+  }
+
+  if ((mode != NULL) && (SDR_demod_set_mode(&(hReceiver.demod), mode) == USBH_OK)) {
+    hReceiver.demod.spectrum = &hSpectrum;
+    if (SDR_demod_set_offset(&(hReceiver.demod), RECEIVER_OFFSET) != USBH_OK) {
+      USBH_UsrLog("Offset out of the band, channel on DC");
+    }
+    receiverMode = mode;
+    receiverOn = 1;
+  } else if (SDR_wbfm_init(&(hReceiver.wbfm), &hAudio, RECEIVER_RATE,
+                           SDR_WBFM_DEEMPHASIS_EU) == USBH_OK) {
+    hReceiver.wbfm.spectrum = &hSpectrum;
+    receiverOn = 1;
+  } else {
+    USBH_UsrLog("No receiver, spectrum only");
+  }
+}
+
 /**
   * @brief EXTI line detection callbacks
   * @param GPIO_Pin: Specifies the pins connected EXTI line
@@ -321,6 +455,41 @@ static void Error_Handler(void)
   }
 }
 
+/**
+  * @brief  Configure the MPU attributes as Write Through for SDRAM.
+  * @note   The Region Size is 8MB, the whole SDRAM holding the LCD frame
+  *         buffers and the RTLSDR sample ring. By default it is Device
+  *         memory, which is not cached and faults on unaligned accesses.
+  *         The USB DMA writes behind the D-cache, see usbh_conf.c.
+  * @param  None
+  * @retval None
+  */
+static void MPU_Config(void)
+{
+  MPU_Region_InitTypeDef MPU_InitStruct;
+  
+  /* Disable the MPU */
+  HAL_MPU_Disable();
+  
+  /* Configure the MPU attributes as WT for SDRAM */
+  MPU_InitStruct.Enable = MPU_REGION_ENABLE;
+  MPU_InitStruct.BaseAddress = SDRAM_DEVICE_ADDR;
+  MPU_InitStruct.Size = MPU_REGION_SIZE_8MB;
+  MPU_InitStruct.AccessPermission = MPU_REGION_FULL_ACCESS;
+  MPU_InitStruct.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
+  MPU_InitStruct.IsCacheable = MPU_ACCESS_CACHEABLE;
+  MPU_InitStruct.IsShareable = MPU_ACCESS_NOT_SHAREABLE;
+  MPU_InitStruct.Number = MPU_REGION_NUMBER0;
+  MPU_InitStruct.TypeExtField = MPU_TEX_LEVEL0;
+  MPU_InitStruct.SubRegionDisable = 0x00;
+  MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+  
+  HAL_MPU_ConfigRegion(&MPU_InitStruct);
+  
+  /* Enable the MPU */
+  HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
+}
+
 /**
   * @brief  CPU L1-Cache enable.
   * @param  None
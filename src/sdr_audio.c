@@ -0,0 +1,468 @@
+/**
+  ******************************************************************************
+  * @file    sdr_audio.c
+  * @author
+  * @version
+  * @date
+  * @brief   Audio sink: audio ring and double buffered SAI DMA
+  ******************************************************************************
+  * @attention
+  *
+  * See sdr_audio.h
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <math.h>
+#include <string.h>
+#include "sdr_audio.h"
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+
+#define SDR_AUDIO_RING_MASK        (SDR_AUDIO_RING_SIZE - 1)
+
+/* Blocks per second */
+#define SDR_AUDIO_BLOCK_RATE       (SDR_AUDIO_RATE / SDR_AUDIO_BLOCK)
+
+/* Fill low-pass, 2 s per pole at one update per block */
+#define SDR_AUDIO_FILL_ALPHA       (1.0f / (2.0f * SDR_AUDIO_BLOCK_RATE))
+
+/* Blocks played before the level is taken as the target, 7 time constants */
+#define SDR_AUDIO_SETTLE           (14 * SDR_AUDIO_BLOCK_RATE)
+
+/* PI gains, error in seconds of audio: critically damped at 0.02 rad/s.
+ * A 200 ppm step moves the level by 5 ms at most */
+#define SDR_AUDIO_KP               0.04f
+#define SDR_AUDIO_KI               (0.0004f / SDR_AUDIO_BLOCK_RATE)
+
+#define SDR_AUDIO_PHASE_BITS       5         /* log2(SDR_AUDIO_RS_PHASES) */
+
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+
+/* Sink of the BSP callbacks */
+static SDR_AudioTypeDef *SDR_audio_sink = NULL;
+
+/* Of the BSP audio driver */
+extern SAI_HandleTypeDef haudio_out_sai;
+
+/* Private function prototypes -----------------------------------------------*/
+static void SDR_audio_design(SDR_AudioTypeDef *audio);
+
+static float SDR_audio_out_rate(void);
+
+static void SDR_audio_track(SDR_AudioTypeDef *audio, uint32_t fill);
+
+static void SDR_audio_stats(SDR_AudioTypeDef *audio, uint32_t fill);
+
+static void SDR_audio_refill(SDR_AudioTypeDef *audio, int16_t *half);
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  SDR_audio_design
+  *         Resampler: one Blackman windowed sinc per fractional delay, from
+  *         0 to 1 sample, each with unity gain at DC. The delay is
+  *         SDR_AUDIO_RS_TAPS / 2 - 1 samples plus the fraction.
+  * @param  audio: Sink
+  * @retval None
+  */
+static void SDR_audio_design(SDR_AudioTypeDef *audio)
+{
+  float m = (float)SDR_AUDIO_RS_TAPS;
+  float f, t, x, w, sum;
+  uint32_t p, n;
+
+  for (p = 0; p <= SDR_AUDIO_RS_PHASES; p++) {
+    f = (float)p / (float)SDR_AUDIO_RS_PHASES;
+    sum = 0.0f;
+
+    for (n = 0; n < SDR_AUDIO_RS_TAPS; n++) {
+      t = (float)n - (float)(SDR_AUDIO_RS_TAPS / 2 - 1) - f;
+      x = (float)n + 1.0f - f;
+      w = 0.42f - 0.5f * cosf(2.0f * (float)M_PI * x / m) +
+          0.08f * cosf(4.0f * (float)M_PI * x / m);
+
+      if (t == 0.0f) {
+        audio->rsCoeffs[p][n] = w;
+      } else {
+        audio->rsCoeffs[p][n] = sinf((float)M_PI * t) / ((float)M_PI * t) * w;
+      }
+
+      sum += audio->rsCoeffs[p][n];
+    }
+
+    for (n = 0; n < SDR_AUDIO_RS_TAPS; n++) {
+      audio->rsCoeffs[p][n] /= sum;
+    }
+  }
+}
+
+/**
+  * @brief  SDR_audio_out_rate
+  *         Frame rate of the SAI, from its kernel clock and the master
+  *         clock divider chosen by HAL_SAI_Init.
+  * @param  None
+  * @retval Hz
+  */
+static float SDR_audio_out_rate(void)
+{
+  float clock = (float)HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_SAI2);
+  uint32_t mckdiv = haudio_out_sai.Init.Mckdiv;
+
+  /* MCLK = 256 * FS = SAI_CK / (MCKDIV * 2), no divider for 0 */
+  if (mckdiv == 0) return clock / 256.0f;
+
+  return clock / (512.0f * (float)mckdiv);
+}
+
+/**
+  * @brief  SDR_audio_track
+  *         PI loop on the fill level, one update per block played. Runs in
+  *         the DMA interrupt.
+  * @param  audio: Sink
+  * @param  fill: Samples in the ring before the block
+  * @retval None
+  */
+static void SDR_audio_track(SDR_AudioTypeDef *audio, uint32_t fill)
+{
+  float bound = SDR_AUDIO_PPM_MAX * 1.0e-6f;
+  float e, c;
+
+  audio->fillLp[0] += ((float)fill - audio->fillLp[0]) * SDR_AUDIO_FILL_ALPHA;
+  audio->fillLp[1] += (audio->fillLp[0] - audio->fillLp[1]) * SDR_AUDIO_FILL_ALPHA;
+
+  if (audio->settle > 0) {
+    if (--audio->settle == 0) audio->target = audio->fillLp[1];
+    c = audio->integ;
+  } else {
+    /* Seconds of audio above the target: the input is too fast */
+    e = (audio->fillLp[1] - audio->target) / (float)SDR_AUDIO_RATE;
+
+    audio->integ += SDR_AUDIO_KI * e;
+    if (audio->integ > bound) audio->integ = bound;
+    if (audio->integ < -bound) audio->integ = -bound;
+
+    c = audio->integ + SDR_AUDIO_KP * e;
+    if (c > bound) c = bound;
+    if (c < -bound) c = -bound;
+  }
+
+  audio->correction = c;
+  audio->step = (int32_t)((audio->base + c + audio->base * c) * 4294967296.0f);
+}
+
+/**
+  * @brief  SDR_audio_stats
+  *         Refresh stats once per second of blocks. Runs in the DMA
+  *         interrupt.
+  * @param  audio: Sink
+  * @param  fill: Samples in the ring before the block
+  * @retval None
+  */
+static void SDR_audio_stats(SDR_AudioTypeDef *audio, uint32_t fill)
+{
+  if (fill < audio->statFillMin) audio->statFillMin = fill;
+  if (fill > audio->statFillMax) audio->statFillMax = fill;
+
+  if (++audio->statBlocks < SDR_AUDIO_BLOCK_RATE) return;
+
+  audio->stats.fill = (uint32_t)audio->fillLp[1];
+  audio->stats.fillMin = audio->statFillMin;
+  audio->stats.fillMax = audio->statFillMax;
+  audio->stats.target = audio->settle ? 0 : (uint32_t)audio->target;
+  audio->stats.outRate = audio->outRate;
+  audio->stats.ppm = audio->correction * 1.0e6f;
+  audio->stats.ratio = 1.0f + (float)audio->step / 4294967296.0f;
+
+  audio->statBlocks = 0;
+  audio->statFillMin = UINT32_MAX;
+  audio->statFillMax = 0;
+}
+
+/**
+  * @brief  SDR_audio_refill
+  *         Copy the next block of the ring to a DMA half, both channels.
+  *         Runs in the DMA interrupt.
+  * @param  audio: Sink
+  * @param  half: DMA half just played
+  * @retval None
+  */
+static void SDR_audio_refill(SDR_AudioTypeDef *audio, int16_t *half)
+{
+  uint32_t tail = audio->tail;
+  uint32_t fill = audio->head - tail;
+  uint32_t n;
+  int16_t s;
+
+  if (!audio->playing && (fill >= audio->prime) && (fill >= SDR_AUDIO_BLOCK)) {
+    audio->playing = 1;
+
+    /* Lock again, the correction learned is kept */
+    audio->fillLp[0] = (float)fill;
+    audio->fillLp[1] = (float)fill;
+    audio->settle = SDR_AUDIO_SETTLE;
+  }
+
+  if (audio->playing && (fill < SDR_AUDIO_BLOCK)) {
+    audio->playing = 0;
+    audio->underruns++;
+  }
+
+  if (audio->playing) {
+    SDR_audio_track(audio, fill);
+    SDR_audio_stats(audio, fill);
+
+    for (n = 0; n < SDR_AUDIO_BLOCK; n++) {
+      s = audio->ring[(tail + n) & SDR_AUDIO_RING_MASK];
+      half[2 * n] = s;
+      half[2 * n + 1] = s;
+    }
+
+    audio->tail = tail + SDR_AUDIO_BLOCK;
+  } else {
+    memset(half, 0, 2 * SDR_AUDIO_BLOCK * sizeof(int16_t));
+  }
+
+  /* Read by the DMA */
+  SCB_CleanDCache_by_Addr((uint32_t*) half, 2 * SDR_AUDIO_BLOCK * sizeof(int16_t));
+
+  audio->blocks++;
+}
+
+/**
+  * @brief  SDR_audio_init
+  *         Start the codec and the SAI DMA, silent until prime samples are
+  *         written. The ring is in SDRAM, it must be initialized.
+  * @param  audio: Sink
+  * @param  device: OUTPUT_DEVICE_HEADPHONE, OUTPUT_DEVICE_SPEAKER, ...
+  * @param  volume: 0..100
+  * @retval USBH_OK, or USBH_FAIL if the codec does not answer
+  */
+USBH_StatusTypeDef SDR_audio_init(SDR_AudioTypeDef *audio, uint16_t device, uint8_t volume)
+{
+  SDR_audio_sink = NULL;
+
+  audio->device = device;
+  audio->volume = volume;
+  audio->playing = 0;
+  audio->prime = SDR_AUDIO_RING_SIZE / 4;
+
+  audio->ring = (int16_t*) SDR_AUDIO_RING_ADDRESS;
+  audio->head = 0;
+  audio->tail = 0;
+
+  audio->blocks = 0;
+  audio->underruns = 0;
+  audio->errors = 0;
+  audio->overruns = 0;
+
+  audio->inRate = (float)SDR_AUDIO_RATE;
+  audio->outRate = (float)SDR_AUDIO_RATE;
+  audio->base = 0.0f;
+  audio->fillLp[0] = 0.0f;
+  audio->fillLp[1] = 0.0f;
+  audio->target = 0.0f;
+  audio->integ = 0.0f;
+  audio->correction = 0.0f;
+  audio->settle = SDR_AUDIO_SETTLE;
+  audio->step = 0;
+
+  memset(&(audio->stats), 0, sizeof(audio->stats));
+  audio->statBlocks = 0;
+  audio->statFillMin = UINT32_MAX;
+  audio->statFillMax = 0;
+
+  SDR_audio_design(audio);
+  audio->rsPos = 0;
+  memset(audio->rsBuf, 0, sizeof(audio->rsBuf));
+
+  memset(audio->dma, 0, sizeof(audio->dma));
+  SCB_CleanDCache_by_Addr((uint32_t*) audio->dma, sizeof(audio->dma));
+
+  if (BSP_AUDIO_OUT_Init(device, volume, SDR_AUDIO_RATE) != AUDIO_OK) return USBH_FAIL;
+
+  audio->outRate = SDR_audio_out_rate();
+  SDR_audio_set_rate(audio, (float)SDR_AUDIO_RATE);
+
+  /* Stereo on slots 0 and 2, the headphone jack */
+  BSP_AUDIO_OUT_SetAudioFrameSlot(CODEC_AUDIOFRAME_SLOT_02);
+
+  SDR_audio_sink = audio;
+
+  if (BSP_AUDIO_OUT_Play((uint16_t*) audio->dma, sizeof(audio->dma)) != AUDIO_OK) {
+    SDR_audio_sink = NULL;
+    return USBH_FAIL;
+  }
+
+  return USBH_OK;
+}
+
+/**
+  * @brief  SDR_audio_set_prime
+  *         Samples queued before playback starts, or restarts after an
+  *         underrun. More than the audio of one sample ring slot keeps it
+  *         going between slots.
+  * @param  audio: Sink
+  * @param  samples: Up to SDR_AUDIO_RING_SIZE / 2
+  * @retval None
+  */
+void SDR_audio_set_prime(SDR_AudioTypeDef *audio, uint32_t samples)
+{
+  if (samples > SDR_AUDIO_RING_SIZE / 2) samples = SDR_AUDIO_RING_SIZE / 2;
+
+  audio->prime = samples;
+}
+
+/**
+  * @brief  SDR_audio_set_rate
+  *         Rate of the samples written, as the source reports it. The PI
+  *         loop only trims the ratio it gives.
+  * @param  audio: Sink
+  * @param  rate: Hz, nominally SDR_AUDIO_RATE
+  * @retval None
+  */
+void SDR_audio_set_rate(SDR_AudioTypeDef *audio, float rate)
+{
+  audio->inRate = rate;
+  audio->base = rate / audio->outRate - 1.0f;
+  audio->step = (int32_t)((audio->base + audio->correction + audio->base * audio->correction) *
+                          4294967296.0f);
+}
+
+/**
+  * @brief  SDR_audio_write
+  *         Resample and queue samples for playback, what does not fit is
+  *         dropped.
+  * @param  audio: Sink
+  * @param  pcm: Mono q15 samples at SDR_AUDIO_RATE
+  * @param  samples: Samples in pcm
+  * @retval Samples queued, at the rate of the SAI
+  */
+uint32_t SDR_audio_write(SDR_AudioTypeDef *audio, const int16_t *pcm, uint32_t samples)
+{
+  float *in = &(audio->rsBuf[SDR_AUDIO_RS_TAPS - 1]);
+  uint64_t step = (uint64_t)((int64_t)(1LL << 32) + audio->step);
+  uint64_t pos = audio->rsPos;
+  uint32_t head = audio->head;
+  uint32_t room = SDR_AUDIO_RING_SIZE - (head - audio->tail);
+  uint32_t queued = 0;
+  uint32_t n, i, k, frac;
+  const float *h0, *h1;
+  const float *x;
+  float a, b, mu;
+
+  while (samples > 0) {
+    n = (samples > SDR_AUDIO_RS_CHUNK) ? SDR_AUDIO_RS_CHUNK : samples;
+
+    for (k = 0; k < n; k++) {
+      in[k] = (float)pcm[k];
+    }
+
+    /* The last input used is rsBuf[i + SDR_AUDIO_RS_TAPS - 1] */
+    while ((i = (uint32_t)(pos >> 32)) < n) {
+      frac = (uint32_t)pos;
+      h0 = audio->rsCoeffs[frac >> (32 - SDR_AUDIO_PHASE_BITS)];
+      h1 = h0 + SDR_AUDIO_RS_TAPS;
+      mu = (float)(frac << SDR_AUDIO_PHASE_BITS) * (1.0f / 4294967296.0f);
+      x = &(audio->rsBuf[i]);
+
+      a = 0.0f;
+      b = 0.0f;
+      for (k = 0; k < SDR_AUDIO_RS_TAPS; k++) {
+        a += x[k] * h0[k];
+        b += x[k] * h1[k];
+      }
+
+      if (queued < room) {
+        audio->ring[(head + queued) & SDR_AUDIO_RING_MASK] =
+          (int16_t)__SSAT((int32_t)lrintf(a + (b - a) * mu), 16);
+        queued++;
+      } else {
+        audio->overruns++;
+      }
+
+      pos += step;
+    }
+
+    pos -= (uint64_t)n << 32;
+    memmove(audio->rsBuf, &(audio->rsBuf[n]), (SDR_AUDIO_RS_TAPS - 1) * sizeof(float));
+
+    pcm += n;
+    samples -= n;
+  }
+
+  audio->rsPos = pos;
+
+  /* The samples before the new head */
+  __DMB();
+  audio->head = head + queued;
+
+  return queued;
+}
+
+/**
+  * @brief  SDR_audio_fill
+  * @param  audio: Sink
+  * @retval Samples queued in the ring
+  */
+uint32_t SDR_audio_fill(SDR_AudioTypeDef *audio)
+{
+  return audio->head - audio->tail;
+}
+
+/**
+  * @brief  SDR_audio_stop
+  *         Stop the DMA and power the codec down.
+  * @param  audio: Sink
+  * @retval None
+  */
+void SDR_audio_stop(SDR_AudioTypeDef *audio)
+{
+  if (SDR_audio_sink != audio) return;
+
+  BSP_AUDIO_OUT_Stop(CODEC_PDWN_SW);
+
+  SDR_audio_sink = NULL;
+  audio->playing = 0;
+}
+
+/**
+  * @brief  BSP_AUDIO_OUT_HalfTransfer_CallBack
+  *         First half played, the DMA is on the second one.
+  * @param  None
+  * @retval None
+  */
+void BSP_AUDIO_OUT_HalfTransfer_CallBack(void)
+{
+  if (SDR_audio_sink != NULL) {
+    SDR_audio_refill(SDR_audio_sink, SDR_audio_sink->dma[0]);
+  }
+}
+
+/**
+  * @brief  BSP_AUDIO_OUT_TransferComplete_CallBack
+  *         Second half played, the DMA is back on the first one.
+  * @param  None
+  * @retval None
+  */
+void BSP_AUDIO_OUT_TransferComplete_CallBack(void)
+{
+  if (SDR_audio_sink != NULL) {
+    SDR_audio_refill(SDR_audio_sink, SDR_audio_sink->dma[1]);
+  }
+}
+
+/**
+  * @brief  BSP_AUDIO_OUT_Error_CallBack
+  * @param  None
+  * @retval None
+  */
+void BSP_AUDIO_OUT_Error_CallBack(void)
+{
+  if (SDR_audio_sink != NULL) {
+    SDR_audio_sink->errors++;
+  }
+}
@@ -0,0 +1,428 @@
+/**
+  ******************************************************************************
+  * @file    sdr_decim.c
+  * @author
+  * @version
+  * @date
+  * @brief   Multistage decimator: half-band cascade and polyphase FIR
+  ******************************************************************************
+  * @attention
+  *
+  * See sdr_decim.h
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <math.h>
+#include <string.h>
+#include "sdr_decim.h"
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+
+/* Half-band, Blackman windowed sinc. Taps at odd distances from the
+ * center, the even ones are 0 and the center is 0.5 */
+static const int32_t SDR_DECIM_HB[4] = { 9920, -2190, 538, -76 };
+
+/* Private function prototypes -----------------------------------------------*/
+static void SDR_decim_design(SDR_DecimTypeDef *d);
+
+static void SDR_decim_halfband(const int16_t *x, int16_t *y, uint32_t n);
+
+static inline int16_t SDR_decim_dot(const int16_t *x, const int16_t *h, uint32_t taps, uint32_t shift);
+
+static uint32_t SDR_decim_block(SDR_DecimTypeDef *d, int16_t *out);
+
+static void SDR_decim_account(SDR_DecimTypeDef *d, uint32_t cycles, uint32_t samples);
+
+/* Private functions ---------------------------------------------------------*/
+
+static inline int16_t SDR_decim_sat16(int32_t v)
+{
+  if (v > 32767) return 32767;
+  if (v < -32768) return -32768;
+  return (int16_t)v;
+}
+
+/**
+  * @brief  SDR_decim_design
+  *         Channel filter: Blackman windowed sinc, cut at half the
+  *         bandwidth, unity gain at DC.
+  * @param  d: Decimator
+  * @retval None
+  */
+static void SDR_decim_design(SDR_DecimTypeDef *d)
+{
+  float fc = (float)d->bandwidth / (2.0f * (float)d->outRate * (float)d->factor);
+  float m = (float)(d->taps - 1);
+  float t, w, sum = 0.0f;
+  uint32_t n;
+
+  /* Float first in the fir buffer, it is cleared afterwards */
+  float *h = (float*) d->fir;
+
+  for (n = 0; n < d->taps; n++) {
+    t = (float)n - m / 2.0f;
+    w = 0.42f - 0.5f * cosf(2.0f * (float)M_PI * (float)n / m) +
+        0.08f * cosf(4.0f * (float)M_PI * (float)n / m);
+
+    if (t == 0.0f) {
+      h[n] = 2.0f * fc * w;
+    } else {
+      h[n] = sinf(2.0f * (float)M_PI * fc * t) / ((float)M_PI * t) * w;
+    }
+
+    sum += h[n];
+  }
+
+  for (n = 0; n < d->taps; n++) {
+    d->coeffs[n] = SDR_decim_sat16((int32_t)lrintf(h[n] / sum * 32768.0f));
+  }
+}
+
+/**
+  * @brief  SDR_decim_halfband
+  *         Half-band by 2 of one channel.
+  * @param  x: SDR_DECIM_HB_HIST + n samples, the history first
+  * @param  y: n / 2 samples
+  * @param  n: New samples in x, even
+  * @retval None
+  */
+static void SDR_decim_halfband(const int16_t *x, int16_t *y, uint32_t n)
+{
+  const int16_t *p = &x[SDR_DECIM_HB_HIST / 2];
+  int32_t acc;
+  uint32_t m;
+
+  for (m = 0; m < n / 2; m++, p += 2) {
+    acc = 16384 * (int32_t)p[0] +
+          SDR_DECIM_HB[0] * ((int32_t)p[-1] + p[1]) +
+          SDR_DECIM_HB[1] * ((int32_t)p[-3] + p[3]) +
+          SDR_DECIM_HB[2] * ((int32_t)p[-5] + p[5]) +
+          SDR_DECIM_HB[3] * ((int32_t)p[-7] + p[7]);
+
+    y[m] = SDR_decim_sat16((acc + (1 << 14)) >> 15);
+  }
+}
+
+/**
+  * @brief  SDR_decim_dot
+  *         One output of the channel filter, two taps per __SMLALD.
+  * @param  x: Oldest sample of the span
+  * @param  h: Coefficients
+  * @param  taps: Even
+  * @param  shift: Of the sum, 15 for unity gain
+  * @retval q15 sample
+  */
+static inline int16_t SDR_decim_dot(const int16_t *x, const int16_t *h, uint32_t taps, uint32_t shift)
+{
+  int64_t acc = 0;
+  uint32_t k;
+
+#if defined(__ARM_FEATURE_DSP)
+  uint32_t a, b;
+
+  for (k = 0; k < taps; k += 2) {
+    /* x is not always word aligned, the M7 takes it */
+    memcpy(&a, &x[k], 4);
+    memcpy(&b, &h[k], 4);
+    acc = (int64_t)__SMLALD(a, b, (uint64_t)acc);
+  }
+#else
+  for (k = 0; k < taps; k++) {
+    acc += (int32_t)x[k] * h[k];
+  }
+#endif
+
+  return SDR_decim_sat16((int32_t)((acc + (1 << (shift - 1))) >> shift));
+}
+
+/**
+  * @brief  SDR_decim_block
+  *         Run one block through all the stages.
+  * @param  d: Decimator
+  * @param  out: Interleaved output, can be d->block
+  * @retval Output samples
+  */
+static uint32_t SDR_decim_block(SDR_DecimTypeDef *d, int16_t *out)
+{
+  uint32_t n = SDR_DECIM_BLOCK;
+  uint32_t hist = d->taps - 1;
+  uint32_t count = 0;
+  uint32_t k, p, s, c;
+  uint8_t ping = 0;
+  int16_t *dst[2];
+
+  /* The channel filter takes back the headroom of the mixer */
+  uint32_t shift = (d->nco.freq != 0) ? (15 - SDR_NCO_HEADROOM) : 15;
+
+  /* Planar into the first stage */
+  if (d->halfbands > 0) {
+    dst[0] = &(d->hb[0][0][SDR_DECIM_HB_HIST]);
+    dst[1] = &(d->hb[0][1][SDR_DECIM_HB_HIST]);
+  } else {
+    dst[0] = &(d->fir[0][hist]);
+    dst[1] = &(d->fir[1][hist]);
+  }
+
+  for (k = 0; k < n; k++) {
+    dst[0][k] = d->block[2 * k];
+    dst[1][k] = d->block[2 * k + 1];
+  }
+
+  for (s = 0; s < d->halfbands; s++) {
+    for (c = 0; c < 2; c++) {
+      memcpy(d->hb[ping][c], d->hbHist[s][c], sizeof(d->hbHist[s][c]));
+      memcpy(d->hbHist[s][c], &(d->hb[ping][c][n]), sizeof(d->hbHist[s][c]));
+
+      if (s == d->halfbands - 1) {
+        dst[c] = &(d->fir[c][hist]);
+      } else {
+        dst[c] = &(d->hb[ping ^ 1][c][SDR_DECIM_HB_HIST]);
+      }
+
+      SDR_decim_halfband(d->hb[ping][c], dst[c], n);
+    }
+
+    n /= 2;
+    ping ^= 1;
+  }
+
+  /* Only the outputs that are kept */
+  for (p = d->phase; p < n; p += d->factor) {
+    out[2 * count] = SDR_decim_dot(&(d->fir[0][p]), d->coeffs, d->taps, shift);
+    out[2 * count + 1] = SDR_decim_dot(&(d->fir[1][p]), d->coeffs, d->taps, shift);
+    count++;
+  }
+
+  d->phase = p - n;
+
+  for (c = 0; c < 2; c++) {
+    memmove(d->fir[c], &(d->fir[c][n]), hist * sizeof(int16_t));
+  }
+
+  return count;
+}
+
+/**
+  * @brief  SDR_decim_account
+  * @param  d: Decimator
+  * @param  cycles: Spent in a process call
+  * @param  samples: Input samples of the call
+  * @retval None
+  */
+static void SDR_decim_account(SDR_DecimTypeDef *d, uint32_t cycles, uint32_t samples)
+{
+  float cps;
+
+  if (samples == 0) return;
+
+  cps = (float)cycles / (float)samples;
+
+  if (d->cyclesPerSample == 0.0f) {
+    d->cyclesPerSample = cps;
+  } else {
+    d->cyclesPerSample += (cps - d->cyclesPerSample) * 0.125f;
+  }
+}
+
+/**
+  * @brief  SDR_decim_init
+  *         Pick the stages for inRate / outRate and design the channel
+  *         filter.
+  * @param  d: Decimator
+  * @param  inRate: Hz
+  * @param  outRate: Hz, inRate must be a multiple of it
+  * @param  bandwidth: Hz, passband of the channel, 0 for 80% of outRate
+  * @retval USBH_OK, or USBH_FAIL if the factor is not an integer or the
+  *         channel filter does not fit SDR_DECIM_TAPS_MAX
+  */
+USBH_StatusTypeDef SDR_decim_init(SDR_DecimTypeDef *d, uint32_t inRate,
+                                  uint32_t outRate, uint32_t bandwidth)
+{
+  uint32_t r;
+  uint8_t hb = 0;
+
+  if ((outRate == 0) || (inRate < outRate) || (inRate % outRate)) return USBH_FAIL;
+
+  r = inRate / outRate;
+
+  while ((r % 2 == 0) && (r >= 4) && (hb < SDR_DECIM_HB_MAX)) {
+    r /= 2;
+    hb++;
+  }
+
+  if (((r < 2) ? 2 : r) * SDR_DECIM_TAPS_PER_PHASE > SDR_DECIM_TAPS_MAX) return USBH_FAIL;
+
+  if ((bandwidth == 0) || (bandwidth > outRate)) bandwidth = outRate / 5 * 4;
+
+  d->inRate = inRate;
+  d->outRate = outRate;
+  d->bandwidth = bandwidth;
+  d->decimation = inRate / outRate;
+  d->halfbands = hb;
+  d->factor = (uint16_t)r;
+  d->taps = (uint16_t)(((r < 2) ? 2 : r) * SDR_DECIM_TAPS_PER_PHASE);
+
+  SDR_nco_init(&(d->nco), inRate, 0);
+  SDR_decim_design(d);
+  SDR_decim_reset(d);
+
+  d->cyclesPerSample = 0.0f;
+  SDR_cycles_init();
+
+  return USBH_OK;
+}
+
+/**
+  * @brief  SDR_decim_reset
+  *         Clear the filter states, after a retune or a gap in the stream.
+  * @param  d: Decimator
+  * @retval None
+  */
+void SDR_decim_reset(SDR_DecimTypeDef *d)
+{
+  memset(d->hbHist, 0, sizeof(d->hbHist));
+  memset(d->fir, 0, sizeof(d->fir));
+
+  SDR_iq_init(&(d->iq), SDR_IQ_DC_SHIFT);
+
+  d->fill = 0;
+  d->phase = d->factor - 1;
+}
+
+/**
+  * @brief  SDR_decim_set_shift
+  *         Move a channel of the input to DC before the filters, the
+  *         tuner stays where it is.
+  * @param  d: Decimator, initialized
+  * @param  freq: Hz from the center of the input to the channel, 0 for
+  *         none
+  * @retval USBH_OK, or USBH_FAIL if the channel is out of the input band
+  */
+USBH_StatusTypeDef SDR_decim_set_shift(SDR_DecimTypeDef *d, int32_t freq)
+{
+  if ((freq >= (int32_t)(d->inRate / 2)) || (freq <= -(int32_t)(d->inRate / 2))) {
+    return USBH_FAIL;
+  }
+
+  SDR_nco_set_freq(&(d->nco), freq);
+
+  return USBH_OK;
+}
+
+/**
+  * @brief  SDR_decim_process
+  * @param  d: Decimator
+  * @param  in: Interleaved q15 I/Q
+  * @param  samples: IQ samples in in
+  * @param  out: Interleaved q15 I/Q, room for SDR_DECIM_OUT_MAX
+  * @retval Output samples
+  */
+uint32_t SDR_decim_process(SDR_DecimTypeDef *d, const int16_t *in, uint32_t samples, int16_t *out)
+{
+  uint32_t start = SDR_cycles();
+  uint32_t total = samples;
+  uint32_t count = 0;
+  uint32_t n;
+
+  while (samples > 0) {
+    n = SDR_DECIM_BLOCK - d->fill;
+    if (n > samples) n = samples;
+
+    memcpy(&(d->block[2 * d->fill]), in, n * 2 * sizeof(int16_t));
+    if (d->nco.freq != 0) SDR_nco_mix_q15(&(d->nco), &(d->block[2 * d->fill]), n);
+    d->fill += n;
+    in += 2 * n;
+    samples -= n;
+
+    if (d->fill == SDR_DECIM_BLOCK) {
+      count += SDR_decim_block(d, &out[2 * count]);
+      d->fill = 0;
+    }
+  }
+
+  SDR_decim_account(d, SDR_cycles() - start, total);
+
+  return count;
+}
+
+/**
+  * @brief  SDR_decim_process_u8
+  *         Same as SDR_decim_process for the bytes of a ring slot, they are
+  *         converted with the DC removal of SDR_iq.
+  * @param  d: Decimator
+  * @param  in: Interleaved offset binary I/Q bytes, 4 byte aligned
+  * @param  samples: IQ samples in in, even to keep in aligned
+  * @param  out: Interleaved q15 I/Q, room for SDR_DECIM_OUT_MAX
+  * @retval Output samples
+  */
+uint32_t SDR_decim_process_u8(SDR_DecimTypeDef *d, const uint8_t *in, uint32_t samples, int16_t *out)
+{
+  uint32_t start = SDR_cycles();
+  uint32_t total = samples;
+  uint32_t count = 0;
+  uint32_t n;
+
+  while (samples > 0) {
+    n = SDR_DECIM_BLOCK - d->fill;
+    if (n > samples) n = samples;
+
+    SDR_iq_to_q15(&(d->iq), in, &(d->block[2 * d->fill]), n);
+    if (d->nco.freq != 0) SDR_nco_mix_q15(&(d->nco), &(d->block[2 * d->fill]), n);
+    d->fill += n;
+    in += 2 * n;
+    samples -= n;
+
+    if (d->fill == SDR_DECIM_BLOCK) {
+      count += SDR_decim_block(d, &out[2 * count]);
+      d->fill = 0;
+    }
+  }
+
+  SDR_decim_account(d, SDR_cycles() - start, total);
+
+  return count;
+}
+
+/**
+  * @brief  SDR_decim_benchmark
+  *         Time the stages alone on whole blocks, with the shift when it is
+  *         on. The conversion from bytes is not included. The states are
+  *         cleared afterwards.
+  * @param  d: Decimator, initialized
+  * @param  samples: Input samples to run, rounded up to blocks
+  * @retval Cycles per input sample
+  */
+float SDR_decim_benchmark(SDR_DecimTypeDef *d, uint32_t samples)
+{
+  uint32_t blocks = (samples + SDR_DECIM_BLOCK - 1) / SDR_DECIM_BLOCK;
+  uint32_t start, cycles;
+  uint32_t n;
+
+  if (blocks == 0) blocks = 1;
+
+  SDR_decim_reset(d);
+
+  /* Timing does not depend on the data, a tone keeps it realistic */
+  for (n = 0; n < SDR_DECIM_BLOCK; n++) {
+    d->block[2 * n] = (int16_t)(8192.0f * cosf(0.1f * (float)n));
+    d->block[2 * n + 1] = (int16_t)(8192.0f * sinf(0.1f * (float)n));
+  }
+
+  start = SDR_cycles();
+
+  for (n = 0; n < blocks; n++) {
+    if (d->nco.freq != 0) SDR_nco_mix_q15(&(d->nco), d->block, SDR_DECIM_BLOCK);
+    SDR_decim_block(d, d->block);
+  }
+
+  cycles = SDR_cycles() - start;
+
+  SDR_decim_reset(d);
+
+  return (float)cycles / (float)(blocks * SDR_DECIM_BLOCK);
+}
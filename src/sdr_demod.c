@@ -0,0 +1,797 @@
+/**
+  ******************************************************************************
+  * @file    sdr_demod.c
+  * @author
+  * @version
+  * @date
+  * @brief   Narrowband demodulators: AM, USB, LSB, CW and NBFM
+  ******************************************************************************
+  * @attention
+  *
+  * See sdr_demod.h
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <math.h>
+#include <string.h>
+#include "sdr_demod.h"
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+
+/* Blocks of the sink answered by one call, the rest are dropped */
+#define SDR_DEMOD_CATCHUP_MAX      4
+
+/* Audio level, full scale is 1 */
+#define SDR_DEMOD_LEVEL            0.5f
+
+/* AM carrier average, 0.2 s. The first SDR_DEMOD_AM_SETTLE samples are
+ * a plain mean and give no output */
+#define SDR_DEMOD_AM_ALPHA         (1.0f / (0.2f * SDR_DEMOD_IF_RATE))
+#define SDR_DEMOD_AM_SETTLE        ((uint32_t)(0.2f * SDR_DEMOD_IF_RATE))
+
+/* AGC: 1 ms attack, 0.5 s decay, up to 60 dB of gain */
+#define SDR_DEMOD_AGC_ATTACK       (1.0f / (0.001f * SDR_DEMOD_IF_RATE))
+#define SDR_DEMOD_AGC_DECAY        (1.0f / (0.5f * SDR_DEMOD_IF_RATE))
+#define SDR_DEMOD_AGC_GAIN_MAX     1000.0f
+
+/* Interpolator cut, between the audio and its image at 24 kHz */
+#define SDR_DEMOD_INTERP_CUTOFF    10500
+
+/* History of the interpolator, per phase */
+#define SDR_DEMOD_INTERP_HIST      (SDR_DEMOD_INTERP_TAPS / 2 - 1)
+
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+/* Private function prototypes -----------------------------------------------*/
+static void SDR_demod_osc_init(SDR_DemodOscTypeDef *osc, float freq);
+
+static void SDR_demod_osc_norm(SDR_DemodOscTypeDef *osc);
+
+static void SDR_demod_design(SDR_DemodTypeDef *demod);
+
+static void SDR_demod_interp_design(SDR_DemodTypeDef *demod);
+
+static void SDR_demod_channel(SDR_DemodTypeDef *demod, uint32_t samples);
+
+static void SDR_demod_agc(SDR_DemodTypeDef *demod, uint32_t samples);
+
+static uint32_t SDR_demod_interpolate(SDR_DemodTypeDef *demod, uint32_t samples);
+
+static uint32_t SDR_demod_chain(SDR_DemodTypeDef *demod, uint32_t samples);
+
+static void SDR_demod_stats(SDR_DemodTypeDef *demod, uint32_t busy, uint32_t samples);
+
+static void SDR_demod_am_init(SDR_DemodTypeDef *demod);
+
+static void SDR_demod_am_detect(SDR_DemodTypeDef *demod, uint32_t samples);
+
+static void SDR_demod_ssb_init(SDR_DemodTypeDef *demod);
+
+static void SDR_demod_cw_init(SDR_DemodTypeDef *demod);
+
+static void SDR_demod_ssb_detect(SDR_DemodTypeDef *demod, uint32_t samples);
+
+static void SDR_demod_nbfm_init(SDR_DemodTypeDef *demod);
+
+static void SDR_demod_nbfm_detect(SDR_DemodTypeDef *demod, uint32_t samples);
+
+/* Exported variables --------------------------------------------------------*/
+
+/* Envelope of a 10 kHz channel, the carrier sets the gain */
+const SDR_DemodModeTypeDef SDR_Demod_AM =
+{
+  "AM",
+  10000,
+  0,
+  128,
+  0,
+  0,
+  SDR_demod_am_init,
+  SDR_demod_am_detect,
+};
+
+/* 300 to 3000 Hz above the carrier */
+const SDR_DemodModeTypeDef SDR_Demod_USB =
+{
+  "USB",
+  2700,
+  1650,
+  256,
+  SDR_IQ_DC_SHIFT,
+  1,
+  SDR_demod_ssb_init,
+  SDR_demod_ssb_detect,
+};
+
+/* 300 to 3000 Hz below the carrier */
+const SDR_DemodModeTypeDef SDR_Demod_LSB =
+{
+  "LSB",
+  2700,
+  -1650,
+  256,
+  SDR_IQ_DC_SHIFT,
+  1,
+  SDR_demod_ssb_init,
+  SDR_demod_ssb_detect,
+};
+
+/* 500 Hz around the carrier */
+const SDR_DemodModeTypeDef SDR_Demod_CW =
+{
+  "CW",
+  500,
+  0,
+  256,
+  0,
+  1,
+  SDR_demod_cw_init,
+  SDR_demod_ssb_detect,
+};
+
+/* 12.5 kHz channels, 5 kHz deviation */
+const SDR_DemodModeTypeDef SDR_Demod_NBFM =
+{
+  "NBFM",
+  12000,
+  0,
+  96,
+  0,
+  0,
+  SDR_demod_nbfm_init,
+  SDR_demod_nbfm_detect,
+};
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  SDR_demod_osc_init
+  * @param  osc: Oscillator
+  * @param  freq: Hz at SDR_DEMOD_IF_RATE, can be negative
+  * @retval None
+  */
+static void SDR_demod_osc_init(SDR_DemodOscTypeDef *osc, float freq)
+{
+  float w = 2.0f * (float)M_PI * freq / (float)SDR_DEMOD_IF_RATE;
+
+  osc->re = 1.0f;
+  osc->im = 0.0f;
+  osc->stepRe = cosf(w);
+  osc->stepIm = sinf(w);
+}
+
+/**
+  * @brief  SDR_demod_osc_norm
+  *         Bring the phasor back to unit length, the rounding of every turn
+  *         adds up. Once per step is plenty.
+  * @param  osc: Oscillator
+  * @retval None
+  */
+static void SDR_demod_osc_norm(SDR_DemodOscTypeDef *osc)
+{
+  float g = 1.0f / sqrtf(osc->re * osc->re + osc->im * osc->im);
+
+  osc->re *= g;
+  osc->im *= g;
+}
+
+/**
+  * @brief  SDR_demod_design
+  *         Channel filter of the mode: Blackman windowed sinc, cut at half
+  *         the bandwidth, unity gain at DC.
+  * @param  demod: Receiver
+  * @retval None
+  */
+static void SDR_demod_design(SDR_DemodTypeDef *demod)
+{
+  uint32_t taps = demod->mode->taps;
+  float fc = (float)demod->mode->bandwidth / (2.0f * (float)SDR_DEMOD_IF_RATE);
+  float m = (float)(taps - 1);
+  float t, w, sum = 0.0f;
+  uint32_t n;
+
+  for (n = 0; n < taps; n++) {
+    t = (float)n - m / 2.0f;
+    w = 0.42f - 0.5f * cosf(2.0f * (float)M_PI * (float)n / m) +
+        0.08f * cosf(4.0f * (float)M_PI * (float)n / m);
+
+    if (t == 0.0f) {
+      demod->coeffs[n] = 2.0f * fc * w;
+    } else {
+      demod->coeffs[n] = sinf(2.0f * (float)M_PI * fc * t) / ((float)M_PI * t) * w;
+    }
+
+    sum += demod->coeffs[n];
+  }
+
+  for (n = 0; n < taps; n++) {
+    demod->coeffs[n] /= sum;
+  }
+}
+
+/**
+  * @brief  SDR_demod_interp_design
+  *         x2 interpolator: Blackman windowed sinc at SDR_AUDIO_RATE split
+  *         in its two phases, each reversed for the dot product and with
+  *         unity gain at DC.
+  * @param  demod: Receiver
+  * @retval None
+  */
+static void SDR_demod_interp_design(SDR_DemodTypeDef *demod)
+{
+  float fc = (float)SDR_DEMOD_INTERP_CUTOFF / (float)SDR_AUDIO_RATE;
+  float m = (float)(SDR_DEMOD_INTERP_TAPS - 1);
+  float t, w, h, sum[2] = { 0.0f, 0.0f };
+  uint32_t n, p, k;
+
+  for (n = 0; n < SDR_DEMOD_INTERP_TAPS; n++) {
+    t = (float)n - m / 2.0f;
+    w = 0.42f - 0.5f * cosf(2.0f * (float)M_PI * (float)n / m) +
+        0.08f * cosf(4.0f * (float)M_PI * (float)n / m);
+    h = sinf(2.0f * (float)M_PI * fc * t) / ((float)M_PI * t) * w;
+
+    p = n % 2;
+    k = SDR_DEMOD_INTERP_HIST - n / 2;
+    demod->interp[p][k] = h;
+    sum[p] += h;
+  }
+
+  for (p = 0; p < 2; p++) {
+    for (k = 0; k < SDR_DEMOD_INTERP_TAPS / 2; k++) {
+      demod->interp[p][k] /= sum[p];
+    }
+  }
+}
+
+/**
+  * @brief  SDR_demod_channel
+  *         Move the channel of the IF samples in ifBuf to DC and filter it,
+  *         into base.
+  * @param  demod: Receiver
+  * @param  samples: IF samples
+  * @retval None
+  */
+static void SDR_demod_channel(SDR_DemodTypeDef *demod, uint32_t samples)
+{
+  SDR_DemodOscTypeDef *osc = &(demod->osc);
+  uint32_t taps = demod->mode->taps;
+  const float *h = demod->coeffs;
+  const float *pi, *pq;
+  float *xi = &(demod->chan[0][SDR_DEMOD_TAPS_MAX - 1]);
+  float *xq = &(demod->chan[1][SDR_DEMOD_TAPS_MAX - 1]);
+  float i, q, re, accI, accQ;
+  uint32_t k, n;
+
+  if (demod->mode->shift == 0) {
+    for (k = 0; k < samples; k++) {
+      xi[k] = (float)demod->ifBuf[2 * k] * (1.0f / 32768.0f);
+      xq[k] = (float)demod->ifBuf[2 * k + 1] * (1.0f / 32768.0f);
+    }
+  } else {
+    /* x * conj(osc) */
+    for (k = 0; k < samples; k++) {
+      i = (float)demod->ifBuf[2 * k] * (1.0f / 32768.0f);
+      q = (float)demod->ifBuf[2 * k + 1] * (1.0f / 32768.0f);
+
+      xi[k] = i * osc->re + q * osc->im;
+      xq[k] = q * osc->re - i * osc->im;
+
+      re = osc->re * osc->stepRe - osc->im * osc->stepIm;
+      osc->im = osc->re * osc->stepIm + osc->im * osc->stepRe;
+      osc->re = re;
+    }
+
+    SDR_demod_osc_norm(osc);
+  }
+
+  /* The last taps samples before each output */
+  for (k = 0; k < samples; k++) {
+    pi = &(demod->chan[0][SDR_DEMOD_TAPS_MAX - taps + k]);
+    pq = &(demod->chan[1][SDR_DEMOD_TAPS_MAX - taps + k]);
+    accI = 0.0f;
+    accQ = 0.0f;
+
+    for (n = 0; n < taps; n++) {
+      accI += pi[n] * h[n];
+      accQ += pq[n] * h[n];
+    }
+
+    demod->base[0][k] = accI;
+    demod->base[1][k] = accQ;
+  }
+
+  memmove(demod->chan[0], &(demod->chan[0][samples]), (SDR_DEMOD_TAPS_MAX - 1) * sizeof(float));
+  memmove(demod->chan[1], &(demod->chan[1][samples]), (SDR_DEMOD_TAPS_MAX - 1) * sizeof(float));
+}
+
+/**
+  * @brief  SDR_demod_agc
+  *         Level the new audio samples on their peak: fast attack, slow
+  *         decay.
+  * @param  demod: Receiver
+  * @param  samples: New samples in af
+  * @retval None
+  */
+static void SDR_demod_agc(SDR_DemodTypeDef *demod, uint32_t samples)
+{
+  float *af = &(demod->af[SDR_DEMOD_INTERP_HIST]);
+  float peak = demod->peak;
+  float a;
+  uint32_t k;
+
+  for (k = 0; k < samples; k++) {
+    a = fabsf(af[k]);
+
+    if (a > peak) {
+      peak += (a - peak) * SDR_DEMOD_AGC_ATTACK;
+    } else {
+      peak -= peak * SDR_DEMOD_AGC_DECAY;
+    }
+
+    if (peak > SDR_DEMOD_LEVEL / SDR_DEMOD_AGC_GAIN_MAX) {
+      af[k] *= SDR_DEMOD_LEVEL / peak;
+    } else {
+      af[k] *= SDR_DEMOD_AGC_GAIN_MAX;
+    }
+  }
+
+  demod->peak = peak;
+}
+
+/**
+  * @brief  SDR_demod_interpolate
+  *         Audio at SDR_AUDIO_RATE into pcm, two outputs per input.
+  * @param  demod: Receiver
+  * @param  samples: New samples in af
+  * @retval Samples in pcm
+  */
+static uint32_t SDR_demod_interpolate(SDR_DemodTypeDef *demod, uint32_t samples)
+{
+  const float *h0 = demod->interp[0];
+  const float *h1 = demod->interp[1];
+  const float *x;
+  float a, b;
+  uint32_t k, n;
+
+  for (k = 0; k < samples; k++) {
+    x = &(demod->af[k]);
+    a = 0.0f;
+    b = 0.0f;
+
+    for (n = 0; n < SDR_DEMOD_INTERP_TAPS / 2; n++) {
+      a += x[n] * h0[n];
+      b += x[n] * h1[n];
+    }
+
+    demod->pcm[2 * k] = (int16_t)__SSAT((int32_t)lrintf(a * 32767.0f), 16);
+    demod->pcm[2 * k + 1] = (int16_t)__SSAT((int32_t)lrintf(b * 32767.0f), 16);
+  }
+
+  memmove(demod->af, &(demod->af[samples]), SDR_DEMOD_INTERP_HIST * sizeof(float));
+
+  return 2 * samples;
+}
+
+/**
+  * @brief  SDR_demod_chain
+  *         Everything after the decimator, for the IF samples in ifBuf.
+  * @param  demod: Receiver
+  * @param  samples: IF samples
+  * @retval Samples in pcm
+  */
+static uint32_t SDR_demod_chain(SDR_DemodTypeDef *demod, uint32_t samples)
+{
+  SDR_demod_channel(demod, samples);
+  demod->mode->Detect(demod, samples);
+
+  if (demod->mode->agc) SDR_demod_agc(demod, samples);
+
+  return SDR_demod_interpolate(demod, samples);
+}
+
+/**
+  * @brief  SDR_demod_stats
+  *         Account the cycles of the chain, refresh stats once per second.
+  * @param  demod: Receiver
+  * @param  busy: Cycles spent in the chain
+  * @param  samples: Ring samples demodulated
+  * @retval None
+  */
+static void SDR_demod_stats(SDR_DemodTypeDef *demod, uint32_t busy, uint32_t samples)
+{
+  uint32_t elapsed = SDR_cycles() - demod->statStart;
+
+  demod->statBusy += busy;
+  demod->statSamples += samples;
+
+  if (elapsed < SystemCoreClock) return;
+
+  demod->stats.load = (float)demod->statBusy / (float)elapsed;
+
+  if (demod->statSamples > 0) {
+    demod->stats.cyclesPerSample = (float)demod->statBusy / (float)demod->statSamples;
+  }
+
+  demod->statStart += elapsed;
+  demod->statBusy = 0;
+  demod->statSamples = 0;
+}
+
+/**
+  * @brief  SDR_demod_am_init
+  * @param  demod: Receiver
+  * @retval None
+  */
+static void SDR_demod_am_init(SDR_DemodTypeDef *demod)
+{
+  demod->carrier = 0.0f;
+  demod->carrierSamples = 0;
+}
+
+/**
+  * @brief  SDR_demod_am_detect
+  *         Envelope less the carrier, over the carrier: the modulation
+  *         depth at SDR_DEMOD_LEVEL, whatever the signal strength.
+  *         Silent until the carrier average has settled, from 0 the output
+  *         would sit at full scale for most of a time constant.
+  * @param  demod: Receiver
+  * @param  samples: Channel samples in base
+  * @retval None
+  */
+static void SDR_demod_am_detect(SDR_DemodTypeDef *demod, uint32_t samples)
+{
+  float *af = &(demod->af[SDR_DEMOD_INTERP_HIST]);
+  float carrier = demod->carrier;
+  float i, q, env;
+  uint32_t k;
+
+  for (k = 0; k < samples; k++) {
+    i = demod->base[0][k];
+    q = demod->base[1][k];
+    env = sqrtf(i * i + q * q);
+
+    if (demod->carrierSamples < SDR_DEMOD_AM_SETTLE) {
+      demod->carrierSamples++;
+      carrier += (env - carrier) / (float)demod->carrierSamples;
+      af[k] = 0.0f;
+      continue;
+    }
+
+    carrier += (env - carrier) * SDR_DEMOD_AM_ALPHA;
+
+    if (carrier > 1.0e-6f) {
+      af[k] = (env - carrier) * (SDR_DEMOD_LEVEL / carrier);
+    } else {
+      af[k] = 0.0f;
+    }
+  }
+
+  demod->carrier = carrier;
+}
+
+/**
+  * @brief  SDR_demod_ssb_init
+  *         The beat oscillator moves the sideband back where it was.
+  * @param  demod: Receiver
+  * @retval None
+  */
+static void SDR_demod_ssb_init(SDR_DemodTypeDef *demod)
+{
+  SDR_demod_osc_init(&(demod->bfo), (float)demod->mode->shift);
+  demod->peak = 0.0f;
+}
+
+/**
+  * @brief  SDR_demod_cw_init
+  * @param  demod: Receiver
+  * @retval None
+  */
+static void SDR_demod_cw_init(SDR_DemodTypeDef *demod)
+{
+  SDR_demod_osc_init(&(demod->bfo), (float)SDR_DEMOD_CW_BFO);
+  demod->peak = 0.0f;
+}
+
+/**
+  * @brief  SDR_demod_ssb_detect
+  *         Real part of the channel times the beat oscillator, USB, LSB
+  *         and CW.
+  * @param  demod: Receiver
+  * @param  samples: Channel samples in base
+  * @retval None
+  */
+static void SDR_demod_ssb_detect(SDR_DemodTypeDef *demod, uint32_t samples)
+{
+  SDR_DemodOscTypeDef *bfo = &(demod->bfo);
+  float *af = &(demod->af[SDR_DEMOD_INTERP_HIST]);
+  float re;
+  uint32_t k;
+
+  for (k = 0; k < samples; k++) {
+    af[k] = demod->base[0][k] * bfo->re - demod->base[1][k] * bfo->im;
+
+    re = bfo->re * bfo->stepRe - bfo->im * bfo->stepIm;
+    bfo->im = bfo->re * bfo->stepIm + bfo->im * bfo->stepRe;
+    bfo->re = re;
+  }
+
+  SDR_demod_osc_norm(bfo);
+}
+
+/**
+  * @brief  SDR_demod_nbfm_init
+  * @param  demod: Receiver
+  * @retval None
+  */
+static void SDR_demod_nbfm_init(SDR_DemodTypeDef *demod)
+{
+  demod->lastI = 0.0f;
+  demod->lastQ = 0.0f;
+}
+
+/**
+  * @brief  SDR_demod_nbfm_detect
+  *         Phase of x[n] * conj(x[n-1]), SDR_DEMOD_NBFM_DEVIATION at
+  *         SDR_DEMOD_LEVEL. No de-emphasis, the voice channels are flat.
+  * @param  demod: Receiver
+  * @param  samples: Channel samples in base
+  * @retval None
+  */
+static void SDR_demod_nbfm_detect(SDR_DemodTypeDef *demod, uint32_t samples)
+{
+  const float scale = SDR_DEMOD_LEVEL * (float)SDR_DEMOD_IF_RATE /
+                      (2.0f * (float)M_PI * (float)SDR_DEMOD_NBFM_DEVIATION);
+  float *af = &(demod->af[SDR_DEMOD_INTERP_HIST]);
+  float li = demod->lastI;
+  float lq = demod->lastQ;
+  float i, q;
+  uint32_t k;
+
+  for (k = 0; k < samples; k++) {
+    i = demod->base[0][k];
+    q = demod->base[1][k];
+
+    af[k] = SDR_atan2(q * li - i * lq, i * li + q * lq) * scale;
+
+    li = i;
+    lq = q;
+  }
+
+  demod->lastI = li;
+  demod->lastQ = lq;
+}
+
+/**
+  * @brief  SDR_demod_init
+  *         Set up the front end for a ring rate and start in a mode. The
+  *         audio sink must be initialized, its prime is set to the audio of
+  *         one slot.
+  * @param  demod: Receiver
+  * @param  audio: Sink
+  * @param  inRate: Hz, a multiple of SDR_DEMOD_IF_RATE, at least
+  *         SDR_DEMOD_DECIM_MIN times it
+  * @param  mode: SDR_Demod_AM, ...
+  * @retval USBH_OK, or USBH_FAIL if the rate can not be decimated or the
+  *         mode is not valid
+  */
+USBH_StatusTypeDef SDR_demod_init(SDR_DemodTypeDef *demod, SDR_AudioTypeDef *audio,
+                                  uint32_t inRate, const SDR_DemodModeTypeDef *mode)
+{
+  if (inRate < SDR_DEMOD_DECIM_MIN * SDR_DEMOD_IF_RATE) return USBH_FAIL;
+
+  if (SDR_decim_init(&(demod->decim), inRate, SDR_DEMOD_IF_RATE, 0) != USBH_OK) {
+    return USBH_FAIL;
+  }
+
+  demod->mode = NULL;
+  demod->audio = audio;
+  demod->spectrum = NULL;
+  demod->inRate = inRate;
+  demod->offset = 0;
+  demod->blocks = audio->blocks;
+
+  SDR_demod_interp_design(demod);
+
+  if (SDR_demod_set_mode(demod, mode) != USBH_OK) return USBH_FAIL;
+
+  SDR_audio_set_prime(audio, (RTLSDR_RING_SLOT_LENGTH / 2) / (inRate / SDR_AUDIO_RATE) +
+                             4 * SDR_AUDIO_BLOCK);
+
+  memset(&(demod->stats), 0, sizeof(demod->stats));
+  demod->statStart = SDR_cycles();
+  demod->statBusy = 0;
+  demod->statSamples = 0;
+
+  return USBH_OK;
+}
+
+/**
+  * @brief  SDR_demod_set_mode
+  *         Switch the detector and the channel filter, the samples in
+  *         flight are lost.
+  * @param  demod: Receiver, initialized
+  * @param  mode: SDR_Demod_AM, ...
+  * @retval USBH_OK, or USBH_FAIL if the mode is not valid
+  */
+USBH_StatusTypeDef SDR_demod_set_mode(SDR_DemodTypeDef *demod, const SDR_DemodModeTypeDef *mode)
+{
+  if ((mode == NULL) || (mode->taps < 2) || (mode->taps > SDR_DEMOD_TAPS_MAX) ||
+      (mode->bandwidth == 0) || (mode->bandwidth >= SDR_DEMOD_IF_RATE)) {
+    return USBH_FAIL;
+  }
+
+  demod->mode = mode;
+
+  SDR_demod_design(demod);
+  SDR_demod_osc_init(&(demod->osc), (float)mode->shift);
+  SDR_demod_reset(demod);
+
+  return USBH_OK;
+}
+
+/**
+  * @brief  SDR_demod_reset
+  *         Clear the filter and detector states, after a retune or a gap
+  *         in the stream.
+  * @param  demod: Receiver
+  * @retval None
+  */
+void SDR_demod_reset(SDR_DemodTypeDef *demod)
+{
+  SDR_decim_reset(&(demod->decim));
+  SDR_iq_init(&(demod->decim.iq), (demod->decim.nco.freq != 0) ?
+                                  SDR_IQ_DC_SHIFT : demod->mode->dcShift);
+
+  memset(demod->chan, 0, sizeof(demod->chan));
+  memset(demod->af, 0, SDR_DEMOD_INTERP_HIST * sizeof(float));
+
+  demod->osc.re = 1.0f;
+  demod->osc.im = 0.0f;
+
+  demod->mode->Init(demod);
+}
+
+/**
+  * @brief  SDR_demod_set_offset
+  *         Receive the channel at freq from the tuner frequency, the shift
+  *         is done by the decimator: picking a channel of the captured band
+  *         is only DSP.
+  * @param  demod: Receiver
+  * @param  freq: Hz, 0 for the channel on DC
+  * @retval USBH_OK, or USBH_FAIL if freq is out of the captured band
+  */
+USBH_StatusTypeDef SDR_demod_set_offset(SDR_DemodTypeDef *demod, int32_t freq)
+{
+  if (SDR_decim_set_shift(&(demod->decim), freq) != USBH_OK) return USBH_FAIL;
+
+  /* Off DC the spike of the tuner can go, whatever the mode */
+  SDR_iq_init(&(demod->decim.iq), (freq != 0) ? SDR_IQ_DC_SHIFT : demod->mode->dcShift);
+
+  return USBH_OK;
+}
+
+/**
+  * @brief  SDR_demod_process
+  *         Demodulate the slots received, called from the main loop. Runs
+  *         once per block played by the sink.
+  * @param  phost: Host handle
+  * @param  demod: Receiver
+  * @retval None
+  */
+void SDR_demod_process(USBH_HandleTypeDef *phost, SDR_DemodTypeDef *demod)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle =
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+  const RTLSDR_SlotTypeDef *info;
+  uint32_t blocks = demod->audio->blocks;
+  uint32_t budget, taken = 0, busy = 0;
+  uint32_t start, length, n, m;
+  uint8_t *slot;
+  uint8_t restart;
+
+  if (blocks == demod->blocks) return;
+
+  budget = blocks - demod->blocks;
+  if (budget > SDR_DEMOD_CATCHUP_MAX) budget = SDR_DEMOD_CATCHUP_MAX;
+  demod->blocks = blocks;
+
+  /* Twice the samples played (the IF is at half the audio rate), the ring
+   * drains while the sink plays */
+  budget *= SDR_AUDIO_BLOCK * (demod->inRate / SDR_DEMOD_IF_RATE);
+
+  while ((taken < budget) && ((slot = RTLSDR_get_slot(phost, &length)) != NULL)) {
+    info = RTLSDR_get_slot_info(phost);
+
+    restart = (demod->offset == 0) && (info->discontinuity || info->lost);
+    if (restart) SDR_demod_reset(demod);
+
+    /* The exact rate of the dongle, the sink trims the rest */
+    if (demod->offset == 0) {
+      SDR_audio_set_rate(demod->audio,
+                         ((float)RTLSDR_Handle->real_rate +
+                          (float)RTLSDR_Handle->real_rate_frac / 65536.0f) *
+                         (float)SDR_AUDIO_RATE / (float)demod->inRate);
+    }
+
+    while ((demod->offset < length) && (taken < budget)) {
+      n = ((length - demod->offset) / 2) & ~1UL;
+      if (n > SDR_DEMOD_CHUNK) n = SDR_DEMOD_CHUNK;
+
+      if (n == 0) {
+        demod->offset = length;
+        break;
+      }
+
+      start = SDR_cycles();
+      m = SDR_decim_process_u8(&(demod->decim), slot + demod->offset, n, demod->ifBuf);
+      m = SDR_demod_chain(demod, m);
+      busy += SDR_cycles() - start;
+
+      SDR_audio_write(demod->audio, demod->pcm, m);
+
+      if (demod->spectrum != NULL) {
+        SDR_fft_feed(demod->spectrum, slot + demod->offset, 2 * n, restart);
+        restart = 0;
+      }
+
+      demod->offset += 2 * n;
+      taken += n;
+    }
+
+    if (demod->offset >= length) {
+      RTLSDR_release_slot(phost);
+      demod->offset = 0;
+    }
+  }
+
+  SDR_demod_stats(demod, busy, taken);
+}
+
+/**
+  * @brief  SDR_demod_benchmark
+  *         Time the chain of a mode: the decimator on whole blocks, then
+  *         the rest on a test tone. The conversion from bytes and the audio
+  *         sink are not included. The receiver goes back to its mode with
+  *         the states cleared.
+  * @param  demod: Receiver, initialized
+  * @param  mode: SDR_Demod_AM, ...
+  * @retval Share of the CPU at the ring rate, 0 if the mode is not valid
+  */
+float SDR_demod_benchmark(SDR_DemodTypeDef *demod, const SDR_DemodModeTypeDef *mode)
+{
+  const SDR_DemodModeTypeDef *current = demod->mode;
+  uint32_t runs = SDR_DEMOD_IF_RATE / 10 / SDR_DEMOD_IF_MAX + 1;
+  float front, back;
+  uint32_t start, cycles;
+  uint32_t n;
+
+  if (SDR_demod_set_mode(demod, mode) != USBH_OK) return 0.0f;
+
+  /* 0.1 s of the ring */
+  front = SDR_decim_benchmark(&(demod->decim), demod->inRate / 10);
+
+  /* 1 kHz off the carrier, inside every channel */
+  for (n = 0; n < SDR_DEMOD_IF_MAX; n++) {
+    demod->ifBuf[2 * n] = (int16_t)(8192.0f * cosf(2.0f * (float)M_PI * 1000.0f * (float)n /
+                                                   (float)SDR_DEMOD_IF_RATE));
+    demod->ifBuf[2 * n + 1] = (int16_t)(8192.0f * sinf(2.0f * (float)M_PI * 1000.0f * (float)n /
+                                                       (float)SDR_DEMOD_IF_RATE));
+  }
+
+  start = SDR_cycles();
+
+  for (n = 0; n < runs; n++) {
+    SDR_demod_chain(demod, SDR_DEMOD_IF_MAX);
+  }
+
+  cycles = SDR_cycles() - start;
+  back = (float)cycles / (float)(runs * SDR_DEMOD_IF_MAX);
+
+  SDR_demod_set_mode(demod, current);
+
+  return (front * (float)demod->inRate + back * (float)SDR_DEMOD_IF_RATE) /
+         (float)SystemCoreClock;
+}
@@ -0,0 +1,548 @@
+/**
+  ******************************************************************************
+  * @file    sdr_fft.c
+  * @author
+  * @version
+  * @date
+  * @brief   Spectrum engine: windowed FFT, averaging and max hold of the ring
+  ******************************************************************************
+  * @attention
+  *
+  * See sdr_fft.h
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <math.h>
+#include <string.h>
+#include "sdr_fft.h"
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+/* Private function prototypes -----------------------------------------------*/
+static void SDR_fft_twiddle(SDR_FftTypeDef *fft);
+
+static void SDR_fft_cfft_f32(SDR_FftTypeDef *fft);
+
+static void SDR_fft_cfft_q15(SDR_FftTypeDef *fft);
+
+static void SDR_fft_window(SDR_FftTypeDef *fft);
+
+static uint8_t SDR_fft_frame(SDR_FftTypeDef *fft);
+
+static void SDR_fft_output(SDR_FftTypeDef *fft);
+
+static void SDR_fft_stats(SDR_FftTypeDef *fft, uint32_t busy);
+
+static USBH_StatusTypeDef SDR_fft_take(SDR_FftTypeDef *fft, const uint8_t *bytes,
+                                       uint32_t length, uint32_t *offset);
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  SDR_fft_twiddle
+  *         Fill the twiddle table of the size and format: W^k = cos - j sin
+  *         of 2 pi k / size, k < size / 2.
+  * @param  fft: Engine
+  * @retval None
+  */
+static void SDR_fft_twiddle(SDR_FftTypeDef *fft)
+{
+  uint32_t half = fft->config.size / 2;
+  uint32_t k;
+  float a, c, s;
+
+  for (k = 0; k < half; k++) {
+    a = 2.0f * (float)M_PI * (float)k / (float)fft->config.size;
+    c = cosf(a);
+    s = sinf(a);
+
+    if (fft->config.format == SDR_FFT_Q15) {
+      fft->twiddle.q15[2 * k] = (int16_t)__SSAT((int32_t)lrintf(c * 32768.0f), 16);
+      fft->twiddle.q15[2 * k + 1] = (int16_t)__SSAT((int32_t)lrintf(-s * 32768.0f), 16);
+    } else {
+      fft->twiddle.f32[2 * k] = c;
+      fft->twiddle.f32[2 * k + 1] = -s;
+    }
+  }
+}
+
+/**
+  * @brief  SDR_fft_cfft_f32
+  *         Forward complex FFT of work.f32 in place, radix 2 decimation in
+  *         time: bit reversed order first, then log2(size) butterfly stages.
+  * @param  fft: Engine
+  * @retval None
+  */
+static void SDR_fft_cfft_f32(SDR_FftTypeDef *fft)
+{
+  float *p = fft->work.f32;
+  const float *w = fft->twiddle.f32;
+  uint32_t size = fft->config.size;
+  uint32_t i, j, m, len, half, step, k, a, b;
+  float wr, wi, tr, ti;
+
+  for (i = 0, j = 0; i < size - 1; i++) {
+    if (i < j) {
+      tr = p[2 * i];
+      ti = p[2 * i + 1];
+      p[2 * i] = p[2 * j];
+      p[2 * i + 1] = p[2 * j + 1];
+      p[2 * j] = tr;
+      p[2 * j + 1] = ti;
+    }
+
+    for (m = size >> 1; j & m; m >>= 1) j ^= m;
+    j |= m;
+  }
+
+  for (len = 2, step = size / 2; len <= size; len <<= 1, step >>= 1) {
+    half = len / 2;
+
+    for (k = 0; k < half; k++) {
+      wr = w[2 * k * step];
+      wi = w[2 * k * step + 1];
+
+      for (a = k; a < size; a += len) {
+        b = a + half;
+        tr = p[2 * b] * wr - p[2 * b + 1] * wi;
+        ti = p[2 * b] * wi + p[2 * b + 1] * wr;
+        p[2 * b] = p[2 * a] - tr;
+        p[2 * b + 1] = p[2 * a + 1] - ti;
+        p[2 * a] += tr;
+        p[2 * a + 1] += ti;
+      }
+    }
+  }
+}
+
+/**
+  * @brief  SDR_fft_cfft_q15
+  *         Same as SDR_fft_cfft_f32 on work.q15, every stage halves its
+  *         output so that it cannot overflow: the result is scaled by
+  *         1 / size.
+  * @param  fft: Engine
+  * @retval None
+  */
+static void SDR_fft_cfft_q15(SDR_FftTypeDef *fft)
+{
+  uint32_t *p32 = (uint32_t*) fft->work.q15;
+  int16_t *p = fft->work.q15;
+  const int16_t *w = fft->twiddle.q15;
+  uint32_t size = fft->config.size;
+  uint32_t i, j, m, len, half, step, k, a, b, t;
+  int32_t wr, wi, tr, ti;
+
+  /* An I/Q pair is one word */
+  for (i = 0, j = 0; i < size - 1; i++) {
+    if (i < j) {
+      t = p32[i];
+      p32[i] = p32[j];
+      p32[j] = t;
+    }
+
+    for (m = size >> 1; j & m; m >>= 1) j ^= m;
+    j |= m;
+  }
+
+  for (len = 2, step = size / 2; len <= size; len <<= 1, step >>= 1) {
+    half = len / 2;
+
+    for (k = 0; k < half; k++) {
+      wr = w[2 * k * step];
+      wi = w[2 * k * step + 1];
+
+      for (a = k; a < size; a += len) {
+        b = a + half;
+        /* |b * w| <= |b|, the products fit 32 bits */
+        tr = (p[2 * b] * wr - p[2 * b + 1] * wi) >> 15;
+        ti = (p[2 * b] * wi + p[2 * b + 1] * wr) >> 15;
+        p[2 * b] = (int16_t)__SSAT((p[2 * a] - tr) >> 1, 16);
+        p[2 * b + 1] = (int16_t)__SSAT((p[2 * a + 1] - ti) >> 1, 16);
+        p[2 * a] = (int16_t)__SSAT((p[2 * a] + tr) >> 1, 16);
+        p[2 * a + 1] = (int16_t)__SSAT((p[2 * a + 1] + ti) >> 1, 16);
+      }
+    }
+  }
+}
+
+/**
+  * @brief  SDR_fft_window
+  *         Fill the window table and the scale of the power: a full scale
+  *         tone in the middle of a bin reads 0 dB whatever the window.
+  * @param  fft: Engine
+  * @retval None
+  */
+static void SDR_fft_window(SDR_FftTypeDef *fft)
+{
+  uint32_t size = fft->config.size;
+  uint32_t n;
+  float a, w, sum = 0.0f;
+
+  for (n = 0; n < size; n++) {
+    a = 2.0f * (float)M_PI * (float)n / (float)size;
+
+    switch (fft->config.window) {
+      case SDR_FFT_WINDOW_HANN:
+        w = 0.5f - 0.5f * cosf(a);
+      break;
+
+      case SDR_FFT_WINDOW_BLACKMAN_HARRIS:
+        w = 0.35875f - 0.48829f * cosf(a) + 0.14128f * cosf(2.0f * a) - 0.01168f * cosf(3.0f * a);
+      break;
+
+      default:
+        w = 1.0f;
+      break;
+    }
+
+    sum += w;
+
+    if (fft->config.format == SDR_FFT_Q15) {
+      fft->window.q15[n] = (int16_t)__SSAT((int32_t)(w * 32768.0f + 0.5f), 16);
+    } else {
+      fft->window.f32[n] = w;
+    }
+  }
+
+  /* SDR_fft_cfft_q15 scales the output down by size, the samples are q15 */
+  if (fft->config.format == SDR_FFT_Q15) {
+    sum = sum * 32768.0f / (float)size;
+  }
+
+  fft->scale = 1.0f / (sum * sum);
+}
+
+/**
+  * @brief  SDR_fft_frame
+  *         Window and transform the frame in work, add its power to the
+  *         average.
+  * @param  fft: Engine
+  * @retval 1 when the average is complete
+  */
+static uint8_t SDR_fft_frame(SDR_FftTypeDef *fft)
+{
+  uint32_t size = fft->config.size;
+  uint32_t n;
+  int32_t i, q;
+  float fi, fq;
+
+  if (fft->config.format == SDR_FFT_Q15) {
+    int16_t *p = fft->work.q15;
+
+    for (n = 0; n < size; n++) {
+      p[2 * n] = (int16_t)(((int32_t)p[2 * n] * fft->window.q15[n]) >> 15);
+      p[2 * n + 1] = (int16_t)(((int32_t)p[2 * n + 1] * fft->window.q15[n]) >> 15);
+    }
+
+    SDR_fft_cfft_q15(fft);
+
+    /* |X|^2 of a q15 pair does not fit q15, keep it in 32 bits */
+    for (n = 0; n < size; n++) {
+      i = p[2 * n];
+      q = p[2 * n + 1];
+      fft->power[n] += (float)((uint32_t)(i * i) + (uint32_t)(q * q));
+    }
+  } else {
+    float *p = fft->work.f32;
+
+    for (n = 0; n < size; n++) {
+      p[2 * n] *= fft->window.f32[n];
+      p[2 * n + 1] *= fft->window.f32[n];
+    }
+
+    SDR_fft_cfft_f32(fft);
+
+    for (n = 0; n < size; n++) {
+      fi = p[2 * n];
+      fq = p[2 * n + 1];
+      fft->power[n] += fi * fi + fq * fq;
+    }
+  }
+
+  fft->frames++;
+  fft->statFrames++;
+  fft->averaged++;
+
+  return (fft->averaged >= fft->config.average);
+}
+
+/**
+  * @brief  SDR_fft_output
+  *         Averaged power to dB, with the negative frequencies first so that
+  *         DC lands on bin size / 2. Updates the max hold.
+  * @param  fft: Engine
+  * @retval None
+  */
+static void SDR_fft_output(SDR_FftTypeDef *fft)
+{
+  uint32_t size = fft->config.size;
+  uint32_t half = size / 2;
+  uint32_t n, b;
+  float scale = fft->scale / (float)fft->averaged;
+  float p, db;
+
+  for (n = 0; n < size; n++) {
+    p = fft->power[n] * scale;
+    db = (p > 0.0f) ? 10.0f * log10f(p) : SDR_FFT_DB_FLOOR;
+    if (db < SDR_FFT_DB_FLOOR) db = SDR_FFT_DB_FLOOR;
+
+    b = (n + half) & (size - 1);
+    fft->db[b] = db;
+    if (db > fft->maxHold[b]) fft->maxHold[b] = db;
+
+    fft->power[n] = 0.0f;
+  }
+
+  fft->averaged = 0;
+  fft->spectra++;
+  fft->statSpectra++;
+}
+
+/**
+  * @brief  SDR_fft_stats
+  *         Account the cycles of one SDR_fft_process call, refresh stats
+  *         once per second.
+  * @param  fft: Engine
+  * @param  busy: Cycles spent in the call
+  * @retval None
+  */
+static void SDR_fft_stats(SDR_FftTypeDef *fft, uint32_t busy)
+{
+  uint32_t elapsed = SDR_cycles() - fft->statStart;
+  float seconds;
+
+  fft->statBusy += busy;
+
+  if (elapsed < SystemCoreClock) return;
+
+  seconds = (float)elapsed / (float)SystemCoreClock;
+
+  fft->stats.fps = (float)fft->statSpectra / seconds;
+  fft->stats.frameRate = (float)fft->statFrames / seconds;
+  fft->stats.load = (float)fft->statBusy / (float)elapsed;
+
+  /* Frames the busy cycles would give in a whole second, each one worth
+   * an interval of samples */
+  if (fft->statBusy > 0) {
+    fft->stats.capacity = (float)fft->statFrames * (float)fft->config.interval *
+                          (float)SystemCoreClock / (float)fft->statBusy;
+  }
+
+  fft->statStart += elapsed;
+  fft->statBusy = 0;
+  fft->statFrames = 0;
+  fft->statSpectra = 0;
+}
+
+/**
+  * @brief  SDR_fft_take
+  *         Build frames from the bytes after offset, up to the end or the
+  *         first spectrum.
+  * @param  fft: Engine
+  * @param  bytes: Interleaved offset binary I/Q, 4 byte aligned
+  * @param  length: Bytes
+  * @param  offset: Bytes already used, advanced
+  * @retval USBH_OK when db[] holds a new spectrum, USBH_BUSY otherwise
+  */
+static USBH_StatusTypeDef SDR_fft_take(SDR_FftTypeDef *fft, const uint8_t *bytes,
+                                       uint32_t length, uint32_t *offset)
+{
+  uint32_t n;
+
+  while (*offset < length) {
+    n = (length - *offset) / 2;
+
+    if (fft->skip) {
+      if (n > fft->skip) n = fft->skip;
+      fft->skip -= n;
+      *offset += 2 * n;
+      continue;
+    }
+
+    if (n > fft->config.size - fft->fill) n = fft->config.size - fft->fill;
+
+    if (fft->config.format == SDR_FFT_Q15) {
+      SDR_iq_to_q15(&(fft->iq), bytes + *offset, &(fft->work.q15[2 * fft->fill]), n);
+    } else {
+      SDR_iq_to_f32(&(fft->iq), bytes + *offset, &(fft->work.f32[2 * fft->fill]), n);
+    }
+
+    fft->fill += n;
+    *offset += 2 * n;
+
+    if (fft->fill < fft->config.size) break;
+
+    fft->fill = 0;
+    fft->skip = fft->config.interval - fft->config.size;
+
+    if (SDR_fft_frame(fft)) {
+      SDR_fft_output(fft);
+      return USBH_OK;
+    }
+  }
+
+  return USBH_BUSY;
+}
+
+/**
+  * @brief  SDR_fft_init
+  *         Set up the engine, can be called again to change the settings.
+  * @param  fft: Engine
+  * @param  config: Settings, they are copied
+  * @retval USBH_OK, or USBH_FAIL if the settings are not valid
+  */
+USBH_StatusTypeDef SDR_fft_init(SDR_FftTypeDef *fft, const SDR_FftConfigTypeDef *config)
+{
+  uint32_t n;
+
+  if ((config->format != SDR_FFT_F32) && (config->format != SDR_FFT_Q15)) return USBH_FAIL;
+
+  /* A power of 2 in range */
+  if ((config->size < SDR_FFT_SIZE_MIN) || (config->size > SDR_FFT_SIZE_MAX) ||
+      (config->size & (config->size - 1))) return USBH_FAIL;
+
+  fft->config = *config;
+  if (fft->config.average == 0) fft->config.average = 1;
+  if (fft->config.interval < fft->config.size) fft->config.interval = fft->config.size;
+
+  /* Frames start on a word of the slot, see SDR_iq */
+  fft->config.interval &= ~1UL;
+
+  SDR_fft_twiddle(fft);
+  SDR_fft_window(fft);
+  SDR_iq_init(&(fft->iq), SDR_IQ_DC_SHIFT);
+
+  fft->fill = 0;
+  fft->skip = 0;
+  fft->offset = 0;
+  fft->averaged = 0;
+  fft->frames = 0;
+  fft->spectra = 0;
+
+  for (n = 0; n < fft->config.size; n++) {
+    fft->power[n] = 0.0f;
+    fft->db[n] = SDR_FFT_DB_FLOOR;
+  }
+
+  SDR_fft_reset_max(fft);
+
+  SDR_cycles_init();
+
+  memset(&(fft->stats), 0, sizeof(fft->stats));
+  fft->statStart = SDR_cycles();
+  fft->statBusy = 0;
+  fft->statFrames = 0;
+  fft->statSpectra = 0;
+
+  return USBH_OK;
+}
+
+/**
+  * @brief  SDR_fft_process
+  *         Run the engine over the slots received, called from the main
+  *         loop. Returns as soon as a spectrum is ready, the rest of the
+  *         slot is used on the next call.
+  * @param  phost: Host handle
+  * @param  fft: Engine
+  * @retval USBH_OK when db[] holds a new spectrum, USBH_BUSY otherwise
+  */
+USBH_StatusTypeDef SDR_fft_process(USBH_HandleTypeDef *phost, SDR_FftTypeDef *fft)
+{
+  const RTLSDR_SlotTypeDef *info;
+  USBH_StatusTypeDef rStatus = USBH_BUSY;
+  uint32_t start = SDR_cycles();
+  uint8_t *slot;
+  uint32_t length;
+
+  if (phost->gState != HOST_CLASS) return USBH_BUSY;
+
+  while ((slot = RTLSDR_get_slot(phost, &length)) != NULL) {
+    info = RTLSDR_get_slot_info(phost);
+
+    /* A frame must not span a gap in the stream */
+    if ((fft->offset == 0) && (info->discontinuity || info->lost)) {
+      fft->fill = 0;
+      fft->skip = 0;
+    }
+
+    rStatus = SDR_fft_take(fft, slot, length, &(fft->offset));
+
+    if (fft->offset >= length) {
+      RTLSDR_release_slot(phost);
+      fft->offset = 0;
+    }
+
+    if (rStatus == USBH_OK) break;
+  }
+
+  SDR_fft_stats(fft, SDR_cycles() - start);
+
+  return rStatus;
+}
+
+/**
+  * @brief  SDR_fft_feed
+  *         Run the engine over samples taken from the ring by someone
+  *         else, a demodulator, instead of SDR_fft_process. All the bytes
+  *         are used, when more than one spectrum is done db[] holds the
+  *         last one.
+  * @param  fft: Engine
+  * @param  bytes: Interleaved offset binary I/Q, 4 byte aligned
+  * @param  length: Bytes, a multiple of 4
+  * @param  restart: Not contiguous with the previous call, drop the frame
+  *         being built
+  * @retval USBH_OK when db[] holds a new spectrum, USBH_BUSY otherwise
+  */
+USBH_StatusTypeDef SDR_fft_feed(SDR_FftTypeDef *fft, const uint8_t *bytes,
+                                uint32_t length, uint8_t restart)
+{
+  USBH_StatusTypeDef rStatus = USBH_BUSY;
+  uint32_t start = SDR_cycles();
+  uint32_t offset = 0;
+
+  if (restart) {
+    fft->fill = 0;
+    fft->skip = 0;
+  }
+
+  while (offset < length) {
+    if (SDR_fft_take(fft, bytes, length, &offset) == USBH_OK) rStatus = USBH_OK;
+  }
+
+  SDR_fft_stats(fft, SDR_cycles() - start);
+
+  return rStatus;
+}
+
+/**
+  * @brief  SDR_fft_reset_max
+  * @param  fft: Engine
+  * @retval None
+  */
+void SDR_fft_reset_max(SDR_FftTypeDef *fft)
+{
+  uint32_t n;
+
+  for (n = 0; n < fft->config.size; n++) {
+    fft->maxHold[n] = SDR_FFT_DB_FLOOR;
+  }
+}
+
+/**
+  * @brief  SDR_fft_bin_freq
+  * @param  fft: Engine
+  * @param  bin: Index in db[] or maxHold[]
+  * @param  centerFreq: Tuner frequency, Hz
+  * @param  rate: Sample rate, Hz
+  * @retval Frequency at the center of the bin, Hz
+  */
+float SDR_fft_bin_freq(SDR_FftTypeDef *fft, uint16_t bin, uint32_t centerFreq, uint32_t rate)
+{
+  int32_t k = (int32_t)bin - (int32_t)(fft->config.size / 2);
+
+  return (float)centerFreq + (float)k * (float)rate / (float)fft->config.size;
+}
@@ -0,0 +1,274 @@
+/**
+  ******************************************************************************
+  * @file    sdr_iq.c
+  * @author
+  * @version
+  * @date
+  * @brief   IQ sample conversion: offset binary bytes to q15 / f32 complex
+  ******************************************************************************
+  * @attention
+  *
+  * See sdr_iq.h
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include "sdr_iq.h"
+
+#if defined(__ARM_FEATURE_DSP)
+#include "stm32f7xx.h"
+#endif
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+/* Private macro -------------------------------------------------------------*/
+
+/* DC estimate rounded to q15 */
+#define SDR_IQ_DC_Q15(dc)          ((int32_t)(((dc) + (1 << (SDR_IQ_DC_FRAC - 1))) >> SDR_IQ_DC_FRAC))
+
+/* Private variables ---------------------------------------------------------*/
+/* Private function prototypes -----------------------------------------------*/
+static void SDR_iq_dc_update(SDR_IqTypeDef *iq, int32_t sumI, int32_t sumQ, uint32_t samples);
+
+static inline int16_t SDR_iq_sat16(int32_t v);
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  SDR_iq_dc_update
+  *         Move the DC estimate towards the mean of the block just converted.
+  * @param  iq: Converter
+  * @param  sumI: Sum of the signed I bytes of the block
+  * @param  sumQ: Sum of the signed Q bytes of the block
+  * @param  samples: IQ samples in the block
+  * @retval None
+  */
+static void SDR_iq_dc_update(SDR_IqTypeDef *iq, int32_t sumI, int32_t sumQ, uint32_t samples)
+{
+  int64_t meanI, meanQ;
+
+  if ((iq->shift == 0) || (samples == 0)) return;
+
+  /* Bytes to q15 is << 8, plus the fraction bits of the estimate */
+  meanI = ((int64_t)sumI << (8 + SDR_IQ_DC_FRAC)) / (int64_t)samples;
+  meanQ = ((int64_t)sumQ << (8 + SDR_IQ_DC_FRAC)) / (int64_t)samples;
+
+  if (!iq->primed) {
+    iq->dcI = (int32_t)meanI;
+    iq->dcQ = (int32_t)meanQ;
+    iq->primed = 1;
+    return;
+  }
+
+  iq->dcI += (int32_t)((meanI - iq->dcI) >> iq->shift);
+  iq->dcQ += (int32_t)((meanQ - iq->dcQ) >> iq->shift);
+}
+
+static inline int16_t SDR_iq_sat16(int32_t v)
+{
+  if (v > 32767) return 32767;
+  if (v < -32768) return -32768;
+  return (int16_t)v;
+}
+
+/**
+  * @brief  SDR_iq_init
+  * @param  iq: Converter
+  * @param  shift: Time constant of the DC estimate, 2^shift blocks,
+  *         SDR_IQ_DC_SHIFT is a good start. 0 leaves the DC in.
+  * @retval None
+  */
+void SDR_iq_init(SDR_IqTypeDef *iq, uint8_t shift)
+{
+  iq->dcI = 0;
+  iq->dcQ = 0;
+  iq->shift = shift;
+  iq->primed = 0;
+}
+
+/**
+  * @brief  SDR_iq_to_q15_ref
+  *         Plain C conversion to q15, the reference for SDR_iq_to_q15.
+  * @param  iq: Converter
+  * @param  in: Interleaved offset binary I/Q bytes
+  * @param  out: Interleaved q15 I/Q, 2 * samples values, can be in
+  * @param  samples: IQ samples
+  * @retval None
+  */
+void SDR_iq_to_q15_ref(SDR_IqTypeDef *iq, const uint8_t *in, int16_t *out, uint32_t samples)
+{
+  int32_t dcI = SDR_IQ_DC_Q15(iq->dcI);
+  int32_t dcQ = SDR_IQ_DC_Q15(iq->dcQ);
+  int32_t sumI = 0, sumQ = 0;
+  int32_t i, q;
+  uint32_t n = samples;
+
+  /* Backwards, so that out can overlap in */
+  while (n > 0) {
+    n--;
+    i = (int32_t)in[2 * n] - 128;
+    q = (int32_t)in[2 * n + 1] - 128;
+    sumI += i;
+    sumQ += q;
+    out[2 * n] = SDR_iq_sat16(i * 256 - dcI);
+    out[2 * n + 1] = SDR_iq_sat16(q * 256 - dcQ);
+  }
+
+  SDR_iq_dc_update(iq, sumI, sumQ, samples);
+}
+
+/**
+  * @brief  SDR_iq_to_f32_ref
+  *         Plain C conversion to f32, the reference for SDR_iq_to_f32.
+  * @param  iq: Converter
+  * @param  in: Interleaved offset binary I/Q bytes
+  * @param  out: Interleaved I/Q, 2 * samples values, full scale is 1.0
+  * @param  samples: IQ samples
+  * @retval None
+  */
+void SDR_iq_to_f32_ref(SDR_IqTypeDef *iq, const uint8_t *in, float *out, uint32_t samples)
+{
+  int32_t dcI = SDR_IQ_DC_Q15(iq->dcI);
+  int32_t dcQ = SDR_IQ_DC_Q15(iq->dcQ);
+  int32_t sumI = 0, sumQ = 0;
+  int32_t i, q;
+  uint32_t n = samples;
+
+  while (n > 0) {
+    n--;
+    i = (int32_t)in[2 * n] - 128;
+    q = (int32_t)in[2 * n + 1] - 128;
+    sumI += i;
+    sumQ += q;
+    out[2 * n] = (float)(i * 256 - dcI) * (1.0f / 32768.0f);
+    out[2 * n + 1] = (float)(q * 256 - dcQ) * (1.0f / 32768.0f);
+  }
+
+  SDR_iq_dc_update(iq, sumI, sumQ, samples);
+}
+
+#if defined(__ARM_FEATURE_DSP)
+
+/**
+  * @brief  SDR_iq_to_q15
+  *         Conversion to q15. Every word in holds I0 Q0 I1 Q1:
+  *
+  *           __SSUB8 by 0x80    signed bytes, same as flipping the sign bit
+  *           __SXTB16           I0 I1 and Q0 Q1 as halfwords, for the DC sums
+  *           mask 0xFF00FF00    bytes into the top of the halfwords, << 8
+  *           __PKHBT / __PKHTB  back into I0 Q0 and I1 Q1
+  *           __QSUB16           DC removal, I and Q in one instruction
+  *
+  *         Sums overflow after 2^24 samples per call.
+  * @param  iq: Converter
+  * @param  in: Interleaved offset binary I/Q bytes, 4 byte aligned
+  * @param  out: Interleaved q15 I/Q, 4 byte aligned, can be in
+  * @param  samples: IQ samples
+  * @retval None
+  */
+void SDR_iq_to_q15(SDR_IqTypeDef *iq, const uint8_t *in, int16_t *out, uint32_t samples)
+{
+  const uint32_t *pIn = (const uint32_t*) in;
+  uint32_t *pOut = (uint32_t*) out;
+  uint32_t dc;
+  uint32_t x, s, lo, hi;
+  int32_t sumI = 0, sumQ = 0;
+  int32_t i, q;
+  uint32_t n = samples >> 1;
+
+  dc = __PKHBT(SDR_IQ_DC_Q15(iq->dcI), SDR_IQ_DC_Q15(iq->dcQ), 16);
+
+  /* Odd sample at the end */
+  if (samples & 1) {
+    i = (int32_t)in[samples * 2 - 2] - 128;
+    q = (int32_t)in[samples * 2 - 1] - 128;
+    sumI += i;
+    sumQ += q;
+    pOut[samples - 1] = __QSUB16(__PKHBT(i * 256, q * 256, 16), dc);
+  }
+
+  while (n > 0) {
+    n--;
+    x = pIn[n];
+
+    s = __SSUB8(x, 0x80808080);
+
+    sumI = __SMLAD(__SXTB16(s), 0x00010001, sumI);
+    sumQ = __SMLAD(__SXTB16(__ROR(s, 8)), 0x00010001, sumQ);
+
+    lo = (s << 8) & 0xFF00FF00;       /* I0, I1 */
+    hi = s & 0xFF00FF00;              /* Q0, Q1 */
+
+    /* I1 Q1 first, it is the word furthest from pIn[n] */
+    pOut[2 * n + 1] = __QSUB16(__PKHTB(hi, lo, 16), dc);
+    pOut[2 * n] = __QSUB16(__PKHBT(lo, hi, 16), dc);
+  }
+
+  SDR_iq_dc_update(iq, sumI, sumQ, samples);
+}
+
+/**
+  * @brief  SDR_iq_to_f32
+  *         Conversion to f32, bytes unpacked as in SDR_iq_to_q15.
+  * @param  iq: Converter
+  * @param  in: Interleaved offset binary I/Q bytes, 4 byte aligned
+  * @param  out: Interleaved I/Q, full scale is 1.0, can be in
+  * @param  samples: IQ samples
+  * @retval None
+  */
+void SDR_iq_to_f32(SDR_IqTypeDef *iq, const uint8_t *in, float *out, uint32_t samples)
+{
+  const uint32_t *pIn = (const uint32_t*) in;
+  int32_t dcI = SDR_IQ_DC_Q15(iq->dcI);
+  int32_t dcQ = SDR_IQ_DC_Q15(iq->dcQ);
+  uint32_t s, ev, od;
+  int32_t sumI = 0, sumQ = 0;
+  int32_t i, q;
+  uint32_t n = samples >> 1;
+  float *p;
+
+  if (samples & 1) {
+    i = (int32_t)in[samples * 2 - 2] - 128;
+    q = (int32_t)in[samples * 2 - 1] - 128;
+    sumI += i;
+    sumQ += q;
+    out[samples * 2 - 2] = (float)(i * 256 - dcI) * (1.0f / 32768.0f);
+    out[samples * 2 - 1] = (float)(q * 256 - dcQ) * (1.0f / 32768.0f);
+  }
+
+  while (n > 0) {
+    n--;
+    s = __SSUB8(pIn[n], 0x80808080);
+
+    ev = __SXTB16(s);                 /* I0, I1 */
+    od = __SXTB16(__ROR(s, 8));       /* Q0, Q1 */
+
+    sumI = __SMLAD(ev, 0x00010001, sumI);
+    sumQ = __SMLAD(od, 0x00010001, sumQ);
+
+    p = &out[4 * n];
+    p[3] = (float)(((int32_t)od >> 16) * 256 - dcQ) * (1.0f / 32768.0f);
+    p[2] = (float)(((int32_t)ev >> 16) * 256 - dcI) * (1.0f / 32768.0f);
+    p[1] = (float)((int16_t)od * 256 - dcQ) * (1.0f / 32768.0f);
+    p[0] = (float)((int16_t)ev * 256 - dcI) * (1.0f / 32768.0f);
+  }
+
+  SDR_iq_dc_update(iq, sumI, sumQ, samples);
+}
+
+#else
+
+/* No DSP extension, the reference does the job */
+
+void SDR_iq_to_q15(SDR_IqTypeDef *iq, const uint8_t *in, int16_t *out, uint32_t samples)
+{
+  SDR_iq_to_q15_ref(iq, in, out, samples);
+}
+
+void SDR_iq_to_f32(SDR_IqTypeDef *iq, const uint8_t *in, float *out, uint32_t samples)
+{
+  SDR_iq_to_f32_ref(iq, in, out, samples);
+}
+
+#endif /* __ARM_FEATURE_DSP */
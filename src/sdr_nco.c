@@ -0,0 +1,130 @@
+/**
+  ******************************************************************************
+  * @file    sdr_nco.c
+  * @author
+  * @version
+  * @date
+  * @brief   Numerically controlled oscillator and mixer
+  ******************************************************************************
+  * @attention
+  *
+  * See sdr_nco.h
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <math.h>
+#include <string.h>
+#include "sdr_nco.h"
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+
+/* cos in the low half, sin in the high half, q15 */
+SDR_DTCM static uint32_t SDR_nco_lut[SDR_NCO_LUT_SIZE];
+
+/* The DTCM is not initialized, this one is */
+static uint8_t SDR_nco_lut_ready = 0;
+
+/* Private function prototypes -----------------------------------------------*/
+static void SDR_nco_lut_fill(void);
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  SDR_nco_lut_fill
+  * @param  None
+  * @retval None
+  */
+static void SDR_nco_lut_fill(void)
+{
+  float w;
+  int16_t c, s;
+  uint32_t n;
+
+  for (n = 0; n < SDR_NCO_LUT_SIZE; n++) {
+    w = 2.0f * (float)M_PI * (float)n / (float)SDR_NCO_LUT_SIZE;
+    c = (int16_t)lrintf(32767.0f * cosf(w));
+    s = (int16_t)lrintf(32767.0f * sinf(w));
+    SDR_nco_lut[n] = (uint16_t)c | ((uint32_t)(uint16_t)s << 16);
+  }
+
+  SDR_nco_lut_ready = 1;
+}
+
+/**
+  * @brief  SDR_nco_init
+  * @param  nco: Oscillator
+  * @param  rate: Hz, of the samples mixed
+  * @param  freq: Hz moved to DC, 0 to leave the samples as they are
+  * @retval None
+  */
+void SDR_nco_init(SDR_NcoTypeDef *nco, uint32_t rate, int32_t freq)
+{
+  if (!SDR_nco_lut_ready) SDR_nco_lut_fill();
+
+  nco->rate = rate;
+  nco->phase = 0;
+  SDR_nco_set_freq(nco, freq);
+}
+
+/**
+  * @brief  SDR_nco_set_freq
+  *         The phase goes on from where it is, there is no step in the
+  *         output.
+  * @param  nco: Oscillator
+  * @param  freq: Hz moved to DC, negative below it
+  * @retval None
+  */
+void SDR_nco_set_freq(SDR_NcoTypeDef *nco, int32_t freq)
+{
+  nco->freq = freq;
+  nco->step = (uint32_t)((int64_t)freq * 4294967296LL / (int64_t)nco->rate);
+}
+
+/**
+  * @brief  SDR_nco_mix_q15
+  *         Multiply by the conjugate of the oscillator, in place. The
+  *         output is scaled by 1 / 2^SDR_NCO_HEADROOM.
+  * @param  nco: Oscillator
+  * @param  iq: Interleaved q15 I/Q, 4 byte aligned
+  * @param  samples: IQ samples in iq
+  * @retval None
+  */
+void SDR_nco_mix_q15(SDR_NcoTypeDef *nco, int16_t *iq, uint32_t samples)
+{
+  uint32_t phase = nco->phase;
+  uint32_t step = nco->step;
+  uint32_t x, w, k;
+  int32_t re, im;
+
+  for (k = 0; k < samples; k++) {
+    memcpy(&x, &iq[2 * k], 4);
+    w = SDR_nco_lut[phase >> (32 - SDR_NCO_LUT_BITS)];
+    phase += step;
+
+    /* (I + jQ) * (c - js), I and c in the low halves */
+#if defined(__ARM_FEATURE_DSP)
+    re = (int32_t)__SMUAD(x, w);
+    im = (int32_t)__SMUSDX(w, x);
+
+    x = __PKHBT((uint32_t)(re >> (15 + SDR_NCO_HEADROOM)),
+                (uint32_t)(im >> (15 + SDR_NCO_HEADROOM)), 16);
+#else
+    re = (int32_t)(int16_t)x * (int16_t)w + (int32_t)(int16_t)(x >> 16) * (int16_t)(w >> 16);
+    im = (int32_t)(int16_t)w * (int16_t)(x >> 16) - (int32_t)(int16_t)(w >> 16) * (int16_t)x;
+
+    re >>= 15 + SDR_NCO_HEADROOM;
+    im >>= 15 + SDR_NCO_HEADROOM;
+
+    x = (uint16_t)re | ((uint32_t)(uint16_t)im << 16);
+#endif
+
+    memcpy(&iq[2 * k], &x, 4);
+  }
+
+  nco->phase = phase;
+}
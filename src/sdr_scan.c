@@ -0,0 +1,364 @@
+/**
+  ******************************************************************************
+  * @file    sdr_scan.c
+  * @author
+  * @version
+  * @date
+  * @brief   Band scanner: retune, settle, capture and measure over a plan
+  ******************************************************************************
+  * @attention
+  *
+  * See sdr_scan.h
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <math.h>
+#include <string.h>
+#include "sdr_scan.h"
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+
+/* Power of a full scale complex tone, in the units of SDR_scan_band_power */
+#define SDR_SCAN_FULL_SCALE        (255.0f * 255.0f)
+
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+/* Private function prototypes -----------------------------------------------*/
+static void SDR_scan_tuned(USBH_HandleTypeDef *phost,
+                           RTLSDR_CtlReqTypeDef *req,
+                           USBH_StatusTypeDef status);
+
+static void SDR_scan_next(SDR_ScanTypeDef *scan);
+
+static void SDR_scan_tune(USBH_HandleTypeDef *phost, SDR_ScanTypeDef *scan);
+
+static void SDR_scan_consume(USBH_HandleTypeDef *phost, SDR_ScanTypeDef *scan);
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  SDR_scan_tuned
+  *         Completion of the retune, runs in USBH_Process. Everything the
+  *         stream holds up to now was sampled at the previous frequency:
+  *         the part of the slot being filled, the URB in flight and the
+  *         backlog of the dongle FIFO. The settling samples go after that.
+  * @param  phost: Host handle
+  * @param  req: Retune request, its context is the scanner
+  * @param  status: USBH_OK if the tuner took the frequency
+  * @retval None
+  */
+static void SDR_scan_tuned(USBH_HandleTypeDef *phost,
+                           RTLSDR_CtlReqTypeDef *req,
+                           USBH_StatusTypeDef status)
+{
+  SDR_ScanTypeDef *scan = (SDR_ScanTypeDef*) req->context;
+  RTLSDR_HandleTypeDef *RTLSDR_Handle =
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+
+  /* Left over from a stopped or restarted scan */
+  if ((scan->state != SDR_SCAN_TUNE) || (req->step.val != scan->tuneFreq)) return;
+
+  scan->tuneSeq = RTLSDR_get_stream_seq(phost);
+  scan->discard = RTLSDR_Handle->ring.fill + RTLSDR_Handle->CommItf.xferLength +
+                  2 * scan->plan.settle;
+
+  if (RTLSDR_Handle->ring.backlog > 0) {
+    scan->discard += RTLSDR_Handle->ring.backlog;
+  }
+
+  scan->tuneStatus = status;
+  scan->tuned = 1;
+}
+
+/**
+  * @brief  SDR_scan_next
+  *         Move to the next step of the plan, or stop after the last one.
+  * @param  scan: Scanner
+  * @retval None
+  */
+static void SDR_scan_next(SDR_ScanTypeDef *scan)
+{
+  scan->index++;
+
+  if (scan->index >= scan->steps) {
+    scan->index = 0;
+
+    if (!(scan->plan.flags & SDR_SCAN_CONTINUOUS)) {
+      scan->state = SDR_SCAN_IDLE;
+      return;
+    }
+  }
+
+  scan->state = SDR_SCAN_TUNE_REQ;
+}
+
+/**
+  * @brief  SDR_scan_tune
+  *         Queue the retune of the current step. When the queue is full
+  *         the state stays SDR_SCAN_TUNE_REQ and the next call tries again.
+  * @param  phost: Host handle
+  * @param  scan: Scanner
+  * @retval None
+  */
+static void SDR_scan_tune(USBH_HandleTypeDef *phost, SDR_ScanTypeDef *scan)
+{
+  USBH_StatusTypeDef uStatus;
+  uint8_t flags;
+
+  flags = (scan->plan.flags & SDR_SCAN_LOCK_CHECK) ? 0 : RTLSDR_FREQ_NO_LOCK_CHECK;
+
+  scan->tuneFreq = SDR_scan_freq(scan, scan->index);
+  scan->tuned = 0;
+
+  uStatus = RTLSDR_ctl_set_freq(phost, scan->tuneFreq, flags, SDR_scan_tuned, scan);
+
+  if (uStatus == USBH_OK) {
+    scan->state = SDR_SCAN_TUNE;
+  } else if (uStatus != USBH_BUSY) {
+    scan->state = SDR_SCAN_IDLE;
+  }
+}
+
+/**
+  * @brief  SDR_scan_consume
+  *         Walk the ring slots received since the retune: drop the first
+  *         discard bytes, then copy the capture. Slots are released as soon
+  *         as they are used, so the bulk pipe never waits for the scanner.
+  * @param  phost: Host handle
+  * @param  scan: Scanner
+  * @retval None
+  */
+static void SDR_scan_consume(USBH_HandleTypeDef *phost, SDR_ScanTypeDef *scan)
+{
+  const RTLSDR_SlotTypeDef *info;
+  uint8_t *slot;
+  uint32_t length;
+  uint32_t need = 2 * scan->plan.samples;
+  uint32_t n;
+
+  while ((slot = RTLSDR_get_slot(phost, &length)) != NULL) {
+    info = RTLSDR_get_slot_info(phost);
+
+    /* Closed before the retune completed */
+    if (info->seq < scan->tuneSeq) {
+      RTLSDR_release_slot(phost);
+      scan->offset = 0;
+      continue;
+    }
+
+    /* Samples were lost, the capture must be contiguous */
+    if ((scan->offset == 0) && (info->discontinuity || info->lost) && scan->captured) {
+      scan->captured = 0;
+    }
+
+    if (scan->discard) {
+      n = length - scan->offset;
+      if (n > scan->discard) n = scan->discard;
+      scan->discard -= n;
+      scan->offset += n;
+    }
+
+    if ((scan->discard == 0) && (scan->offset < length)) {
+      n = length - scan->offset;
+      if (n > need - scan->captured) n = need - scan->captured;
+      memcpy(&(scan->capture[scan->captured]), slot + scan->offset, n);
+      scan->captured += n;
+      scan->offset += n;
+    }
+
+    if ((scan->offset >= length) || (scan->captured >= need)) {
+      RTLSDR_release_slot(phost);
+      scan->offset = 0;
+    }
+
+    if (scan->captured >= need) {
+      /* Queue the next retune now, USBH_Process starts it before the
+       * next call, which measures this capture while it is on the bus */
+      scan->measureIndex = scan->index;
+      scan->measurePending = 1;
+      SDR_scan_next(scan);
+      if (scan->state == SDR_SCAN_TUNE_REQ) SDR_scan_tune(phost, scan);
+      return;
+    }
+  }
+}
+
+/**
+  * @brief  SDR_scan_init
+  * @param  scan: Scanner
+  * @retval None
+  */
+void SDR_scan_init(SDR_ScanTypeDef *scan)
+{
+  memset(&(scan->plan), 0, sizeof(scan->plan));
+  scan->state = SDR_SCAN_IDLE;
+  scan->map = NULL;
+  scan->steps = 0;
+  scan->index = 0;
+  scan->tuneFreq = 0;
+  scan->tuned = 0;
+  scan->measurePending = 0;
+  scan->sweeps = 0;
+  scan->errors = 0;
+}
+
+/**
+  * @brief  SDR_scan_start
+  *         Start a scan. The sample rate set in the dongle is not changed,
+  *         the step would usually be a fraction of it.
+  * @param  scan: Scanner
+  * @param  plan: Frequency plan, it is copied
+  * @param  map: Output, plan bins values per step in dB, full scale is 0
+  * @param  mapLength: Values that fit in map
+  * @retval USBH_OK, or USBH_FAIL if the plan does not fit
+  */
+USBH_StatusTypeDef SDR_scan_start(SDR_ScanTypeDef *scan,
+                                  const SDR_ScanPlanTypeDef *plan,
+                                  float *map,
+                                  uint32_t mapLength)
+{
+  uint32_t steps;
+
+  if ((plan->step == 0) || (plan->stop < plan->start) || (plan->bins == 0) ||
+      (plan->samples == 0) || (plan->samples > SDR_SCAN_CAPTURE_MAX)) {
+    return USBH_FAIL;
+  }
+
+  steps = (plan->stop - plan->start) / plan->step + 1;
+
+  if ((map == NULL) || (steps * plan->bins > mapLength)) return USBH_FAIL;
+
+  scan->plan = *plan;
+  if (scan->plan.measure == NULL) scan->plan.measure = SDR_scan_band_power;
+
+  scan->map = map;
+  scan->steps = steps;
+  scan->index = 0;
+  scan->measurePending = 0;
+  scan->sweeps = 0;
+  scan->errors = 0;
+  scan->state = SDR_SCAN_TUNE_REQ;
+
+  return USBH_OK;
+}
+
+/**
+  * @brief  SDR_scan_stop
+  *         Stop scanning, a retune already queued still completes.
+  * @param  scan: Scanner
+  * @retval None
+  */
+void SDR_scan_stop(SDR_ScanTypeDef *scan)
+{
+  scan->state = SDR_SCAN_IDLE;
+}
+
+/**
+  * @brief  SDR_scan_process
+  *         Run the scanner, called from the main loop.
+  * @param  phost: Host handle
+  * @param  scan: Scanner
+  * @retval USBH_BUSY while scanning, USBH_OK when idle
+  */
+USBH_StatusTypeDef SDR_scan_process(USBH_HandleTypeDef *phost, SDR_ScanTypeDef *scan)
+{
+  uint32_t length;
+
+  /* Measure the previous capture, the retune that followed it was queued
+   * by SDR_scan_consume and USBH_Process has put it on the bus since */
+  if (scan->measurePending) {
+    scan->plan.measure(scan->capture, scan->plan.samples,
+                       &(scan->map[scan->measureIndex * scan->plan.bins]),
+                       scan->plan.bins, scan->plan.context);
+    scan->measurePending = 0;
+
+    if (scan->measureIndex == scan->steps - 1) scan->sweeps++;
+  }
+
+  if (phost->gState != HOST_CLASS) return USBH_BUSY;
+
+  switch (scan->state) {
+    case SDR_SCAN_IDLE:
+      return USBH_OK;
+
+    case SDR_SCAN_TUNE_REQ:
+      SDR_scan_tune(phost, scan);
+    break;
+
+    case SDR_SCAN_TUNE:
+      if (!scan->tuned) {
+        /* Old frequency, keep the ring from overflowing */
+        while (RTLSDR_get_slot(phost, &length) != NULL) {
+          RTLSDR_release_slot(phost);
+        }
+        break;
+      }
+
+      if (scan->tuneStatus != USBH_OK) {
+        scan->errors++;
+        SDR_scan_next(scan);
+        if (scan->state == SDR_SCAN_TUNE_REQ) SDR_scan_tune(phost, scan);
+        break;
+      }
+
+      scan->captured = 0;
+      scan->offset = 0;
+      scan->state = SDR_SCAN_CAPTURE;
+      SDR_scan_consume(phost, scan);
+    break;
+
+    case SDR_SCAN_CAPTURE:
+      SDR_scan_consume(phost, scan);
+    break;
+  }
+
+  return USBH_BUSY;
+}
+
+/**
+  * @brief  SDR_scan_freq
+  * @param  scan: Scanner
+  * @param  index: Step of the plan
+  * @retval Center frequency of the step, Hz
+  */
+uint32_t SDR_scan_freq(SDR_ScanTypeDef *scan, uint32_t index)
+{
+  return scan->plan.start + index * scan->plan.step;
+}
+
+/**
+  * @brief  SDR_scan_band_power
+  *         Default measurement: mean power over the whole captured band,
+  *         the same value goes to every bin.
+  * @param  iq: Interleaved offset binary I/Q bytes
+  * @param  samples: IQ samples
+  * @param  out: Power in dB, a full scale tone is 0
+  * @param  bins: Values to write in out
+  * @param  context: Not used
+  * @retval None
+  */
+void SDR_scan_band_power(const uint8_t *iq, uint32_t samples,
+                         float *out, uint16_t bins, void *context)
+{
+  uint64_t sum = 0;
+  int32_t v;
+  uint32_t n;
+  uint16_t b;
+  float db;
+
+  /* 2 * x - 255 keeps the offset binary samples in integers */
+  for (n = 0; n < 2 * samples; n++) {
+    v = 2 * (int32_t)iq[n] - 255;
+    sum += (uint32_t)(v * v);
+  }
+
+  /* + 1 keeps a silent capture finite */
+  db = 10.0f * log10f((float)(sum + 1) / ((float)samples * SDR_SCAN_FULL_SCALE));
+
+  for (b = 0; b < bins; b++) {
+    out[b] = db;
+  }
+}
@@ -0,0 +1,230 @@
+/**
+  ******************************************************************************
+  * @file    sdr_waterfall.c
+  * @author
+  * @version
+  * @date
+  * @brief   Waterfall display: DMA2D palette lines and LTDC scrolling
+  ******************************************************************************
+  * @attention
+  *
+  * See sdr_waterfall.h
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include "sdr_waterfall.h"
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+
+#define SDR_WATERFALL_LINE_SIZE    (SDR_WATERFALL_WIDTH * 4)
+
+/* DMA2D transfers are a few us, this is only a guard */
+#define SDR_WATERFALL_TIMEOUT      10
+
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+
+/* Palette stops, black -> blue -> cyan -> yellow -> red */
+static const uint32_t SDR_WATERFALL_STOPS[] = {
+  0xFF000000, 0xFF0000FF, 0xFF00FFFF, 0xFFFFFF00, 0xFFFF0000
+};
+
+extern LTDC_HandleTypeDef hLtdcHandler;
+
+/* Private function prototypes -----------------------------------------------*/
+static void SDR_waterfall_palette(SDR_WaterfallTypeDef *wf);
+
+static void SDR_waterfall_columns(SDR_WaterfallTypeDef *wf, uint16_t bins);
+
+static void SDR_waterfall_blit(SDR_WaterfallTypeDef *wf, uint32_t address);
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  SDR_waterfall_palette
+  *         Interpolate the palette between the stops.
+  * @param  wf: Waterfall
+  * @retval None
+  */
+static void SDR_waterfall_palette(SDR_WaterfallTypeDef *wf)
+{
+  uint32_t segments = sizeof(SDR_WATERFALL_STOPS) / sizeof(SDR_WATERFALL_STOPS[0]) - 1;
+  uint32_t n, s, t, a, b;
+  uint32_t c, sh;
+
+  for (n = 0; n < 256; n++) {
+    s = n * segments / 256;
+    t = n * segments - s * 256;      /* 0..255 into the segment */
+    a = SDR_WATERFALL_STOPS[s];
+    b = SDR_WATERFALL_STOPS[s + 1];
+
+    c = 0xFF000000;
+    for (sh = 0; sh < 24; sh += 8) {
+      c |= ((((a >> sh) & 0xFF) * (255 - t) + ((b >> sh) & 0xFF) * t) / 255) << sh;
+    }
+
+    wf->palette[n] = c;
+  }
+
+  /* Read by DMA2D */
+  SCB_CleanDCache_by_Addr(wf->palette, sizeof(wf->palette));
+}
+
+/**
+  * @brief  SDR_waterfall_columns
+  *         Split the bins among the pixel columns.
+  * @param  wf: Waterfall
+  * @param  bins: Bins of the spectra
+  * @retval None
+  */
+static void SDR_waterfall_columns(SDR_WaterfallTypeDef *wf, uint16_t bins)
+{
+  uint32_t x;
+
+  for (x = 0; x <= SDR_WATERFALL_WIDTH; x++) {
+    wf->column[x] = (uint16_t)(x * bins / SDR_WATERFALL_WIDTH);
+  }
+
+  wf->bins = bins;
+}
+
+/**
+  * @brief  SDR_waterfall_blit
+  *         Convert the L8 line to ARGB8888 through the palette.
+  * @param  wf: Waterfall
+  * @param  address: Framebuffer line
+  * @retval None
+  */
+static void SDR_waterfall_blit(SDR_WaterfallTypeDef *wf, uint32_t address)
+{
+  HAL_DMA2D_Start(&(wf->hdma2d), (uint32_t)wf->line, address, SDR_WATERFALL_WIDTH, 1);
+  HAL_DMA2D_PollForTransfer(&(wf->hdma2d), SDR_WATERFALL_TIMEOUT);
+}
+
+/**
+  * @brief  SDR_waterfall_init
+  *         Clear the framebuffer and show it on layer 1. The LCD must be
+  *         initialized.
+  * @param  wf: Waterfall
+  * @param  dbMin: Level of the first color
+  * @param  dbMax: Level of the last color
+  * @retval None
+  */
+void SDR_waterfall_init(SDR_WaterfallTypeDef *wf, float dbMin, float dbMax)
+{
+  wf->hdma2d.Instance = DMA2D;
+  wf->top = 0;
+  wf->lines = 0;
+  wf->bins = 0;
+
+  SDR_waterfall_set_range(wf, dbMin, dbMax);
+  SDR_waterfall_palette(wf);
+
+  /* Both halves to black */
+  wf->hdma2d.Init.Mode = DMA2D_R2M;
+  wf->hdma2d.Init.ColorMode = DMA2D_OUTPUT_ARGB8888;
+  wf->hdma2d.Init.OutputOffset = 0;
+
+  if (HAL_DMA2D_Init(&(wf->hdma2d)) == HAL_OK) {
+    HAL_DMA2D_Start(&(wf->hdma2d), wf->palette[0], SDR_WATERFALL_FB_ADDRESS,
+                    SDR_WATERFALL_WIDTH, 2 * SDR_WATERFALL_HEIGHT);
+    HAL_DMA2D_PollForTransfer(&(wf->hdma2d), SDR_WATERFALL_TIMEOUT);
+  }
+
+  HAL_LTDC_SetAddress(&hLtdcHandler, SDR_WATERFALL_FB_ADDRESS, SDR_WATERFALL_LAYER);
+}
+
+/**
+  * @brief  SDR_waterfall_set_range
+  *         Levels mapped to the palette, the lines already drawn keep their
+  *         colors.
+  * @param  wf: Waterfall
+  * @param  dbMin: Level of the first color
+  * @param  dbMax: Level of the last color
+  * @retval None
+  */
+void SDR_waterfall_set_range(SDR_WaterfallTypeDef *wf, float dbMin, float dbMax)
+{
+  if (dbMax <= dbMin) dbMax = dbMin + 1.0f;
+
+  wf->dbMin = dbMin;
+  wf->dbMax = dbMax;
+  wf->dbScale = 255.0f / (dbMax - dbMin);
+}
+
+/**
+  * @brief  SDR_waterfall_push
+  *         Draw a spectrum as the new top line. When there are more bins
+  *         than columns a column shows its strongest bin, so narrow
+  *         signals do not disappear.
+  * @param  wf: Waterfall
+  * @param  db: Spectrum, DC in the middle, see SDR_fft
+  * @param  bins: Values in db
+  * @retval None
+  */
+void SDR_waterfall_push(SDR_WaterfallTypeDef *wf, const float *db, uint16_t bins)
+{
+  DMA2D_CLUTCfgTypeDef clut;
+  uint32_t x, b, end;
+  uint32_t address;
+  float v, peak;
+
+  if (bins == 0) return;
+  if (bins != wf->bins) SDR_waterfall_columns(wf, bins);
+
+  for (x = 0; x < SDR_WATERFALL_WIDTH; x++) {
+    b = wf->column[x];
+    end = wf->column[x + 1];
+    peak = db[b];
+
+    for (b++; b < end; b++) {
+      if (db[b] > peak) peak = db[b];
+    }
+
+    v = (peak - wf->dbMin) * wf->dbScale;
+    if (v < 0.0f) v = 0.0f;
+    if (v > 255.0f) v = 255.0f;
+
+    wf->line[x] = (uint8_t)v;
+  }
+
+  /* Read by DMA2D */
+  SCB_CleanDCache_by_Addr((uint32_t*) wf->line, sizeof(wf->line));
+
+  /* The BSP reprograms DMA2D between our calls, set it all up again */
+  wf->hdma2d.Init.Mode = DMA2D_M2M_PFC;
+  wf->hdma2d.Init.ColorMode = DMA2D_OUTPUT_ARGB8888;
+  wf->hdma2d.Init.OutputOffset = 0;
+
+  wf->hdma2d.LayerCfg[1].InputColorMode = DMA2D_INPUT_L8;
+  wf->hdma2d.LayerCfg[1].AlphaMode = DMA2D_NO_MODIF_ALPHA;
+  wf->hdma2d.LayerCfg[1].InputAlpha = 0xFF;
+  wf->hdma2d.LayerCfg[1].InputOffset = 0;
+
+  clut.pCLUT = wf->palette;
+  clut.CLUTColorMode = DMA2D_CCM_ARGB8888;
+  clut.Size = 255;
+
+  if ((HAL_DMA2D_Init(&(wf->hdma2d)) != HAL_OK) ||
+      (HAL_DMA2D_ConfigLayer(&(wf->hdma2d), 1) != HAL_OK) ||
+      (HAL_DMA2D_CLUTLoad(&(wf->hdma2d), clut, 1) != HAL_OK) ||
+      (HAL_DMA2D_PollForTransfer(&(wf->hdma2d), SDR_WATERFALL_TIMEOUT) != HAL_OK)) {
+    return;
+  }
+
+  /* One line up in the framebuffer is one line down on the screen */
+  wf->top = (wf->top == 0) ? (SDR_WATERFALL_HEIGHT - 1) : (wf->top - 1);
+
+  address = SDR_WATERFALL_FB_ADDRESS + wf->top * SDR_WATERFALL_LINE_SIZE;
+  SDR_waterfall_blit(wf, address);
+  SDR_waterfall_blit(wf, address + SDR_WATERFALL_HEIGHT * SDR_WATERFALL_LINE_SIZE);
+
+  /* Taken by LTDC in the next vertical blanking */
+  HAL_LTDC_SetAddress_NoReload(&hLtdcHandler, address, SDR_WATERFALL_LAYER);
+  hLtdcHandler.Instance->SRCR = LTDC_SRCR_VBR;
+
+  wf->lines++;
+}
@@ -0,0 +1,375 @@
+/**
+  ******************************************************************************
+  * @file    sdr_wbfm.c
+  * @author
+  * @version
+  * @date
+  * @brief   Wideband FM broadcast receiver: discriminator, de-emphasis, audio
+  ******************************************************************************
+  * @attention
+  *
+  * See sdr_wbfm.h
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <math.h>
+#include <string.h>
+#include "sdr_wbfm.h"
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+
+/* Blocks of the sink answered by one call, the rest are dropped */
+#define SDR_WBFM_CATCHUP_MAX       4
+
+/* Full deviation to q15, some headroom for the overshoot of the filters */
+#define SDR_WBFM_PCM_SCALE         (0.8f * 32767.0f)
+
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+/* Private function prototypes -----------------------------------------------*/
+static void SDR_wbfm_design(SDR_WbfmTypeDef *wbfm);
+
+static void SDR_wbfm_demod(SDR_WbfmTypeDef *wbfm, uint32_t samples);
+
+static uint32_t SDR_wbfm_audio(SDR_WbfmTypeDef *wbfm, uint32_t samples);
+
+static void SDR_wbfm_latency(SDR_WbfmTypeDef *wbfm, const RTLSDR_SlotTypeDef *info, uint32_t length);
+
+static void SDR_wbfm_stats(SDR_WbfmTypeDef *wbfm, uint32_t busy, uint32_t samples);
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  SDR_wbfm_design
+  *         Audio low-pass: Blackman windowed sinc, unity gain at DC.
+  * @param  wbfm: Receiver
+  * @retval None
+  */
+static void SDR_wbfm_design(SDR_WbfmTypeDef *wbfm)
+{
+  float fc = (float)SDR_WBFM_AUDIO_CUTOFF / (float)SDR_WBFM_IF_RATE;
+  float m = (float)(SDR_WBFM_AUDIO_TAPS - 1);
+  float t, w, sum = 0.0f;
+  uint32_t n;
+
+  for (n = 0; n < SDR_WBFM_AUDIO_TAPS; n++) {
+    t = (float)n - m / 2.0f;
+    w = 0.42f - 0.5f * cosf(2.0f * (float)M_PI * (float)n / m) +
+        0.08f * cosf(4.0f * (float)M_PI * (float)n / m);
+
+    if (t == 0.0f) {
+      wbfm->audioCoeffs[n] = 2.0f * fc * w;
+    } else {
+      wbfm->audioCoeffs[n] = sinf(2.0f * (float)M_PI * fc * t) / ((float)M_PI * t) * w;
+    }
+
+    sum += wbfm->audioCoeffs[n];
+  }
+
+  for (n = 0; n < SDR_WBFM_AUDIO_TAPS; n++) {
+    wbfm->audioCoeffs[n] /= sum;
+  }
+}
+
+/**
+  * @brief  SDR_wbfm_demod
+  *         Discriminator and de-emphasis of the IF samples in ifBuf, into
+  *         fm after the history of the audio low-pass.
+  * @param  wbfm: Receiver
+  * @param  samples: IF samples
+  * @retval None
+  */
+static void SDR_wbfm_demod(SDR_WbfmTypeDef *wbfm, uint32_t samples)
+{
+  float *out = &(wbfm->fm[SDR_WBFM_AUDIO_TAPS - 1]);
+  uint32_t last = wbfm->last;
+  float deemph = wbfm->deemph;
+  uint32_t x, k;
+  int32_t re, im;
+
+  for (k = 0; k < samples; k++) {
+    memcpy(&x, &(wbfm->ifBuf[2 * k]), 4);
+
+    /* x[n] * conj(x[n-1]), I in the low half */
+#if defined(__ARM_FEATURE_DSP)
+    re = (int32_t)__SMUAD(x, last);
+    im = (int32_t)__SMUSDX(last, x);
+#else
+    re = (int32_t)(int16_t)x * (int16_t)last + (int32_t)(int16_t)(x >> 16) * (int16_t)(last >> 16);
+    im = (int32_t)(int16_t)(x >> 16) * (int16_t)last - (int32_t)(int16_t)x * (int16_t)(last >> 16);
+#endif
+    last = x;
+
+    deemph += wbfm->deemphAlpha *
+              (SDR_atan2((float)im, (float)re) * wbfm->discScale - deemph);
+    out[k] = deemph;
+  }
+
+  wbfm->last = last;
+  wbfm->deemph = deemph;
+}
+
+/**
+  * @brief  SDR_wbfm_audio
+  *         Audio low-pass, only the outputs at SDR_AUDIO_RATE are computed.
+  * @param  wbfm: Receiver
+  * @param  samples: New samples in fm
+  * @retval Samples in pcm
+  */
+static uint32_t SDR_wbfm_audio(SDR_WbfmTypeDef *wbfm, uint32_t samples)
+{
+  const float *h = wbfm->audioCoeffs;
+  uint32_t count = 0;
+  uint32_t p, k;
+  float acc;
+
+  for (p = wbfm->audioPhase; p < samples; p += SDR_WBFM_AUDIO_DECIM) {
+    acc = 0.0f;
+
+    for (k = 0; k < SDR_WBFM_AUDIO_TAPS; k++) {
+      acc += wbfm->fm[p + k] * h[k];
+    }
+
+    wbfm->pcm[count++] = (int16_t)__SSAT((int32_t)lrintf(acc * SDR_WBFM_PCM_SCALE), 16);
+  }
+
+  wbfm->audioPhase = (uint16_t)(p - samples);
+
+  memmove(wbfm->fm, &(wbfm->fm[samples]), (SDR_WBFM_AUDIO_TAPS - 1) * sizeof(float));
+
+  return count;
+}
+
+/**
+  * @brief  SDR_wbfm_latency
+  *         Age of the next sample of the slot when it will leave the codec:
+  *         time since the dongle sent it, plus the audio queued before it.
+  *         The filter delays (< 1 ms) are not counted.
+  * @param  wbfm: Receiver
+  * @param  info: Slot descriptor
+  * @param  length: Bytes in the slot
+  * @retval None
+  */
+static void SDR_wbfm_latency(SDR_WbfmTypeDef *wbfm, const RTLSDR_SlotTypeDef *info, uint32_t length)
+{
+  float ms;
+
+  /* The slot was closed with its last sample */
+  ms = (float)(HAL_GetTick() - info->timestamp) +
+       (float)((length - wbfm->offset) / 2) * 1000.0f / (float)wbfm->inRate;
+
+  /* Ring, then the half being played and the one waiting */
+  ms += ((float)SDR_audio_fill(wbfm->audio) + 1.5f * SDR_AUDIO_BLOCK) *
+        1000.0f / (float)SDR_AUDIO_RATE;
+
+  wbfm->statLatency += ms;
+  wbfm->statLatencies++;
+  if (ms > wbfm->statLatencyMax) wbfm->statLatencyMax = ms;
+}
+
+/**
+  * @brief  SDR_wbfm_stats
+  *         Account the cycles of the chain, refresh stats once per second.
+  * @param  wbfm: Receiver
+  * @param  busy: Cycles spent in the chain
+  * @param  samples: Ring samples demodulated
+  * @retval None
+  */
+static void SDR_wbfm_stats(SDR_WbfmTypeDef *wbfm, uint32_t busy, uint32_t samples)
+{
+  uint32_t elapsed = SDR_cycles() - wbfm->statStart;
+
+  wbfm->statBusy += busy;
+  wbfm->statSamples += samples;
+
+  if (elapsed < SystemCoreClock) return;
+
+  wbfm->stats.load = (float)wbfm->statBusy / (float)elapsed;
+
+  if (wbfm->statSamples > 0) {
+    wbfm->stats.cyclesPerSample = (float)wbfm->statBusy / (float)wbfm->statSamples;
+  }
+
+  if (wbfm->statLatencies > 0) {
+    wbfm->stats.latency = wbfm->statLatency / (float)wbfm->statLatencies;
+    wbfm->stats.latencyMax = wbfm->statLatencyMax;
+  }
+
+  wbfm->statStart += elapsed;
+  wbfm->statBusy = 0;
+  wbfm->statSamples = 0;
+  wbfm->statLatency = 0.0f;
+  wbfm->statLatencies = 0;
+  wbfm->statLatencyMax = 0.0f;
+}
+
+/**
+  * @brief  SDR_wbfm_init
+  *         Set up the chain for a ring rate. The audio sink must be
+  *         initialized, its prime is set to the audio of one slot.
+  * @param  wbfm: Receiver
+  * @param  audio: Sink
+  * @param  inRate: Hz, a multiple of SDR_WBFM_IF_RATE
+  * @param  deemphasis: Time constant in us, SDR_WBFM_DEEMPHASIS_EU or _US,
+  *         0 for none
+  * @retval USBH_OK, or USBH_FAIL if the rate can not be decimated
+  */
+USBH_StatusTypeDef SDR_wbfm_init(SDR_WbfmTypeDef *wbfm, SDR_AudioTypeDef *audio,
+                                 uint32_t inRate, uint8_t deemphasis)
+{
+  if (SDR_decim_init(&(wbfm->decim), inRate, SDR_WBFM_IF_RATE, 0) != USBH_OK) {
+    return USBH_FAIL;
+  }
+
+  wbfm->audio = audio;
+  wbfm->spectrum = NULL;
+  wbfm->inRate = inRate;
+  wbfm->offset = 0;
+  wbfm->blocks = audio->blocks;
+
+  wbfm->discScale = (float)SDR_WBFM_IF_RATE / (2.0f * (float)M_PI * (float)SDR_WBFM_DEVIATION);
+
+  if (deemphasis == 0) {
+    wbfm->deemphAlpha = 1.0f;
+  } else {
+    wbfm->deemphAlpha = 1.0f - expf(-1.0e6f / ((float)deemphasis * (float)SDR_WBFM_IF_RATE));
+  }
+
+  SDR_wbfm_design(wbfm);
+  SDR_wbfm_reset(wbfm);
+
+  SDR_audio_set_prime(audio, (RTLSDR_RING_SLOT_LENGTH / 2) / (inRate / SDR_AUDIO_RATE) +
+                             4 * SDR_AUDIO_BLOCK);
+
+  memset(&(wbfm->stats), 0, sizeof(wbfm->stats));
+  wbfm->statStart = SDR_cycles();
+  wbfm->statBusy = 0;
+  wbfm->statSamples = 0;
+  wbfm->statLatency = 0.0f;
+  wbfm->statLatencies = 0;
+  wbfm->statLatencyMax = 0.0f;
+
+  return USBH_OK;
+}
+
+/**
+  * @brief  SDR_wbfm_reset
+  *         Clear the filter states, after a retune or a gap in the stream.
+  * @param  wbfm: Receiver
+  * @retval None
+  */
+void SDR_wbfm_reset(SDR_WbfmTypeDef *wbfm)
+{
+  SDR_decim_reset(&(wbfm->decim));
+
+  /* On DC the estimate would take the carrier of the station away, the
+   * RTL2832 cancels the DC of the tuner then (see the init sequence). Off
+   * DC it takes the spike of the tuner away */
+  SDR_iq_init(&(wbfm->decim.iq), (wbfm->decim.nco.freq != 0) ? SDR_IQ_DC_SHIFT : 0);
+
+  wbfm->last = 0;
+  wbfm->deemph = 0.0f;
+  wbfm->audioPhase = SDR_WBFM_AUDIO_DECIM - 1;
+
+  memset(wbfm->fm, 0, (SDR_WBFM_AUDIO_TAPS - 1) * sizeof(float));
+}
+
+/**
+  * @brief  SDR_wbfm_set_offset
+  *         Receive the station at freq from the tuner frequency, the shift
+  *         is done by the decimator. The ring rate must leave room for the
+  *         channel around it.
+  * @param  wbfm: Receiver
+  * @param  freq: Hz, 0 for the station on DC
+  * @retval USBH_OK, or USBH_FAIL if freq is out of the captured band
+  */
+USBH_StatusTypeDef SDR_wbfm_set_offset(SDR_WbfmTypeDef *wbfm, int32_t freq)
+{
+  if (SDR_decim_set_shift(&(wbfm->decim), freq) != USBH_OK) return USBH_FAIL;
+
+  SDR_iq_init(&(wbfm->decim.iq), (freq != 0) ? SDR_IQ_DC_SHIFT : 0);
+
+  return USBH_OK;
+}
+
+/**
+  * @brief  SDR_wbfm_process
+  *         Demodulate the slots received, called from the main loop. Runs
+  *         once per block played by the sink.
+  * @param  phost: Host handle
+  * @param  wbfm: Receiver
+  * @retval None
+  */
+void SDR_wbfm_process(USBH_HandleTypeDef *phost, SDR_WbfmTypeDef *wbfm)
+{
+  RTLSDR_HandleTypeDef *RTLSDR_Handle =
+    (RTLSDR_HandleTypeDef*) phost->pActiveClass->pData;
+  const RTLSDR_SlotTypeDef *info;
+  uint32_t blocks = wbfm->audio->blocks;
+  uint32_t budget, taken = 0, busy = 0;
+  uint32_t start, length, n, m;
+  uint8_t *slot;
+  uint8_t restart;
+
+  if (blocks == wbfm->blocks) return;
+
+  budget = blocks - wbfm->blocks;
+  if (budget > SDR_WBFM_CATCHUP_MAX) budget = SDR_WBFM_CATCHUP_MAX;
+  wbfm->blocks = blocks;
+
+  /* Twice the samples played, the ring drains while the sink plays */
+  budget *= 2 * SDR_AUDIO_BLOCK * (wbfm->inRate / SDR_AUDIO_RATE);
+
+  while ((taken < budget) && ((slot = RTLSDR_get_slot(phost, &length)) != NULL)) {
+    info = RTLSDR_get_slot_info(phost);
+
+    restart = (wbfm->offset == 0) && (info->discontinuity || info->lost);
+    if (restart) SDR_wbfm_reset(wbfm);
+
+    /* The exact rate of the dongle, the sink trims the rest */
+    if (wbfm->offset == 0) {
+      SDR_audio_set_rate(wbfm->audio,
+                         ((float)RTLSDR_Handle->real_rate +
+                          (float)RTLSDR_Handle->real_rate_frac / 65536.0f) *
+                         (float)SDR_AUDIO_RATE / (float)wbfm->inRate);
+    }
+
+    while ((wbfm->offset < length) && (taken < budget)) {
+      n = ((length - wbfm->offset) / 2) & ~1UL;
+      if (n > SDR_WBFM_CHUNK) n = SDR_WBFM_CHUNK;
+
+      if (n == 0) {
+        wbfm->offset = length;
+        break;
+      }
+
+      SDR_wbfm_latency(wbfm, info, length);
+
+      start = SDR_cycles();
+      m = SDR_decim_process_u8(&(wbfm->decim), slot + wbfm->offset, n, wbfm->ifBuf);
+      SDR_wbfm_demod(wbfm, m);
+      m = SDR_wbfm_audio(wbfm, m);
+      busy += SDR_cycles() - start;
+
+      SDR_audio_write(wbfm->audio, wbfm->pcm, m);
+
+      if (wbfm->spectrum != NULL) {
+        SDR_fft_feed(wbfm->spectrum, slot + wbfm->offset, 2 * n, restart);
+        restart = 0;
+      }
+
+      wbfm->offset += 2 * n;
+      taken += n;
+    }
+
+    if (wbfm->offset >= length) {
+      RTLSDR_release_slot(phost);
+      wbfm->offset = 0;
+    }
+  }
+
+  SDR_wbfm_stats(wbfm, busy, taken);
+}
@@ -35,6 +35,7 @@
 /* Private macro -------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
 extern HCD_HandleTypeDef hhcd;
+extern SAI_HandleTypeDef haudio_out_sai;
 
 /* Private function prototypes -----------------------------------------------*/
 /* Private functions ---------------------------------------------------------*/
@@ -237,5 +238,16 @@ void EXTI15_10_IRQHandler(void)
   HAL_GPIO_EXTI_IRQHandler(WAKEUP_BUTTON_PIN);
 }
 
+/**
+  * @brief  This function handles the SAI DMA interrupt of the audio output,
+  *         its callbacks are in sdr_audio.c.
+  * @param  None
+  * @retval None
+  */
+void AUDIO_OUT_SAIx_DMAx_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(haudio_out_sai.hdmatx);
+}
+
 
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
@@ -0,0 +1,108 @@
+/**
+  ******************************************************************************
+  * @file    e4k_pll_check.c
+  * @author
+  * @version
+  * @date
+  * @brief   Host check of the E4000 PLL parameter fast path
+  ******************************************************************************
+  * @attention
+  *
+  * Runs E4K_compute_pll_params_fast and the 64 bit E4K_compute_pll_params_64
+  * of tuner_e4k.c (built with E4K_PLL_CHECK) over the tuner range and
+  * reports every difference in Z, X, R, SYNTH7, three-phase mode or flo.
+  *
+  *   make -C test e4k_pll_check
+  *
+  * The nominal crystal is swept at 1 Hz steps, the crystals corrected by
+  * RTLSDR_set_freq_correction up to RTLSDR_PPM_MAX at 7 Hz steps. That is
+  * a couple of minutes, an argument multiplies the steps.
+  *
+  * The tuner driver is included as a whole, only the PLL math runs.
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "tuner_e4k.c"
+
+/* Private define ------------------------------------------------------------*/
+#define CHECK_FLO_MIN              MHZ(E4K_FLO_MIN_MHZ)
+#define CHECK_FLO_MAX              MHZ(E4K_FLO_MAX_MHZ)
+
+/* Step of the corrected crystals, odd so the sweeps do not share residues */
+#define CHECK_CORR_STEP            7
+
+/* Private variables ---------------------------------------------------------*/
+static const int32_t check_ppm[] = {
+  1, -1, 50, -50, RTLSDR_PPM_MAX, -RTLSDR_PPM_MAX
+};
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  check_same
+  * @param  a: Fast path
+  * @param  b: 64 bit path
+  * @retval 1 when the tuner would get the same registers and flo
+  */
+static int check_same(const struct e4k_pll_params *a, const struct e4k_pll_params *b)
+{
+  return (a->fosc == b->fosc) && (a->intended_flo == b->intended_flo) &&
+         (a->flo == b->flo) && (a->x == b->x) && (a->z == b->z) &&
+         (a->r == b->r) && (a->r_idx == b->r_idx) &&
+         (a->threephase == b->threephase);
+}
+
+/**
+  * @brief  check_fosc
+  *         Sweep the tuner range for one crystal.
+  * @param  fosc: Crystal, Hz
+  * @param  step: Hz
+  * @retval Frequencies that differ
+  */
+static uint32_t check_fosc(uint32_t fosc, uint32_t step)
+{
+  struct e4k_pll_params fast = { 0 }, ref = { 0 };
+  uint32_t flo, bad = 0;
+
+  for (flo = CHECK_FLO_MIN; flo <= CHECK_FLO_MAX; flo += step) {
+    E4K_compute_pll_params_fast(&fast, fosc, flo);
+    E4K_compute_pll_params_64(&ref, fosc, flo);
+
+    if (!check_same(&fast, &ref)) {
+      if (bad++ < 10) {
+        printf("fosc %lu flo %lu: fast z=%u x=%u r=%u flo=%lu, 64 bit z=%u x=%u r=%u flo=%lu\n",
+               (unsigned long)fosc, (unsigned long)flo,
+               fast.z, fast.x, fast.r, (unsigned long)fast.flo,
+               ref.z, ref.x, ref.r, (unsigned long)ref.flo);
+      }
+    }
+  }
+
+  printf("fosc %lu Hz, %lu..%lu Hz step %lu: %lu mismatches\n",
+         (unsigned long)fosc, (unsigned long)CHECK_FLO_MIN,
+         (unsigned long)CHECK_FLO_MAX, (unsigned long)step, (unsigned long)bad);
+
+  return bad;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t step = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 0) : 1;
+  uint32_t n, fosc, bad;
+
+  if (step == 0) step = 1;
+
+  bad = check_fosc(DEF_RTL_XTAL_FREQ, step);
+
+  /* Same rounding as RTLSDR_ppm_xtal */
+  for (n = 0; n < sizeof(check_ppm) / sizeof(check_ppm[0]); n++) {
+    fosc = (uint32_t)(((uint64_t)DEF_RTL_XTAL_FREQ * (uint32_t)(1000000 + check_ppm[n])) / 1000000);
+    bad += check_fosc(fosc, step * CHECK_CORR_STEP);
+  }
+
+  return (bad == 0) ? 0 : 1;
+}
@@ -0,0 +1,224 @@
+/**
+  ******************************************************************************
+  * @file    fir_check.c
+  * @author
+  * @version
+  * @date
+  * @brief   Host check of the FIR coefficient upload
+  ******************************************************************************
+  * @attention
+  *
+  * Runs RTLSDR_load_fir and RTLSDR_set_fir of usbh_rtlsdr.c against a
+  * USBH_CtlReq that completes every transfer at once:
+  *
+  *   make -C test fir_check
+  *
+  * A valid set is packed into the 20 register bytes and selected. A set
+  * with a coefficient out of range is refused before any transfer, and
+  * the set in use before stays selected: RTLSDR_set_fir, as run by the
+  * init sequence, still uploads it.
+  *
+  * An upload is one write and one read-back of the demod, the read-back
+  * right after the write or, with RTLSDR_DEMOD_SYNC_DEFERRED, from
+  * RTLSDR_demod_sync at the end. fir_check_deferred is the same check
+  * built with the deferred read-back.
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include "usbh_rtlsdr.c"
+
+/* Private define ------------------------------------------------------------*/
+
+/* Calls of an FSM before it is taken as stuck */
+#define CHECK_CALLS_MAX            16
+
+/* Control transfers of an upload: the write and its read-back */
+#define CHECK_UPLOAD_TRANSFERS     2
+
+/* Private variables ---------------------------------------------------------*/
+static RTLSDR_HandleTypeDef check_rtlsdr;
+static USBH_ClassTypeDef check_class;
+static USBH_HandleTypeDef check_host;
+
+/* Last write of the FIR registers seen on the control pipe */
+static uint8_t check_regs[RTLSDR_FIR_BYTES];
+static uint32_t check_uploads;
+static uint32_t check_transfers;
+
+static const int check_good[RTLSDR_FIR_LEN] = {
+  -128, 127, -1, 0, 1, -64, 63, 5,
+  -2048, 2047, -1, 0, 1, -1000, 1000, 421
+};
+
+/* Private functions ---------------------------------------------------------*/
+
+/* The control pipe: every request completes at once, FIR writes are kept */
+USBH_StatusTypeDef USBH_CtlReq(USBH_HandleTypeDef *phost, uint8_t *buff, uint16_t length)
+{
+  check_transfers++;
+
+  if ((phost->Control.setup.b.bmRequestType == CTRL_OUT) &&
+      (phost->Control.setup.b.wValue.w == ((RTLSDR_FIR_ADDR << 8) | 0x20)) &&
+      (length == RTLSDR_FIR_BYTES)) {
+    memcpy(check_regs, buff, RTLSDR_FIR_BYTES);
+    check_uploads++;
+  }
+
+  return USBH_OK;
+}
+
+/**
+  * @brief  check_pack
+  *         Register bytes of a set, as librtlsdr packs them.
+  * @param  coeffs: RTLSDR_FIR_LEN coefficients
+  * @param  regs: RTLSDR_FIR_BYTES bytes
+  * @retval None
+  */
+static void check_pack(const int *coeffs, uint8_t *regs)
+{
+  int i;
+
+  for (i = 0; i < 8; i++) regs[i] = (uint8_t)coeffs[i];
+
+  for (i = 0; i < 8; i += 2) {
+    regs[8 + i * 3 / 2] = (uint8_t)(coeffs[8 + i] >> 4);
+    regs[8 + i * 3 / 2 + 1] = (uint8_t)((coeffs[8 + i] << 4) | ((coeffs[8 + i + 1] >> 8) & 0x0f));
+    regs[8 + i * 3 / 2 + 2] = (uint8_t)coeffs[8 + i + 1];
+  }
+}
+
+/**
+  * @brief  check_load
+  *         Run RTLSDR_load_fir to the end.
+  * @param  coeffs: Set, or NULL for RTLSDR_FIR
+  * @retval Final status
+  */
+static USBH_StatusTypeDef check_load(const int *coeffs)
+{
+  USBH_StatusTypeDef uStatus = USBH_BUSY;
+  int n;
+
+  for (n = 0; (n < CHECK_CALLS_MAX) && (uStatus == USBH_BUSY); n++) {
+    uStatus = RTLSDR_load_fir(&check_host, coeffs);
+  }
+
+  return uStatus;
+}
+
+/**
+  * @brief  check_set
+  *         Run RTLSDR_set_fir to the end, as RTLSDR_seq_set_fir does.
+  * @retval Final status
+  */
+static USBH_StatusTypeDef check_set(void)
+{
+  USBH_StatusTypeDef uStatus = USBH_BUSY;
+  int n;
+
+  for (n = 0; (n < CHECK_CALLS_MAX) && (uStatus == USBH_BUSY); n++) {
+    uStatus = RTLSDR_set_fir(&check_host);
+  }
+
+  return uStatus;
+}
+
+/**
+  * @brief  check_uploaded
+  * @param  name: Case
+  * @param  status: Of the load or set
+  * @param  coeffs: Set expected in the registers and selected
+  * @retval 1 on a mismatch
+  */
+static int check_uploaded(const char *name, USBH_StatusTypeDef status, const int *coeffs)
+{
+  uint8_t regs[RTLSDR_FIR_BYTES];
+
+  check_pack((coeffs != NULL) ? coeffs : RTLSDR_FIR, regs);
+
+  if ((status != USBH_OK) || (check_uploads != 1) ||
+      memcmp(regs, check_regs, sizeof(regs)) ||
+      (check_rtlsdr.firCoeffs != coeffs) || (check_rtlsdr.firState != RTLSDR_FIR_CALC)) {
+    printf("%s: status %d, %lu uploads, wrong set\n", name, status, (unsigned long)check_uploads);
+    return 1;
+  }
+
+  if ((check_transfers != CHECK_UPLOAD_TRANSFERS) || check_rtlsdr.demodPending ||
+      (check_rtlsdr.demodState != RTLSDR_DEM_WRITE_WAIT)) {
+    printf("%s: %lu transfers, read-back pending %d\n", name,
+           (unsigned long)check_transfers, check_rtlsdr.demodPending);
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+  * @brief  check_refused
+  * @param  name: Case
+  * @param  bad: Set with one coefficient out of range
+  * @param  current: Set selected before
+  * @retval 1 on a mismatch
+  */
+static int check_refused(const char *name, const int *bad, const int *current)
+{
+  USBH_StatusTypeDef uStatus;
+
+  check_transfers = 0;
+  check_uploads = 0;
+  uStatus = RTLSDR_load_fir(&check_host, bad);
+
+  if ((uStatus != USBH_FAIL) || (check_transfers != 0) ||
+      (check_rtlsdr.firCoeffs != current) || (check_rtlsdr.firState != RTLSDR_FIR_CALC)) {
+    printf("%s: status %d, %lu transfers, set changed\n", name, uStatus, (unsigned long)check_transfers);
+    return 1;
+  }
+
+  /* The next upload, a re-init, still works with the set kept */
+  check_transfers = 0;
+  uStatus = check_set();
+  return check_uploaded(name, uStatus, current);
+}
+
+int main(void)
+{
+  int bad[RTLSDR_FIR_LEN];
+  int fails = 0, i;
+
+  check_class.pData = &check_rtlsdr;
+  check_host.pActiveClass = &check_class;
+  check_host.RequestState = CMD_SEND;
+
+  check_uploads = 0;
+  fails += check_uploaded("default", check_set(), NULL);
+
+  check_transfers = 0;
+  check_uploads = 0;
+  fails += check_uploaded("valid set", check_load(check_good), check_good);
+
+  /* Each coefficient just out of its range, on both sides */
+  for (i = 0; i < RTLSDR_FIR_LEN; i++) {
+    memcpy(bad, check_good, sizeof(bad));
+
+    bad[i] = (i < 8) ? 128 : 2048;
+    fails += check_refused("too high", bad, check_good);
+
+    bad[i] = (i < 8) ? -129 : -2049;
+    fails += check_refused("too low", bad, check_good);
+  }
+
+  check_transfers = 0;
+  check_uploads = 0;
+  fails += check_uploaded("back to default", check_load(NULL), NULL);
+
+  memcpy(bad, check_good, sizeof(bad));
+  bad[0] = 1000;
+  fails += check_refused("over the default", bad, NULL);
+
+  printf("FIR upload, deferred read-back %d: %d failures\n", RTLSDR_DEMOD_SYNC_DEFERRED, fails);
+
+  return (fails == 0) ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+/**
+  ******************************************************************************
+  * @file    cmsis_gcc.h
+  * @author
+  * @version
+  * @date
+  * @brief   Host stand-in for the CMSIS GCC intrinsics
+  ******************************************************************************
+  * @attention
+  *
+  * The Cortex-M intrinsics of CMSIS/core/cmsis_gcc.h are ARM assembly, a
+  * host build of a driver that uses them does not assemble. The checks
+  * that need the real device headers force this file first (-include),
+  * its guard keeps the ARM one out. Interrupts and barriers do nothing,
+  * the checks run on one thread.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __CMSIS_GCC_H
+#define __CMSIS_GCC_H
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+/* Exported variables --------------------------------------------------------*/
+static uint32_t host_primask;
+
+/* Exported functions ------------------------------------------------------- */
+
+static inline void __enable_irq(void)
+{
+  host_primask = 0;
+}
+
+static inline void __disable_irq(void)
+{
+  host_primask = 1;
+}
+
+static inline uint32_t __get_PRIMASK(void)
+{
+  return host_primask;
+}
+
+static inline void __set_PRIMASK(uint32_t priMask)
+{
+  host_primask = priMask;
+}
+
+static inline void __NOP(void) { }
+static inline void __WFI(void) { }
+static inline void __ISB(void) { __sync_synchronize(); }
+static inline void __DSB(void) { __sync_synchronize(); }
+static inline void __DMB(void) { __sync_synchronize(); }
+
+static inline uint32_t __CLZ(uint32_t value)
+{
+  return (value == 0) ? 32 : (uint32_t)__builtin_clz(value);
+}
+
+static inline uint32_t __REV(uint32_t value)
+{
+  return __builtin_bswap32(value);
+}
+
+#endif /* __CMSIS_GCC_H */
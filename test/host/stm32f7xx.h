@@ -0,0 +1,97 @@
+/**
+  ******************************************************************************
+  * @file    stm32f7xx.h
+  * @author
+  * @version
+  * @date
+  * @brief   Host stand-in for the device header, Cortex-M7 DSP intrinsics only
+  ******************************************************************************
+  * @attention
+  *
+  * Found before the real device header by the checks that build the DSP
+  * kernels on the host (-Ihost). Each intrinsic follows the instruction
+  * description of the ARMv7-M Architecture Reference Manual, written
+  * lane by lane so that it does not share the tricks of the kernels it
+  * checks. Little endian, as the Cortex-M7 of the board.
+  *
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __STM32F7xx_H
+#define __STM32F7xx_H
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+/* Exported functions ------------------------------------------------------- */
+
+static inline int32_t host_lane8(uint32_t x, int n)
+{
+  return (int8_t)(uint8_t)(x >> (8 * n));
+}
+
+static inline int32_t host_lane16(uint32_t x, int n)
+{
+  return (int16_t)(uint16_t)(x >> (16 * n));
+}
+
+static inline int32_t host_sat16(int32_t v)
+{
+  if (v > 32767) return 32767;
+  if (v < -32768) return -32768;
+  return v;
+}
+
+/* SSUB8: four signed byte differences, modulo 2^8 (GE flags not modelled) */
+static inline uint32_t __SSUB8(uint32_t a, uint32_t b)
+{
+  uint32_t r = 0;
+  int n;
+
+  for (n = 0; n < 4; n++) {
+    r |= (uint32_t)(uint8_t)(host_lane8(a, n) - host_lane8(b, n)) << (8 * n);
+  }
+  return r;
+}
+
+/* SXTB16: bytes 0 and 2 sign extended into the two halfwords */
+static inline uint32_t __SXTB16(uint32_t a)
+{
+  return (uint32_t)(uint16_t)host_lane8(a, 0) |
+         ((uint32_t)(uint16_t)host_lane8(a, 2) << 16);
+}
+
+static inline uint32_t __ROR(uint32_t a, uint32_t s)
+{
+  s &= 31;
+  return (s == 0) ? a : ((a >> s) | (a << (32 - s)));
+}
+
+/* SMLAD: both halfword products added to the accumulator */
+static inline uint32_t __SMLAD(uint32_t a, uint32_t b, uint32_t acc)
+{
+  return (uint32_t)((int32_t)acc + host_lane16(a, 0) * host_lane16(b, 0) +
+                    host_lane16(a, 1) * host_lane16(b, 1));
+}
+
+/* QSUB16: two saturated halfword differences */
+static inline uint32_t __QSUB16(uint32_t a, uint32_t b)
+{
+  return (uint32_t)(uint16_t)host_sat16(host_lane16(a, 0) - host_lane16(b, 0)) |
+         ((uint32_t)(uint16_t)host_sat16(host_lane16(a, 1) - host_lane16(b, 1)) << 16);
+}
+
+/* PKHBT: bottom halfword of a, top halfword of b shifted left */
+static inline uint32_t __PKHBT(uint32_t a, uint32_t b, uint32_t s)
+{
+  return (a & 0x0000FFFF) | ((b << s) & 0xFFFF0000);
+}
+
+/* PKHTB: top halfword of a, bottom halfword of b shifted right (arithmetic) */
+static inline uint32_t __PKHTB(uint32_t a, uint32_t b, uint32_t s)
+{
+  return (a & 0xFFFF0000) | ((uint32_t)((int32_t)b >> s) & 0x0000FFFF);
+}
+
+#endif /* __STM32F7xx_H */
@@ -0,0 +1,207 @@
+/**
+  ******************************************************************************
+  * @file    iq_check.c
+  * @author
+  * @version
+  * @date
+  * @brief   Host check of the DSP extension IQ converters
+  ******************************************************************************
+  * @attention
+  *
+  * Builds the __ARM_FEATURE_DSP kernels of sdr_iq.c against the intrinsics
+  * of host/stm32f7xx.h and compares SDR_iq_to_q15 / SDR_iq_to_f32 with the
+  * plain C SDR_iq_to_q15_ref / SDR_iq_to_f32_ref, bit for bit:
+  *
+  *   make -C test iq_check
+  *
+  * Every pattern runs for 1 to CHECK_MAX_SAMPLES samples, so all odd
+  * tails are covered, out of place and in place (out over in), for a few
+  * blocks in a row so the DC estimate is carried and, with a preset DC,
+  * the q15 output saturates. The converter state after each block must
+  * match as well.
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The DSP kernels, with the intrinsics of host/stm32f7xx.h */
+#define __ARM_FEATURE_DSP          1
+#include "sdr_iq.c"
+
+/* Private define ------------------------------------------------------------*/
+#define CHECK_MAX_SAMPLES          67
+#define CHECK_BLOCKS               4
+
+/* Private typedef -----------------------------------------------------------*/
+typedef enum
+{
+  CHECK_RANDOM = 0,
+  CHECK_ZERO,                        /* 0x00, negative full scale */
+  CHECK_MID,                         /* 0x80, zero */
+  CHECK_FULL,                        /* 0xFF, positive full scale */
+  CHECK_EDGES,                       /* 0x00, 0x7F, 0x80, 0xFF, 0x01, 0xFE */
+  CHECK_PATTERNS
+}
+CHECK_PatternTypeDef;
+
+/* Private variables ---------------------------------------------------------*/
+static const char *check_name[CHECK_PATTERNS] = {
+  "random", "0x00", "0x80", "0xFF", "edges"
+};
+
+/* Preset DC estimates, q15 << SDR_IQ_DC_FRAC; the large ones saturate */
+static const int32_t check_dc[][2] = {
+  { 0, 0 },
+  { 1234567, -7654321 },
+  { 20000 << SDR_IQ_DC_FRAC, -20000 << SDR_IQ_DC_FRAC },
+  { -32768 << SDR_IQ_DC_FRAC, 32767 << SDR_IQ_DC_FRAC },
+};
+
+/* 4 byte aligned like the ring slots, room for the f32 output in place */
+static uint32_t check_in[CHECK_MAX_SAMPLES];
+static uint32_t check_a[CHECK_MAX_SAMPLES * 2];
+static uint32_t check_b[CHECK_MAX_SAMPLES * 2];
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+  * @brief  check_fill
+  * @param  buf: IQ bytes, 2 * samples
+  * @param  pattern: CHECK_PatternTypeDef
+  * @param  samples: IQ samples
+  * @retval None
+  */
+static void check_fill(uint8_t *buf, CHECK_PatternTypeDef pattern, uint32_t samples)
+{
+  static const uint8_t edges[] = { 0x00, 0x7F, 0x80, 0xFF, 0x01, 0xFE };
+  uint32_t n;
+
+  for (n = 0; n < samples * 2; n++) {
+    switch (pattern) {
+    case CHECK_ZERO:  buf[n] = 0x00; break;
+    case CHECK_MID:   buf[n] = 0x80; break;
+    case CHECK_FULL:  buf[n] = 0xFF; break;
+    case CHECK_EDGES: buf[n] = edges[n % sizeof(edges)]; break;
+    default:          buf[n] = (uint8_t)rand(); break;
+    }
+  }
+}
+
+/**
+  * @brief  check_state
+  * @retval 1 when both converters carry the same DC estimate
+  */
+static int check_state(const SDR_IqTypeDef *a, const SDR_IqTypeDef *b)
+{
+  return (a->dcI == b->dcI) && (a->dcQ == b->dcQ) && (a->primed == b->primed);
+}
+
+/**
+  * @brief  check_run
+  *         CHECK_BLOCKS blocks of one pattern and size through both
+  *         converters, q15 and f32, out of place and in place.
+  * @param  pattern: CHECK_PatternTypeDef
+  * @param  samples: IQ samples per block
+  * @param  dc: Preset DC estimate, I and Q
+  * @retval Blocks that differ
+  */
+static uint32_t check_run(CHECK_PatternTypeDef pattern, uint32_t samples, const int32_t *dc)
+{
+  SDR_IqTypeDef q15, q15ref, f32, f32ref, q15ip, f32ip;
+  uint32_t bytes = samples * 2;
+  uint32_t blk, bad = 0;
+
+  SDR_iq_init(&q15, SDR_IQ_DC_SHIFT);
+  q15.dcI = dc[0];
+  q15.dcQ = dc[1];
+  q15.primed = 1;
+  q15ref = f32 = f32ref = q15ip = f32ip = q15;
+
+  for (blk = 0; blk < CHECK_BLOCKS; blk++) {
+    check_fill((uint8_t*) check_in, pattern, samples);
+
+    /* q15, out of place */
+    memset(check_a, 0x55, sizeof(check_a));
+    memset(check_b, 0x55, sizeof(check_b));
+    SDR_iq_to_q15(&q15, (uint8_t*) check_in, (int16_t*) check_a, samples);
+    SDR_iq_to_q15_ref(&q15ref, (uint8_t*) check_in, (int16_t*) check_b, samples);
+    if (memcmp(check_a, check_b, sizeof(check_a)) || !check_state(&q15, &q15ref)) {
+      printf("q15 %s, %lu samples, block %lu: differs\n", check_name[pattern],
+             (unsigned long)samples, (unsigned long)blk);
+      bad++;
+    }
+
+    /* q15, in place, against the out of place reference */
+    memset(check_a, 0x55, sizeof(check_a));
+    memcpy(check_a, check_in, bytes);
+    SDR_iq_to_q15(&q15ip, (uint8_t*) check_a, (int16_t*) check_a, samples);
+    if (memcmp(check_a, check_b, samples * 4) || !check_state(&q15ip, &q15ref)) {
+      printf("q15 in place %s, %lu samples, block %lu: differs\n", check_name[pattern],
+             (unsigned long)samples, (unsigned long)blk);
+      bad++;
+    }
+
+    /* f32, out of place */
+    memset(check_a, 0x55, sizeof(check_a));
+    memset(check_b, 0x55, sizeof(check_b));
+    SDR_iq_to_f32(&f32, (uint8_t*) check_in, (float*) check_a, samples);
+    SDR_iq_to_f32_ref(&f32ref, (uint8_t*) check_in, (float*) check_b, samples);
+    if (memcmp(check_a, check_b, sizeof(check_a)) || !check_state(&f32, &f32ref)) {
+      printf("f32 %s, %lu samples, block %lu: differs\n", check_name[pattern],
+             (unsigned long)samples, (unsigned long)blk);
+      bad++;
+    }
+
+    /* f32, in place */
+    memset(check_a, 0x55, sizeof(check_a));
+    memcpy(check_a, check_in, bytes);
+    SDR_iq_to_f32(&f32ip, (uint8_t*) check_a, (float*) check_a, samples);
+    if (memcmp(check_a, check_b, samples * 8) || !check_state(&f32ip, &f32ref)) {
+      printf("f32 in place %s, %lu samples, block %lu: differs\n", check_name[pattern],
+             (unsigned long)samples, (unsigned long)blk);
+      bad++;
+    }
+  }
+
+  return bad;
+}
+
+int main(void)
+{
+  uint32_t pattern, samples, d, runs = 0, bad = 0;
+
+  srand(1);
+
+  for (d = 0; d < sizeof(check_dc) / sizeof(check_dc[0]); d++) {
+    for (pattern = 0; pattern < CHECK_PATTERNS; pattern++) {
+      for (samples = 1; samples <= CHECK_MAX_SAMPLES; samples++) {
+        bad += check_run((CHECK_PatternTypeDef)pattern, samples, check_dc[d]);
+        runs++;
+      }
+    }
+  }
+
+  /* Unprimed converter, the first block sets the estimate */
+  for (samples = 1; samples <= CHECK_MAX_SAMPLES; samples++) {
+    SDR_IqTypeDef a, b;
+
+    SDR_iq_init(&a, SDR_IQ_DC_SHIFT);
+    SDR_iq_init(&b, SDR_IQ_DC_SHIFT);
+    check_fill((uint8_t*) check_in, CHECK_RANDOM, samples);
+    SDR_iq_to_q15(&a, (uint8_t*) check_in, (int16_t*) check_a, samples);
+    SDR_iq_to_q15_ref(&b, (uint8_t*) check_in, (int16_t*) check_b, samples);
+    if (memcmp(check_a, check_b, samples * 4) || !check_state(&a, &b)) {
+      printf("q15 unprimed, %lu samples: differs\n", (unsigned long)samples);
+      bad++;
+    }
+    runs++;
+  }
+
+  printf("IQ converters: %lu runs, %lu mismatches\n", (unsigned long)runs, (unsigned long)bad);
+
+  return (bad == 0) ? 0 : 1;
+}